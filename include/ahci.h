@@ -3,6 +3,7 @@
 #include <pci.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "storage.h"
 
 // AHCI register layout definitions based on the AHCI specification, section 3.3.
 struct ahci_port
@@ -49,7 +50,10 @@ struct ahci_memory
 
 void ahci_init(struct pci_device device);
 bool ahci_port_ready(void);
+uint32_t ahci_queue_depth(void); // Commands the active port keeps in flight
 int ahci_read(uint64_t lba, uint32_t sector_count, void *buffer);
 int ahci_write(uint64_t lba, uint32_t sector_count, const void *buffer);
+int ahci_read_segments(uint64_t lba, const storage_segment_t *segments, size_t count);
+int ahci_write_segments(uint64_t lba, const storage_segment_t *segments, size_t count);
 
 #define AHCI_SECTOR_SIZE 512u
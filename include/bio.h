@@ -1,10 +1,30 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include "list.h"
 #include "sleeplock.h"
 
-#define BIO_BLOCK_SIZE 512
+#define BIO_BLOCK_SIZE 512 // Bytes behind each buffer_head_t (one sector)
+
+// The cache holds blocks of bio_block_size bytes, read from disk in one request and
+// handed out one sector at a time. The block size is fixed at boot; the number of
+// blocks is 1/BIO_CACHE_FRACTION of the free memory, within the bounds below.
+#define BIO_DEFAULT_BLOCK_SIZE 4096
+#define BIO_CACHE_FRACTION 64
+#define BIO_MIN_BLOCKS 32
+#define BIO_MAX_BLOCKS 16384
+
+// Sectors marked with bdirty() are written back by the flusher thread once they
+// have been dirty for BIO_DIRTY_EXPIRE_MS, at most BIO_FLUSH_BATCH blocks per pass.
+#define BIO_FLUSH_INTERVAL_MS 500
+#define BIO_DIRTY_EXPIRE_MS 1000
+#define BIO_FLUSH_BATCH 64
+
+// Largest run breada() fetches in a single request
+#define BIO_READAHEAD_MAX_SECTORS 128
+
+struct bio_block;
 
 typedef struct buffer_head
 {
@@ -12,15 +32,39 @@ typedef struct buffer_head
     uint32_t block; // LBA
     uint8_t *data;
     uint8_t flags;
-    uint32_t ref_count;
-    list_head_t list; // For LRU
-    sleeplock_t lock; // Per-buffer lock for exclusive access
+    sleeplock_t lock;        // Per-buffer lock for exclusive access
+    struct bio_block *owner; // Cached block this sector belongs to
 } buffer_head_t;
 
+typedef struct bio_block
+{
+    uint8_t device;
+    uint32_t number;  // LBA / sectors per block
+    uint32_t ref_count;
+    uint64_t dirty_since; // scheduler_ticks when a sector was first dirtied, 0 if clean
+    bool writeback;       // A flush_block() is copying or writing the block
+    list_head_t hash;     // Bucket chain
+    list_head_t list; // For LRU, most recently used first
+    sleeplock_t lock; // Held while sectors are read in
+    uint8_t *data;
+    buffer_head_t sectors[];
+} bio_block_t;
+
 #define BIO_FLAG_VALID 0x01
 #define BIO_FLAG_DIRTY 0x02
 
 void bio_init(void);
 buffer_head_t *bread(uint8_t device, uint32_t block);
+buffer_head_t *bzeroed(uint8_t device, uint32_t block); // bread() for a sector about to be rewritten: zeroed, never read
 void bwrite(buffer_head_t *bh);
+void bdirty(buffer_head_t *bh); // Delayed bwrite: the flusher writes the sector later
 void brelse(buffer_head_t *bh);
+void breada(uint8_t device, uint32_t block, uint32_t count); // Prefetch sectors [block, block + count)
+void bio_sync(void);
+void bio_start_flusher(void);
+// Hold off all writeback (flusher and bio_sync) until the same thread resumes it
+void bio_flusher_pause(void);
+void bio_flusher_resume(void);
+
+size_t bio_block_size(void);
+size_t bio_cache_blocks(void);
@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "gdt.h"
+#include "list.h"
+#include "pmm.h"
 
 // XCR0 feature bits
 #define XCR0_X87 (1u << 0)
@@ -40,6 +42,18 @@ typedef struct cpu
     int lapic_id;
     struct gdt_desc gdt[7];
     struct tss_entry tss;
+    // Fields above are referenced from assembly via GS; keep new ones below.
+    uint32_t id;                 // Index into the SMP cpu table
+    volatile bool sched_online;  // Set once this CPU schedules threads
+    list_head_t run_queue;       // THREAD_READY threads owned by this CPU
+    uint32_t nr_ready;           // Length of run_queue
+    struct Thread *idle_thread;  // Runs when run_queue is empty
+    uint64_t nr_switches;        // Context switches performed on this CPU
+    struct
+    {
+        uint32_t count;
+        uint64_t pfns[PMM_CPU_CACHE_SIZE];
+    } page_cache;                // Order-0 page magazine, see pmm.c
 } cpu_t;
 
 cpu_t *get_cpu(void);
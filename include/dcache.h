@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+// Directory entry cache: maps (directory, name) to the cache key of the entry it
+// names, or records that the name does not exist. Entries hold no references on the
+// filesystem; a hit is turned back into a node with iops->iget.
+#define DCACHE_ENTRIES 1024
+#define DCACHE_NAME_LEN 64 // Longer names are not cached
+
+typedef struct
+{
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+} dcache_stats_t;
+
+void dcache_init(void);
+
+// Returns 1 and sets *key if name is cached under dir, 0 if it is cached as missing and
+// -1 if nothing is known. *gen is to be handed to dcache_insert after a miss.
+int dcache_lookup(const vfs_cache_key_t *dir, const char *name, vfs_cache_key_t *key, uint64_t *gen);
+// Records the result of a directory search, key nullptr meaning the name does not exist.
+// Dropped if anything was invalidated since the lookup that returned gen.
+void dcache_insert(const vfs_cache_key_t *dir, const char *name, const vfs_cache_key_t *key, uint64_t gen);
+// Forgets every name cached under dir (an entry was created in it)
+void dcache_invalidate_dir(const vfs_cache_key_t *dir);
+// Forgets every name that leads to key, and the names cached under it (key was removed)
+void dcache_invalidate(const vfs_cache_key_t *key);
+void dcache_flush(void);
+
+void dcache_get_stats(dcache_stats_t *stats);
@@ -86,4 +86,8 @@ typedef struct
 
 #define ELF_MAGIC 0x464C457F
 
-bool elf_load(const char *path, uint64_t *entry_point, uint64_t *max_vaddr, pml4_t pml4);
+struct Process;
+
+// Maps the PT_LOAD segments of path into pml4. Segments become demand-paged
+// areas of proc; their pages are read from the file on first touch.
+bool elf_load(const char *path, uint64_t *entry_point, uint64_t *max_vaddr, pml4_t pml4, struct Process *proc);
@@ -43,10 +43,27 @@ extern struct icache icache;
 
 #define NINODE 50
 
+// Hashed directories (HTree): block 0 of a directory with EXT2_INDEX_FL holds a tree
+// of (hash, block) pairs over the leaf blocks, which are plain directory blocks.
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_INDEX_FL 0x00001000
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+#define EXT2_DX_HASH_LEGACY 0
+#define EXT2_DX_HASH_HALF_MD4 1
+#define EXT2_DX_HASH_TEA 2
+#define EXT2_DX_HASH_UNSIGNED 3 // Added to the above when s_flags has EXT2_FLAGS_UNSIGNED_HASH
+
+// Directories of at least this size without an HTree get a name index in memory on
+// first lookup, kept for the EXT2_DIR_INDEX_SLOTS most recently used ones.
+#define EXT2_DIR_INDEX_MIN_SIZE (2 * EXT2_BSIZE)
+#define EXT2_DIR_INDEX_SLOTS 16
+
 struct ext2fs_addrs
 {
     uint32_t busy;
     uint32_t addrs[EXT2_N_BLOCKS];
+    uint32_t goal; // Block to try first for the next allocation, 0 to start at the inode's group
 };
 
 extern struct ext2fs_addrs ext2fs_addrs[NINODE];
@@ -121,7 +138,15 @@ struct ext2_super_block
     uint16_t s_reserved_word_pad;
     uint32_t s_default_mount_opts;
     uint32_t s_first_meta_bg; /* First metablock block group */
-    uint32_t s_reserved[190]; /* Padding to the end of the block */
+    uint32_t s_mkfs_time; /* When the filesystem was created */
+    uint32_t s_jnl_blocks[17]; /* Backup of the journal inode */
+    uint32_t s_blocks_count_hi; /* Blocks count */
+    uint32_t s_r_blocks_count_hi; /* Reserved blocks count */
+    uint32_t s_free_blocks_hi; /* Free blocks count */
+    uint16_t s_min_extra_isize; /* All inodes have at least # bytes */
+    uint16_t s_want_extra_isize; /* New inodes should reserve # bytes */
+    uint32_t s_flags; /* Miscellaneous flags */
+    uint32_t s_reserved[167]; /* Padding to the end of the block */
 };
 
 struct ext2_group_desc
@@ -268,6 +293,10 @@ struct ext2_inode
     uint16_t i_uid;
     uint16_t i_gid;
     uint32_t i_flags;
+
+    // Readdir cursor: live entry readdir_index starts at byte readdir_off
+    uint32_t readdir_index;
+    uint32_t readdir_off;
 };
 
 struct icache
@@ -279,7 +308,7 @@ struct icache
 void ext2fs_readsb(int dev, struct ext2_super_block* sb);
 int ext2fs_dirlink(struct ext2_inode*, const char*, uint32_t);
 struct ext2_inode* ext2fs_dirlookup(const struct ext2_inode*, const char*, uint32_t*);
-struct ext2_inode* ext2fs_ialloc(uint32_t, short);
+struct ext2_inode* ext2fs_ialloc(uint32_t, short, uint32_t);
 void ext2_init_inode(int dev);
 int ext2fs_ilock(struct ext2_inode*);
 void ext2fs_iput(struct ext2_inode*);
@@ -291,3 +320,5 @@ void ext2_stat_inode(const struct ext2_inode*, struct stat*);
 int ext2_write_inode(struct ext2_inode*, const char*, uint32_t, uint32_t);
 
 vfs_inode_t* ext2_mount(uint8_t drive_index, uint32_t partition_lba);
+// Free blocks and inodes of a mounted filesystem, as tracked by the allocator
+int ext2_free_counts(uint32_t dev, uint32_t* blocks, uint32_t* inodes);
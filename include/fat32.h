@@ -33,6 +33,26 @@ typedef struct __attribute__((packed))
     uint8_t fs_type[8];
 } fat32_bpb_t;
 
+// FSInfo sector: the free cluster count and where to look for the next free cluster
+typedef struct __attribute__((packed))
+{
+    uint32_t lead_sig;
+    uint8_t reserved1[480];
+    uint32_t struct_sig;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t reserved2[12];
+    uint32_t trail_sig;
+} fat32_fsinfo_t;
+
+#define FAT32_FSINFO_LEAD_SIG 0x41615252
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272
+#define FAT32_FSINFO_TRAIL_SIG 0xAA550000
+
+// ext_flags: with mirroring off only the active FAT is used
+#define FAT32_EXT_FLAGS_ACTIVE 0x0F
+#define FAT32_EXT_FLAGS_NO_MIRROR 0x80
+
 typedef struct __attribute__((packed))
 {
     uint8_t name[11];
@@ -77,6 +97,7 @@ typedef struct
     uint32_t bytes_per_cluster;
     uint32_t fat_start_lba;
     uint32_t total_clusters;
+    struct fat32_fat *fat; // In-memory FAT, shared by every fat32_fs_t on the volume
 } fat32_fs_t;
 
 typedef struct
@@ -99,3 +120,4 @@ int fat32_create_file(fat32_fs_t *fs, const char *path);
 int fat32_create_dir(fat32_fs_t *fs, const char *path);
 int fat32_write_file(fat32_fs_t *fs, const char *path, uint8_t *buffer, uint32_t size);
 int fat32_delete_file(fat32_fs_t *fs, const char *path);
+uint32_t fat32_free_clusters(const fat32_fs_t *fs);
@@ -15,12 +15,14 @@ typedef struct
     uint16_t capabilities;
     uint32_t command_sets;
     uint32_t size; // Size in sectors
+    uint8_t dma;   // Multiword DMA supported (IDENTIFY word 49 bit 8)
     char model[41];
 } ide_device_t;
 
 extern ide_device_t ide_devices[4];
 
 void ide_init(void);
+void ide_init_dma(uint16_t bmide); // Bus-master registers from BAR4, 0 keeps PIO
 int ide_read_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer);
 int ide_write_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer);
 void ide_irq_handler(uint8_t channel);
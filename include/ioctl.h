@@ -19,5 +19,9 @@ struct winsize
 #define FB_IOCTL_GET_FBADDR 0x4602
 #define FB_IOCTL_GET_PITCH 0x4603
 
+// Pipe capacity in bytes, through a uint32_t
+#define PIPE_IOCTL_GET_SIZE 0x5000
+#define PIPE_IOCTL_SET_SIZE 0x5001
+
 // Keyboard ioctls
 #define KDFLUSH 0x4B00 // Flush keyboard input buffers
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+// The cache may grow to 1/PAGE_CACHE_FRACTION of the memory free at boot, and
+// gives pages back whenever free memory drops below 1/PAGE_CACHE_RESERVE of it.
+#define PAGE_CACHE_FRACTION 4
+#define PAGE_CACHE_RESERVE 16
+#define PAGE_CACHE_MIN_PAGES 64
+
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t pages;
+    size_t max_pages;
+} page_cache_stats_t;
+
+void page_cache_init(void);
+
+// Reads file contents through the cache, filling missing pages with node->iops->read
+uint64_t page_cache_read(vfs_inode_t *node, const vfs_cache_key_t *key, uint64_t offset, uint64_t size,
+                         uint8_t *buffer);
+// True if page index of the file is cached
+bool page_cache_contains(const vfs_cache_key_t *key, uint64_t index);
+// Copies data that was just written to the file into any cached pages it covers
+void page_cache_update(const vfs_cache_key_t *key, uint64_t offset, uint64_t size, const uint8_t *buffer);
+// Drops every cached page of a file (truncate, delete)
+void page_cache_invalidate(const vfs_cache_key_t *key);
+
+// Frame holding page index of a cached file, with a reference for the caller to map.
+// Returns nullptr unless the file is cacheable and the page lies entirely inside it.
+void *page_cache_map(vfs_inode_t *node, uint64_t index);
+// Like page_cache_map(), but also hands out the last, partial page of the file, so shared
+// mappings of it see one frame. Bytes past the end of the file are zero until written
+// through a mapping, and never reach the file.
+void *page_cache_map_shared(vfs_inode_t *node, uint64_t index);
+
+void page_cache_get_stats(page_cache_stats_t *stats);
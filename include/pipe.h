@@ -5,21 +5,28 @@
 #include "vfs.h"
 #include "spinlock.h"
 
-#define PIPE_BUF_SIZE 4096
+#define PIPE_BUF_SIZE 4096             // Capacity of a new pipe
+#define PIPE_MAX_SIZE (1024 * 1024)   // Largest capacity PIPE_IOCTL_SET_SIZE accepts
 
 typedef struct pipe
 {
     spinlock_t lock;
-    uint8_t buffer[PIPE_BUF_SIZE];
+    uint8_t *buffer;   // Ring of capacity bytes
+    uint32_t capacity; // Whole pages
     uint32_t read_pos;
     uint32_t write_pos;
     uint32_t count;
-    int read_open;  // Number of readers
-    int write_open; // Number of writers
+    int read_open;       // Number of readers
+    int write_open;      // Number of writers
+    int readers_waiting; // Readers asleep on &readers_waiting until there is data
+    int writers_waiting; // Writers asleep on &writers_waiting until there is room
 } pipe_t;
 
 // Create a new pipe and return read/write inodes
 int pipe_alloc(vfs_inode_t **read_inode, vfs_inode_t **write_inode);
+// Resizes the ring to capacity rounded up to whole pages, keeping what is in it. Fails if
+// the capacity is above PIPE_MAX_SIZE or too small for the data the pipe holds.
+int pipe_set_capacity(pipe_t *p, uint32_t capacity);
 
 // Pipe inode operations
 uint64_t pipe_read(const vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer);
@@ -4,6 +4,9 @@
 #include <stddef.h>
 
 #define PAGE_SIZE 4096
+#define PMM_MAX_ORDER 10        // Largest buddy block is 2^10 pages (4 MiB); longer runs join such blocks
+#define PMM_CPU_CACHE_SIZE 32   // Order-0 pages cached per CPU
+#define PMM_CPU_CACHE_BATCH 16  // Pages moved per refill/drain
 
 void pmm_init(uint64_t hhdm_offset);
 void *pmm_alloc_page(void);
@@ -11,3 +14,9 @@ void pmm_free_page(void *ptr);
 void *pmm_alloc_pages(size_t count);
 void pmm_free_pages(void *ptr, size_t count);
 uint64_t pmm_get_highest_addr(void);
+size_t pmm_free_page_count(void);
+// True if every page of the range sits in a block on the buddy lists (pages in the
+// per-CPU magazines do not count)
+bool pmm_range_is_free(void *ptr, size_t count);
+void pmm_page_get(void *ptr);          // Take an extra reference on an allocated page
+uint32_t pmm_page_refcount(void *ptr); // 0 for free or unmanaged pages
@@ -15,6 +15,17 @@
 #define VMA_USER (1u << 3)
 #define VMA_MMAP (1u << 4)
 #define VMA_STACK (1u << 5)
+#define VMA_HEAP (1u << 6)
+#define VMA_SHARED (1u << 7) // MAP_SHARED: writes reach the file and survive fork
+
+// End of the lower canonical half, the most user mappings can reach
+#define USER_SPACE_END 0x800000000000ull
+
+// User stack: a grows-down area below USER_STACK_TOP, populated on demand
+#define USER_STACK_TOP 0x7FFFFFFFF000ull
+#define USER_STACK_SIZE (4 * PAGE_SIZE)            // Initially reserved, not mapped
+#define USER_STACK_MAX (8ull * 1024 * 1024)        // Growth limit below USER_STACK_TOP
+#define USER_STACK_GUARD_GAP (256ull * PAGE_SIZE) // Kept free between the stack and the area below
 
 typedef enum
 {
@@ -42,13 +53,15 @@ struct context
 #include "vfs.h"
 #include "spinlock.h"
 #include "list.h"
+#include "timer.h"
 
 typedef struct
 {
     struct vfs_inode *inode;
     uint64_t offset;
     int flags;
-    uint32_t ref; // Reference count for dup()
+    uint32_t ref;       // Reference count for dup()
+    vfs_readahead_t ra; // Sequential read detection for regular files
 } file_descriptor_t;
 
 typedef struct vm_area
@@ -57,6 +70,9 @@ typedef struct vm_area
     uint64_t end;
     uint32_t flags;
     list_head_t list;
+    struct vfs_inode *file; // Backing file for demand paging, nullptr for anonymous memory
+    uint64_t file_offset;   // File offset that maps to start
+    uint64_t file_size;     // Bytes from start backed by the file; the rest is zero-filled
 } vm_area_t;
 
 typedef struct Process
@@ -93,6 +109,10 @@ typedef struct Thread
     uint64_t ticks_remaining; // Time slice remaining
     uint64_t _align[2];       // Padding to ensure list is 16-byte aligned relative to start
     list_head_t list;         // Thread list node
+    list_head_t run_list;     // Node in the owning CPU's run queue
+    uint32_t cpu;             // Index of the CPU whose run queue owns this thread
+    ktimer_t sleep_timer;     // Wakes the thread at sleep_until
+    list_head_t wait_list;    // Node in the wait-queue bucket for chan
 } thread_t;
 
 extern list_head_t process_list;
@@ -108,7 +128,19 @@ void vm_area_init(process_t *proc);
 vm_area_t *vm_area_add(process_t *proc, uint64_t start, uint64_t end, uint32_t flags);
 void vm_area_clone(process_t *dest, const process_t *src);
 void vm_area_clear(process_t *proc);
+vm_area_t *vm_area_add_file(process_t *proc, uint64_t start, uint64_t end, uint32_t flags,
+                            struct vfs_inode *file, uint64_t file_offset, uint64_t file_size);
+vm_area_t *vm_area_find(process_t *proc, uint64_t addr);
+void vm_area_swap(process_t *proc, list_head_t *areas);
+void vm_area_release(list_head_t *areas, pml4_t pml4);
+int vm_area_unmap_area(process_t *proc, uint64_t start, uint64_t end);
+bool vm_area_populate(vm_area_t *area, pml4_t pml4, uint64_t addr);
+bool vm_area_handle_fault(process_t *proc, uint64_t addr, bool write);
+int vm_area_brk(process_t *proc, uint64_t old_brk, uint64_t new_brk);
 thread_t *thread_create(process_t *process, void (*entry)(void), bool is_user);
+thread_t *thread_alloc(process_t *process, void (*entry)(void));
+void thread_start(thread_t *thread);
+void thread_start_on(thread_t *thread, uint32_t cpu);
 thread_t *get_current_thread(void);
 process_t *get_current_process(void);
 
@@ -116,11 +148,14 @@ process_t *get_current_process(void);
 #define current_process (get_current_process())
 
 bool scheduler_tick(void);
+[[noreturn]] void scheduler_enter_ap(void);
 
 void schedule(void);
 void yield(void);
 void thread_sleep(void *chan, spinlock_t *lock);
+void thread_sleep_until(uint64_t tick);
 void thread_wakeup(void *chan);
+void thread_wake(thread_t *thread);
 void switch_to(thread_t *prev, thread_t *next);
 
 void process_spawn_init(void);
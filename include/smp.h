@@ -1,6 +1,14 @@
 #pragma once
 #include <stdint.h>
 #include <limine.h>
+#include "cpu.h"
+
+#define MAX_CPUS 32
 
 void smp_init_cpu0(void);
 void smp_boot_aps(void);
+
+// Number of cpu_t slots handed out by Limine (BSP included), capped at MAX_CPUS.
+uint32_t smp_cpu_count(void);
+cpu_t *smp_get_cpu(uint32_t index);
+cpu_t *smp_bsp(void);
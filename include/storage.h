@@ -1,11 +1,48 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 // Logical block device abstraction used by BIO/VFS.
 // device 0: prefer AHCI port if available, else first IDE drive.
 // device 1: next available IDE drive (if any) to allow mixed AHCI/IDE setups.
 
+// A physically contiguous piece of a block request; length is a multiple of the sector size.
+typedef struct
+{
+    uint64_t phys;
+    uint32_t length;
+} storage_segment_t;
+
+#define STORAGE_SECTOR_SIZE 512
+
+// Requests from threads that can sleep go through a per-device queue kept in LBA
+// order. Up to the backend's queue depth of them are dispatched at once, each taking
+// adjacent requests of the same direction along (at most STORAGE_MERGE_SEGMENTS
+// segments). A request older than STORAGE_DEADLINE_MS is served before the elevator.
+#define STORAGE_MERGE_SEGMENTS 64
+#define STORAGE_DEADLINE_MS 100
+#define STORAGE_LATENCY_BUCKETS 16 // Bucket i counts requests that took < 2^i * 16 us
+
+typedef struct
+{
+    uint64_t requests;   // Requests submitted
+    uint64_t dispatches; // Backend commands issued for them
+    uint64_t merged;     // Requests that rode along with another one's command
+    uint64_t bypassed;   // Requests issued directly (caller cannot sleep, buffer outside the HHDM)
+    uint64_t deadline;   // Dispatches chosen by age rather than LBA order
+    uint32_t depth;      // Requests queued or in flight right now
+    uint32_t max_depth;
+    uint64_t latency[STORAGE_LATENCY_BUCKETS];
+} storage_stats_t;
+
 void storage_init(void);
-int storage_read(uint8_t device, uint32_t lba, uint8_t count, uint8_t *buffer);
-int storage_write(uint8_t device, uint32_t lba, uint8_t count, const uint8_t *buffer);
+int storage_read(uint8_t device, uint32_t lba, uint32_t count, uint8_t *buffer);
+int storage_write(uint8_t device, uint32_t lba, uint32_t count, const uint8_t *buffer);
+
+// Scatter-gather requests: consecutive sectors starting at lba move to or from the
+// segments in order. AHCI turns each segment into a PRDT entry of a single command.
+int storage_read_segments(uint8_t device, uint32_t lba, const storage_segment_t *segments, size_t count);
+int storage_write_segments(uint8_t device, uint32_t lba, const storage_segment_t *segments, size_t count);
+
+int storage_get_stats(uint8_t device, storage_stats_t *stats);
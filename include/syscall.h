@@ -42,6 +42,9 @@ struct syscall_regs
 #define SYS_SHUTDOWN 30
 #define SYS_REBOOT 31
 #define SYS_KILL 32
+#define SYS_SYNC 33
+#define SYS_FSYNC 34
+#define SYS_SPLICE 35
 
 void syscall_init(void);
 void syscall_set_exit_hook(void (*hook)(int));
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "list.h"
+
+// One-shot kernel timers driven by scheduler_ticks (advanced by the BSP).
+// Callbacks run from the BSP timer interrupt with no locks held, so they
+// must not sleep.
+
+typedef void (*timer_callback_t)(void *arg);
+
+typedef struct ktimer
+{
+    uint64_t expires;          // Absolute scheduler_ticks value
+    timer_callback_t callback;
+    void *arg;
+    list_head_t list;          // Wheel slot node
+    bool pending;
+} ktimer_t;
+
+void timer_init(ktimer_t *timer, timer_callback_t callback, void *arg);
+// Arms (or re-arms) the timer to fire once scheduler_ticks reaches `expires`.
+void timer_add(ktimer_t *timer, uint64_t expires);
+// Disarms the timer and waits for a callback already running on another CPU.
+// Returns true if the timer was pending.
+bool timer_cancel(ktimer_t *timer);
+bool timer_pending(const ktimer_t *timer);
+uint64_t timer_ms_to_ticks(uint64_t ms);
+// Fires every timer due at or before `now`. Called from scheduler_tick().
+void timer_run(uint64_t now);
@@ -12,6 +12,13 @@
 #define VFS_SYMLINK 0x06
 #define VFS_MOUNTPOINT 0x08
 
+// Sequential readers are read ahead of by a window that starts at VFS_READAHEAD_MIN
+// bytes and doubles on every refill up to VFS_READAHEAD_MAX.
+#define VFS_READAHEAD_MIN (16 * 1024)
+#define VFS_READAHEAD_MAX (256 * 1024)
+// Largest piece vfs_splice() moves through its buffer at a time
+#define VFS_SPLICE_CHUNK (64 * 1024)
+
 struct stat
 {
     int dev;
@@ -31,15 +38,33 @@ struct stat
 
 struct vfs_inode;
 
+// Names a file's contents independently of the per-open vfs_inode_t copy: the
+// volume (drive << 32 | partition LBA) plus a file id that is stable while the file exists.
+typedef struct
+{
+    uint64_t volume;
+    uint64_t id;
+} vfs_cache_key_t;
+
 typedef struct
 {
     char name[128];
     uint32_t inode;
 } vfs_dirent_t;
 
+// Per-open read-ahead state, kept next to the file offset
+typedef struct
+{
+    uint64_t next;   // Offset a sequential read would start at
+    uint64_t end;    // End of what has been read ahead
+    uint32_t window; // Current read-ahead size in bytes, 0 after a seek
+} vfs_readahead_t;
+
 struct inode_operations
 {
     uint64_t (*read)(const struct vfs_inode *node, uint64_t offset, uint64_t size, uint8_t *buffer);
+    // Starts bringing [offset, offset + size) of the file into the buffer cache in large requests
+    void (*readahead)(const struct vfs_inode *node, uint64_t offset, uint64_t size);
     uint64_t (*write)(struct vfs_inode *node, uint64_t offset, uint64_t size, uint8_t *buffer);
     int (*truncate)(struct vfs_inode *node);
     void (*open)(const struct vfs_inode *node);
@@ -47,11 +72,20 @@ struct inode_operations
     int (*ioctl)(struct vfs_inode *node, int request, void *arg);
     vfs_dirent_t *(*readdir)(const struct vfs_inode *node, uint32_t index);
     struct vfs_inode *(*finddir)(const struct vfs_inode *node, const char *name);
+    // Opens the entry name of the directory node that finddir found earlier and whose
+    // cache_key was key, without searching the directory. Returns nullptr if it is gone.
+    struct vfs_inode *(*iget)(const struct vfs_inode *node, const char *name, const vfs_cache_key_t *key);
     struct vfs_inode *(*clone)(const struct vfs_inode *node);
     int (*mknod)(const struct vfs_inode *node, const char *name, int mode, int dev);
     int (*link)(struct vfs_inode *parent, const char *name, struct vfs_inode *target);
     int (*unlink)(struct vfs_inode *parent, const char *name);
     int (*stat)(const struct vfs_inode *node, struct stat *st);
+    // Validates a mapping of *length bytes at offset. Devices set *phys to the physical
+    // address backing offset (and may shrink *length); files leave it 0 and are paged in on fault.
+    int (*mmap)(struct vfs_inode *node, uint64_t offset, uint64_t *length, uint64_t *phys);
+    // Regular files whose contents may be kept in the page cache fill in key and return 0.
+    // Directories that fill it in have their lookups cached in the dentry cache.
+    int (*cache_key)(const struct vfs_inode *node, vfs_cache_key_t *key);
 };
 
 typedef struct vfs_inode
@@ -69,10 +103,20 @@ extern vfs_inode_t *vfs_root;
 
 void vfs_init();
 uint64_t vfs_read(vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer);
+// Called before each read through an open file; reads ahead once the access looks sequential
+void vfs_readahead(vfs_inode_t *node, vfs_readahead_t *ra, uint64_t offset, uint64_t size);
 uint64_t vfs_write(vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer);
+// Moves up to count bytes from in to out inside the kernel and advances both offsets by
+// what was moved. ra, if given, is the read-ahead state of the input. Bytes taken from a
+// pipe that the output refuses are lost: the return value counts only what was delivered,
+// and is -1 if that is nothing.
+int64_t vfs_splice(vfs_inode_t *in, uint64_t *in_offset, vfs_readahead_t *ra, vfs_inode_t *out,
+                   uint64_t *out_offset, uint64_t count);
 int vfs_truncate(vfs_inode_t *node);
 void vfs_open(vfs_inode_t *node);
 void vfs_close(vfs_inode_t *node);
+vfs_inode_t *vfs_clone(const vfs_inode_t *node); // Independent handle on the same file, or nullptr
+int vfs_generic_file_mmap(vfs_inode_t *node, uint64_t offset, uint64_t *length, uint64_t *phys);
 vfs_dirent_t *vfs_readdir(vfs_inode_t *node, uint32_t index);
 vfs_inode_t *vfs_finddir(vfs_inode_t *node, char *name);
 vfs_inode_t *vfs_resolve_path(const char *path);
@@ -9,7 +9,10 @@
 #define PTE_USER (1ull << 2)
 #define PTE_PWT (1ull << 3) // Page Write-Through
 #define PTE_PCD (1ull << 4) // Page Cache Disable
+#define PTE_DIRTY (1ull << 6) // Set by the CPU on the first write through the entry
 #define PTE_HUGE (1ull << 7)
+#define PTE_COW (1ull << 9)     // Available bit: read-only share created by fork
+#define PTE_SHARED (1ull << 10) // Available bit: MAP_SHARED page, fork keeps it writable in both
 #define PTE_NX (1ull << 63)
 
 typedef uint64_t *pml4_t;
@@ -20,8 +23,11 @@ void vmm_init(uint64_t hhdm_offset);
 void vmm_map_page(pml4_t pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 void vmm_unmap_page(pml4_t pml4, uint64_t virt);
 pml4_t vmm_new_pml4(void);
-pml4_t vmm_copy_pml4(pml4_t src);
+pml4_t vmm_copy_pml4(pml4_t src);       // Copy-on-write: shares user frames read-only
+pml4_t vmm_copy_pml4_eager(pml4_t src); // Duplicates every user frame up front
 void vmm_destroy_pml4(pml4_t pml4);
 void vmm_switch_pml4(const uint64_t *pml4);
 void vmm_finalize(void);
 uint64_t vmm_virt_to_phys(pml4_t pml4, uint64_t virt);
+bool vmm_handle_cow_fault(pml4_t pml4, uint64_t virt);
+bool vmm_page_dirty(pml4_t pml4, uint64_t virt); // Present and written through this mapping
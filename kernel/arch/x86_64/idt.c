@@ -9,6 +9,7 @@
 #include "process.h"
 #include "kernel.h"
 #include "debug.h"
+#include "vmm.h"
 
 #define IDT_FLAG_PRESENT 0x80
 #define IDT_FLAG_RING0 0x00
@@ -21,6 +22,10 @@
 #define IRQ_IDE_PRIMARY 14
 #define IRQ_IDE_SECONDARY 15
 
+#define EXCEPTION_PAGE_FAULT 14
+#define PF_PRESENT (1ull << 0) // Protection violation rather than a missing page
+#define PF_WRITE (1ull << 1)
+
 // We need the framebuffer request to get the framebuffer
 extern volatile struct limine_framebuffer_request framebuffer_request;
 
@@ -95,39 +100,76 @@ static void ide_secondary_isr([[maybe_unused]] struct interrupt_frame *frame)
     apic_send_eoi();
 }
 
-void interrupt_handler(struct interrupt_frame *frame)
+[[noreturn]] static void exception_panic(struct interrupt_frame *frame)
 {
-    if (isr_handlers[frame->int_no])
+    printk("PANIC: EXCEPTION OCCURRED! Vector: %d\n", frame->int_no);
+    printk("Error Code: 0x%lx\n", frame->err_code);
+    printk("RIP: 0x%lx\n", frame->rip);
+    printk("CS: 0x%lx\n", frame->cs);
+    printk("RFLAGS: 0x%lx\n", frame->rflags);
+    printk("RSP: 0x%lx\n", frame->rsp);
+    printk("SS: 0x%lx\n", frame->ss);
+
+    if (frame->int_no == EXCEPTION_PAGE_FAULT)
     {
-        isr_handlers[frame->int_no](frame);
+        uint64_t cr2;
+        __asm__ volatile("mov %0, cr2" : "=r"(cr2));
+        printk("CR2 (Page Fault Address): 0x%lx\n", cr2);
     }
-    else if (frame->int_no < 32)
-    {
-        printk("PANIC: EXCEPTION OCCURRED! Vector: %d\n", frame->int_no);
-        printk("Error Code: 0x%lx\n", frame->err_code);
-        printk("RIP: 0x%lx\n", frame->rip);
-        printk("CS: 0x%lx\n", frame->cs);
-        printk("RFLAGS: 0x%lx\n", frame->rflags);
-        printk("RSP: 0x%lx\n", frame->rsp);
-        printk("SS: 0x%lx\n", frame->ss);
-
-        if (frame->int_no == 14)
-        {
-            uint64_t cr2;
-            __asm__ volatile("mov %0, cr2" : "=r"(cr2));
-            printk("CR2 (Page Fault Address): 0x%lx\n", cr2);
-        }
 
-        stack_trace();
+    stack_trace();
 
 #ifdef TEST_MODE
-        shutdown();
+    shutdown();
 #endif
 
-        for (;;)
+    for (;;)
+    {
+        __asm__("hlt");
+    }
+}
+
+// Write faults on copy-on-write pages and first touches of demand-paged areas
+// are resolved here; anything else is fatal. Kernel accesses through user
+// pointers (copy_to_user) land here too since CR0.WP is set.
+static void page_fault_isr(struct interrupt_frame *frame)
+{
+    uint64_t cr2;
+    __asm__ volatile("mov %0, cr2" : "=r"(cr2));
+
+    if (cr2 < 0x800000000000)
+    {
+        if (frame->err_code & PF_PRESENT)
         {
-            __asm__("hlt");
+            uint64_t cr3;
+            __asm__ volatile("mov %0, cr3" : "=r"(cr3));
+            if ((frame->err_code & PF_WRITE) && vmm_handle_cow_fault((pml4_t)(cr3 & 0x000FFFFFFFFFF000), cr2))
+                return;
         }
+        else if (current_process)
+        {
+            // Filling a page may read from disk, so let interrupts back in if the faulting code had them
+            if (frame->rflags & RFLAGS_IF)
+                __asm__ volatile("sti");
+            bool handled = vm_area_handle_fault(current_process, cr2, frame->err_code & PF_WRITE);
+            __asm__ volatile("cli");
+            if (handled)
+                return;
+        }
+    }
+
+    exception_panic(frame);
+}
+
+void interrupt_handler(struct interrupt_frame *frame)
+{
+    if (isr_handlers[frame->int_no])
+    {
+        isr_handlers[frame->int_no](frame);
+    }
+    else if (frame->int_no < 32)
+    {
+        exception_panic(frame);
     }
 
     if (frame->int_no >= 32)
@@ -151,6 +193,7 @@ void idt_init(void)
         isr_handlers[i] = nullptr;
     }
 
+    register_interrupt_handler(EXCEPTION_PAGE_FAULT, page_fault_isr);
     register_interrupt_handler(IRQ_BASE + 0, timer_isr);
     register_interrupt_handler(IRQ_BASE + IRQ_KEYBOARD, keyboard_isr);
     register_interrupt_handler(IRQ_BASE + IRQ_IDE_PRIMARY, ide_primary_isr);
@@ -10,11 +10,38 @@
 #include "spinlock.h"
 #include <stdatomic.h>
 #include "uart.h"
-
-#define MAX_CPUS 32
+#include "process.h"
 
 static atomic_int cpus_started = 0;
 static cpu_t cpus[MAX_CPUS];
+static uint32_t cpu_count = 0;
+static cpu_t *bsp_cpu = nullptr;
+
+static void smp_setup_cpu(uint32_t index, int lapic_id)
+{
+    cpus[index].lapic_id = lapic_id;
+    cpus[index].self = &cpus[index];
+    cpus[index].active_thread = nullptr;
+    cpus[index].id = index;
+    INIT_LIST_HEAD(&cpus[index].run_queue);
+}
+
+uint32_t smp_cpu_count(void)
+{
+    return cpu_count;
+}
+
+cpu_t *smp_get_cpu(uint32_t index)
+{
+    if (index >= cpu_count || !cpus[index].self)
+        return nullptr;
+    return &cpus[index];
+}
+
+cpu_t *smp_bsp(void)
+{
+    return bsp_cpu;
+}
 
 static void ap_main(struct limine_smp_info *info)
 {
@@ -30,12 +57,8 @@ static void ap_main(struct limine_smp_info *info)
 
     atomic_fetch_add(&cpus_started, 1);
 
-    __asm__ volatile("sti");
-
-    while (1)
-    {
-        __asm__ volatile("hlt");
-    }
+    // Parks until process_init() has run, then becomes this CPU's idle thread.
+    scheduler_enter_ap();
 }
 
 void smp_init_cpu0(void)
@@ -49,6 +72,8 @@ void smp_init_cpu0(void)
         return;
     }
 
+    cpu_count = smp_response->cpu_count < MAX_CPUS ? (uint32_t)smp_response->cpu_count : MAX_CPUS;
+
     bool bsp_found = false;
     for (uint64_t i = 0; i < smp_response->cpu_count; i++)
     {
@@ -59,9 +84,8 @@ void smp_init_cpu0(void)
 
         if (cpu_info->lapic_id == smp_response->bsp_lapic_id)
         {
-            cpus[i].lapic_id = (int)cpu_info->lapic_id;
-            cpus[i].self = &cpus[i];
-            cpus[i].active_thread = nullptr;
+            smp_setup_cpu((uint32_t)i, (int)cpu_info->lapic_id);
+            bsp_cpu = &cpus[i];
 
             // Load null selector into GS/FS to ensure MSR_GS_BASE is used
             __asm__ volatile("xor eax, eax; mov gs, eax; mov fs, eax" ::: "eax");
@@ -105,9 +129,7 @@ void smp_boot_aps(void)
 
         if (cpu_info->lapic_id != smp_response->bsp_lapic_id)
         {
-            cpus[i].lapic_id = (int)cpu_info->lapic_id;
-            cpus[i].self = &cpus[i];
-            cpus[i].active_thread = nullptr;
+            smp_setup_cpu((uint32_t)i, (int)cpu_info->lapic_id);
 
             cpu_info->extra_argument = (uint64_t)&cpus[i];
             cpu_info->goto_address = ap_main;
@@ -22,8 +22,10 @@
 #include "vfs.h"
 #include "time.h"
 #include "tsc.h"
+#include "timer.h"
 #include "path.h"
 #include "pipe.h"
+#include "bio.h"
 
 #ifdef KASAN
 #include "kasan.h"
@@ -58,6 +60,9 @@ int sys_pipe(int pipefd[2]);
 long sys_lseek(int fd, long offset, int whence);
 int sys_dup(int oldfd);
 int sys_kill(int pid, int sig);
+int sys_sync(void);
+int sys_fsync(int fd);
+int sys_splice(int fd_in, int fd_out, size_t count);
 void sys_shutdown();
 void sys_reboot();
 
@@ -168,8 +173,6 @@ extern void syscall_entry(void);
 extern void fork_return(void);
 extern void fork_child_trampoline(void);
 
-#define TIMER_TICK_MS 10
-
 static void set_process_name_from_path(process_t *proc, const char *path)
 {
     if (!proc || !path)
@@ -458,35 +461,35 @@ int sys_spawn(const char *path)
     if (!new_pml4)
         return -1;
 
-    uint64_t entry_point;
-    uint64_t max_vaddr;
-    if (!elf_load(abs_path, &entry_point, &max_vaddr, new_pml4))
+    process_t *proc = process_create(path);
+    if (!proc)
     {
+        vmm_destroy_pml4(new_pml4);
         return -1;
     }
+    proc->pml4 = new_pml4;
 
-    uint64_t stack_top = 0x7FFFFFFFF000;
-    uint64_t stack_size = 4 * 4096;
-    uint64_t stack_base = stack_top - stack_size;
-
-    for (uint64_t addr = stack_base; addr < stack_top; addr += 4096)
+    uint64_t entry_point;
+    uint64_t max_vaddr;
+    if (!elf_load(abs_path, &entry_point, &max_vaddr, new_pml4, proc))
     {
-        void *phys = pmm_alloc_page();
-        vmm_map_page(new_pml4, addr, (uint64_t)phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
+        process_destroy(proc);
+        return -1;
     }
 
-    process_t *proc = process_create(path);
     set_process_name_from_path(proc, abs_path);
-    proc->pml4 = new_pml4;
     proc->parent = current_process;
     proc->heap_end = max_vaddr;
 
     process_copy_fds(proc, current_process);
-    vm_area_add(proc, stack_base, stack_top, VMA_READ | VMA_WRITE | VMA_USER | VMA_STACK);
+    uint64_t stack_top = USER_STACK_TOP;
+    vm_area_add(proc, stack_top - USER_STACK_SIZE, stack_top, VMA_READ | VMA_WRITE | VMA_USER | VMA_STACK);
 
-    thread_t *thread = thread_create(proc, spawn_trampoline, false);
+    // Fill in the user entry before the thread becomes visible to other CPUs.
+    thread_t *thread = thread_alloc(proc, spawn_trampoline);
     thread->user_entry = entry_point;
     thread->user_stack = stack_top;
+    thread_start(thread);
 
     return proc->pid;
 }
@@ -514,7 +517,7 @@ int sys_fork(struct syscall_regs *regs)
     vm_area_clone(child_proc, current_process);
 
     // Create Thread
-    thread_t *child_thread = thread_create(child_proc, nullptr, true);
+    thread_t *child_thread = thread_alloc(child_proc, nullptr);
     if (!child_thread)
         return -1;
 
@@ -552,6 +555,7 @@ int sys_fork(struct syscall_regs *regs)
     child_thread->context = child_ctx;
     cpu_t *cpu = get_cpu();
     child_thread->saved_user_rsp = cpu->user_rsp; // Inherit user stack pointer
+    thread_start(child_thread);
 
     return child_proc->pid;
 }
@@ -626,25 +630,32 @@ int sys_execve(const char *path, const char *const argv[], [[maybe_unused]] cons
     if (!new_pml4)
         return -1;
 
+    // Build the new image's areas on the side so a failed load leaves the old image intact
+    list_head_t old_areas;
+    INIT_LIST_HEAD(&old_areas);
+    vm_area_swap(current_process, &old_areas);
+
     uint64_t entry_point;
     uint64_t max_vaddr;
-    if (!elf_load(abs_path, &entry_point, &max_vaddr, new_pml4))
+    if (!elf_load(abs_path, &entry_point, &max_vaddr, new_pml4, current_process))
     {
+        vm_area_swap(current_process, &old_areas);
+        vm_area_release(&old_areas, nullptr);
+        vmm_destroy_pml4(new_pml4);
         return -1;
     }
+    vm_area_release(&old_areas, current_process->pml4);
 
+    // Drop the old image so frames still shared copy-on-write with the parent go back to it
+    pml4_t old_pml4 = current_process->pml4;
     current_process->pml4 = new_pml4;
     vmm_switch_pml4(new_pml4);
+    if (old_pml4 && old_pml4 != kernel_process->pml4)
+        vmm_destroy_pml4(old_pml4);
 
-    uint64_t stack_top = 0x7FFFFFFFF000;
-    uint64_t stack_size = 4 * 4096;
-    uint64_t stack_base = stack_top - stack_size;
-
-    for (uint64_t addr = stack_base; addr < stack_top; addr += 4096)
-    {
-        void *phys = pmm_alloc_page();
-        vmm_map_page(new_pml4, addr, (uint64_t)phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-    }
+    // The argument strings written below fault the top stack pages in
+    uint64_t stack_top = USER_STACK_TOP;
+    vm_area_add(current_process, stack_top - USER_STACK_SIZE, stack_top, VMA_READ | VMA_WRITE | VMA_USER | VMA_STACK);
 
     uint64_t user_rsp = stack_top;
     if (setup_user_stack(new_pml4, stack_top, args, argc, &user_rsp) != 0)
@@ -727,15 +738,7 @@ int sys_gettimeofday(struct timeval *tv, struct timezone *tz)
 
 int sys_sleep(uint64_t milliseconds)
 {
-    uint64_t start = scheduler_ticks;
-    uint64_t ticks = milliseconds / TIMER_TICK_MS;
-    if (ticks == 0)
-        ticks = 1;
-
-    while (scheduler_ticks < start + ticks)
-    {
-        schedule();
-    }
+    thread_sleep_until(scheduler_ticks + timer_ms_to_ticks(milliseconds));
     return 0;
 }
 
@@ -841,28 +844,9 @@ int64_t sys_sbrk(int64_t increment)
     uint64_t old_brk = current_process->heap_end;
     uint64_t new_brk = old_brk + increment;
 
-    // Align to page size for mapping
-    uint64_t old_page_end = (old_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    uint64_t new_page_end = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-
-    if (increment > 0)
-    {
-        for (uint64_t addr = old_page_end; addr < new_page_end; addr += PAGE_SIZE)
-        {
-            void *phys = pmm_alloc_page();
-            if (!phys)
-            {
-                return -1; // OOM
-            }
-            vmm_map_page(current_process->pml4, addr, (uint64_t)phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-            memset((void *)addr, 0, PAGE_SIZE);
-        }
-    }
-    else if (increment < 0)
-    {
-        // Shrinking heap
-        // We could unmap pages here if we wanted to be thorough
-    }
+    // Only the heap area is adjusted; pages show up zero-filled on first touch
+    if (increment != 0 && vm_area_brk(current_process, old_brk, new_brk) != 0)
+        return -1;
 
     current_process->heap_end = new_brk;
     return (int64_t)old_brk;
@@ -957,6 +941,12 @@ uint64_t syscall_handler(uint64_t syscall_number, uint64_t arg1, uint64_t arg2,
         return 0;
     case SYS_KILL:
         return sys_kill((int)arg1, (int)arg2);
+    case SYS_SYNC:
+        return sys_sync();
+    case SYS_FSYNC:
+        return sys_fsync((int)arg1);
+    case SYS_SPLICE:
+        return sys_splice((int)arg1, (int)arg2, (size_t)arg3);
     default:
         printk("Unknown syscall: %lu\n", syscall_number);
         return -1;
@@ -1014,6 +1004,7 @@ int sys_read(int fd, char *buf, size_t count)
     if (!fd_can_read(desc))
         return -1;
 
+    vfs_readahead(desc->inode, &desc->ra, desc->offset, count);
     uint64_t read = vfs_read(desc->inode, desc->offset, count, (uint8_t *)buf);
     desc->offset += read;
     return clamp_to_int(read);
@@ -1084,6 +1075,7 @@ int sys_open(const char *path, int flags)
         desc->offset = inode->size;
     desc->flags = flags;
     desc->ref = 1;
+    desc->ra = (vfs_readahead_t){.next = desc->offset};
     current_process->fd_table[fd] = desc;
 
     vfs_open(inode);
@@ -1093,6 +1085,7 @@ int sys_open(const char *path, int flags)
 int sys_ioctl(int fd, int request, void *arg)
 {
     size_t arg_size = 0;
+    bool arg_write = true;
     switch (request)
     {
     case TIOCGWINSZ:
@@ -1106,11 +1099,18 @@ int sys_ioctl(int fd, int request, void *arg)
     case FB_IOCTL_GET_FBADDR:
         arg_size = sizeof(uint64_t);
         break;
+    case PIPE_IOCTL_GET_SIZE:
+        arg_size = sizeof(uint32_t);
+        break;
+    case PIPE_IOCTL_SET_SIZE:
+        arg_size = sizeof(uint32_t);
+        arg_write = false;
+        break;
     default:
         break;
     }
 
-    if (arg_size > 0 && !prepare_user_buffer(arg, arg_size, true))
+    if (arg_size > 0 && !prepare_user_buffer(arg, arg_size, arg_write))
         return -1;
 
     if (fd < 0 || fd >= MAX_FDS)
@@ -1123,56 +1123,23 @@ int sys_ioctl(int fd, int request, void *arg)
     return vfs_ioctl(desc->inode, request, arg);
 }
 
-void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, size_t offset)
+// True if [base, base + len) is non-empty, lies in user space and does not wrap
+static bool mmap_range_valid(uint64_t base, uint64_t len)
 {
-    (void)prot;
-    if (length == 0)
-        return MAP_FAILED;
-
-    // Only support shared mappings of /dev/fb0 for now.
-    if (!(flags & MAP_SHARED))
-        return MAP_FAILED;
-
-    if (fd < 0 || fd >= MAX_FDS)
-        return MAP_FAILED;
-
-    file_descriptor_t *desc = current_process->fd_table[fd];
-    if (!desc || !desc->inode)
-        return MAP_FAILED;
-
-    // Require this to be the framebuffer device.
-    struct limine_framebuffer *fb = framebuffer_current();
-    if (!fb || desc->inode->device != fb)
-        return MAP_FAILED;
-
-    uint64_t fb_size = (uint64_t)fb->pitch * fb->height;
-    if (offset >= fb_size)
-        return MAP_FAILED;
-
-    uint64_t map_len = length;
-    if (offset + map_len > fb_size)
-        map_len = fb_size - offset;
-
-    uint64_t page_len = align_up(map_len, PAGE_SIZE);
-    uint64_t page_offset = offset & ~(PAGE_SIZE - 1);
-    uint64_t in_page_delta = offset - page_offset;
-    uint64_t total_len = page_len + in_page_delta;
-
-    // Choose a base address if none provided.
-    uint64_t base = (uint64_t)addr;
-    if (base == 0)
-        base = 0x4000000000; // simple search base for mmaps
-
-    base = align_up(base, PAGE_SIZE);
+    return len != 0 && len <= USER_SPACE_END && base <= USER_SPACE_END - len;
+}
 
-    // Ensure no overlap with existing VMAs.
+// Finds a free, page-aligned range of len bytes at or above hint.
+static uint64_t mmap_find_base(uint64_t hint, uint64_t len)
+{
+    uint64_t base = align_up(hint ? hint : 0x4000000000, PAGE_SIZE); // simple search base for mmaps
     while (true)
     {
         bool overlap = false;
         vm_area_t *area;
         list_for_each_entry(area, &current_process->vm_areas, list)
         {
-            if (!(base + total_len <= area->start || base >= area->end))
+            if (!(base + len <= area->start || base >= area->end))
             {
                 overlap = true;
                 base = align_up(area->end, PAGE_SIZE);
@@ -1180,27 +1147,105 @@ void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, size_t of
             }
         }
         if (!overlap)
-            break;
-        if (base >= 0x7FFFFFFFF000)
+            return base;
+        if (base >= USER_STACK_TOP - USER_STACK_MAX)
+            return 0;
+    }
+}
+
+void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, size_t offset)
+{
+    if (length == 0)
+        return MAP_FAILED;
+    if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+        return MAP_FAILED;
+
+    uint32_t vma_flags = VMA_USER | VMA_MMAP;
+    if (prot & PROT_READ)
+        vma_flags |= VMA_READ;
+    if (prot & PROT_WRITE)
+        vma_flags |= VMA_WRITE;
+    if (prot & PROT_EXEC)
+        vma_flags |= VMA_EXEC;
+    if (flags & MAP_SHARED)
+        vma_flags |= VMA_SHARED;
+
+    // Anonymous memory is zero-filled on fault and files are paged in from the file;
+    // devices (e.g. /dev/fb0) hand back the physical range to map directly.
+    vfs_inode_t *file = nullptr;
+    uint64_t file_size = 0;
+    uint64_t phys = 0;
+    uint64_t map_len = length;
+    if (!(flags & MAP_ANONYMOUS))
+    {
+        if (fd < 0 || fd >= MAX_FDS)
+            return MAP_FAILED;
+
+        file_descriptor_t *desc = current_process->fd_table[fd];
+        if (!desc || !desc->inode || !desc->inode->iops || !desc->inode->iops->mmap)
+            return MAP_FAILED;
+        if ((prot & PROT_READ) && !fd_can_read(desc))
             return MAP_FAILED;
+        if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !fd_can_write(desc))
+            return MAP_FAILED;
+        if (desc->inode->iops->mmap(desc->inode, offset, &map_len, &phys) != 0)
+            return MAP_FAILED;
+
+        if (!phys)
+        {
+            if (offset & (PAGE_SIZE - 1))
+                return MAP_FAILED;
+            file = vfs_clone(desc->inode);
+            if (!file)
+                return MAP_FAILED;
+            if (desc->inode->size > offset)
+                file_size = desc->inode->size - offset < map_len ? desc->inode->size - offset : map_len;
+        }
     }
 
-    uint64_t fb_addr = (uint64_t)fb->address;
-    uint64_t phys_base = (fb_addr >= g_hhdm_offset) ? (fb_addr - g_hhdm_offset) : fb_addr;
+    uint64_t in_page_delta = phys ? (offset & (PAGE_SIZE - 1)) : 0;
+    uint64_t total_len = align_up(map_len + in_page_delta, PAGE_SIZE);
 
-    uint64_t virt = base;
-    uint64_t phys = phys_base + page_offset;
-    uint64_t bytes_mapped = 0;
+    // A hint that would leave user space is ignored; a fixed address like that fails
+    uint64_t base = (uint64_t)addr;
+    if (!(flags & MAP_FIXED))
+        base = mmap_find_base(mmap_range_valid(base, total_len) ? base : 0, total_len);
+    vm_area_t *area = nullptr;
+    if (base && !(base & (PAGE_SIZE - 1)) && mmap_range_valid(base, total_len))
+        area = vm_area_add_file(current_process, base, base + total_len, vma_flags, file, offset, file_size);
+    if (!area)
+    {
+        if (file)
+        {
+            vfs_close(file);
+            kfree(file);
+        }
+        return MAP_FAILED;
+    }
 
-    while (bytes_mapped < total_len)
+    // Shared anonymous memory has no file to meet in, so its frames are allocated now and
+    // marked shared; fork then hands the same frames to the child
+    if ((flags & MAP_SHARED) && (flags & MAP_ANONYMOUS))
     {
-        vmm_map_page(current_process->pml4, virt, phys, PTE_PRESENT | PTE_USER | PTE_WRITABLE);
-        virt += PAGE_SIZE;
-        phys += PAGE_SIZE;
-        bytes_mapped += PAGE_SIZE;
+        for (uint64_t off = 0; off < total_len; off += PAGE_SIZE)
+        {
+            if (!vm_area_populate(area, current_process->pml4, base + off))
+            {
+                vm_area_unmap_area(current_process, base, base + total_len);
+                return MAP_FAILED;
+            }
+        }
     }
 
-    vm_area_add(current_process, base, base + total_len, VMA_READ | VMA_WRITE | VMA_USER | VMA_MMAP);
+    if (phys)
+    {
+        uint64_t pte_flags = PTE_PRESENT | PTE_USER | PTE_SHARED;
+        if (prot & PROT_WRITE)
+            pte_flags |= PTE_WRITABLE;
+        phys -= in_page_delta;
+        for (uint64_t off = 0; off < total_len; off += PAGE_SIZE)
+            vmm_map_page(current_process->pml4, base + off, phys + off, pte_flags);
+    }
 
     return (void *)(base + in_page_delta);
 }
@@ -1212,35 +1257,7 @@ int sys_munmap(void *addr, size_t length)
 
     uint64_t start = (uint64_t)addr & ~(PAGE_SIZE - 1);
     uint64_t end = start + align_up(length, PAGE_SIZE);
-
-    vm_area_t *area;
-    bool found = false;
-    list_for_each_entry(area, &current_process->vm_areas, list)
-    {
-        if (area->start == start && area->end == end && (area->flags & VMA_MMAP))
-        {
-            found = true;
-            break;
-        }
-    }
-    if (!found)
-        return -1;
-
-    for (uint64_t va = start; va < end; va += PAGE_SIZE)
-        vmm_unmap_page(current_process->pml4, va);
-
-    vm_area_t *tmp;
-    list_for_each_entry_safe(area, tmp, &current_process->vm_areas, list)
-    {
-        if (area->start == start && area->end == end && (area->flags & VMA_MMAP))
-        {
-            list_del(&area->list);
-            kfree(area);
-            current_process->vm_area_count--;
-            break;
-        }
-    }
-    return 0;
+    return vm_area_unmap_area(current_process, start, end);
 }
 
 int sys_pipe(int pipefd[2])
@@ -1412,6 +1429,41 @@ int sys_dup(int oldfd)
     return newfd;
 }
 
+int sys_sync(void)
+{
+    bio_sync();
+    return 0;
+}
+
+// File data is written through to the buffer cache, and the buffer cache does not
+// know which file a block belongs to, so this flushes everything like sync.
+int sys_fsync(int fd)
+{
+    if (fd < 0 || fd >= MAX_FDS || !current_process->fd_table[fd])
+        return -1;
+    bio_sync();
+    return 0;
+}
+
+// Copies up to count bytes from fd_in to fd_out without passing them through user memory,
+// starting at the offsets of both descriptors. Returns the number of bytes moved, 0 at the
+// end of the input, or -1 if none of the data read from a pipe could be written out.
+int sys_splice(int fd_in, int fd_out, size_t count)
+{
+    if (fd_in < 0 || fd_in >= MAX_FDS || fd_out < 0 || fd_out >= MAX_FDS)
+        return -1;
+    file_descriptor_t *in = current_process->fd_table[fd_in];
+    file_descriptor_t *out = current_process->fd_table[fd_out];
+    if (!in || !in->inode || !out || !out->inode || !fd_can_read(in) || !fd_can_write(out))
+        return -1;
+
+    if (out->flags & O_APPEND)
+        out->offset = out->inode->size;
+    count = min(count, (size_t)INT_MAX);
+    const int64_t moved = vfs_splice(in->inode, &in->offset, &in->ra, out->inode, &out->offset, count);
+    return moved < 0 ? -1 : clamp_to_int((uint64_t)moved);
+}
+
 int sys_readdir(int fd, vfs_dirent_t *dent)
 {
     if (fd < 3 || fd >= MAX_FDS)
@@ -1436,6 +1488,7 @@ int sys_readdir(int fd, vfs_dirent_t *dent)
 
 void sys_shutdown()
 {
+    bio_sync();
     outw(0x604, 0x2000);  // qemu
     outw(0x4004, 0x3400); // VirtualBox
     outw(0xB004, 0x2000); // Bochs
@@ -1446,6 +1499,7 @@ void sys_shutdown()
 
 void sys_reboot()
 {
+    bio_sync();
     uint8_t good = 0x02;
     while (good & 0x02)
         good = inb(0x64);
@@ -6,9 +6,17 @@
 #include "vmm.h"
 #include "pmm.h"
 #include "ide.h"
+#include "idt.h"
+#include "apic.h"
+#include "process.h"
 #include <stdint.h>
 
+#define IRQ0 0x20
+
 #define AHCI_GHC_ENABLE (1u << 31)
+#define AHCI_GHC_IE (1u << 1)
+
+#define AHCI_CAP_SNCQ (1u << 30)
 
 #define AHCI_DET_NO_DEVICE 0x0
 #define AHCI_DET_DEVICE_PRESENT 0x1
@@ -24,7 +32,19 @@
 #define AHCI_HBA_PxCMD_FR (1u << 14)
 #define AHCI_HBA_PxCMD_CR (1u << 15)
 
-#define AHCI_PORT_IS_TFES (1u << 30)
+#define AHCI_PORT_IS_DHRS (1u << 0)  // D2H register FIS, non-queued completion
+#define AHCI_PORT_IS_SDBS (1u << 3)  // Set device bits FIS, NCQ completion
+#define AHCI_PORT_IS_IFS (1u << 27)  // Interface fatal error
+#define AHCI_PORT_IS_HBDS (1u << 28) // Host bus data error
+#define AHCI_PORT_IS_HBFS (1u << 29) // Host bus fatal error
+#define AHCI_PORT_IS_TFES (1u << 30) // Task file error
+#define AHCI_PORT_IS_ERRORS (AHCI_PORT_IS_IFS | AHCI_PORT_IS_HBDS | AHCI_PORT_IS_HBFS | AHCI_PORT_IS_TFES)
+
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_IDENTIFY 0xEC
 
 #define AHCI_TFD_ERR 0x01
 #define AHCI_TFD_DRQ 0x08
@@ -34,7 +54,8 @@
 #define AHCI_RECEIVED_FIS_BYTES 256u
 #define AHCI_PRDT_MAX_BYTES (4u * 1024u * 1024u)
 #define AHCI_MAX_SECTORS_PER_CMD (AHCI_PRDT_MAX_BYTES / AHCI_SECTOR_SIZE)
-#define AHCI_CMD_SLOT 0u
+#define AHCI_MAX_PRDT 64u // PRDT entries in the command table, one per segment
+#define AHCI_MAX_SLOTS 32u
 #define AHCI_GENERIC_TIMEOUT 1000000u
 #define AHCI_MMIO_BYTES 0x1100u
 
@@ -61,21 +82,36 @@ struct ahci_command_table
     uint8_t cfis[64];
     uint8_t acmd[16];
     uint8_t reserved0[48];
-    struct ahci_prdt_entry prdt[1];
+    struct ahci_prdt_entry prdt[AHCI_MAX_PRDT];
 } __attribute__((packed));
 
+// A command in flight. Lives on the submitter's stack; the submitter sleeps on it
+// until the completion interrupt (or its own polling) marks it done.
+struct ahci_request
+{
+    volatile bool done;
+    int status;
+};
+
 struct ahci_port_state
 {
     bool configured;
+    bool ncq;               // READ/WRITE FPDMA QUEUED, several commands in flight
+    volatile bool irq_seen; // The completion interrupt is known to arrive
     uint8_t port_index;
+    uint32_t depth;      // Usable command slots
+    uint32_t free_slots; // Bitmap of idle slots
+    uint32_t issued;     // Bitmap of slots handed to the HBA
+    struct ahci_request *requests[AHCI_MAX_SLOTS];
     volatile struct ahci_port *port;
     struct ahci_command_header *command_list;
-    struct ahci_command_table *command_table;
+    struct ahci_command_table *command_tables; // One per slot
     uint8_t *fis;
-    uint8_t *bounce_buffer;
-    uintptr_t bounce_phys;
 };
 
+static int ahci_identify_queue_depth(uint32_t *depth);
+static void ahci_interrupt_handler(struct interrupt_frame *frame);
+
 static volatile struct ahci_memory *hba_memory;
 static struct ahci_port_state active_port;
 static spinlock_t ahci_lock;
@@ -136,49 +172,6 @@ static inline uint32_t ahci_upper32(uintptr_t value)
 }
 #endif
 
-static uint32_t ahci_calculate_chunk(const uint8_t *buffer, const uint32_t requested_sectors, uintptr_t *phys_out,
-                                bool *needs_bounce)
-{
-    const uintptr_t phys = ahci_virt_to_phys(buffer);
-    if (phys == 0) {
-        *phys_out     = active_port.bounce_phys;
-        *needs_bounce = true;
-        return 1;
-    }
-
-    const size_t offset     = phys & (PAGE_SIZE - 1u);
-    size_t contiguous_bytes = PAGE_SIZE - offset;
-    if (contiguous_bytes > AHCI_PRDT_MAX_BYTES) {
-        contiguous_bytes = AHCI_PRDT_MAX_BYTES;
-    }
-
-    const size_t requested_bytes = (size_t)requested_sectors * AHCI_SECTOR_SIZE;
-
-    if (contiguous_bytes >= AHCI_SECTOR_SIZE) {
-        if (contiguous_bytes > requested_bytes) {
-            contiguous_bytes = requested_bytes;
-        }
-
-        uint32_t sectors = (uint32_t)(contiguous_bytes / AHCI_SECTOR_SIZE);
-        if (sectors == 0) {
-            sectors = 1;
-        }
-
-        if (sectors > AHCI_MAX_SECTORS_PER_CMD) {
-            sectors = AHCI_MAX_SECTORS_PER_CMD;
-        }
-
-        *phys_out     = phys;
-        *needs_bounce = false;
-        return sectors;
-    }
-
-    // Crosses a page with less than a full sector remaining; fall back to the bounce buffer.
-    *phys_out     = active_port.bounce_phys;
-    *needs_bounce = true;
-    return 1;
-}
-
 static void ahci_init_lock()
 {
     if (!ahci_lock_initialized) {
@@ -267,11 +260,10 @@ static int ahci_configure_active_port(volatile struct ahci_memory *memory, const
     struct ahci_command_header *const command_list =
         (struct ahci_command_header *)ahci_alloc_aligned(AHCI_COMMAND_LIST_BYTES, 1024);
     uint8_t *const fis                                  = ahci_alloc_aligned(AHCI_RECEIVED_FIS_BYTES, 256);
-    struct ahci_command_table *const command_table =
-        (struct ahci_command_table *)ahci_alloc_aligned(sizeof(struct ahci_command_table), 128);
-    uint8_t *const bounce_buffer = ahci_alloc_aligned(AHCI_SECTOR_SIZE, AHCI_SECTOR_SIZE);
+    struct ahci_command_table *const command_tables = (struct ahci_command_table *)ahci_alloc_aligned(
+        AHCI_MAX_SLOTS * sizeof(struct ahci_command_table), 128);
 
-    if (!command_list || !fis || !command_table || !bounce_buffer) {
+    if (!command_list || !fis || !command_tables) {
         boot_message(ERROR,
                      "[AHCI] failed to allocate command structures for port %lu",
                      (unsigned long)port_index);
@@ -280,15 +272,13 @@ static int ahci_configure_active_port(volatile struct ahci_memory *memory, const
 
     memset(command_list, 0, AHCI_COMMAND_LIST_BYTES);
     memset(fis, 0, AHCI_RECEIVED_FIS_BYTES);
-    memset(command_table, 0, sizeof(struct ahci_command_table));
-    memset(bounce_buffer, 0, AHCI_SECTOR_SIZE);
+    memset(command_tables, 0, AHCI_MAX_SLOTS * sizeof(struct ahci_command_table));
 
     const uintptr_t clb_phys    = ahci_virt_to_phys(command_list);
     const uintptr_t fb_phys     = ahci_virt_to_phys(fis);
-    const uintptr_t ct_phys     = ahci_virt_to_phys(command_table);
-    const uintptr_t bounce_phys = ahci_virt_to_phys(bounce_buffer);
+    const uintptr_t ct_phys     = ahci_virt_to_phys(command_tables);
 
-    if (clb_phys == 0 || fb_phys == 0 || ct_phys == 0 || bounce_phys == 0) {
+    if (clb_phys == 0 || fb_phys == 0 || ct_phys == 0) {
         boot_message(ERROR, "[AHCI] failed to resolve physical addresses for command buffers");
         return -1;
     }
@@ -298,9 +288,11 @@ static int ahci_configure_active_port(volatile struct ahci_memory *memory, const
     port->fb   = (uint32_t)fb_phys;
     port->fbu  = ahci_upper32(fb_phys);
 
-    command_list[AHCI_CMD_SLOT].ctba  = (uint32_t)ct_phys;
-    command_list[AHCI_CMD_SLOT].ctbau = ahci_upper32(ct_phys);
-    command_list[AHCI_CMD_SLOT].prdtl = 1;
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        const uintptr_t table_phys = ct_phys + slot * sizeof(struct ahci_command_table);
+        command_list[slot].ctba    = (uint32_t)table_phys;
+        command_list[slot].ctbau   = ahci_upper32(table_phys);
+    }
 
     port->serr = 0xFFFFFFFF;
     port->is   = 0xFFFFFFFF;
@@ -313,18 +305,34 @@ static int ahci_configure_active_port(volatile struct ahci_memory *memory, const
         return status;
     }
 
-    active_port.configured    = true;
-    active_port.port_index    = (uint8_t)port_index;
-    active_port.port          = port;
-    active_port.command_list  = command_list;
-    active_port.command_table = command_table;
-    active_port.fis           = fis;
-    active_port.bounce_buffer = bounce_buffer;
-    active_port.bounce_phys   = bounce_phys;
-
     ahci_init_lock();
 
-    boot_message(INFO, "[AHCI] using port %lu for DMA transfers", (unsigned long)port_index);
+    // Polled and single-slot until the device has said whether it can queue
+    active_port.port_index     = (uint8_t)port_index;
+    active_port.port           = port;
+    active_port.command_list   = command_list;
+    active_port.command_tables = command_tables;
+    active_port.fis            = fis;
+    active_port.depth          = 1;
+    active_port.free_slots     = 1;
+    active_port.configured     = true;
+
+    uint32_t depth = ((memory->cap >> 8) & 0x1F) + 1;
+    uint32_t queue = 0;
+    if ((memory->cap & AHCI_CAP_SNCQ) && ahci_identify_queue_depth(&queue) == 0 && queue > 1) {
+        active_port.ncq = true;
+        depth           = depth < queue ? depth : queue;
+    } else {
+        depth = 1; // Without NCQ the device takes one command at a time
+    }
+    active_port.depth      = depth;
+    active_port.free_slots = depth == 32 ? 0xFFFFFFFFu : (1u << depth) - 1u;
+
+    boot_message(INFO,
+                 "[AHCI] using port %lu for DMA transfers, %s, %lu slots",
+                 (unsigned long)port_index,
+                 active_port.ncq ? "NCQ" : "no NCQ",
+                 (unsigned long)depth);
     return 0;
 }
 
@@ -444,6 +452,19 @@ void ahci_init(struct pci_device device)
         }
     }
 
+    // Completions arrive through the port interrupt; until the first one is seen,
+    // submitters keep polling so a misrouted IRQ only costs speed.
+    const uint8_t irq = device.header.irq;
+    if (active_port.configured && irq != 0 && irq != 0xFF) {
+        const uint8_t vector = IRQ0 + irq;
+        apic_enable_irq(irq, vector);
+        register_interrupt_handler(vector, ahci_interrupt_handler);
+        active_port.port->is = 0xFFFFFFFF;
+        active_port.port->ie = AHCI_PORT_IS_DHRS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_ERRORS;
+        hba_memory->is       = 0xFFFFFFFF;
+        hba_memory->ghc |= AHCI_GHC_IE;
+    }
+
     if (!device_present_found) {
         boot_message(WARNING, "[AHCI] no SATA devices detected on implemented ports");
     } else if (!link_active_found) {
@@ -457,157 +478,367 @@ bool ahci_port_ready(void)
     return active_port.configured;
 }
 
-static int ahci_issue_dma(uint64_t lba, const uintptr_t buffer_phys, const uint32_t sector_count, const bool write)
+uint32_t ahci_queue_depth(void)
 {
-    if (!active_port.configured) {
-        return -1;
-    }
+    return active_port.configured ? active_port.depth : 0;
+}
 
+// Fails every command in flight and restarts the command engine, which clears
+// PxCI and PxSACT. Called with ahci_lock held.
+static void ahci_recover(const uint32_t is)
+{
     volatile struct ahci_port *const port = active_port.port;
-
-    int status = ahci_port_wait(port, AHCI_TFD_BUSY | AHCI_TFD_DRQ);
-    if (status != 0) {
-        return status;
-    }
-
+    boot_message(ERROR,
+                 "[AHCI] port error, failing %lu commands: IS=0x%x SERR=0x%x TFD=0x%x",
+                 (unsigned long)__builtin_popcount(active_port.issued),
+                 is,
+                 port->serr,
+                 port->tfd);
+
+    ahci_port_stop(port);
     port->serr = 0xFFFFFFFF;
     port->is   = 0xFFFFFFFF;
+    ahci_port_start(port);
 
-    struct ahci_command_header *const header = &active_port.command_list[AHCI_CMD_SLOT];
-    struct ahci_command_table *const table   = active_port.command_table;
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        struct ahci_request *const req = active_port.requests[slot];
+        if (!req) {
+            continue;
+        }
+        active_port.requests[slot] = nullptr;
+        req->status                = -1;
+        req->done                  = true;
+        thread_wakeup(req);
+    }
+    active_port.free_slots |= active_port.issued;
+    active_port.issued = 0;
+    thread_wakeup(&active_port.free_slots);
+}
 
-    memset(table, 0, sizeof(*table));
+// Retires every issued command the HBA no longer reports as active. Runs from the
+// interrupt handler and from submitters that poll. Called with ahci_lock held.
+static void ahci_complete(void)
+{
+    volatile struct ahci_port *const port = active_port.port;
 
-    header->flags = 5; // CFL = 5 (20 bytes)
-    if (write) {
-        header->flags |= 1u << 6; // write
-    } else {
-        header->flags &= ~(1u << 6);
+    const uint32_t is = port->is;
+    port->is          = is;
+    hba_memory->is    = 1u << active_port.port_index;
+
+    if (is & AHCI_PORT_IS_ERRORS) {
+        ahci_recover(is);
+        return;
     }
-    header->prdtl = 1;
-    header->prdbc = 0;
 
-    struct ahci_prdt_entry *const prdt = &table->prdt[0];
-    const uint32_t bytes                    = sector_count * AHCI_SECTOR_SIZE;
+    const uint32_t done = active_port.issued & ~(port->ci | port->sact);
+    if (done == 0) {
+        return;
+    }
+    const int status = (!active_port.ncq && (port->tfd & AHCI_TFD_ERR)) ? -1 : 0;
+
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if ((done & (1u << slot)) == 0) {
+            continue;
+        }
+        struct ahci_request *const req = active_port.requests[slot];
+        active_port.requests[slot]     = nullptr;
+        if (req) {
+            req->status = status;
+            req->done   = true;
+            thread_wakeup(req);
+        }
+    }
+    active_port.issued &= ~done;
+    active_port.free_slots |= done;
+    thread_wakeup(&active_port.free_slots);
+}
 
-    prdt->dba  = (uint32_t)buffer_phys;
-    prdt->dbau = ahci_upper32(buffer_phys);
-    prdt->dbc  = (bytes - 1) | (1u << 31); // Interrupt on completion
+static void ahci_interrupt_handler([[maybe_unused]] struct interrupt_frame *frame)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(ahci_lock, flags);
+    if (active_port.configured) {
+        active_port.irq_seen = true;
+        // The IOAPIC entry is edge-triggered, so leave no port status behind
+        do {
+            ahci_complete();
+        } while (hba_memory->is & (1u << active_port.port_index));
+    }
+    SPIN_UNLOCK_IRQRESTORE(ahci_lock, flags);
+    apic_send_eoi();
+}
 
-    uint8_t *const cfis = table->cfis;
-    memset(cfis, 0, sizeof(table->cfis));
+// Builds the command FIS for slot. NCQ commands carry the sector count in the
+// feature field and the tag in the count field.
+static void ahci_build_fis(uint8_t *const cfis, const uint8_t command, const uint64_t lba, const uint32_t sector_count,
+                           const uint32_t slot)
+{
+    memset(cfis, 0, 64);
+    cfis[0] = 0x27;    // FIS type: Register Host to Device
+    cfis[1] = 1u << 7; // Command, not control
+    cfis[2] = command;
+    if (command == ATA_CMD_IDENTIFY) {
+        return;
+    }
 
-    cfis[0]  = 0x27; // FIS type: Register Host to Device
-    cfis[1]  = 1u << 7;
-    cfis[2]  = write ? 0x35 : 0x25; // WRITE/READ DMA EXT
-    cfis[3]  = 0;
     cfis[4]  = (uint8_t)(lba & 0xFF);
     cfis[5]  = (uint8_t)((lba >> 8) & 0xFF);
     cfis[6]  = (uint8_t)((lba >> 16) & 0xFF);
-    cfis[7]  = (uint8_t)(0x40 | ((lba >> 24) & 0x0F));
+    cfis[7]  = 0x40; // LBA mode
     cfis[8]  = (uint8_t)((lba >> 24) & 0xFF);
     cfis[9]  = (uint8_t)((lba >> 32) & 0xFF);
     cfis[10] = (uint8_t)((lba >> 40) & 0xFF);
-    cfis[12] = (uint8_t)(sector_count & 0xFF);
-    cfis[13] = (uint8_t)((sector_count >> 8) & 0xFF);
 
-    port->ci = 1u << AHCI_CMD_SLOT;
+    if (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        cfis[3]  = (uint8_t)(sector_count & 0xFF);
+        cfis[11] = (uint8_t)((sector_count >> 8) & 0xFF);
+        cfis[12] = (uint8_t)(slot << 3);
+    } else {
+        cfis[12] = (uint8_t)(sector_count & 0xFF);
+        cfis[13] = (uint8_t)((sector_count >> 8) & 0xFF);
+    }
+}
+
+// Issues one command moving sector_count sectors between the disk and up to AHCI_MAX_PRDT
+// segments, then waits for it. Takes a free slot (sleeping for one if all are busy),
+// and sleeps until the completion interrupt once interrupts are known to work and the
+// caller may block; otherwise it polls. Called without ahci_lock.
+static int ahci_issue_command(const uint8_t command, uint64_t lba, const storage_segment_t *segments,
+                              const uint32_t segment_count, const uint32_t sector_count, const bool write)
+{
+    if (!active_port.configured) {
+        return -1;
+    }
+
+    volatile struct ahci_port *const port = active_port.port;
+    struct ahci_request req               = {.done = false, .status = 0};
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(ahci_lock, flags);
+    const bool can_sleep = (flags & RFLAGS_IF) && get_current_thread() != nullptr;
 
     uint32_t timeout = AHCI_GENERIC_TIMEOUT;
-    while ((port->ci & (1u << AHCI_CMD_SLOT)) != 0 && timeout-- > 0) {
-        if (port->is & AHCI_PORT_IS_TFES) {
-            const uint32_t is   = port->is;
-            const uint32_t serr = port->serr;
-            const uint32_t tfd  = port->tfd;
+    while (active_port.free_slots == 0) {
+        if (can_sleep && active_port.irq_seen) {
+            thread_sleep(&active_port.free_slots, &ahci_lock);
+        } else {
+            SPIN_UNLOCK_IRQRESTORE(ahci_lock, flags);
+            SPIN_LOCK_IRQSAVE(ahci_lock, flags);
+            ahci_complete();
+        }
+    }
+
+    const uint32_t slot = (uint32_t)__builtin_ctz(active_port.free_slots);
+    active_port.free_slots &= ~(1u << slot);
+
+    const bool queued = command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED;
+    if (!queued && ahci_port_wait(port, AHCI_TFD_BUSY | AHCI_TFD_DRQ) != 0) {
+        active_port.free_slots |= 1u << slot;
+        SPIN_UNLOCK_IRQRESTORE(ahci_lock, flags);
+        return -1;
+    }
+
+    struct ahci_command_header *const header = &active_port.command_list[slot];
+    struct ahci_command_table *const table   = &active_port.command_tables[slot];
+
+    header->flags = 5; // CFL = 5 (20 bytes)
+    if (write) {
+        header->flags |= 1u << 6; // write
+    }
+    header->prdtl = (uint16_t)segment_count;
+    header->prdbc = 0;
+
+    for (uint32_t i = 0; i < segment_count; i++) {
+        struct ahci_prdt_entry *const prdt = &table->prdt[i];
+        prdt->dba                          = (uint32_t)segments[i].phys;
+        prdt->dbau                         = ahci_upper32(segments[i].phys);
+        prdt->reserved                     = 0;
+        prdt->dbc                          = segments[i].length - 1;
+    }
+    ahci_build_fis(table->cfis, command, lba, sector_count, slot);
+
+    active_port.requests[slot] = &req;
+    active_port.issued |= 1u << slot;
+    if (queued) {
+        port->sact = 1u << slot;
+    }
+    port->ci = 1u << slot;
+
+    while (!req.done) {
+        if (can_sleep && active_port.irq_seen) {
+            thread_sleep(&req, &ahci_lock);
+            continue;
+        }
 
+        // Let the interrupt handler (or another CPU) in between polls
+        SPIN_UNLOCK_IRQRESTORE(ahci_lock, flags);
+        SPIN_LOCK_IRQSAVE(ahci_lock, flags);
+        ahci_complete();
+        if (!req.done && timeout-- == 0) {
             boot_message(ERROR,
-                         "[AHCI] DMA taskfile error during %s: LBA=%llu count=%u IS=0x%x SERR=0x%x TFD=0x%x",
+                         "[AHCI] DMA timeout during %s: LBA=%llu count=%u",
                          write ? "write" : "read",
                          (unsigned long long)lba,
-                         sector_count,
-                         is,
-                         serr,
-                         tfd);
-            port->is = AHCI_PORT_IS_TFES;
-            return -1;
+                         sector_count);
+            ahci_recover(port->is);
         }
     }
+    SPIN_UNLOCK_IRQRESTORE(ahci_lock, flags);
+    return req.status;
+}
 
-    if (timeout == 0) {
-        const uint32_t is   = port->is;
-        const uint32_t serr = port->serr;
-        const uint32_t tfd  = port->tfd;
-        boot_message(ERROR,
-                     "[AHCI] DMA timeout during %s: LBA=%llu count=%u IS=0x%x SERR=0x%x TFD=0x%x",
-                     write ? "write" : "read",
-                     (unsigned long long)lba,
-                     sector_count,
-                     is,
-                     serr,
-                     tfd);
-        port->is = 0xFFFFFFFF;
-        return -1;
+static int ahci_issue_dma(uint64_t lba, const storage_segment_t *segments, const uint32_t segment_count,
+                          const uint32_t sector_count, const bool write)
+{
+    uint8_t command;
+    if (active_port.ncq) {
+        command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    } else {
+        command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
     }
+    return ahci_issue_command(command, lba, segments, segment_count, sector_count, write);
+}
 
-    if (port->tfd & AHCI_TFD_ERR) {
-        const uint32_t serr = port->serr;
-        const uint32_t is   = port->is;
-        const uint32_t tfd  = port->tfd;
-        boot_message(ERROR,
-                     "[AHCI] DMA taskfile status error during %s: LBA=%llu count=%u IS=0x%x SERR=0x%x TFD=0x%x",
-                     write ? "write" : "read",
-                     (unsigned long long)lba,
-                     sector_count,
-                     is,
-                     serr,
-                     tfd);
-        port->is = 0xFFFFFFFF;
+// Reads IDENTIFY DEVICE and returns the NCQ queue depth, or 1 if the device cannot queue
+static int ahci_identify_queue_depth(uint32_t *depth)
+{
+    void *page = pmm_alloc_page();
+    if (!page) {
         return -1;
     }
 
-    return 0;
+    const storage_segment_t segment = {.phys = (uint64_t)page, .length = AHCI_SECTOR_SIZE};
+    const int result                = ahci_issue_command(ATA_CMD_IDENTIFY, 0, &segment, 1, 0, false);
+    if (result == 0) {
+        const uint16_t *const id = (const uint16_t *)((uint64_t)page + g_hhdm_offset);
+        *depth                   = (id[76] & (1u << 8)) ? (id[75] & 0x1F) + 1u : 1u;
+    }
+    pmm_free_page(page);
+    return result;
 }
 
-int ahci_read(uint64_t lba, uint32_t sector_count, void *buffer)
+// Moves a list of segments, packing them into as few commands as the PRDT and the
+// per-command sector limit allow.
+static int ahci_transfer(uint64_t lba, const storage_segment_t *segments, const size_t count, const bool write)
 {
-    if (!buffer || sector_count == 0) {
-        return -1;
+    storage_segment_t batch[AHCI_MAX_PRDT];
+    uint32_t entries = 0;
+    uint32_t sectors = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t phys = segments[i].phys;
+        uint32_t left = segments[i].length / AHCI_SECTOR_SIZE;
+        while (left > 0) {
+            uint32_t n = AHCI_MAX_SECTORS_PER_CMD - sectors;
+            if (n > left) {
+                n = left;
+            }
+            batch[entries].phys   = phys;
+            batch[entries].length = n * AHCI_SECTOR_SIZE;
+            entries++;
+            sectors += n;
+            phys += (uint64_t)n * AHCI_SECTOR_SIZE;
+            left -= n;
+
+            if (entries == AHCI_MAX_PRDT || sectors == AHCI_MAX_SECTORS_PER_CMD) {
+                const int result = ahci_issue_dma(lba, batch, entries, sectors, write);
+                if (result != 0) {
+                    return result;
+                }
+                lba += sectors;
+                entries = 0;
+                sectors = 0;
+            }
+        }
     }
 
-    if (!active_port.configured) {
-        return -1;
+    if (entries > 0) {
+        return ahci_issue_dma(lba, batch, entries, sectors, write);
     }
+    return 0;
+}
 
-    spinlock_acquire(&ahci_lock);
-
-    uint8_t *byte_buffer = (uint8_t *)buffer;
-    uint32_t remaining   = sector_count;
-    int result      = 0;
+// Splits a virtually contiguous buffer into physically contiguous segments. A sector
+// straddling a page boundary goes through a bounce page on its own.
+static int ahci_transfer_buffer(uint64_t lba, uint32_t sector_count, uint8_t *buffer, const bool write)
+{
+    storage_segment_t segments[AHCI_MAX_PRDT];
+    size_t count       = 0;
+    uint64_t first_lba = lba;
+    int result         = 0;
+
+    while (sector_count > 0) {
+        const uintptr_t phys  = ahci_virt_to_phys(buffer);
+        const size_t in_page  = PAGE_SIZE - (phys & (PAGE_SIZE - 1u));
+
+        if (phys == 0 || in_page < AHCI_SECTOR_SIZE) {
+            if (count > 0) {
+                result = ahci_transfer(first_lba, segments, count, write);
+                if (result != 0) {
+                    return result;
+                }
+                count = 0;
+            }
 
-    while (remaining > 0) {
-        uintptr_t buffer_phys  = 0;
-        bool needs_bounce = false;
-        uint32_t chunk         = ahci_calculate_chunk(byte_buffer, remaining, &buffer_phys, &needs_bounce);
+            void *const bounce_page = pmm_alloc_page();
+            if (!bounce_page) {
+                return -1;
+            }
+            uint8_t *const bounce          = (uint8_t *)((uint64_t)bounce_page + g_hhdm_offset);
+            const storage_segment_t segment = {.phys = (uint64_t)bounce_page, .length = AHCI_SECTOR_SIZE};
+            if (write) {
+                memcpy(bounce, buffer, AHCI_SECTOR_SIZE);
+            }
+            result = ahci_issue_dma(lba, &segment, 1, 1, write);
+            if (result == 0 && !write) {
+                memcpy(buffer, bounce, AHCI_SECTOR_SIZE);
+            }
+            pmm_free_page(bounce_page);
+            if (result != 0) {
+                return result;
+            }
 
-        result = ahci_issue_dma(lba, buffer_phys, chunk, false);
-        if (result != 0) {
-            break;
+            lba++;
+            buffer += AHCI_SECTOR_SIZE;
+            sector_count--;
+            first_lba = lba;
+            continue;
         }
 
-        if (needs_bounce) {
-            memcpy(byte_buffer, active_port.bounce_buffer, AHCI_SECTOR_SIZE);
+        uint32_t sectors = (uint32_t)(in_page / AHCI_SECTOR_SIZE);
+        if (sectors > sector_count) {
+            sectors = sector_count;
+        }
+        const uint32_t bytes = sectors * AHCI_SECTOR_SIZE;
+
+        if (count > 0 && segments[count - 1].phys + segments[count - 1].length == phys) {
+            segments[count - 1].length += bytes;
+        } else {
+            if (count == AHCI_MAX_PRDT) {
+                result = ahci_transfer(first_lba, segments, count, write);
+                if (result != 0) {
+                    return result;
+                }
+                count     = 0;
+                first_lba = lba;
+            }
+            segments[count].phys   = phys;
+            segments[count].length = bytes;
+            count++;
         }
 
-        lba += chunk;
-        byte_buffer += chunk * AHCI_SECTOR_SIZE;
-        remaining -= chunk;
+        lba += sectors;
+        buffer += bytes;
+        sector_count -= sectors;
     }
 
-    spinlock_release(&ahci_lock);
+    if (count > 0) {
+        result = ahci_transfer(first_lba, segments, count, write);
+    }
     return result;
 }
 
-int ahci_write(uint64_t lba, uint32_t sector_count, const void *buffer)
+int ahci_read(uint64_t lba, uint32_t sector_count, void *buffer)
 {
     if (!buffer || sector_count == 0) {
         return -1;
@@ -617,31 +848,36 @@ int ahci_write(uint64_t lba, uint32_t sector_count, const void *buffer)
         return -1;
     }
 
-    spinlock_acquire(&ahci_lock);
+    return ahci_transfer_buffer(lba, sector_count, (uint8_t *)buffer, false);
+}
+
+int ahci_write(uint64_t lba, uint32_t sector_count, const void *buffer)
+{
+    if (!buffer || sector_count == 0) {
+        return -1;
+    }
 
-    const uint8_t *byte_buffer_const = (const uint8_t *)buffer;
-    uint32_t remaining               = sector_count;
-    int result                  = 0;
+    if (!active_port.configured) {
+        return -1;
+    }
 
-    while (remaining > 0) {
-        uintptr_t buffer_phys  = 0;
-        bool needs_bounce = false;
-        uint32_t chunk         = ahci_calculate_chunk(byte_buffer_const, remaining, &buffer_phys, &needs_bounce);
+    return ahci_transfer_buffer(lba, sector_count, (uint8_t *)buffer, true);
+}
 
-        if (needs_bounce) {
-            memcpy(active_port.bounce_buffer, byte_buffer_const, AHCI_SECTOR_SIZE);
-        }
+int ahci_read_segments(uint64_t lba, const storage_segment_t *segments, size_t count)
+{
+    if (!segments || count == 0 || !active_port.configured) {
+        return -1;
+    }
 
-        result = ahci_issue_dma(lba, buffer_phys, chunk, true);
-        if (result != 0) {
-            break;
-        }
+    return ahci_transfer(lba, segments, count, false);
+}
 
-        lba += chunk;
-        byte_buffer_const += chunk * AHCI_SECTOR_SIZE;
-        remaining -= chunk;
+int ahci_write_segments(uint64_t lba, const storage_segment_t *segments, size_t count)
+{
+    if (!segments || count == 0 || !active_port.configured) {
+        return -1;
     }
 
-    spinlock_release(&ahci_lock);
-    return result;
+    return ahci_transfer(lba, segments, count, true);
 }
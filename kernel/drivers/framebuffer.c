@@ -8,6 +8,7 @@
 #include "devfs.h"
 #include "vfs.h"
 #include "ioctl.h"
+#include "vmm.h"
 
 static struct limine_framebuffer* active_fb = nullptr;
 
@@ -111,10 +112,28 @@ static int framebuffer_dev_ioctl(vfs_inode_t* node, int request, void* arg)
     }
 }
 
+static int framebuffer_dev_mmap(vfs_inode_t* node, uint64_t offset, uint64_t* length, uint64_t* phys)
+{
+    const struct limine_framebuffer* fb = node->device;
+    if (!fb)
+        return -1;
+
+    uint64_t fb_size = framebuffer_size_bytes(fb);
+    if (offset >= fb_size)
+        return -1;
+    if (*length > fb_size - offset)
+        *length = fb_size - offset;
+
+    uint64_t fb_addr = (uint64_t)fb->address;
+    *phys = ((fb_addr >= g_hhdm_offset) ? (fb_addr - g_hhdm_offset) : fb_addr) + offset;
+    return 0;
+}
+
 static struct inode_operations framebuffer_dev_ops = {
     .read = framebuffer_dev_read,
     .write = framebuffer_dev_write,
     .ioctl = framebuffer_dev_ioctl,
+    .mmap = framebuffer_dev_mmap,
 };
 
 static vfs_inode_t framebuffer_device_node;
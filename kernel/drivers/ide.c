@@ -4,6 +4,10 @@
 #include "string.h"
 #include "apic.h"
 #include "terminal.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "process.h"
+#include "sleeplock.h"
 
 #define IDE_BSY 0x80
 #define IDE_DRDY 0x40
@@ -14,6 +18,39 @@
 #define IDE_CMD_READ 0x20
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_IDENTIFY 0xEC
+#define IDE_CMD_READ_DMA 0xC8
+#define IDE_CMD_WRITE_DMA 0xCA
+
+// Bus-master IDE registers, per channel at BAR4 + 8 * channel
+#define BMIDE_COMMAND 0x00
+#define BMIDE_STATUS 0x02
+#define BMIDE_PRDT 0x04
+
+#define BMIDE_CMD_START 0x01
+#define BMIDE_CMD_READ 0x08 // Device to memory
+#define BMIDE_STATUS_ACTIVE 0x01
+#define BMIDE_STATUS_ERROR 0x02
+#define BMIDE_STATUS_IRQ 0x04
+#define BMIDE_STATUS_DRIVE0_DMA 0x20
+#define BMIDE_STATUS_DRIVE1_DMA 0x40
+
+#define PRD_END_OF_TABLE 0x80000000u
+#define PRD_MAX_ENTRIES (PAGE_SIZE / sizeof(ide_prd_t))
+
+// Physical region descriptor: a piece of the transfer that does not cross 64 KiB
+typedef struct
+{
+    uint32_t phys;
+    uint32_t count; // Bytes (0 means 64 KiB), PRD_END_OF_TABLE on the last entry
+} __attribute__((packed)) ide_prd_t;
+
+// Per-channel bus-master state, set up by ide_init_dma()
+typedef struct
+{
+    uint16_t bmide; // 0 if the channel has no bus master
+    ide_prd_t *prdt;
+    uint32_t prdt_phys;
+} ide_dma_channel_t;
 
 ide_device_t ide_devices[4];
 
@@ -21,12 +58,19 @@ static uint16_t ide_channels[2] = {0x1F0, 0x170};
 static uint16_t ide_control[2] = {0x3F6, 0x376};
 
 static volatile int ide_irq_invoked[2] = {0, 0};
+static spinlock_t ide_irq_lock[2];
+static sleeplock_t ide_channel_lock[2]; // One command per channel at a time
+static ide_dma_channel_t ide_dma[2];
 
 void ide_irq_handler(uint8_t channel)
 {
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(ide_irq_lock[channel], flags);
     ide_irq_invoked[channel] = 1;
     // Read status register to clear interrupt
     inb(ide_channels[channel] + 7);
+    thread_wakeup((void *)&ide_irq_invoked[channel]);
+    SPIN_UNLOCK_IRQRESTORE(ide_irq_lock[channel], flags);
 }
 
 static int ide_wait_irq(uint8_t channel)
@@ -107,6 +151,11 @@ static uint8_t ide_wait_flag(uint8_t channel, uint8_t flag)
 void ide_init(void)
 {
     memset(ide_devices, 0, sizeof(ide_devices));
+    for (int i = 0; i < 2; i++)
+    {
+        spinlock_init(&ide_irq_lock[i]);
+        sleeplock_init(&ide_channel_lock[i], "ide_channel");
+    }
 
     for (int i = 0; i < 2; i++)
     { // Channels
@@ -156,6 +205,7 @@ void ide_init(void)
             ide_devices[idx].capabilities = *((uint16_t *)(ide_buf + 49));
             ide_devices[idx].command_sets = *((uint32_t *)(ide_buf + 82));
             ide_devices[idx].size = *((uint32_t *)(ide_buf + 60)); // Total sectors (LBA28)
+            ide_devices[idx].dma = (((uint16_t *)ide_buf)[49] & (1u << 8)) != 0;
 
             // Model string needs byte swapping
             ide_swap_and_trim_model(ide_devices[idx].model, ide_buf + 27 * 2);
@@ -171,7 +221,7 @@ void ide_init(void)
     apic_enable_irq(15, 47);
 }
 
-int ide_read_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer)
+static int ide_pio_read(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer)
 {
     if (drive_index >= 4 || !ide_devices[drive_index].exists)
         return 1;
@@ -205,7 +255,7 @@ int ide_read_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *
     return 0;
 }
 
-int ide_write_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer)
+static int ide_pio_write(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer)
 {
     if (drive_index >= 4 || !ide_devices[drive_index].exists)
         return 1;
@@ -241,3 +291,189 @@ int ide_write_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t
 
     return 0;
 }
+
+void ide_init_dma(uint16_t bmide)
+{
+    if (bmide == 0)
+        return;
+
+    for (int channel = 0; channel < 2; channel++)
+    {
+        void *page = pmm_alloc_page();
+        // The PRD table and the buffers it points at must sit below 4 GiB
+        if (!page || (uint64_t)page + PAGE_SIZE > 0x100000000ull)
+        {
+            if (page)
+                pmm_free_page(page);
+            boot_message(WARNING, "IDE: no PRD table for channel %d, staying with PIO", channel);
+            continue;
+        }
+
+        ide_dma[channel].bmide = bmide + channel * 8;
+        ide_dma[channel].prdt = (ide_prd_t *)((uint64_t)page + g_hhdm_offset);
+        ide_dma[channel].prdt_phys = (uint32_t)(uint64_t)page;
+
+        uint8_t status = BMIDE_STATUS_ERROR | BMIDE_STATUS_IRQ;
+        for (int i = 0; i < 4; i++)
+        {
+            if (ide_devices[i].exists && ide_devices[i].channel == channel && ide_devices[i].dma)
+                status |= ide_devices[i].drive ? BMIDE_STATUS_DRIVE1_DMA : BMIDE_STATUS_DRIVE0_DMA;
+        }
+        outb(ide_dma[channel].bmide + BMIDE_COMMAND, 0);
+        outb(ide_dma[channel].bmide + BMIDE_STATUS, status);
+        outl(ide_dma[channel].bmide + BMIDE_PRDT, ide_dma[channel].prdt_phys);
+    }
+    boot_message(INFO, "IDE: bus-master DMA at I/O 0x%x", bmide);
+}
+
+// Waits for the end of a bus-master transfer by polling, for callers running with
+// interrupts off that would never see ide_irq_invoked change. The transfer is over once
+// the controller has latched the drive's interrupt, or the bus master has stopped and
+// the drive is no longer busy (a transfer cut short).
+static int ide_poll_dma(uint8_t channel)
+{
+    uint16_t bmide = ide_dma[channel].bmide;
+    for (uint64_t timeout = 10000000; timeout > 0; timeout--)
+    {
+        uint8_t bm_status = inb(bmide + BMIDE_STATUS);
+        if ((bm_status & BMIDE_STATUS_IRQ) ||
+            (!(bm_status & BMIDE_STATUS_ACTIVE) && !(inb(ide_control[channel]) & IDE_BSY)))
+        {
+            // Reading the status register acknowledges the drive's interrupt
+            inb(ide_channels[channel] + 7);
+            ide_irq_invoked[channel] = 0;
+            return 0;
+        }
+        __asm__ volatile("pause");
+    }
+    return 1;
+}
+
+// Waits for the channel interrupt, sleeping when the caller is allowed to block
+static int ide_wait_completion(uint8_t channel)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(ide_irq_lock[channel], flags);
+    bool can_sleep = (flags & RFLAGS_IF) && get_current_thread() != nullptr;
+    if (can_sleep)
+    {
+        while (!ide_irq_invoked[channel])
+            thread_sleep((void *)&ide_irq_invoked[channel], &ide_irq_lock[channel]);
+        ide_irq_invoked[channel] = 0;
+    }
+    SPIN_UNLOCK_IRQRESTORE(ide_irq_lock[channel], flags);
+    return can_sleep ? 0 : ide_poll_dma(channel);
+}
+
+// Fills the channel's PRD table for a buffer. Returns false if some part of it
+// cannot be reached by the bus master (outside the HHDM, above 4 GiB, odd address).
+static bool ide_build_prdt(uint8_t channel, const uint8_t *buffer, uint32_t bytes)
+{
+    ide_prd_t *prdt = ide_dma[channel].prdt;
+    size_t entries = 0;
+    while (bytes > 0)
+    {
+        if ((uint64_t)buffer < g_hhdm_offset || entries == PRD_MAX_ENTRIES)
+            return false;
+        uint64_t phys = (uint64_t)buffer - g_hhdm_offset;
+        uint32_t chunk = PAGE_SIZE - (phys & (PAGE_SIZE - 1));
+        if (chunk > bytes)
+            chunk = bytes;
+        if ((phys & 1) || phys + chunk > 0x100000000ull)
+            return false;
+
+        // Physically adjacent pages share an entry as long as it stays inside one 64 KiB region
+        ide_prd_t *last = entries > 0 ? &prdt[entries - 1] : nullptr;
+        if (last && last->phys + last->count == phys && (last->phys >> 16) == ((phys + chunk - 1) >> 16) &&
+            last->count + chunk < 0x10000)
+        {
+            last->count += chunk;
+        }
+        else
+        {
+            prdt[entries].phys = (uint32_t)phys;
+            prdt[entries].count = chunk;
+            entries++;
+        }
+        buffer += chunk;
+        bytes -= chunk;
+    }
+    prdt[entries - 1].count |= PRD_END_OF_TABLE;
+    return true;
+}
+
+// One bus-master transfer of up to 255 sectors. Returns 1 on failure, or -1 if the
+// buffer cannot be used for DMA so the caller should fall back to PIO.
+static int ide_dma_transfer(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer, bool write)
+{
+    uint8_t channel = ide_devices[drive_index].channel;
+    uint8_t slave = ide_devices[drive_index].drive;
+    uint16_t bmide = ide_dma[channel].bmide;
+
+    if (!ide_build_prdt(channel, buffer, count * 512u))
+        return -1;
+    if (ide_wait_ready(channel) != 0)
+        return 1;
+
+    outb(bmide + BMIDE_COMMAND, 0);
+    outl(bmide + BMIDE_PRDT, ide_dma[channel].prdt_phys);
+    outb(bmide + BMIDE_STATUS, inb(bmide + BMIDE_STATUS) | BMIDE_STATUS_ERROR | BMIDE_STATUS_IRQ);
+    outb(bmide + BMIDE_COMMAND, write ? 0 : BMIDE_CMD_READ);
+
+    ide_irq_invoked[channel] = 0;
+    outb(ide_channels[channel] + 6, 0xE0 | (slave << 4) | ((lba >> 24) & 0x0F));
+    outb(ide_channels[channel] + 1, 0x00);
+    outb(ide_channels[channel] + 2, count);
+    outb(ide_channels[channel] + 3, (uint8_t)lba);
+    outb(ide_channels[channel] + 4, (uint8_t)(lba >> 8));
+    outb(ide_channels[channel] + 5, (uint8_t)(lba >> 16));
+    outb(ide_channels[channel] + 7, write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+    outb(bmide + BMIDE_COMMAND, (write ? 0 : BMIDE_CMD_READ) | BMIDE_CMD_START);
+
+    int rc = ide_wait_completion(channel);
+
+    outb(bmide + BMIDE_COMMAND, 0);
+    uint8_t bm_status = inb(bmide + BMIDE_STATUS);
+    outb(bmide + BMIDE_STATUS, bm_status | BMIDE_STATUS_ERROR | BMIDE_STATUS_IRQ);
+    uint8_t status = inb(ide_channels[channel] + 7);
+
+    if (rc != 0 || (bm_status & BMIDE_STATUS_ERROR) || (status & (IDE_ERR | IDE_DF)))
+    {
+        printk("IDE: DMA %s failed: drive %d LBA %u BM=0x%x status=0x%x\n", write ? "write" : "read", drive_index, lba,
+               bm_status, status);
+        return 1;
+    }
+    return 0;
+}
+
+static bool ide_can_dma(uint8_t drive_index)
+{
+    return ide_devices[drive_index].dma && ide_dma[ide_devices[drive_index].channel].bmide != 0;
+}
+
+// Bus-master DMA when the controller and drive support it, PIO otherwise or when DMA fails
+static int ide_transfer_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer, bool write)
+{
+    if (drive_index >= 4 || !ide_devices[drive_index].exists)
+        return 1;
+
+    uint8_t channel = ide_devices[drive_index].channel;
+    sleeplock_acquire(&ide_channel_lock[channel]);
+    int rc = -1;
+    if (ide_can_dma(drive_index))
+        rc = ide_dma_transfer(drive_index, lba, count, buffer, write);
+    if (rc != 0)
+        rc = write ? ide_pio_write(drive_index, lba, count, buffer) : ide_pio_read(drive_index, lba, count, buffer);
+    sleeplock_release(&ide_channel_lock[channel]);
+    return rc;
+}
+
+int ide_read_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer)
+{
+    return ide_transfer_sectors(drive_index, lba, count, buffer, false);
+}
+
+int ide_write_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, uint8_t *buffer)
+{
+    return ide_transfer_sectors(drive_index, lba, count, buffer, true);
+}
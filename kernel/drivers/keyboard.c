@@ -104,7 +104,7 @@ static void keyboard_enqueue_char(char c)
 
     if (keyboard_waiter)
     {
-        keyboard_waiter->state = THREAD_READY;
+        thread_wake(keyboard_waiter);
         keyboard_waiter = nullptr;
     }
 }
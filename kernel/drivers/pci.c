@@ -143,8 +143,15 @@ struct pci_vendor vendors[] = {
 
 static void pci_ide_init(struct pci_device device)
 {
-    (void)device;
     ide_init();
+
+    // Bus mastering is advertised in bit 7 of the programming interface; BAR4 is an I/O BAR
+    const uint32_t bar4 = device.header.bars[4];
+    if ((device.header.prog_if & 0x80) && (bar4 & 0x1))
+    {
+        pci_enable_bus_mastering(device);
+        ide_init_dma((uint16_t)(bar4 & ~0x3u));
+    }
 }
 
 struct pci_driver pci_drivers[] = {
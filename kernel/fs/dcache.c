@@ -0,0 +1,195 @@
+#include "dcache.h"
+#include "heap.h"
+#include "list.h"
+#include "spinlock.h"
+#include "string.h"
+#include "terminal.h"
+
+typedef struct dcache_entry
+{
+    list_head_t hash; // Bucket chain, unlinked while the entry is free
+    list_head_t lru;  // Most recently used first, free entries at the tail
+    vfs_cache_key_t dir;
+    vfs_cache_key_t key;
+    bool used;
+    bool negative; // The name does not exist in dir
+    char name[DCACHE_NAME_LEN];
+} dcache_entry_t;
+
+#define DCACHE_BUCKETS 256
+
+static dcache_entry_t *entries;
+static list_head_t buckets[DCACHE_BUCKETS];
+static LIST_HEAD(lru_list);
+static spinlock_t dcache_lock;
+static bool dcache_ready = false;
+static uint64_t generation; // Bumped by every invalidation so racing lookups are not cached
+static dcache_stats_t stats;
+
+void dcache_init(void)
+{
+    spinlock_init(&dcache_lock);
+    entries = kzalloc(DCACHE_ENTRIES * sizeof(dcache_entry_t));
+    if (!entries)
+    {
+        boot_message(ERROR, "Dentry cache: failed to allocate %d entries", DCACHE_ENTRIES);
+        return;
+    }
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++)
+        INIT_LIST_HEAD(&buckets[i]);
+    for (size_t i = 0; i < DCACHE_ENTRIES; i++)
+        list_add_tail(&entries[i].lru, &lru_list);
+
+    dcache_ready = true;
+    boot_message(INFO, "Dentry cache initialized. Limit: %d entries", DCACHE_ENTRIES);
+}
+
+static size_t hash_name(const vfs_cache_key_t *dir, const char *name)
+{
+    uint64_t h = dir->volume ^ (dir->id * 0x9E3779B97F4A7C15ull);
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 0x100000001B3ull;
+    h ^= h >> 29;
+    return h & (DCACHE_BUCKETS - 1);
+}
+
+static inline bool key_equal(const vfs_cache_key_t *a, const vfs_cache_key_t *b)
+{
+    return a->id == b->id && a->volume == b->volume;
+}
+
+// Called with dcache_lock held
+static dcache_entry_t *lookup(const vfs_cache_key_t *dir, const char *name)
+{
+    dcache_entry_t *entry;
+    list_for_each_entry(entry, &buckets[hash_name(dir, name)], hash)
+    {
+        if (key_equal(&entry->dir, dir) && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return nullptr;
+}
+
+// Called with dcache_lock held
+static void remove_entry(dcache_entry_t *entry)
+{
+    list_del(&entry->hash);
+    list_del(&entry->lru);
+    list_add_tail(&entry->lru, &lru_list);
+    entry->used = false;
+    stats.entries--;
+}
+
+int dcache_lookup(const vfs_cache_key_t *dir, const char *name, vfs_cache_key_t *key, uint64_t *gen)
+{
+    if (!dcache_ready)
+        return -1;
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(dcache_lock, flags);
+    *gen = generation;
+    dcache_entry_t *entry = strlen(name) < DCACHE_NAME_LEN ? lookup(dir, name) : nullptr;
+    int result = -1;
+    if (!entry)
+        stats.misses++;
+    else
+    {
+        list_del(&entry->lru);
+        list_add(&entry->lru, &lru_list);
+        if (entry->negative)
+        {
+            stats.negative_hits++;
+            result = 0;
+        }
+        else
+        {
+            stats.hits++;
+            *key = entry->key;
+            result = 1;
+        }
+    }
+    SPIN_UNLOCK_IRQRESTORE(dcache_lock, flags);
+    return result;
+}
+
+void dcache_insert(const vfs_cache_key_t *dir, const char *name, const vfs_cache_key_t *key, uint64_t gen)
+{
+    if (!dcache_ready || strlen(name) >= DCACHE_NAME_LEN)
+        return;
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(dcache_lock, flags);
+    if (gen != generation)
+    {
+        SPIN_UNLOCK_IRQRESTORE(dcache_lock, flags);
+        return;
+    }
+
+    dcache_entry_t *entry = lookup(dir, name);
+    if (entry)
+        remove_entry(entry);
+
+    // The tail holds a free entry if there is one, the least recently used otherwise
+    entry = list_entry(lru_list.prev, dcache_entry_t, lru);
+    if (entry->used)
+    {
+        remove_entry(entry);
+        stats.evictions++;
+    }
+
+    entry->dir = *dir;
+    entry->negative = key == nullptr;
+    if (key)
+        entry->key = *key;
+    strcpy(entry->name, name);
+    entry->used = true;
+    list_add(&entry->hash, &buckets[hash_name(dir, name)]);
+    list_del(&entry->lru);
+    list_add(&entry->lru, &lru_list);
+    stats.entries++;
+    SPIN_UNLOCK_IRQRESTORE(dcache_lock, flags);
+}
+
+// Drops the entries under dir, and if key is given the ones leading to it
+static void invalidate(const vfs_cache_key_t *dir, const vfs_cache_key_t *key)
+{
+    if (!dcache_ready)
+        return;
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(dcache_lock, flags);
+    generation++;
+    dcache_entry_t *entry;
+    dcache_entry_t *tmp;
+    list_for_each_entry_safe(entry, tmp, &lru_list, lru)
+    {
+        if (!entry->used)
+            break;
+        if ((!dir || key_equal(&entry->dir, dir)) || (key && !entry->negative && key_equal(&entry->key, key)))
+            remove_entry(entry);
+    }
+    SPIN_UNLOCK_IRQRESTORE(dcache_lock, flags);
+}
+
+void dcache_invalidate_dir(const vfs_cache_key_t *dir)
+{
+    invalidate(dir, nullptr);
+}
+
+void dcache_invalidate(const vfs_cache_key_t *key)
+{
+    invalidate(key, key);
+}
+
+void dcache_flush(void)
+{
+    invalidate(nullptr, nullptr);
+}
+
+void dcache_get_stats(dcache_stats_t *out)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(dcache_lock, flags);
+    *out = stats;
+    SPIN_UNLOCK_IRQRESTORE(dcache_lock, flags);
+}
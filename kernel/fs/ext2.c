@@ -11,6 +11,7 @@
 #include <limits.h>
 #include "util.h"
 #include "assert.h"
+#include "page_cache.h"
 #ifdef KASAN
 #include "kasan.h"
 #endif
@@ -28,8 +29,8 @@ typedef uint64_t u64;
 #define BLOCK_TO_SECTOR(b) ((b) * (EXT2_BSIZE / 512))
 #define PTRS_PER_SECTOR (512 / sizeof(uint32_t))
 
-static void ext2fs_bzero(uint32_t dev, uint32_t bno);
-static uint32_t ext2fs_balloc(uint32_t dev, uint32_t inum);
+static void ext2fs_bzero(uint32_t dev, uint32_t block);
+static uint32_t ext2fs_balloc(const struct ext2_inode *ip);
 static void ext2fs_bfree(uint32_t dev, uint32_t b);
 static uint32_t ext2fs_bmap(const struct ext2_inode *ip, uint32_t bn);
 static void ext2fs_itrunc(struct ext2_inode *ip);
@@ -89,6 +90,8 @@ void ext2fs_readsb(int dev, struct ext2_super_block *sb)
 
 struct icache icache;
 
+static void ext2_dir_index_drop(const struct ext2_inode *dp);
+
 static struct ext2_inode *iget(uint32_t dev, uint32_t inum)
 {
     struct ext2_inode *ip;
@@ -123,6 +126,8 @@ static struct ext2_inode *iget(uint32_t dev, uint32_t inum)
     ip->type = 0;
     ip->size = 0;
     ip->nlink = 0;
+    ip->readdir_index = 0;
+    ip->readdir_off = 0;
     ip->addrs = &ext2fs_addrs[ip - icache.inode];
     memset(ip->addrs, 0, sizeof(struct ext2fs_addrs));
     spinlock_release(&icache.lock);
@@ -130,20 +135,25 @@ static struct ext2_inode *iget(uint32_t dev, uint32_t inum)
     return ip;
 }
 
-// Zero a block.
-static void ext2fs_bzero(uint32_t dev, uint32_t bno)
+// Zero a newly allocated block in the cache. Its old contents are never read, and the
+// zeroes go out with the flusher's next pass.
+static void ext2fs_bzero(uint32_t dev, uint32_t block)
 {
-    buffer_head_t *bp = bread(dev, bno);
-    if (!bp)
+    const uint32_t first = BLOCK_TO_SECTOR(block) + ext2_part_offset(dev);
+    for (uint32_t i = 0; i < EXT2_BSIZE / 512; i++)
     {
-        printk("ext2fs_bzero: bread failed\n");
-        return;
+        buffer_head_t *bp = bzeroed(dev, first + i);
+        if (!bp)
+        {
+            printk("ext2fs_bzero: no buffer\n");
+            return;
+        }
+        bdirty(bp);
+        brelse(bp);
     }
-    memset(bp->data, 0, 512);
-    bwrite(bp);
-    brelse(bp);
 }
 
+
 // Recursively free an indirect block tree.
 // depth=1: single-indirect, depth=2: double-indirect, depth=3: triple-indirect
 static void ext2_free_indirect(uint32_t dev, uint32_t block, int depth)
@@ -174,47 +184,280 @@ static void ext2_free_indirect(uint32_t dev, uint32_t block, int depth)
     ext2fs_bfree(dev, block);
 }
 
-// check if a block is free and return its bit number
-// Helper: find and set a free bit in bitmap sector
-// Returns bit index (absolute) or -1 if none found
-static int find_and_set_free_bit(uint8_t *sector_data, uint32_t start_bit, uint32_t max_bits)
+// In-memory allocation state of a mounted filesystem. The group descriptors are read at
+// mount and a group's bitmaps the first time it is searched. Allocating and freeing only
+// touch memory and mark what changed; ext2_alloc_sync() writes it back in one batch.
+#define EXT2_GROUP_BLOCK_BITMAP 0x1
+#define EXT2_GROUP_INODE_BITMAP 0x2
+#define EXT2_GROUP_DESC 0x4
+#define EXT2_ALLOC_RUN 64 // Free blocks a new file's first block should lead, if there is room
+
+struct ext2_group
+{
+    struct ext2_group_desc desc;
+    u8 *block_bitmap; // EXT2_BSIZE bytes each, nullptr until loaded
+    u8 *inode_bitmap;
+    u8 dirty; // EXT2_GROUP_* parts that differ from the disk
+};
+
+struct ext2_alloc_state
+{
+    sleeplock_t lock;
+    struct ext2_group *groups;
+    uint32_t group_count;
+    bool dirty; // Some group or the superblock's free counts need writing back
+};
+
+static struct ext2_alloc_state ext2_alloc[4];
+
+static inline struct ext2_alloc_state *ext2_get_alloc(uint32_t dev)
+{
+    return (dev < 4) ? &ext2_alloc[dev] : &ext2_alloc[0];
+}
+
+// The descriptor table fills the block after the superblock
+static inline uint32_t ext2_gdt_sector(uint32_t dev)
+{
+    return BLOCK_TO_SECTOR(ext2_get_sb(dev)->s_first_data_block + 1) + ext2_part_offset(dev);
+}
+
+// Number of blocks in group gno; the last group may be short
+static inline uint32_t ext2_group_blocks(const struct ext2_super_block *sb, uint32_t gno)
 {
-    for (uint32_t i = 0; i < 512; i++)
+    return min(sb->s_blocks_per_group, sb->s_blocks_count - sb->s_first_data_block - gno * sb->s_blocks_per_group);
+}
+
+static void ext2_alloc_release(struct ext2_alloc_state *st)
+{
+    for (uint32_t i = 0; st->groups && i < st->group_count; i++)
     {
-        for (uint32_t j = 0; j < 8; j++)
+        kfree(st->groups[i].block_bitmap);
+        kfree(st->groups[i].inode_bitmap);
+    }
+    kfree(st->groups);
+    st->groups = nullptr;
+    st->group_count = 0;
+    st->dirty = false;
+}
+
+// Reads the group descriptors of a freshly mounted filesystem
+static int ext2_alloc_load(uint32_t dev)
+{
+    struct ext2_super_block *sb = ext2_get_sb(dev);
+    struct ext2_alloc_state *st = ext2_get_alloc(dev);
+    if (sb->s_blocks_per_group == 0 || sb->s_blocks_per_group > EXT2_BSIZE * 8 ||
+        sb->s_inodes_per_group > EXT2_BSIZE * 8 || sb->s_blocks_count <= sb->s_first_data_block)
+    {
+        printk("ext2: unsupported group layout\n");
+        return -1;
+    }
+
+    sleeplock_acquire(&st->lock);
+    ext2_alloc_release(st);
+    const uint32_t count = (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) /
+                           sb->s_blocks_per_group;
+    st->groups = kzalloc(count * sizeof(struct ext2_group));
+    if (!st->groups)
+    {
+        sleeplock_release(&st->lock);
+        printk("ext2: failed to allocate %d group descriptors\n", count);
+        return -1;
+    }
+    st->group_count = count;
+
+    const uint32_t first = ext2_gdt_sector(dev);
+    for (uint32_t gno = 0; gno < count; gno++)
+    {
+        const uint32_t byte = gno * sizeof(struct ext2_group_desc);
+        buffer_head_t *bp = bread(dev, first + byte / 512);
+        if (!bp)
         {
-            const uint32_t bit = start_bit + i * 8 + j;
-            if (bit >= max_bits)
-                return -1;
-            const uint8_t mask = (uint8_t)(1U << j);
-            if ((sector_data[i] & mask) != 0)
-                continue;
-            sector_data[i] |= mask;
-            return (int)bit;
+            printk("ext2: failed to read group descriptor %d\n", gno);
+            ext2_alloc_release(st);
+            sleeplock_release(&st->lock);
+            return -1;
         }
+        memcpy(&st->groups[gno].desc, bp->data + byte % 512, sizeof(struct ext2_group_desc));
+        brelse(bp);
     }
-    return -1;
+    sleeplock_release(&st->lock);
+    return 0;
 }
 
-static inline void ext2_read_group_desc(uint32_t dev, uint32_t gno, struct ext2_group_desc *out)
+// Returns a group's block or inode bitmap, reading it in on first use.
+// Called with the allocation lock held.
+static u8 *ext2_group_bitmap(uint32_t dev, uint32_t gno, bool inodes)
 {
-    const uint32_t desc_blockno = ext2_part_offset(dev) + BLOCK_TO_SECTOR(2);
-    buffer_head_t *bp = bread(dev, desc_blockno);
-    if (!bp)
+    struct ext2_group *g = &ext2_get_alloc(dev)->groups[gno];
+    u8 **slot = inodes ? &g->inode_bitmap : &g->block_bitmap;
+    if (*slot)
+        return *slot;
+
+    u8 *bitmap = kmalloc(EXT2_BSIZE);
+    if (!bitmap)
+        return nullptr;
+    const uint32_t first = BLOCK_TO_SECTOR(inodes ? g->desc.bg_inode_bitmap : g->desc.bg_block_bitmap) +
+                           ext2_part_offset(dev);
+    for (uint32_t i = 0; i < EXT2_BSIZE / 512; i++)
+    {
+        buffer_head_t *bp = bread(dev, first + i);
+        if (!bp)
+        {
+            printk("ext2: failed to read a bitmap of group %d\n", gno);
+            kfree(bitmap);
+            return nullptr;
+        }
+        memcpy(bitmap + i * 512, bp->data, 512);
+        brelse(bp);
+    }
+    *slot = bitmap;
+    return bitmap;
+}
+
+static inline bool ext2_bit_test(const u8 *bitmap, uint32_t bit)
+{
+    return (bitmap[bit / 8] & (1U << (bit % 8))) != 0;
+}
+
+// First clear bit in [from, nbits), or UINT32_MAX
+static uint32_t ext2_first_free_bit(const u8 *bitmap, uint32_t from, uint32_t nbits)
+{
+    for (uint32_t bit = from; bit < nbits; bit++)
+    {
+        if (bit % 8 == 0 && bitmap[bit / 8] == 0xFF)
+        {
+            bit += 7;
+            continue;
+        }
+        if (!ext2_bit_test(bitmap, bit))
+            return bit;
+    }
+    return UINT32_MAX;
+}
+
+// First clear bit in [from, nbits) that starts bytes wholly free bytes in a row, so that
+// the run it begins has room to grow, or UINT32_MAX
+static uint32_t ext2_first_free_bytes(const u8 *bitmap, uint32_t from, uint32_t nbits, uint32_t bytes)
+{
+    uint32_t found = 0;
+    for (uint32_t byte = (from + 7) / 8; byte < nbits / 8; byte++)
+    {
+        found = (bitmap[byte] == 0) ? found + 1 : 0;
+        if (found == bytes)
+            return (byte + 1 - bytes) * 8;
+    }
+    return UINT32_MAX;
+}
+
+// Picks a clear bit for an allocation aimed at goal: goal itself, else one close after
+// it, else the start of a free run after it, else anything after it, then the same
+// before it. A file's first block skips the first two so that the file starts a long
+// run. Returns UINT32_MAX if every bit is set.
+static uint32_t ext2_pick_bit(const u8 *bitmap, uint32_t goal, uint32_t nbits, bool first)
+{
+    if (goal >= nbits)
+        goal = 0;
+    uint32_t bit = UINT32_MAX;
+    if (first)
+        bit = ext2_first_free_bytes(bitmap, goal, nbits, EXT2_ALLOC_RUN / 8);
+    else if (!ext2_bit_test(bitmap, goal))
+        return goal;
+    else
+        bit = ext2_first_free_bit(bitmap, goal, min(nbits, (goal | 63) + 1));
+
+    if (bit == UINT32_MAX)
+        bit = ext2_first_free_bytes(bitmap, goal, nbits, 1);
+    if (bit == UINT32_MAX)
+        bit = ext2_first_free_bit(bitmap, goal, nbits);
+    if (bit == UINT32_MAX && first)
+        bit = ext2_first_free_bytes(bitmap, 0, goal, EXT2_ALLOC_RUN / 8);
+    if (bit == UINT32_MAX)
+        bit = ext2_first_free_bytes(bitmap, 0, goal, 1);
+    if (bit == UINT32_MAX)
+        bit = ext2_first_free_bit(bitmap, 0, goal);
+    return bit;
+}
+
+// Copies len bytes to byte off of sector onward, as delayed writes
+static void ext2_write_delayed(uint32_t dev, uint32_t sector, uint32_t off, const void *src, uint32_t len)
+{
+    const u8 *p = src;
+    sector += off / 512;
+    off %= 512;
+    while (len > 0)
     {
-        printk("ext2_read_group_desc: bread failed\n");
-        memset(out, 0, sizeof(*out));
+        const uint32_t chunk = min(len, 512 - off);
+        buffer_head_t *bp = bread(dev, sector);
+        if (!bp)
+        {
+            printk("ext2: write-back of sector %d failed\n", sector);
+            return;
+        }
+        memcpy(bp->data + off, p, chunk);
+        bdirty(bp);
+        brelse(bp);
+        p += chunk;
+        len -= chunk;
+        sector++;
+        off = 0;
+    }
+}
+
+// Writes the bitmaps and group descriptors changed since the last call, and the
+// superblock's free counts, through the buffer cache.
+static void ext2_alloc_sync(uint32_t dev)
+{
+    struct ext2_super_block *sb = ext2_get_sb(dev);
+    struct ext2_alloc_state *st = ext2_get_alloc(dev);
+    sleeplock_acquire(&st->lock);
+    if (!st->dirty)
+    {
+        sleeplock_release(&st->lock);
         return;
     }
-    memcpy(out, bp->data + gno * sizeof(*out), sizeof(*out));
-    brelse(bp);
+
+    for (uint32_t gno = 0; gno < st->group_count; gno++)
+    {
+        struct ext2_group *g = &st->groups[gno];
+        if (g->dirty & EXT2_GROUP_BLOCK_BITMAP)
+            ext2_write_delayed(dev, BLOCK_TO_SECTOR(g->desc.bg_block_bitmap) + ext2_part_offset(dev), 0,
+                               g->block_bitmap, EXT2_BSIZE);
+        if (g->dirty & EXT2_GROUP_INODE_BITMAP)
+            ext2_write_delayed(dev, BLOCK_TO_SECTOR(g->desc.bg_inode_bitmap) + ext2_part_offset(dev), 0,
+                               g->inode_bitmap, EXT2_BSIZE);
+        if (g->dirty & EXT2_GROUP_DESC)
+            ext2_write_delayed(dev, ext2_gdt_sector(dev), gno * sizeof(struct ext2_group_desc), &g->desc,
+                               sizeof(struct ext2_group_desc));
+        g->dirty = 0;
+    }
+
+    // The superblock starts at byte 1024, both counts are in its first sector
+    const uint32_t sb_sector = ext2_part_offset(dev) + 2;
+    ext2_write_delayed(dev, sb_sector, offsetof(struct ext2_super_block, s_free_blocks_count),
+                       &sb->s_free_blocks_count, sizeof(sb->s_free_blocks_count));
+    ext2_write_delayed(dev, sb_sector, offsetof(struct ext2_super_block, s_free_inodes_count),
+                       &sb->s_free_inodes_count, sizeof(sb->s_free_inodes_count));
+    st->dirty = false;
+    sleeplock_release(&st->lock);
+}
+
+int ext2_free_counts(uint32_t dev, uint32_t *blocks, uint32_t *inodes)
+{
+    struct ext2_alloc_state *st = ext2_get_alloc(dev);
+    if (!st->groups)
+        return -1;
+    sleeplock_acquire(&st->lock);
+    *blocks = ext2_get_sb(dev)->s_free_blocks_count;
+    *inodes = ext2_get_sb(dev)->s_free_inodes_count;
+    sleeplock_release(&st->lock);
+    return 0;
 }
 
 // Read a pointer entry from a block and allocate it if empty.
-static uint32_t ext2_ensure_ptr(uint32_t dev, uint32_t block, uint32_t slot, uint32_t inum)
+static uint32_t ext2_ensure_ptr(const struct ext2_inode *ip, uint32_t block, uint32_t slot)
 {
-    const uint32_t sector = BLOCK_TO_SECTOR(block) + ext2_part_offset(dev) + (slot / PTRS_PER_SECTOR);
-    buffer_head_t *bp = bread(dev, sector);
+    const uint32_t sector = BLOCK_TO_SECTOR(block) + ext2_part_offset(ip->dev) + (slot / PTRS_PER_SECTOR);
+    buffer_head_t *bp = bread(ip->dev, sector);
     if (!bp)
     {
         printk("ext2_ensure_ptr: bread failed\n");
@@ -225,76 +468,78 @@ static uint32_t ext2_ensure_ptr(uint32_t dev, uint32_t block, uint32_t slot, uin
     uint32_t val = *entry;
     if (val == 0)
     {
-        val = ext2fs_balloc(dev, inum);
+        // Continue after the previous block of the file if nothing was allocated since
+        // the inode was read in
+        if (ip->addrs->goal == 0 && slot % PTRS_PER_SECTOR > 0 && entry[-1] != 0)
+            ip->addrs->goal = entry[-1] + 1;
+        val = ext2fs_balloc(ip);
         if (val == 0)
         {
             brelse(bp);
             return 0;
         }
         *entry = val;
-        bwrite(bp);
+        bdirty(bp);
     }
     brelse(bp);
     return val;
 }
 
-// Allocate a zeroed disk block.
-static uint32_t ext2fs_balloc(uint32_t dev, uint32_t inum)
+// Allocate a zeroed disk block for ip, right after the last one allocated to it when
+// possible so that the file stays contiguous. Without such a goal the search starts
+// at the inode's group.
+static uint32_t ext2fs_balloc(const struct ext2_inode *ip)
 {
-    struct ext2_super_block *sb = ext2_get_sb(dev);
-    const uint32_t bgcount = (sb->s_blocks_count + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
-    const int preferred_gno = GET_GROUP_NO(inum, *sb);
-    const uint32_t sectors_per_block = EXT2_BSIZE / 512;
-
-    // Search all block groups, starting with the inode's group
-    for (uint32_t gi = 0; gi < bgcount; gi++)
-    {
-        const uint32_t gno = (preferred_gno + gi) % bgcount;
-        struct ext2_group_desc bgdesc;
-        ext2_read_group_desc(dev, gno, &bgdesc);
-
-        const uint32_t bitmap_first_sector = BLOCK_TO_SECTOR(bgdesc.bg_block_bitmap) + ext2_part_offset(dev);
-
-        // Search through all sectors of the bitmap block
-        for (uint32_t sec = 0; sec < sectors_per_block; sec++)
-        {
-            buffer_head_t *bp = bread(dev, bitmap_first_sector + sec);
-            if (!bp)
-            {
-                continue;
-            }
-
-            const uint32_t start_bit = sec * 512 * 8; // First bit in this sector
-            int fbit = find_and_set_free_bit(bp->data, start_bit, sb->s_blocks_per_group);
-            if (fbit >= 0)
-            {
-                bwrite(bp);
-                brelse(bp);
-
-                const uint32_t group_first_block = sb->s_first_data_block + gno * sb->s_blocks_per_group;
-                const uint32_t rel_block = group_first_block + (uint32_t)fbit;
+    struct ext2_super_block *sb = ext2_get_sb(ip->dev);
+    struct ext2_alloc_state *st = ext2_get_alloc(ip->dev);
+    uint32_t goal = ip->addrs->goal;
+    const bool first = goal < sb->s_first_data_block || goal >= sb->s_blocks_count;
+    if (first)
+        goal = sb->s_first_data_block + (uint32_t)GET_GROUP_NO(ip->inum, *sb) * sb->s_blocks_per_group;
+    const uint32_t goal_group = (goal - sb->s_first_data_block) / sb->s_blocks_per_group;
+
+    uint32_t block = 0;
+    sleeplock_acquire(&st->lock);
+    for (uint32_t i = 0; i < st->group_count && block == 0; i++)
+    {
+        const uint32_t gno = (goal_group + i) % st->group_count;
+        struct ext2_group *g = &st->groups[gno];
+        if (g->desc.bg_free_blocks_count == 0)
+            continue;
+        u8 *bitmap = ext2_group_bitmap(ip->dev, gno, false);
+        if (!bitmap)
+            continue;
+        const uint32_t start = (i == 0) ? (goal - sb->s_first_data_block) % sb->s_blocks_per_group : 0;
+        const uint32_t bit = ext2_pick_bit(bitmap, start, ext2_group_blocks(sb, gno), first);
+        if (bit == UINT32_MAX)
+            continue;
 
-                const uint32_t start_sector = BLOCK_TO_SECTOR(rel_block) + ext2_part_offset(dev);
-                for (uint32_t i = 0; i < sectors_per_block; i++)
-                {
-                    ext2fs_bzero(dev, start_sector + i);
-                }
-                return rel_block;
-            }
-            brelse(bp);
-        }
+        bitmap[bit / 8] |= (u8)(1U << (bit % 8));
+        g->desc.bg_free_blocks_count--;
+        g->dirty |= EXT2_GROUP_BLOCK_BITMAP | EXT2_GROUP_DESC;
+        if (sb->s_free_blocks_count > 0)
+            sb->s_free_blocks_count--;
+        st->dirty = true;
+        block = sb->s_first_data_block + gno * sb->s_blocks_per_group + bit;
     }
+    sleeplock_release(&st->lock);
 
-    printk("PANIC: ");
-    printk("ext2_balloc: out of blocks\n");
-    return 0;
+    if (block == 0)
+    {
+        printk("PANIC: ");
+        printk("ext2_balloc: out of blocks\n");
+        return 0;
+    }
+    ip->addrs->goal = block + 1;
+    ext2fs_bzero(ip->dev, block);
+    return block;
 }
 
 // Free a disk block.
 static void ext2fs_bfree(uint32_t dev, uint32_t b)
 {
     struct ext2_super_block *sb = ext2_get_sb(dev);
-    if (b < sb->s_first_data_block)
+    if (b < sb->s_first_data_block || b >= sb->s_blocks_count)
     {
         printk("PANIC: ");
         printk("ext2fs_bfree: invalid block\n");
@@ -305,34 +550,28 @@ static void ext2fs_bfree(uint32_t dev, uint32_t b)
     const uint32_t gno = block_index / sb->s_blocks_per_group;
     const uint32_t offset = block_index % sb->s_blocks_per_group;
 
-    struct ext2_group_desc bgdesc;
-    ext2_read_group_desc(dev, gno, &bgdesc);
-
-    // Calculate which sector of the bitmap contains this bit
-    const uint32_t bits_per_sector = 512 * 8;
-    const uint32_t sector_in_block = offset / bits_per_sector;
-    const uint32_t bit_in_sector = offset % bits_per_sector;
-    const uint32_t byte_index = bit_in_sector / 8;
-
-    buffer_head_t *bp = bread(dev, BLOCK_TO_SECTOR(bgdesc.bg_block_bitmap) + ext2_part_offset(dev) + sector_in_block);
-    if (!bp)
+    struct ext2_alloc_state *st = ext2_get_alloc(dev);
+    sleeplock_acquire(&st->lock);
+    u8 *bitmap = ext2_group_bitmap(dev, gno, false);
+    if (!bitmap)
     {
-        printk("ext2fs_bfree: bread failed\n");
+        sleeplock_release(&st->lock);
+        printk("ext2fs_bfree: bitmap unavailable\n");
         return;
     }
-
-    const u8 mask = (u8)(1U << (bit_in_sector % 8));
-
-    if ((bp->data[byte_index] & mask) == 0)
+    if (!ext2_bit_test(bitmap, offset))
     {
+        sleeplock_release(&st->lock);
         printk("PANIC: ");
         printk("ext2fs_bfree: block already free\n");
-        brelse(bp);
         return;
     }
-    bp->data[byte_index] &= ~mask;
-    bwrite(bp);
-    brelse(bp);
+    bitmap[offset / 8] &= (u8)~(1U << (offset % 8));
+    st->groups[gno].desc.bg_free_blocks_count++;
+    st->groups[gno].dirty |= EXT2_GROUP_BLOCK_BITMAP | EXT2_GROUP_DESC;
+    sb->s_free_blocks_count++;
+    st->dirty = true;
+    sleeplock_release(&st->lock);
 }
 
 void ext2_init_inode(int dev)
@@ -360,11 +599,11 @@ static void ext2_inode_loc(uint32_t dev, uint32_t inum, uint32_t *sector, uint32
     struct ext2_super_block *sb = ext2_get_sb(dev);
     const int gno = GET_GROUP_NO(inum, *sb);
     const int ioff = GET_INODE_INDEX(inum, *sb);
-    struct ext2_group_desc bgdesc;
-    ext2_read_group_desc(dev, gno, &bgdesc);
+    // The table's location never changes, so the cached descriptor is read without the lock
+    const uint32_t inode_table = ext2_get_alloc(dev)->groups[gno].desc.bg_inode_table;
 
     const uint32_t inodes_per_block = EXT2_BSIZE / sb->s_inode_size;
-    const uint32_t bno = BLOCK_TO_SECTOR(bgdesc.bg_inode_table + ioff / inodes_per_block) + ext2_part_offset(dev);
+    const uint32_t bno = BLOCK_TO_SECTOR(inode_table + ioff / inodes_per_block) + ext2_part_offset(dev);
     const uint32_t iindex = ioff % inodes_per_block;
 
     const uint32_t block_off = iindex * sb->s_inode_size;
@@ -372,106 +611,146 @@ static void ext2_inode_loc(uint32_t dev, uint32_t inum, uint32_t *sector, uint32
     *byte_offset = block_off % 512;
 }
 
-struct ext2_inode *ext2fs_ialloc(uint32_t dev, short type)
+// Group to search first for a new inode. A directory goes to the group with the most
+// free blocks among those with at least the average number of free inodes, so that
+// trees spread over the disk; anything else goes next to its parent directory.
+static uint32_t ext2_ialloc_group(uint32_t dev, short type, uint32_t parent)
 {
-    struct ext2_super_block *sb = ext2_get_sb(dev);
-    struct ext2_group_desc bgdesc;
-    const uint32_t desc_blockno = part_offset(dev) + BLOCK_TO_SECTOR(2);
-    // block group descriptor table starts at block 2
-
-    const uint32_t bgcount = sb->s_blocks_count / sb->s_blocks_per_group;
-    for (uint32_t i = 0; i <= bgcount; i++)
+    const struct ext2_super_block *sb = ext2_get_sb(dev);
+    const struct ext2_alloc_state *st = ext2_get_alloc(dev);
+    if (type == T_DIR)
     {
-        buffer_head_t *group_desc_buf = bread(dev, desc_blockno);
-        if (!group_desc_buf)
-        {
-            printk("ext2fs_ialloc: bread failed for group desc\n");
-            return nullptr;
-        }
-        memcpy(&bgdesc, group_desc_buf->data + i * sizeof(bgdesc), sizeof(bgdesc));
-        brelse(group_desc_buf);
-
-        // Search inode bitmap (may span multiple sectors)
-        const uint32_t ibitmap_first_sector = BLOCK_TO_SECTOR(bgdesc.bg_inode_bitmap) + part_offset(dev);
-        const uint32_t sectors_per_block = EXT2_BSIZE / 512;
-        int fbit = -1;
-        buffer_head_t *ibitmap_buff = nullptr;
-
-        for (uint32_t sec = 0; sec < sectors_per_block && fbit < 0; sec++)
+        const uint32_t average = sb->s_free_inodes_count / st->group_count;
+        uint32_t best = UINT32_MAX;
+        for (uint32_t gno = 0; gno < st->group_count; gno++)
         {
-            ibitmap_buff = bread(dev, ibitmap_first_sector + sec);
-            if (!ibitmap_buff)
-            {
-                printk("ext2fs_ialloc: bread failed for inode bitmap\n");
-                return nullptr;
-            }
-            const uint32_t start_bit = sec * 512 * 8;
-            fbit = find_and_set_free_bit(ibitmap_buff->data, start_bit, sb->s_inodes_per_group);
-            if (fbit < 0)
-            {
-                brelse(ibitmap_buff);
-                ibitmap_buff = nullptr;
-            }
+            const struct ext2_group_desc *desc = &st->groups[gno].desc;
+            if (desc->bg_free_inodes_count == 0 || desc->bg_free_inodes_count < average)
+                continue;
+            if (best == UINT32_MAX || desc->bg_free_blocks_count > st->groups[best].desc.bg_free_blocks_count)
+                best = gno;
         }
+        if (best != UINT32_MAX)
+            return best;
+    }
+    return parent > 0 ? (uint32_t)GET_GROUP_NO(parent, *sb) % st->group_count : 0;
+}
 
-        if (fbit < 0)
-        {
-            continue;
-        }
+// Clears an inode's bit in its group's bitmap
+static void ext2_ifree(uint32_t dev, uint32_t inum, bool dir)
+{
+    struct ext2_super_block *sb = ext2_get_sb(dev);
+    struct ext2_alloc_state *st = ext2_get_alloc(dev);
+    const uint32_t gno = GET_GROUP_NO(inum, *sb);
+    const uint32_t index = GET_INODE_INDEX(inum, *sb);
 
-        if (sb->s_inode_size == 0)
-        {
-            printk("PANIC: ");
-            printk("ext2fs_ialloc: invalid inode size");
-            brelse(ibitmap_buff);
-            return nullptr;
-        }
+    sleeplock_acquire(&st->lock);
+    u8 *bitmap = ext2_group_bitmap(dev, gno, true);
+    if (!bitmap)
+    {
+        sleeplock_release(&st->lock);
+        printk("ext2_ifree: bitmap unavailable\n");
+        return;
+    }
+    if (!ext2_bit_test(bitmap, index))
+    {
+        sleeplock_release(&st->lock);
+        printk("PANIC: ");
+        printk("ext2fs_ifree: inode %d already free\n", inum);
+        return;
+    }
+    bitmap[index / 8] &= (u8)~(1U << (index % 8));
+    struct ext2_group *g = &st->groups[gno];
+    g->desc.bg_free_inodes_count++;
+    if (dir && g->desc.bg_used_dirs_count > 0)
+        g->desc.bg_used_dirs_count--;
+    g->dirty |= EXT2_GROUP_INODE_BITMAP | EXT2_GROUP_DESC;
+    sb->s_free_inodes_count++;
+    st->dirty = true;
+    sleeplock_release(&st->lock);
+}
 
-        const uint32_t inodes_per_block = EXT2_BSIZE / sb->s_inode_size;
+// Allocate an inode of the given type, placed by ext2_ialloc_group() relative to the
+// directory parent that will link it.
+struct ext2_inode *ext2fs_ialloc(uint32_t dev, short type, uint32_t parent)
+{
+    struct ext2_super_block *sb = ext2_get_sb(dev);
+    struct ext2_alloc_state *st = ext2_get_alloc(dev);
+    if (sb->s_inode_size == 0)
+    {
+        printk("PANIC: ");
+        printk("ext2fs_ialloc: invalid inode size");
+        return nullptr;
+    }
 
-        const uint32_t bno = BLOCK_TO_SECTOR(bgdesc.bg_inode_table + (uint32_t)fbit / inodes_per_block) + part_offset(dev);
-        const uint32_t iindex = (uint32_t)fbit % inodes_per_block;
+    uint32_t inum = 0;
+    sleeplock_acquire(&st->lock);
+    const uint32_t start = ext2_ialloc_group(dev, type, parent);
+    for (uint32_t i = 0; i < st->group_count && inum == 0; i++)
+    {
+        const uint32_t gno = (start + i) % st->group_count;
+        struct ext2_group *g = &st->groups[gno];
+        if (g->desc.bg_free_inodes_count == 0)
+            continue;
+        u8 *bitmap = ext2_group_bitmap(dev, gno, true);
+        if (!bitmap)
+            continue;
+        const uint32_t bit = ext2_first_free_bit(bitmap, 0, sb->s_inodes_per_group);
+        if (bit == UINT32_MAX)
+            continue;
 
-        const uint32_t block_offset = iindex * sb->s_inode_size;
-        const uint32_t sector_offset = block_offset / 512;
-        const uint32_t sector_byte_offset = block_offset % 512;
+        bitmap[bit / 8] |= (u8)(1U << (bit % 8));
+        g->desc.bg_free_inodes_count--;
+        if (type == T_DIR)
+            g->desc.bg_used_dirs_count++;
+        g->dirty |= EXT2_GROUP_INODE_BITMAP | EXT2_GROUP_DESC;
+        if (sb->s_free_inodes_count > 0)
+            sb->s_free_inodes_count--;
+        st->dirty = true;
+        inum = gno * sb->s_inodes_per_group + bit + 1;
+    }
+    sleeplock_release(&st->lock);
 
-        buffer_head_t *dinode_buff = bread(dev, bno + sector_offset);
-        if (!dinode_buff)
-        {
-            printk("ext2fs_ialloc: bread failed for inode block\n");
-            brelse(ibitmap_buff);
-            return nullptr;
-        }
-        u8 *slot = dinode_buff->data + sector_byte_offset;
+    if (inum == 0)
+    {
+        printk("PANIC: ");
+        printk("ext2_ialloc: no inodes");
+        return nullptr;
+    }
 
-        memset(slot, 0, sb->s_inode_size);
-        struct ext2_disk_inode *din = (struct ext2_disk_inode *)slot;
-        if (type == T_DIR)
-        {
-            din->i_mode = S_IFDIR;
-        }
-        else if (type == T_FILE)
-        {
-            din->i_mode = S_IFREG;
-        }
-        else if (type == T_DEV)
-        {
-            din->i_mode = S_IFCHR;
-        }
-        bwrite(dinode_buff);
-        bwrite(ibitmap_buff);
-        brelse(dinode_buff);
-        brelse(ibitmap_buff);
+    uint32_t sector, sector_byte_offset;
+    ext2_inode_loc(dev, inum, &sector, &sector_byte_offset);
+    buffer_head_t *dinode_buff = bread(dev, sector);
+    if (!dinode_buff)
+    {
+        printk("ext2fs_ialloc: bread failed for inode block\n");
+        ext2_ifree(dev, inum, type == T_DIR);
+        ext2_alloc_sync(dev);
+        return nullptr;
+    }
+    u8 *slot = dinode_buff->data + sector_byte_offset;
 
-        const uint32_t inum = i * sb->s_inodes_per_group + (uint32_t)fbit + 1;
-        struct ext2_inode *ip = iget(dev, inum);
-        ip->type = type;
-        return ip;
+    memset(slot, 0, sb->s_inode_size);
+    struct ext2_disk_inode *din = (struct ext2_disk_inode *)slot;
+    if (type == T_DIR)
+    {
+        din->i_mode = S_IFDIR;
     }
-    printk("PANIC: ");
-    printk("ext2_ialloc: no inodes");
-    return nullptr;
+    else if (type == T_FILE)
+    {
+        din->i_mode = S_IFREG;
+    }
+    else if (type == T_DEV)
+    {
+        din->i_mode = S_IFCHR;
+    }
+    bwrite(dinode_buff);
+    brelse(dinode_buff);
+    ext2_alloc_sync(dev);
+
+    struct ext2_inode *ip = iget(dev, inum);
+    ip->type = type;
+    return ip;
 }
 
 void ext2fs_iupdate(const struct ext2_inode *ip)
@@ -616,45 +895,14 @@ void ext2fs_iunlock(struct ext2_inode *ip)
 // Free an inode
 static void ext2_free_inode(const struct ext2_inode *ip)
 {
-    struct ext2_super_block *sb = ext2_get_sb(ip->dev);
-    struct ext2_group_desc bgdesc;
-    const uint32_t desc_blockno = part_offset(ip->dev) + BLOCK_TO_SECTOR(2);
-    // block group descriptor table starts at block 2
-
-    const int gno = GET_GROUP_NO(ip->inum, *sb);
-    buffer_head_t *bp1 = bread(ip->dev, desc_blockno);
-    memcpy(&bgdesc, bp1->data + gno * sizeof(bgdesc), sizeof(bgdesc));
-    brelse(bp1);
-
-    const uint32_t index = (ip->inum - 1) % sb->s_inodes_per_group;
-
-    // Calculate which sector of the bitmap contains this bit
-    const uint32_t bits_per_sector = 512 * 8;
-    const uint32_t sector_in_block = index / bits_per_sector;
-    const uint32_t bit_in_sector = index % bits_per_sector;
-    const uint32_t byte_index = bit_in_sector / 8;
-
-    buffer_head_t *bp2 = bread(ip->dev, BLOCK_TO_SECTOR(bgdesc.bg_inode_bitmap) + part_offset(ip->dev) + sector_in_block);
-    if (!bp2)
-    {
-        printk("ext2_free_inode: bread failed\n");
-        return;
-    }
-
-    const u8 mask = (u8)(1U << (bit_in_sector % 8));
+    ext2_ifree(ip->dev, ip->inum, ip->type == T_DIR);
+}
 
-    if ((bp2->data[byte_index] & mask) == 0)
-    {
-        printk("PANIC: ");
-        printk("ext2fs_ifree: inode already free (inum=%u type=%d nlink=%d ref=%d)\n",
-               ip->inum,
-               ip->type,
-               ip->nlink,
-               ip->ref);
-    }
-    bp2->data[byte_index] &= ~mask;
-    bwrite(bp2);
-    brelse(bp2);
+// Names an inode's contents in the page cache
+static void ext2_cache_key(const struct ext2_inode *ip, vfs_cache_key_t *key)
+{
+    key->volume = ((uint64_t)ip->dev << 32) | ext2_part_offset(ip->dev);
+    key->id = ip->inum;
 }
 
 void ext2fs_iput(struct ext2_inode *ip)
@@ -672,6 +920,12 @@ void ext2fs_iput(struct ext2_inode *ip)
             // inode has no links and no other references: truncate and free.
             ext2_free_inode(ip);
             ext2fs_itrunc(ip);
+            if (ip->type == T_DIR)
+                ext2_dir_index_drop(ip);
+            // The inode number is up for reuse
+            vfs_cache_key_t key;
+            ext2_cache_key(ip, &key);
+            page_cache_invalidate(&key);
             ip->type = 0;
             ext2fs_iupdate(ip);
             ip->valid = 0;
@@ -737,7 +991,9 @@ static uint32_t ext2fs_bmap(const struct ext2_inode *ip, uint32_t bn)
     {
         if (ad->addrs[bn] == 0)
         {
-            ad->addrs[bn] = ext2fs_balloc(ip->dev, ip->inum);
+            if (ad->goal == 0 && bn > 0 && ad->addrs[bn - 1] != 0)
+                ad->goal = ad->addrs[bn - 1] + 1;
+            ad->addrs[bn] = ext2fs_balloc(ip);
             if (ad->addrs[bn] == 0)
                 return 0;
         }
@@ -748,11 +1004,11 @@ static uint32_t ext2fs_bmap(const struct ext2_inode *ip, uint32_t bn)
     {
         if (ad->addrs[EXT2_IND_BLOCK] == 0)
         {
-            ad->addrs[EXT2_IND_BLOCK] = ext2fs_balloc(ip->dev, ip->inum);
+            ad->addrs[EXT2_IND_BLOCK] = ext2fs_balloc(ip);
             if (ad->addrs[EXT2_IND_BLOCK] == 0)
                 return 0;
         }
-        const uint32_t entry = ext2_ensure_ptr(ip->dev, ad->addrs[EXT2_IND_BLOCK], bn, ip->inum);
+        const uint32_t entry = ext2_ensure_ptr(ip, ad->addrs[EXT2_IND_BLOCK], bn);
         if (entry == 0)
             return 0;
         return BLOCK_TO_SECTOR(entry) + ext2_part_offset(ip->dev);
@@ -763,7 +1019,7 @@ static uint32_t ext2fs_bmap(const struct ext2_inode *ip, uint32_t bn)
     {
         if (ad->addrs[EXT2_DIND_BLOCK] == 0)
         {
-            ad->addrs[EXT2_DIND_BLOCK] = ext2fs_balloc(ip->dev, ip->inum);
+            ad->addrs[EXT2_DIND_BLOCK] = ext2fs_balloc(ip);
             if (ad->addrs[EXT2_DIND_BLOCK] == 0)
                 return 0;
         }
@@ -771,10 +1027,10 @@ static uint32_t ext2fs_bmap(const struct ext2_inode *ip, uint32_t bn)
         const uint32_t first_index = bn / EXT2_INDIRECT;
         const uint32_t second_index = bn % EXT2_INDIRECT;
 
-        const uint32_t mid = ext2_ensure_ptr(ip->dev, ad->addrs[EXT2_DIND_BLOCK], first_index, ip->inum);
+        const uint32_t mid = ext2_ensure_ptr(ip, ad->addrs[EXT2_DIND_BLOCK], first_index);
         if (mid == 0)
             return 0;
-        const uint32_t leaf = ext2_ensure_ptr(ip->dev, mid, second_index, ip->inum);
+        const uint32_t leaf = ext2_ensure_ptr(ip, mid, second_index);
         if (leaf == 0)
             return 0;
         return BLOCK_TO_SECTOR(leaf) + ext2_part_offset(ip->dev);
@@ -785,7 +1041,7 @@ static uint32_t ext2fs_bmap(const struct ext2_inode *ip, uint32_t bn)
     {
         if (ad->addrs[EXT2_TIND_BLOCK] == 0)
         {
-            ad->addrs[EXT2_TIND_BLOCK] = ext2fs_balloc(ip->dev, ip->inum);
+            ad->addrs[EXT2_TIND_BLOCK] = ext2fs_balloc(ip);
             if (ad->addrs[EXT2_TIND_BLOCK] == 0)
                 return 0;
         }
@@ -795,13 +1051,13 @@ static uint32_t ext2fs_bmap(const struct ext2_inode *ip, uint32_t bn)
         const uint32_t second_index = remainder / EXT2_INDIRECT;
         const uint32_t third_index = remainder % EXT2_INDIRECT;
 
-        const uint32_t level1 = ext2_ensure_ptr(ip->dev, ad->addrs[EXT2_TIND_BLOCK], first_index, ip->inum);
+        const uint32_t level1 = ext2_ensure_ptr(ip, ad->addrs[EXT2_TIND_BLOCK], first_index);
         if (level1 == 0)
             return 0;
-        const uint32_t level2 = ext2_ensure_ptr(ip->dev, level1, second_index, ip->inum);
+        const uint32_t level2 = ext2_ensure_ptr(ip, level1, second_index);
         if (level2 == 0)
             return 0;
-        const uint32_t leaf = ext2_ensure_ptr(ip->dev, level2, third_index, ip->inum);
+        const uint32_t leaf = ext2_ensure_ptr(ip, level2, third_index);
         if (leaf == 0)
             return 0;
         return BLOCK_TO_SECTOR(leaf) + ext2_part_offset(ip->dev);
@@ -847,8 +1103,10 @@ static void ext2fs_itrunc(struct ext2_inode *ip)
         ad->addrs[EXT2_TIND_BLOCK] = 0;
     }
 
+    ad->goal = 0;
     ip->size = 0;
     ext2fs_iupdate(ip);
+    ext2_alloc_sync(ip->dev);
 }
 
 int ext2_read_inode(const struct ext2_inode *ip, char *dst, uint32_t off, uint32_t n)
@@ -904,6 +1162,36 @@ int ext2_read_inode(const struct ext2_inode *ip, char *dst, uint32_t off, uint32
     return clamp_to_int(n);
 }
 
+// Prefetch the sectors behind [off, off + n) of a file, one request per run of
+// physically contiguous blocks.
+static void ext2_readahead_inode(const struct ext2_inode *ip, uint32_t off, uint32_t n)
+{
+    if (ip->type == T_DEV || off >= ip->size || n == 0)
+        return;
+    n = min(n, ip->size - off);
+
+    const uint32_t sectors_per_block = EXT2_BSIZE / 512;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for (uint32_t bn = off / EXT2_BSIZE; bn <= (off + n - 1) / EXT2_BSIZE; bn++)
+    {
+        const uint32_t sector = ext2fs_bmap(ip, bn);
+        if (sector == 0)
+            break;
+        if (run_len > 0 && sector == run_start + run_len)
+        {
+            run_len += sectors_per_block;
+            continue;
+        }
+        if (run_len > 0)
+            breada(ip->dev, run_start, run_len);
+        run_start = sector;
+        run_len = sectors_per_block;
+    }
+    if (run_len > 0)
+        breada(ip->dev, run_start, run_len);
+}
+
 int ext2_write_inode(struct ext2_inode *ip, const char *src, uint32_t off, uint32_t n)
 {
     if (ip->type == T_DEV)
@@ -943,7 +1231,7 @@ int ext2_write_inode(struct ext2_inode *ip, const char *src, uint32_t off, uint3
         const uint32_t bytes_to_copy = min(n - tot, 512 - offset_in_sector);
 
         memcpy(bp->data + offset_in_sector, src, bytes_to_copy);
-        bwrite(bp);
+        bdirty(bp);
         brelse(bp);
 
         tot += bytes_to_copy;
@@ -956,6 +1244,7 @@ int ext2_write_inode(struct ext2_inode *ip, const char *src, uint32_t off, uint3
         if (off > ip->size)
             ip->size = off;
         ext2fs_iupdate(ip);
+        ext2_alloc_sync(ip->dev);
     }
     return clamp_to_int(n);
 }
@@ -965,49 +1254,552 @@ int ext2fs_namecmp(const char *s, const char *t)
     return strncmp(s, t, EXT2_NAME_LEN);
 }
 
-struct ext2_inode *ext2fs_dirlookup(const struct ext2_inode *dp, const char *name, uint32_t *poff)
+// Walks the live entries of the directory block at byte offset base, already read into
+// block, starting at byte start of it. Stops when fn returns true and returns that
+// entry's offset in the directory, or UINT32_MAX. A damaged block ends the walk.
+typedef bool (*ext2_dirent_fn)(const struct ext2_dir_entry_2 *de, uint32_t off, void *arg);
+
+static uint32_t ext2_dir_walk_block(const u8 *block, uint32_t base, uint32_t start, ext2_dirent_fn fn, void *arg)
 {
-    struct ext2_dir_entry_2 de;
-    char file_name[EXT2_NAME_LEN + 1];
+    for (uint32_t pos = start; pos + 8 <= EXT2_BSIZE;)
+    {
+        const struct ext2_dir_entry_2 *de = (const struct ext2_dir_entry_2 *)(block + pos);
+        if (de->rec_len < 8 || pos + de->rec_len > EXT2_BSIZE || 8u + de->name_len > de->rec_len)
+        {
+            printk("ext2: bad directory entry at %d\n", base + pos);
+            return UINT32_MAX;
+        }
+        if (de->inode != 0 && fn(de, base + pos, arg))
+            return base + pos;
+        pos += de->rec_len;
+    }
+    return UINT32_MAX;
+}
 
-    for (uint32_t off = 0; off + 8 <= dp->size;)
+// Walks the live entries of the directory from byte offset start, one block read at a time
+static uint32_t ext2_dir_walk(const struct ext2_inode *dp, uint32_t start, ext2_dirent_fn fn, void *arg)
+{
+    uint32_t block[EXT2_BSIZE / sizeof(uint32_t)]; // Entries are 4-byte aligned
+    for (uint32_t base = start - start % EXT2_BSIZE; base < dp->size; base += EXT2_BSIZE)
     {
-        if (ext2_read_inode(dp, (char *)&de, off, 8) != 8)
+        if (ext2_read_inode(dp, (char *)block, base, EXT2_BSIZE) != EXT2_BSIZE)
             break;
-        if (de.rec_len < 8 || de.rec_len > EXT2_BSIZE || off + de.rec_len > dp->size)
+        uint32_t off = ext2_dir_walk_block((const u8 *)block, base, base < start ? start - base : 0, fn, arg);
+        if (off != UINT32_MAX)
+            return off;
+    }
+    return UINT32_MAX;
+}
+
+struct ext2_dir_match
+{
+    const char *name;
+    size_t len;
+    uint32_t inode;
+};
+
+static bool ext2_dir_match(const struct ext2_dir_entry_2 *de, [[maybe_unused]] uint32_t off, void *arg)
+{
+    struct ext2_dir_match *m = arg;
+    if (de->name_len != m->len || memcmp(de->name, m->name, m->len) != 0)
+        return false;
+    m->inode = de->inode;
+    return true;
+}
+
+// HTree name hashes, as computed by the Linux ext2/3/4 drivers and e2fsprogs
+
+static uint32_t ext2_dx_hack_hash(const char *name, size_t len, bool unsigned_chars)
+{
+    uint32_t hash;
+    uint32_t hash0 = 0x12a3fe2d;
+    uint32_t hash1 = 0x37abe8f9;
+    for (size_t i = 0; i < len; i++)
+    {
+        int c = unsigned_chars ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void ext2_str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num, bool unsigned_chars)
+{
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > (size_t)num * 4)
+        len = (size_t)num * 4;
+    for (size_t i = 0; i < len; i++)
+    {
+        int c = unsigned_chars ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3)
         {
-            panic("ext2fs_dirlookup: bad rec_len");
+            *buf++ = val;
+            val = pad;
+            num--;
         }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+static inline uint32_t ext2_rol32(uint32_t x, int s)
+{
+    return (x << s) | (x >> (32 - s));
+}
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) ((a) += f((b), (c), (d)) + (x), (a) = ext2_rol32((a), (s)))
+#define DX_K2 013240474631u
+#define DX_K3 015666365641u
+
+static void ext2_half_md4(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    DX_ROUND(DX_F, a, b, c, d, in[0], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[1], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+    DX_ROUND(DX_F, a, b, c, d, in[4], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[5], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+
+    DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+    DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+    DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+    DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
 
-        if (de.inode == 0)
+static void ext2_tea(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    for (int n = 0; n < 16; n++)
+    {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// Returns the major hash of name, or 0 with *ok false for an unknown hash version
+static uint32_t ext2_dx_hash(const struct ext2_super_block *sb, uint8_t version, const char *name, size_t len,
+                             bool *ok)
+{
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    if (sb->s_hash_seed[0] | sb->s_hash_seed[1] | sb->s_hash_seed[2] | sb->s_hash_seed[3])
+        memcpy(buf, sb->s_hash_seed, sizeof(buf));
+
+    bool unsigned_chars = version >= EXT2_DX_HASH_UNSIGNED;
+    uint32_t in[8];
+    uint32_t hash;
+    *ok = true;
+    switch (unsigned_chars ? version - EXT2_DX_HASH_UNSIGNED : version)
+    {
+    case EXT2_DX_HASH_LEGACY:
+        hash = ext2_dx_hack_hash(name, len, unsigned_chars);
+        break;
+    case EXT2_DX_HASH_HALF_MD4:
+        for (size_t done = 0; done < len; done += 32)
         {
-            off += de.rec_len;
-            continue;
+            ext2_str2hashbuf(name + done, len - done, in, 8, unsigned_chars);
+            ext2_half_md4(buf, in);
         }
+        hash = buf[1];
+        break;
+    case EXT2_DX_HASH_TEA:
+        for (size_t done = 0; done < len; done += 16)
+        {
+            ext2_str2hashbuf(name + done, len - done, in, 4, unsigned_chars);
+            ext2_tea(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        *ok = false;
+        return 0;
+    }
+
+    hash &= ~1u;
+    if (hash == (0x7fffffffu << 1))
+        hash = (0x7fffffffu - 1) << 1;
+    return hash;
+}
+
+struct ext2_dx_entry
+{
+    uint32_t hash; // In entry 0 of a node: limit (low half) and count (high half)
+    uint32_t block;
+};
+
+// Looks name up through the HTree. Returns 1 if found, 0 if it is not in the directory
+// and -1 if the directory has no usable index, in which case it is to be scanned.
+static int ext2_dx_lookup(const struct ext2_inode *dp, const char *name, size_t len, uint32_t *inum, uint32_t *poff)
+{
+    const struct ext2_super_block *sb = ext2_get_sb(dp->dev);
+    if (!(dp->i_flags & EXT2_INDEX_FL) || !(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX))
+        return -1;
+    // "." and ".." are in block 0, outside the leaves the tree covers
+    if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+        return -1;
+
+    uint32_t block[EXT2_BSIZE / sizeof(uint32_t)];
+    if (ext2_read_inode(dp, (char *)block, 0, EXT2_BSIZE) != EXT2_BSIZE)
+        return -1;
+
+    // Block 0: "." and ".." entries, then the root info and the first level of the tree
+    const u8 *info = (const u8 *)block + 24;
+    uint8_t version = info[4];
+    uint8_t info_len = info[5];
+    uint8_t levels = info[6];
+    if (block[6] != 0 || info_len != 8 || levels > 1)
+        return -1;
+    if (version <= EXT2_DX_HASH_TEA && (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        version += EXT2_DX_HASH_UNSIGNED;
+
+    bool ok;
+    uint32_t hash = ext2_dx_hash(sb, version, name, len, &ok);
+    if (!ok)
+        return -1;
+
+    const struct ext2_dx_entry *entries = (const struct ext2_dx_entry *)(info + info_len);
+    uint32_t limit_expected = (EXT2_BSIZE - 24 - info_len) / sizeof(struct ext2_dx_entry);
+    for (int level = 0;; level++)
+    {
+        uint16_t limit = (uint16_t)entries[0].hash;
+        uint16_t count = (uint16_t)(entries[0].hash >> 16);
+        if (limit != limit_expected || count == 0 || count > limit)
+            return -1;
 
-        int to_copy = de.name_len;
-        if (to_copy > EXT2_NAME_LEN)
-            to_copy = EXT2_NAME_LEN;
-        if (to_copy > 0 && ext2_read_inode(dp, (char *)de.name, off + 8, to_copy) != to_copy)
+        // Last entry whose hash is <= the name's; entry 0 covers everything below entry 1
+        uint32_t lo = 1, hi = count;
+        while (lo < hi)
         {
-            panic("ext2fs_dirlookup: name read");
+            uint32_t mid = (lo + hi) / 2;
+            if (entries[mid].hash > hash)
+                hi = mid;
+            else
+                lo = mid + 1;
         }
-        memcpy(file_name, de.name, to_copy);
-        file_name[to_copy] = '\0';
+        uint32_t at = lo - 1;
 
-        if (ext2fs_namecmp(name, file_name) == 0)
+        if (level == levels)
         {
-            if (poff)
+            // Names sharing a hash may continue into the following leaves, whose hash then has bit 0 set
+            for (;;)
             {
-                *poff = off;
+                uint32_t leaf = entries[at].block & 0x0FFFFFFF;
+                uint32_t data[EXT2_BSIZE / sizeof(uint32_t)];
+                if ((uint64_t)leaf * EXT2_BSIZE >= dp->size ||
+                    ext2_read_inode(dp, (char *)data, leaf * EXT2_BSIZE, EXT2_BSIZE) != EXT2_BSIZE)
+                    return -1;
+                struct ext2_dir_match m = {.name = name, .len = len};
+                uint32_t off = ext2_dir_walk_block((const u8 *)data, leaf * EXT2_BSIZE, 0, ext2_dir_match, &m);
+                if (off != UINT32_MAX)
+                {
+                    *inum = m.inode;
+                    *poff = off;
+                    return 1;
+                }
+                // Past the end of an interior node the run may go on in the next one; let a scan decide
+                at++;
+                if (at >= count)
+                    return levels > 0 ? -1 : 0;
+                if ((entries[at].hash & ~1u) != hash)
+                    return 0;
             }
-            return iget(dp->dev, de.inode);
         }
-        off += de.rec_len;
+
+        // Interior node: a fake empty entry spanning the block, then the entries
+        uint32_t node = entries[at].block & 0x0FFFFFFF;
+        if ((uint64_t)node * EXT2_BSIZE >= dp->size ||
+            ext2_read_inode(dp, (char *)block, node * EXT2_BSIZE, EXT2_BSIZE) != EXT2_BSIZE)
+            return -1;
+        entries = (const struct ext2_dx_entry *)((const u8 *)block + 8);
+        limit_expected = (EXT2_BSIZE - 8) / sizeof(struct ext2_dx_entry);
+    }
+}
+
+// In-memory name index of large directories without an HTree
+
+struct ext2_dir_name
+{
+    struct ext2_dir_name *next;
+    uint32_t inode;
+    uint32_t off;
+    uint8_t len;
+    char name[];
+};
+
+struct ext2_dir_index
+{
+    uint32_t dev;
+    uint32_t inum; // 0 if the slot is free
+    uint64_t last_used;
+    uint32_t count;
+    uint32_t nbuckets; // Power of two
+    struct ext2_dir_name **buckets;
+};
+
+static struct ext2_dir_index dir_indexes[EXT2_DIR_INDEX_SLOTS];
+static sleeplock_t dir_index_lock; // Taken after the directory's inode lock
+static uint64_t dir_index_clock;
+
+static uint32_t ext2_dir_name_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+static void ext2_dir_index_clear(struct ext2_dir_index *idx)
+{
+    for (uint32_t i = 0; i < idx->nbuckets; i++)
+    {
+        struct ext2_dir_name *n = idx->buckets[i];
+        while (n)
+        {
+            struct ext2_dir_name *next = n->next;
+            kfree(n);
+            n = next;
+        }
+    }
+    kfree(idx->buckets);
+    idx->buckets = nullptr;
+    idx->nbuckets = 0;
+    idx->count = 0;
+    idx->inum = 0;
+}
+
+static bool ext2_dir_index_put(struct ext2_dir_index *idx, const char *name, size_t len, uint32_t inode, uint32_t off)
+{
+    // Keep chains short as the directory grows
+    if (idx->count >= 2 * idx->nbuckets)
+    {
+        uint32_t nbuckets = idx->nbuckets * 4;
+        struct ext2_dir_name **buckets = kzalloc(nbuckets * sizeof(*buckets));
+        if (!buckets)
+            return false;
+        for (uint32_t i = 0; i < idx->nbuckets; i++)
+        {
+            struct ext2_dir_name *n = idx->buckets[i];
+            while (n)
+            {
+                struct ext2_dir_name *next = n->next;
+                uint32_t b = ext2_dir_name_hash(n->name, n->len) & (nbuckets - 1);
+                n->next = buckets[b];
+                buckets[b] = n;
+                n = next;
+            }
+        }
+        kfree(idx->buckets);
+        idx->buckets = buckets;
+        idx->nbuckets = nbuckets;
+    }
+
+    struct ext2_dir_name *n = kmalloc(sizeof(*n) + len);
+    if (!n)
+        return false;
+    n->inode = inode;
+    n->off = off;
+    n->len = (uint8_t)len;
+    memcpy(n->name, name, len);
+    uint32_t b = ext2_dir_name_hash(name, len) & (idx->nbuckets - 1);
+    n->next = idx->buckets[b];
+    idx->buckets[b] = n;
+    idx->count++;
+    return true;
+}
+
+static bool ext2_dir_index_fill(const struct ext2_dir_entry_2 *de, uint32_t off, void *arg)
+{
+    // Stop the walk on allocation failure; the caller notices the short count
+    return !ext2_dir_index_put(arg, de->name, de->name_len, de->inode, off);
+}
+
+// Called with dir_index_lock held
+static struct ext2_dir_index *ext2_dir_index_find(const struct ext2_inode *dp)
+{
+    for (int i = 0; i < EXT2_DIR_INDEX_SLOTS; i++)
+    {
+        if (dir_indexes[i].inum == dp->inum && dir_indexes[i].dev == dp->dev)
+            return &dir_indexes[i];
     }
     return nullptr;
 }
 
+// Called with dir_index_lock held. Indexes the directory in the least recently used slot.
+static struct ext2_dir_index *ext2_dir_index_build(const struct ext2_inode *dp)
+{
+    struct ext2_dir_index *idx = &dir_indexes[0];
+    for (int i = 1; i < EXT2_DIR_INDEX_SLOTS && idx->inum != 0; i++)
+    {
+        if (dir_indexes[i].inum == 0 || dir_indexes[i].last_used < idx->last_used)
+            idx = &dir_indexes[i];
+    }
+    if (idx->inum != 0)
+        ext2_dir_index_clear(idx);
+
+    idx->nbuckets = 64;
+    idx->buckets = kzalloc(idx->nbuckets * sizeof(*idx->buckets));
+    if (!idx->buckets)
+    {
+        idx->nbuckets = 0;
+        return nullptr;
+    }
+    idx->dev = dp->dev;
+    idx->inum = dp->inum;
+    if (ext2_dir_walk(dp, 0, ext2_dir_index_fill, idx) != UINT32_MAX)
+    {
+        ext2_dir_index_clear(idx);
+        return nullptr;
+    }
+    return idx;
+}
+
+static int ext2_dir_index_lookup(const struct ext2_inode *dp, const char *name, size_t len, uint32_t *inum,
+                                 uint32_t *poff)
+{
+    if (dp->size < EXT2_DIR_INDEX_MIN_SIZE)
+        return -1;
+
+    sleeplock_acquire(&dir_index_lock);
+    struct ext2_dir_index *idx = ext2_dir_index_find(dp);
+    if (!idx)
+        idx = ext2_dir_index_build(dp);
+    if (!idx)
+    {
+        sleeplock_release(&dir_index_lock);
+        return -1;
+    }
+    idx->last_used = ++dir_index_clock;
+
+    int found = 0;
+    for (struct ext2_dir_name *n = idx->buckets[ext2_dir_name_hash(name, len) & (idx->nbuckets - 1)]; n; n = n->next)
+    {
+        if (n->len == len && memcmp(n->name, name, len) == 0)
+        {
+            *inum = n->inode;
+            *poff = n->off;
+            found = 1;
+            break;
+        }
+    }
+    sleeplock_release(&dir_index_lock);
+    return found;
+}
+
+// Called with the directory locked after an entry was added (inode != 0) or removed.
+// A directory that is not indexed yet is left alone; one that cannot be updated is dropped.
+static void ext2_dir_index_update(const struct ext2_inode *dp, const char *name, uint32_t inode, uint32_t off)
+{
+    size_t len = strlen(name);
+    sleeplock_acquire(&dir_index_lock);
+    struct ext2_dir_index *idx = ext2_dir_index_find(dp);
+    if (idx && inode != 0)
+    {
+        if (!ext2_dir_index_put(idx, name, len, inode, off))
+            ext2_dir_index_clear(idx);
+    }
+    else if (idx)
+    {
+        struct ext2_dir_name **link = &idx->buckets[ext2_dir_name_hash(name, len) & (idx->nbuckets - 1)];
+        for (struct ext2_dir_name *n = *link; n; link = &n->next, n = n->next)
+        {
+            if (n->len == len && memcmp(n->name, name, len) == 0)
+            {
+                *link = n->next;
+                kfree(n);
+                idx->count--;
+                break;
+            }
+        }
+    }
+    sleeplock_release(&dir_index_lock);
+}
+
+// Forgets the index of a directory whose inode is being freed
+static void ext2_dir_index_drop(const struct ext2_inode *dp)
+{
+    sleeplock_acquire(&dir_index_lock);
+    struct ext2_dir_index *idx = ext2_dir_index_find(dp);
+    if (idx)
+        ext2_dir_index_clear(idx);
+    sleeplock_release(&dir_index_lock);
+}
+
+struct ext2_inode *ext2fs_dirlookup(const struct ext2_inode *dp, const char *name, uint32_t *poff)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > EXT2_NAME_LEN)
+        return nullptr;
+
+    uint32_t inum = 0;
+    uint32_t off = 0;
+    int found = ext2_dx_lookup(dp, name, len, &inum, &off);
+    if (found < 0)
+        found = ext2_dir_index_lookup(dp, name, len, &inum, &off);
+    if (found < 0)
+    {
+        struct ext2_dir_match m = {.name = name, .len = len};
+        off = ext2_dir_walk(dp, 0, ext2_dir_match, &m);
+        found = off != UINT32_MAX;
+        inum = m.inode;
+    }
+    if (!found)
+        return nullptr;
+
+    if (poff)
+    {
+        *poff = off;
+    }
+    return iget(dp->dev, inum);
+}
+
+// Called with the directory locked after an entry was added or removed at off
+static void ext2_dir_changed(struct ext2_inode *dp, const char *name, uint32_t inum, uint32_t off)
+{
+    // Entries may now be where the HTree does not expect them (iupdate already
+    // cleared the flag on disk), and readdir indices have shifted.
+    dp->i_flags &= ~EXT2_INDEX_FL;
+    dp->readdir_index = 0;
+    dp->readdir_off = 0;
+    ext2_dir_index_update(dp, name, inum, off);
+}
+
 int ext2fs_dirlink(struct ext2_inode *dp, const char *name, uint32_t inum)
 {
     if (name == nullptr)
@@ -1078,6 +1870,7 @@ int ext2fs_dirlink(struct ext2_inode *dp, const char *name, uint32_t inum)
                 if (ext2_write_inode(dp, (char *)&de, off, 8 + name_len) != (int)(8 + name_len))
                     return -1;
             }
+            ext2_dir_changed(dp, name, inum, off);
             return 0;
         }
 
@@ -1135,6 +1928,7 @@ int ext2fs_dirlink(struct ext2_inode *dp, const char *name, uint32_t inum)
     // Update directory size
     dp->size = off + EXT2_BSIZE;
     ext2fs_iupdate(dp);
+    ext2_dir_changed(dp, name, inum, off);
 
     return 0;
 }
@@ -1165,6 +1959,17 @@ static uint64_t ext2_vfs_write(vfs_inode_t *node, uint64_t offset, uint64_t size
     return n > 0 ? n : 0;
 }
 
+static void ext2_vfs_readahead(const vfs_inode_t *node, uint64_t offset, uint64_t size)
+{
+    struct ext2_inode *ip = (struct ext2_inode *)node->device;
+    if (ip == nullptr || offset >= UINT32_MAX)
+        return;
+    if (ext2fs_ilock(ip) != 0)
+        return;
+    ext2_readahead_inode(ip, (uint32_t)offset, (uint32_t)min(size, (uint64_t)UINT32_MAX - offset));
+    ext2fs_iunlock(ip);
+}
+
 static int ext2_vfs_truncate(vfs_inode_t *node)
 {
     struct ext2_inode *ip = (struct ext2_inode *)node->device;
@@ -1261,6 +2066,7 @@ static int ext2_vfs_unlink(vfs_inode_t *parent, const char *name)
         ext2fs_iunlock(dp);
         return -1;
     }
+    ext2_dir_changed(dp, name, 0, off);
     ext2fs_iunlock(dp);
 
     if (ext2fs_ilock(ip) != 0)
@@ -1276,19 +2082,32 @@ static int ext2_vfs_unlink(vfs_inode_t *parent, const char *name)
     return 0;
 }
 
+// Wraps a referenced, locked inode in a new vfs node. The reference moves to the node.
+static vfs_inode_t *ext2_vfs_node(struct ext2_inode *ip)
+{
+    vfs_inode_t *new_node = kmalloc(sizeof(vfs_inode_t));
+    memset(new_node, 0, sizeof(vfs_inode_t));
+    new_node->inode = ip->inum;
+    new_node->size = ip->size;
+    if (ip->type == T_DIR)
+    {
+        new_node->flags = VFS_DIRECTORY;
+    }
+    else
+    {
+        new_node->flags = VFS_FILE;
+    }
+
+    new_node->device = ip;
+    new_node->iops = &ext2_vfs_ops;
+    return new_node;
+}
+
 static vfs_inode_t *ext2_vfs_finddir(const vfs_inode_t *node, const char *name)
 {
     struct ext2_inode *dp = (struct ext2_inode *)node->device;
     if (ext2fs_ilock(dp) != 0)
         return nullptr;
-    // Note: ext2fs_dirlookup uses ext2fs_readi.
-    // But we removed iops from struct ext2_inode.
-    // We need to fix ext2fs_dirlookup to call ext2fs_readi directly.
-    // Or restore iops but point to internal functions.
-    // Since we are modifying ext2.c, we should fix the calls.
-    // I will fix ext2fs_dirlookup and ext2fs_dirlink later.
-    // For now assuming they call ext2fs_readi directly.
-
     struct ext2_inode *ip = ext2fs_dirlookup(dp, name, nullptr);
     ext2fs_iunlock(dp);
 
@@ -1301,67 +2120,86 @@ static vfs_inode_t *ext2_vfs_finddir(const vfs_inode_t *node, const char *name)
         return nullptr;
     }
 
-    vfs_inode_t *new_node = kmalloc(sizeof(vfs_inode_t));
-    memset(new_node, 0, sizeof(vfs_inode_t));
-    new_node->inode = ip->inum;
-    new_node->size = ip->size;
-    if (ip->type == T_DIR)
+    vfs_inode_t *new_node = ext2_vfs_node(ip);
+    ext2fs_iunlock(ip);
+    return new_node;
+}
+
+// The dentry cache remembers the inode number, so a cached lookup only reads the inode
+static vfs_inode_t *ext2_vfs_iget(const vfs_inode_t *node, [[maybe_unused]] const char *name,
+                                  const vfs_cache_key_t *key)
+{
+    const struct ext2_inode *dp = (struct ext2_inode *)node->device;
+    struct ext2_inode *ip = iget(dp->dev, (uint32_t)key->id);
+    if (ext2fs_ilock(ip) != 0)
     {
-        new_node->flags = VFS_DIRECTORY;
+        ext2fs_iput(ip);
+        return nullptr;
     }
-    else
+    if (ip->type == 0 || ip->nlink == 0)
     {
-        new_node->flags = VFS_FILE;
+        ext2fs_iunlock(ip);
+        ext2fs_iput(ip);
+        return nullptr;
     }
 
-    new_node->device = ip;
-    new_node->iops = &ext2_vfs_ops;
-
+    vfs_inode_t *new_node = ext2_vfs_node(ip);
     ext2fs_iunlock(ip);
     return new_node;
 }
 
+struct ext2_readdir_walk
+{
+    uint32_t count; // Index of the next live entry
+    uint32_t index; // Index wanted
+    uint32_t next;  // Offset following the entry found
+    vfs_dirent_t *dent;
+};
+
+static bool ext2_readdir_step(const struct ext2_dir_entry_2 *de, uint32_t off, void *arg)
+{
+    struct ext2_readdir_walk *w = arg;
+    if (w->count++ != w->index)
+        return false;
+
+    w->next = off + de->rec_len;
+    vfs_dirent_t *dent = kmalloc(sizeof(vfs_dirent_t));
+    if (!dent)
+        return true;
+    dent->inode = de->inode;
+    int name_len = de->name_len;
+    assert(name_len < 128, "ext2_vfs_readdir: name_len too large");
+    memcpy(dent->name, de->name, name_len);
+    dent->name[name_len] = 0;
+    w->dent = dent;
+    return true;
+}
+
+// Listing a directory asks for index 0, 1, 2, ... so the offset following the last entry
+// returned is remembered and the next call continues from there instead of from 0.
 static vfs_dirent_t *ext2_vfs_readdir(const vfs_inode_t *node, uint32_t index)
 {
     struct ext2_inode *dp = (struct ext2_inode *)node->device;
     if (ext2fs_ilock(dp) != 0)
         return nullptr;
 
-    struct ext2_dir_entry_2 de;
-    uint32_t off = 0;
-    uint32_t count = 0;
-
-    while (off < dp->size)
+    struct ext2_readdir_walk w = {.count = 0, .index = index, .next = 0, .dent = nullptr};
+    uint32_t start = 0;
+    if (dp->readdir_index > 0 && dp->readdir_index <= index)
     {
-        if (ext2_read_inode(dp, (char *)&de, off, 8) != 8)
-            break;
-        if (de.rec_len < 8 || de.rec_len > EXT2_BSIZE)
-            break;
+        w.count = dp->readdir_index;
+        start = dp->readdir_off;
+    }
 
-        if (de.inode != 0)
-        {
-            if (count == index)
-            {
-                vfs_dirent_t *dent = kmalloc(sizeof(vfs_dirent_t));
-                dent->inode = de.inode;
-
-                int name_len = de.name_len;
-                if (name_len > EXT2_NAME_LEN)
-                    name_len = EXT2_NAME_LEN;
-                ext2_read_inode(dp, dent->name, off + 8, name_len);
-                assert(name_len < 128, "ext2_vfs_readdir: name_len too large");
-                dent->name[name_len] = 0;
-
-                ext2fs_iunlock(dp);
-                return dent;
-            }
-            count++;
-        }
-        off += de.rec_len;
+    ext2_dir_walk(dp, start, ext2_readdir_step, &w);
+    if (w.dent)
+    {
+        dp->readdir_index = index + 1;
+        dp->readdir_off = w.next;
     }
 
     ext2fs_iunlock(dp);
-    return nullptr;
+    return w.dent;
 }
 
 static int ext2_vfs_mknod(const struct vfs_inode *node, const char *name, const int mode, const int dev)
@@ -1386,7 +2224,7 @@ static int ext2_vfs_mknod(const struct vfs_inode *node, const char *name, const
     else if (mode == VFS_DIRECTORY)
         ext2_type = EXT2_FT_DIR;
 
-    ip = ext2fs_ialloc(parent_inode->dev, ext2_type);
+    ip = ext2fs_ialloc(parent_inode->dev, ext2_type, parent_inode->inum);
     if (!ip)
     {
         printk("ext2_vfs_mknod: ialloc failed\n");
@@ -1441,19 +2279,32 @@ static int ext2_vfs_stat(const vfs_inode_t *node, struct stat *st)
     return 0;
 }
 
+static int ext2_vfs_cache_key(const vfs_inode_t *node, vfs_cache_key_t *key)
+{
+    const struct ext2_inode *ip = (struct ext2_inode *)node->device;
+    if (!ip)
+        return -1;
+    ext2_cache_key(ip, key);
+    return 0;
+}
+
 static struct inode_operations ext2_vfs_ops = {
     .read = ext2_vfs_read,
+    .readahead = ext2_vfs_readahead,
     .write = ext2_vfs_write,
     .truncate = ext2_vfs_truncate,
     .open = ext2_vfs_open,
     .close = ext2_vfs_close,
     .readdir = ext2_vfs_readdir,
     .finddir = ext2_vfs_finddir,
+    .iget = ext2_vfs_iget,
     .mknod = ext2_vfs_mknod,
     .clone = ext2_vfs_clone,
     .link = ext2_vfs_link,
     .unlink = ext2_vfs_unlink,
     .stat = ext2_vfs_stat,
+    .mmap = vfs_generic_file_mmap,
+    .cache_key = ext2_vfs_cache_key,
 };
 
 vfs_inode_t *ext2_mount(uint8_t drive_index, uint32_t partition_lba)
@@ -1465,11 +2316,16 @@ vfs_inode_t *ext2_mount(uint8_t drive_index, uint32_t partition_lba)
         spinlock_init(&icache.lock);
         for (int i = 0; i < NINODE; i++)
             sleeplock_init(&icache.inode[i].lock, "inode");
+        sleeplock_init(&dir_index_lock, "ext2 dir index");
+        for (int i = 0; i < 4; i++)
+            sleeplock_init(&ext2_alloc[i].lock, "ext2 alloc");
         initialized = true;
     }
 
     first_partition_blocks[drive_index] = partition_lba;
     ext2fs_readsb(drive_index, ext2_get_sb(drive_index));
+    if (ext2_alloc_load(drive_index) != 0)
+        return nullptr;
 
     struct ext2_inode *root_ip = iget(drive_index, 2);
     if (ext2fs_ilock(root_ip) != 0)
@@ -4,12 +4,21 @@
 #include "terminal.h"
 #include "bio.h"
 #include "util.h"
+#include "page_cache.h"
+#include "sleeplock.h"
 #include <stddef.h>
 #include <limits.h>
 
 static struct inode_operations fat32_iops;
 static int fat32_vfs_unlink(vfs_inode_t* parent, const char* name);
 
+typedef struct
+{
+    uint32_t index;   // Position of the run's first cluster in the file, in clusters
+    uint32_t cluster; // First disk cluster of the run
+    uint32_t length;  // Clusters in the run
+} fat32_extent_t;
+
 typedef struct
 {
     fat32_fs_t* fs;
@@ -18,8 +27,26 @@ typedef struct
     uint32_t crt_time;   // Creation time (Unix timestamp)
     uint32_t mod_time;   // Modification time (Unix timestamp)
     uint32_t acc_time;   // Last access time (Unix timestamp)
+
+    // Cluster chain of the file as runs of contiguous clusters, filled in from the FAT
+    // as far as it has been needed and dropped when the first cluster changes. Reads
+    // and readahead grow it too, so it is only touched with extent_lock held.
+    sleeplock_t extent_lock;
+    fat32_extent_t* extents;
+    uint32_t extent_count;
+    uint32_t extent_capacity;
+    uint32_t extent_first;   // First cluster of the chain the extents describe
+    uint32_t mapped_clusters; // Clusters covered by the extents
 } fat32_inode_data_t;
 
+// Names a file's contents in the page cache by the location of its directory entry,
+// which unlike the first cluster survives truncation.
+static void fat32_cache_key(const fat32_fs_t* fs, uint32_t dir_cluster, uint32_t dir_offset, vfs_cache_key_t* key)
+{
+    key->volume = ((uint64_t)fs->drive_index << 32) | fs->partition_lba;
+    key->id = ((uint64_t)dir_cluster << 32) | dir_offset;
+}
+
 static uint32_t cluster_to_lba(fat32_fs_t* fs, uint32_t cluster)
 {
     return fs->first_data_sector + ((cluster - 2) * fs->sectors_per_cluster);
@@ -74,6 +101,235 @@ static int fat32_write_cluster(fat32_fs_t* fs, uint32_t cluster, uint8_t* buffer
 static int fat32_read_fat_entry(fat32_fs_t* fs, uint32_t cluster, uint32_t* value);
 static int fat32_write_fat_entry(fat32_fs_t* fs, uint32_t cluster, uint32_t value);
 
+// In-memory copy of a volume's FAT, shared by every fat32_fs_t on that volume. Entries
+// are read without the lock; changes take it, keep free_map and free_count in step and
+// mark their FAT sector dirty until fat32_flush_fat() writes it to every FAT copy.
+// The entries and the free map are kept in chunks of FAT32_FAT_CHUNK bytes, so a large
+// volume needs no large contiguous allocation.
+#define FAT32_FAT_CHUNK 4096
+#define FAT32_CHUNK_ENTRIES (FAT32_FAT_CHUNK / sizeof(uint32_t))
+#define FAT32_CHUNK_WORDS (FAT32_FAT_CHUNK / sizeof(uint64_t))
+
+typedef struct fat32_fat
+{
+    uint8_t drive_index;
+    uint32_t partition_lba;
+    sleeplock_t lock;
+    uint32_t** entries;
+    uint64_t** free_map; // Bit set for every free cluster
+    uint32_t entry_chunks;
+    uint32_t map_chunks;
+    uint64_t* dirty;    // Bit set for every FAT sector that differs from the disk
+    uint32_t clusters;  // Entries in use, total_clusters + 2
+    uint32_t sectors;   // FAT sectors covering them
+    uint32_t fat_lba;   // First sector of FAT #0
+    uint32_t fat_size;  // Sectors per FAT copy
+    uint32_t first_copy;
+    uint32_t last_copy; // Copies [first_copy, last_copy] are kept identical
+    uint32_t free_count;
+    uint32_t next_free;  // Where the search for a free cluster starts
+    uint32_t fsinfo_lba; // 0 if the volume has no FSInfo sector
+    bool fsinfo_dirty;
+    struct fat32_fat* next;
+} fat32_fat_t;
+
+static fat32_fat_t* fat_volumes;
+static spinlock_t fat_volumes_lock;
+
+static inline uint32_t* fat32_entry(const fat32_fat_t* fat, uint32_t cluster)
+{
+    return &fat->entries[cluster / FAT32_CHUNK_ENTRIES][cluster % FAT32_CHUNK_ENTRIES];
+}
+
+// A FAT sector never straddles two chunks
+static inline uint8_t* fat32_fat_sector(const fat32_fat_t* fat, uint32_t sector)
+{
+    return (uint8_t*)fat32_entry(fat, sector * (512 / sizeof(uint32_t)));
+}
+
+static inline uint64_t* fat32_map_word(const fat32_fat_t* fat, uint32_t word)
+{
+    return &fat->free_map[word / FAT32_CHUNK_WORDS][word % FAT32_CHUNK_WORDS];
+}
+
+static inline bool fat32_cluster_free(const fat32_fat_t* fat, uint32_t cluster)
+{
+    return *fat32_map_word(fat, cluster / 64) & (1ull << (cluster % 64));
+}
+
+static void fat32_fat_release(fat32_fat_t* fat)
+{
+    for (uint32_t i = 0; fat->entries && i < fat->entry_chunks; i++)
+        kfree(fat->entries[i]);
+    for (uint32_t i = 0; fat->free_map && i < fat->map_chunks; i++)
+        kfree(fat->free_map[i]);
+    kfree(fat->entries);
+    kfree(fat->free_map);
+    kfree(fat->dirty);
+    kfree(fat);
+}
+
+// Reads FAT #0 (or the active FAT when mirroring is off) and the FSInfo sector
+static fat32_fat_t* fat32_fat_load(const fat32_fs_t* fs, const fat32_bpb_t* bpb, uint32_t fat_size)
+{
+    fat32_fat_t* fat = kzalloc(sizeof(fat32_fat_t));
+    if (!fat)
+        return nullptr;
+    fat->drive_index = fs->drive_index;
+    fat->partition_lba = fs->partition_lba;
+    sleeplock_init(&fat->lock, "fat32 fat");
+    fat->clusters = fs->total_clusters + 2;
+    fat->sectors = (fat->clusters * 4 + 511) / 512;
+    fat->fat_lba = fs->fat_start_lba;
+    fat->fat_size = fat_size;
+    fat->first_copy = 0;
+    fat->last_copy = bpb->num_fats ? bpb->num_fats - 1u : 0;
+    if (bpb->ext_flags & FAT32_EXT_FLAGS_NO_MIRROR)
+        fat->first_copy = fat->last_copy = bpb->ext_flags & FAT32_EXT_FLAGS_ACTIVE;
+    if (fat->sectors > fat_size || fat->first_copy > fat->last_copy)
+    {
+        printk("FAT32: FAT of %d sectors cannot map %d clusters\n", fat_size, fs->total_clusters);
+        kfree(fat);
+        return nullptr;
+    }
+
+    const uint32_t words = (fat->clusters + 63) / 64;
+    fat->entry_chunks = (uint32_t)((fat->sectors * 512ull + FAT32_FAT_CHUNK - 1) / FAT32_FAT_CHUNK);
+    fat->map_chunks = (uint32_t)((words + FAT32_CHUNK_WORDS - 1) / FAT32_CHUNK_WORDS);
+    fat->entries = kzalloc(fat->entry_chunks * sizeof(uint32_t*));
+    fat->free_map = kzalloc(fat->map_chunks * sizeof(uint64_t*));
+    fat->dirty = kzalloc((fat->sectors + 63) / 64 * sizeof(uint64_t));
+    bool allocated = fat->entries && fat->free_map && fat->dirty;
+    for (uint32_t i = 0; allocated && i < fat->entry_chunks; i++)
+        allocated = (fat->entries[i] = kmalloc(FAT32_FAT_CHUNK)) != nullptr;
+    for (uint32_t i = 0; allocated && i < fat->map_chunks; i++)
+        allocated = (fat->free_map[i] = kzalloc(FAT32_FAT_CHUNK)) != nullptr;
+    if (!allocated)
+    {
+        printk("FAT32: out of memory caching a FAT of %d sectors\n", fat->sectors);
+        fat32_fat_release(fat);
+        return nullptr;
+    }
+
+    const uint32_t first = fat->fat_lba + fat->first_copy * fat_size;
+    breada(fat->drive_index, first, fat->sectors);
+    for (uint32_t i = 0; i < fat->sectors; i++)
+    {
+        buffer_head_t* bh = bread(fat->drive_index, first + i);
+        if (!bh)
+        {
+            printk("FAT32: failed to read FAT sector %d\n", i);
+            fat32_fat_release(fat);
+            return nullptr;
+        }
+        memcpy(fat32_fat_sector(fat, i), bh->data, 512);
+        brelse(bh);
+    }
+    for (uint32_t cluster = 2; cluster < fat->clusters; cluster++)
+    {
+        if ((*fat32_entry(fat, cluster) & FAT32_CLUSTER_MASK) == 0)
+        {
+            *fat32_map_word(fat, cluster / 64) |= 1ull << (cluster % 64);
+            fat->free_count++;
+        }
+    }
+
+    // The free count is ours, but the next-free hint saves a scan past the used clusters
+    fat->next_free = 2;
+    if (bpb->fs_info != 0 && bpb->fs_info != 0xFFFF)
+    {
+        buffer_head_t* bh = bread(fat->drive_index, fs->partition_lba + bpb->fs_info);
+        if (bh)
+        {
+            const fat32_fsinfo_t* info = (const fat32_fsinfo_t*)bh->data;
+            if (info->lead_sig == FAT32_FSINFO_LEAD_SIG && info->struct_sig == FAT32_FSINFO_STRUCT_SIG)
+            {
+                fat->fsinfo_lba = fs->partition_lba + bpb->fs_info;
+                if (info->next_free >= 2 && info->next_free < fat->clusters)
+                    fat->next_free = info->next_free;
+                fat->fsinfo_dirty = info->free_count != fat->free_count;
+            }
+            brelse(bh);
+        }
+    }
+    return fat;
+}
+
+// Returns the FAT of the volume fs is on, loading it on the first mount
+static fat32_fat_t* fat32_fat_get(const fat32_fs_t* fs, const fat32_bpb_t* bpb, uint32_t fat_size)
+{
+    spinlock_acquire(&fat_volumes_lock);
+    for (fat32_fat_t* fat = fat_volumes; fat; fat = fat->next)
+    {
+        if (fat->drive_index == fs->drive_index && fat->partition_lba == fs->partition_lba)
+        {
+            spinlock_release(&fat_volumes_lock);
+            return fat;
+        }
+    }
+    spinlock_release(&fat_volumes_lock);
+
+    fat32_fat_t* loaded = fat32_fat_load(fs, bpb, fat_size);
+    if (!loaded)
+        return nullptr;
+
+    // Someone else may have mounted the volume while we read it
+    spinlock_acquire(&fat_volumes_lock);
+    for (fat32_fat_t* fat = fat_volumes; fat; fat = fat->next)
+    {
+        if (fat->drive_index == fs->drive_index && fat->partition_lba == fs->partition_lba)
+        {
+            spinlock_release(&fat_volumes_lock);
+            fat32_fat_release(loaded);
+            return fat;
+        }
+    }
+    loaded->next = fat_volumes;
+    fat_volumes = loaded;
+    spinlock_release(&fat_volumes_lock);
+    return loaded;
+}
+
+// Called with the FAT lock held
+static void fat32_set_entry(fat32_fat_t* fat, uint32_t cluster, uint32_t value)
+{
+    const bool was_free = fat32_cluster_free(fat, cluster);
+    // The top four bits are reserved and kept as they are
+    uint32_t* entry = fat32_entry(fat, cluster);
+    *entry = (*entry & ~FAT32_CLUSTER_MASK) | (value & FAT32_CLUSTER_MASK);
+    if (was_free && value != 0)
+    {
+        *fat32_map_word(fat, cluster / 64) &= ~(1ull << (cluster % 64));
+        fat->free_count--;
+        fat->fsinfo_dirty = true;
+    }
+    else if (!was_free && value == 0)
+    {
+        *fat32_map_word(fat, cluster / 64) |= 1ull << (cluster % 64);
+        fat->free_count++;
+        fat->fsinfo_dirty = true;
+    }
+    const uint32_t sector = cluster / 128;
+    fat->dirty[sector / 64] |= 1ull << (sector % 64);
+}
+
+// First free cluster at or after next_free, wrapping around. Called with the FAT lock held.
+static uint32_t fat32_next_free(const fat32_fat_t* fat)
+{
+    const uint32_t words = (fat->clusters + 63) / 64;
+    const uint32_t start = fat->next_free < fat->clusters ? fat->next_free : 2;
+    for (uint32_t n = 0; n <= words; n++)
+    {
+        const uint32_t w = (start / 64 + n) % words;
+        uint64_t bits = *fat32_map_word(fat, w);
+        if (n == 0)
+            bits &= ~0ull << (start % 64);
+        if (bits)
+            return w * 64 + (uint32_t)__builtin_ctzll(bits);
+    }
+    return 0;
+}
+
 int fat32_init(fat32_fs_t* fs, uint8_t drive_index, uint32_t partition_lba)
 {
     fs->drive_index = drive_index;
@@ -125,6 +381,13 @@ int fat32_init(fat32_fs_t* fs, uint8_t drive_index, uint32_t partition_lba)
     uint32_t data_sectors = total_sectors - data_start_block;
     fs->total_clusters = data_sectors / fs->sectors_per_cluster;
 
+    fs->fat = fat32_fat_get(fs, bpb, fat_size);
+    if (!fs->fat)
+    {
+        boot_message(ERROR, "FAT32: Failed to load the FAT");
+        return 1;
+    }
+
     boot_message(INFO, "FAT32 Init: Drive %d, Partition LBA %d", drive_index, partition_lba);
     boot_message(INFO, "  Root Cluster: %d", fs->root_cluster);
     boot_message(INFO, "  Sectors Per Cluster: %d", fs->sectors_per_cluster);
@@ -136,6 +399,9 @@ int fat32_init(fat32_fs_t* fs, uint8_t drive_index, uint32_t partition_lba)
 static int fat32_read_cluster(fat32_fs_t* fs, uint32_t cluster, uint8_t* buffer)
 {
     uint32_t lba = cluster_to_lba(fs, cluster);
+    // Clusters spanning several cache blocks come in with one request
+    if (fs->sectors_per_cluster * 512 > bio_block_size())
+        breada(fs->drive_index, lba, fs->sectors_per_cluster);
     for (uint32_t i = 0; i < fs->sectors_per_cluster; i++)
     {
         buffer_head_t* bh = bread(fs->drive_index, lba + i);
@@ -147,16 +413,19 @@ static int fat32_read_cluster(fat32_fs_t* fs, uint32_t cluster, uint8_t* buffer)
     return 0;
 }
 
+// Overwrites every sector of the cluster, so nothing is read from the disk first. A null
+// buffer writes zeroes.
 static int fat32_write_cluster(fat32_fs_t* fs, uint32_t cluster, uint8_t* buffer)
 {
     uint32_t lba = cluster_to_lba(fs, cluster);
     for (uint32_t i = 0; i < fs->sectors_per_cluster; i++)
     {
-        buffer_head_t* bh = bread(fs->drive_index, lba + i);
+        buffer_head_t* bh = bzeroed(fs->drive_index, lba + i);
         if (!bh)
             return 1;
-        memcpy(bh->data, buffer + i * 512, 512);
-        bwrite(bh);
+        if (buffer)
+            memcpy(bh->data, buffer + i * 512, 512);
+        bdirty(bh);
         brelse(bh);
     }
     return 0;
@@ -164,57 +433,251 @@ static int fat32_write_cluster(fat32_fs_t* fs, uint32_t cluster, uint8_t* buffer
 
 static int fat32_read_fat_entry(fat32_fs_t* fs, uint32_t cluster, uint32_t* value)
 {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs->fat_start_lba + (fat_offset / 512);
-    uint32_t ent_offset = fat_offset % 512;
-
-    buffer_head_t* bh = bread(fs->drive_index, fat_sector);
-    if (!bh)
+    if (cluster >= fs->fat->clusters)
         return 1;
-
-    *value = *(uint32_t*)&bh->data[ent_offset] & FAT32_CLUSTER_MASK;
-    brelse(bh);
+    *value = *fat32_entry(fs->fat, cluster) & FAT32_CLUSTER_MASK;
     return 0;
 }
 
 static int fat32_write_fat_entry(fat32_fs_t* fs, uint32_t cluster, uint32_t value)
 {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs->fat_start_lba + (fat_offset / 512);
-    uint32_t ent_offset = fat_offset % 512;
-
-    buffer_head_t* bh = bread(fs->drive_index, fat_sector);
-    if (!bh)
+    fat32_fat_t* fat = fs->fat;
+    if (cluster < 2 || cluster >= fat->clusters)
         return 1;
 
-    *(uint32_t*)&bh->data[ent_offset] = value;
-    bwrite(bh);
-    brelse(bh);
+    sleeplock_acquire(&fat->lock);
+    fat32_set_entry(fat, cluster, value);
+    sleeplock_release(&fat->lock);
     return 0;
 }
 
-static uint32_t fat32_find_free_cluster(fat32_fs_t* fs)
+// Takes up to want free clusters that follow each other on the disk, chains them, marks
+// the last one as the end of the chain and links the first after prev unless prev is 0.
+// The run starts right after prev when that cluster is free. Returns the first cluster
+// and sets *got to the length of the run, or returns 0 if the volume is full.
+static uint32_t fat32_alloc_run(fat32_fs_t* fs, uint32_t prev, uint32_t want, uint32_t* got)
+{
+    fat32_fat_t* fat = fs->fat;
+    *got = 0;
+    sleeplock_acquire(&fat->lock);
+    uint32_t first = 0;
+    if (prev >= 2 && prev + 1 < fat->clusters && fat32_cluster_free(fat, prev + 1))
+        first = prev + 1;
+    else if (fat->free_count)
+        first = fat32_next_free(fat);
+    if (first != 0)
+    {
+        uint32_t count = 1;
+        while (count < want && first + count < fat->clusters && fat32_cluster_free(fat, first + count))
+            count++;
+        for (uint32_t i = 0; i + 1 < count; i++)
+            fat32_set_entry(fat, first + i, first + i + 1);
+        fat32_set_entry(fat, first + count - 1, FAT32_EOC_MARK);
+        if (prev >= 2 && prev < fat->clusters)
+            fat32_set_entry(fat, prev, first);
+        fat->next_free = first + count;
+        *got = count;
+    }
+    sleeplock_release(&fat->lock);
+    return first;
+}
+
+// Takes a single cluster, as fat32_alloc_run()
+static uint32_t fat32_alloc_cluster(fat32_fs_t* fs, uint32_t prev)
 {
-    // Simple scan from cluster 2
-    // Limit to total clusters + 2 (since clusters start at 2)
-    uint32_t max_cluster = fs->total_clusters + 2;
+    uint32_t got;
+    return fat32_alloc_run(fs, prev, 1, &got);
+}
 
-    // printk("Scanning for free cluster up to %d\n", max_cluster);
+// Writes the dirty FAT sectors to every FAT copy, and the free count and hint to the
+// FSInfo sector, as delayed writes through the buffer cache.
+static void fat32_flush_fat(fat32_fs_t* fs)
+{
+    fat32_fat_t* fat = fs->fat;
+    sleeplock_acquire(&fat->lock);
+    for (uint32_t w = 0; w < (fat->sectors + 63) / 64; w++)
+    {
+        while (fat->dirty[w])
+        {
+            const uint32_t sector = w * 64 + (uint32_t)__builtin_ctzll(fat->dirty[w]);
+            fat->dirty[w] &= fat->dirty[w] - 1;
+            for (uint32_t copy = fat->first_copy; copy <= fat->last_copy; copy++)
+            {
+                buffer_head_t* bh = bread(fat->drive_index, fat->fat_lba + copy * fat->fat_size + sector);
+                if (!bh)
+                {
+                    printk("FAT32: failed to write FAT sector %d of copy %d\n", sector, copy);
+                    continue;
+                }
+                memcpy(bh->data, fat32_fat_sector(fat, sector), 512);
+                bdirty(bh);
+                brelse(bh);
+            }
+        }
+    }
 
-    for (uint32_t i = 2; i < max_cluster; i++)
+    if (fat->fsinfo_dirty && fat->fsinfo_lba != 0)
     {
-        uint32_t entry;
-        if (fat32_read_fat_entry(fs, i, &entry) != 0)
+        buffer_head_t* bh = bread(fat->drive_index, fat->fsinfo_lba);
+        if (bh)
         {
-            printk("fat32_find_free_cluster: Read error at cluster %d\n", i);
-            break;
+            fat32_fsinfo_t* info = (fat32_fsinfo_t*)bh->data;
+            info->free_count = fat->free_count;
+            info->next_free = fat->next_free;
+            bdirty(bh);
+            brelse(bh);
+            fat->fsinfo_dirty = false;
+        }
+    }
+    sleeplock_release(&fat->lock);
+}
+
+uint32_t fat32_free_clusters(const fat32_fs_t* fs)
+{
+    return fs->fat ? fs->fat->free_count : 0;
+}
+
+static void fat32_extents_reset(fat32_inode_data_t* data, uint32_t first_cluster)
+{
+    data->extent_count = 0;
+    data->extent_first = first_cluster;
+    data->mapped_clusters = 0;
+}
+
+// Adds the next cluster of the chain to the extents, growing the last run if it is
+// contiguous with it
+static int fat32_extent_append(fat32_inode_data_t* data, uint32_t cluster)
+{
+    if (data->extent_count > 0)
+    {
+        fat32_extent_t* last = &data->extents[data->extent_count - 1];
+        if (last->cluster + last->length == cluster)
+        {
+            last->length++;
+            data->mapped_clusters++;
+            return 0;
         }
-        if (entry == 0)
-            return i;
     }
+    if (data->extent_count == data->extent_capacity)
+    {
+        uint32_t capacity = data->extent_capacity ? data->extent_capacity * 2 : 8;
+        fat32_extent_t* extents = krealloc(data->extents, capacity * sizeof(fat32_extent_t));
+        if (!extents)
+            return 1;
+        data->extents = extents;
+        data->extent_capacity = capacity;
+    }
+    data->extents[data->extent_count++] = (fat32_extent_t){data->mapped_clusters, cluster, 1};
+    data->mapped_clusters++;
     return 0;
 }
 
+// Returns the disk cluster at position index of the file, or 0 past the end of its chain,
+// and sets *run to the number of clusters from there on known to be contiguous. The
+// extents are extended from the FAT as far as index, then searched in O(log n). The
+// caller holds extent_lock.
+static uint32_t fat32_map_cluster_locked(const vfs_inode_t* node, uint32_t index, uint32_t* run)
+{
+    fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
+    fat32_fs_t* fs = data->fs;
+    if (data->extent_first != node->inode)
+        fat32_extents_reset(data, (uint32_t)node->inode);
+    if (node->inode < 2)
+        return 0;
+
+    while (data->mapped_clusters <= index)
+    {
+        uint32_t next = (uint32_t)node->inode;
+        if (data->extent_count > 0)
+        {
+            const fat32_extent_t* last = &data->extents[data->extent_count - 1];
+            if (fat32_read_fat_entry(fs, last->cluster + last->length - 1, &next) != 0)
+                return 0;
+        }
+        // A chain longer than the volume has a loop in it
+        if (next < 2 || next >= FAT32_EOC || data->mapped_clusters >= fs->total_clusters ||
+            fat32_extent_append(data, next) != 0)
+            return 0;
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = data->extent_count - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (data->extents[mid].index <= index)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    const fat32_extent_t* extent = &data->extents[lo];
+    if (run)
+        *run = extent->length - (index - extent->index);
+    return extent->cluster + (index - extent->index);
+}
+
+static uint32_t fat32_map_cluster(const vfs_inode_t* node, uint32_t index, uint32_t* run)
+{
+    fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
+    sleeplock_acquire(&data->extent_lock);
+    uint32_t cluster = fat32_map_cluster_locked(node, index, run);
+    sleeplock_release(&data->extent_lock);
+    return cluster;
+}
+
+// Like fat32_map_cluster(), but grows the chain up to index, taking contiguous runs. New
+// clusters are zeroed, except those in [keep_from, keep_to) which the caller is about to
+// overwrite whole. *fresh_from is set to the position of the first new cluster, and stays
+// UINT32_MAX if the chain was already long enough.
+static uint32_t fat32_extend_to_locked(vfs_inode_t* node, uint32_t index, uint32_t keep_from, uint32_t keep_to,
+                                       uint32_t* fresh_from)
+{
+    *fresh_from = UINT32_MAX;
+    uint32_t cluster = fat32_map_cluster_locked(node, index, nullptr);
+    if (cluster != 0 || node->inode < 2)
+        return cluster;
+
+    // The extents now end where the chain does
+    fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
+    fat32_fs_t* fs = data->fs;
+    if (data->extent_count == 0)
+        return 0;
+    const fat32_extent_t* last = &data->extents[data->extent_count - 1];
+    uint32_t tail = last->cluster + last->length - 1;
+    uint32_t next;
+    if (fat32_read_fat_entry(fs, tail, &next) != 0 || next < FAT32_EOC)
+        return 0;
+
+    *fresh_from = data->mapped_clusters;
+    while (data->mapped_clusters <= index)
+    {
+        uint32_t count;
+        uint32_t first = fat32_alloc_run(fs, tail, index - data->mapped_clusters + 1, &count);
+        if (first == 0)
+            return 0; // Disk full
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const uint32_t pos = data->mapped_clusters;
+            if (pos < keep_from || pos >= keep_to)
+                fat32_write_cluster(fs, first + i, nullptr);
+            if (fat32_extent_append(data, first + i) != 0)
+                return 0;
+        }
+        tail = first + count - 1;
+    }
+    return tail;
+}
+
+static uint32_t fat32_extend_to(vfs_inode_t* node, uint32_t index, uint32_t keep_from, uint32_t keep_to,
+                                uint32_t* fresh_from)
+{
+    fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
+    sleeplock_acquire(&data->extent_lock);
+    uint32_t cluster = fat32_extend_to_locked(node, index, keep_from, keep_to, fresh_from);
+    sleeplock_release(&data->extent_lock);
+    return cluster;
+}
+
 static int fat32_unlink_entry(fat32_fs_t* fs, uint32_t parent_cluster, const char* filename)
 {
     fat32_directory_entry_t entry;
@@ -485,7 +948,6 @@ static uint64_t fat32_vfs_read(const vfs_inode_t* node, uint64_t offset, uint64_
 {
     fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
     fat32_fs_t* fs = data->fs;
-    uint32_t current_cluster = node->inode;
     uint32_t bytes_per_cluster = fs->bytes_per_cluster;
 
     if (offset >= node->size)
@@ -493,111 +955,111 @@ static uint64_t fat32_vfs_read(const vfs_inode_t* node, uint64_t offset, uint64_
     if (offset + size > node->size)
         size = node->size - offset;
 
-    // Skip clusters
-    uint32_t clusters_to_skip = offset / bytes_per_cluster;
-    uint32_t cluster_offset = offset % bytes_per_cluster;
-
-    for (uint32_t i = 0; i < clusters_to_skip; i++)
-    {
-        uint32_t next_cluster;
-        if (fat32_read_fat_entry(fs, current_cluster, &next_cluster) != 0)
-            return 0;
-        if (next_cluster >= FAT32_EOC)
-            return 0;
-        current_cluster = next_cluster;
-    }
-
     uint64_t bytes_read = 0;
-    uint8_t* cluster_buf = kmalloc(bytes_per_cluster);
-    if (!cluster_buf)
-        return 0;
-    defer(cleanup_kfree, &cluster_buf);
-
     while (bytes_read < size)
     {
-        if (fat32_read_cluster(fs, current_cluster, cluster_buf) != 0)
+        uint64_t pos = offset + bytes_read;
+        uint32_t run;
+        uint32_t cluster = fat32_map_cluster(node, (uint32_t)(pos / bytes_per_cluster), &run);
+        if (cluster == 0)
             break;
 
-        uint32_t chunk_size = bytes_per_cluster - cluster_offset;
-        if (chunk_size > size - bytes_read)
-            chunk_size = size - bytes_read;
-
-        memcpy(buffer + bytes_read, cluster_buf + cluster_offset, chunk_size);
-        bytes_read += chunk_size;
-        cluster_offset = 0;
+        // As much of the request as the run of contiguous clusters holds, read in one request
+        uint64_t run_bytes = (uint64_t)run * bytes_per_cluster - pos % bytes_per_cluster;
+        uint64_t chunk = min(size - bytes_read, run_bytes);
+        uint32_t lba = cluster_to_lba(fs, cluster) + (uint32_t)(pos % bytes_per_cluster / 512);
+        uint32_t sector_offset = pos % 512;
+        uint32_t sectors = (uint32_t)((sector_offset + chunk + 511) / 512);
+        if (sectors > 1)
+            breada(fs->drive_index, lba, sectors);
 
-        if (bytes_read < size)
+        for (uint32_t i = 0; i < sectors; i++)
         {
-            uint32_t next_cluster;
-            if (fat32_read_fat_entry(fs, current_cluster, &next_cluster) != 0)
-                break;
-            if (next_cluster >= FAT32_EOC)
-                break;
-            current_cluster = next_cluster;
+            buffer_head_t* bh = bread(fs->drive_index, lba + i);
+            if (!bh)
+                return bytes_read;
+            uint32_t n = (uint32_t)min(chunk, (uint64_t)(512 - sector_offset));
+            memcpy(buffer + bytes_read, bh->data + sector_offset, n);
+            brelse(bh);
+            bytes_read += n;
+            chunk -= n;
+            sector_offset = 0;
         }
     }
 
     return bytes_read;
 }
 
-static uint64_t fat32_vfs_write(vfs_inode_t* node, uint64_t offset, uint64_t size, uint8_t* buffer)
+// Prefetch the clusters behind [offset, offset + size), one request per run of
+// physically contiguous clusters.
+static void fat32_vfs_readahead(const vfs_inode_t* node, uint64_t offset, uint64_t size)
 {
     fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
     fat32_fs_t* fs = data->fs;
-    uint32_t current_cluster = node->inode;
     uint32_t bytes_per_cluster = fs->bytes_per_cluster;
 
-    // Seek to offset
-    uint32_t clusters_to_skip = offset / bytes_per_cluster;
-    uint32_t cluster_offset = offset % bytes_per_cluster;
+    if (node->inode < 2 || offset >= node->size || size == 0)
+        return;
+    if (offset + size > node->size)
+        size = node->size - offset;
 
-    for (uint32_t i = 0; i < clusters_to_skip; i++)
+    uint32_t index = offset / bytes_per_cluster;
+    uint32_t last = (offset + size - 1) / bytes_per_cluster;
+    while (index <= last)
     {
-        uint32_t next_cluster;
-        if (fat32_read_fat_entry(fs, current_cluster, &next_cluster) != 0)
-            return 0; // Error
-
-        if (next_cluster >= FAT32_EOC)
-        {
-            // End of chain, but we need to write further. Allocate new cluster.
-            uint32_t new_cluster = fat32_find_free_cluster(fs);
-            if (new_cluster == 0)
-                return 0; // Disk full
+        uint32_t run;
+        uint32_t cluster = fat32_map_cluster(node, index, &run);
+        if (cluster == 0)
+            break;
+        run = min(run, last - index + 1);
+        breada(fs->drive_index, cluster_to_lba(fs, cluster), run * fs->sectors_per_cluster);
+        index += run;
+    }
+}
 
-            fat32_write_fat_entry(fs, current_cluster, new_cluster);
-            fat32_write_fat_entry(fs, new_cluster, FAT32_EOC_MARK);
+static uint64_t fat32_vfs_write(vfs_inode_t* node, uint64_t offset, uint64_t size, uint8_t* buffer)
+{
+    fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
+    fat32_fs_t* fs = data->fs;
+    uint32_t bytes_per_cluster = fs->bytes_per_cluster;
+    if (size == 0)
+        return 0;
 
-            // Clear new cluster
-            uint8_t* zero_buf = kmalloc(bytes_per_cluster);
-            if (zero_buf)
-            {
-                memset(zero_buf, 0, bytes_per_cluster);
-                fat32_write_cluster(fs, new_cluster, zero_buf);
-                kfree(zero_buf);
-            }
+    // Grow the chain for the whole write at once. The clusters it covers completely are
+    // written straight from the caller's buffer, so they are neither zeroed nor read.
+    const uint64_t end = offset + size;
+    const uint32_t full_from = (uint32_t)((offset + bytes_per_cluster - 1) / bytes_per_cluster);
+    const uint32_t full_to = (uint32_t)(end / bytes_per_cluster);
+    uint32_t fresh_from;
+    fat32_extend_to(node, (uint32_t)((end - 1) / bytes_per_cluster), full_from, full_to, &fresh_from);
 
-            current_cluster = new_cluster;
-        }
-        else
-        {
-            current_cluster = next_cluster;
-        }
-    }
+    uint8_t* cluster_buf = nullptr;
+    defer(cleanup_kfree, &cluster_buf);
 
     uint64_t bytes_written = 0;
-
     while (bytes_written < size)
     {
+        uint64_t pos = offset + bytes_written;
+        uint32_t current_cluster = fat32_map_cluster(node, (uint32_t)(pos / bytes_per_cluster), nullptr);
+        if (current_cluster == 0)
+            break;
+
+        uint32_t cluster_offset = pos % bytes_per_cluster;
         uint32_t chunk_size = bytes_per_cluster - cluster_offset;
         if (chunk_size > size - bytes_written)
             chunk_size = size - bytes_written;
 
+        if (chunk_size == bytes_per_cluster)
+        {
+            if (fat32_write_cluster(fs, current_cluster, buffer + bytes_written) != 0)
+                break;
+            bytes_written += chunk_size;
+            continue;
+        }
+
         // Read-modify-write if partial cluster
-        uint8_t* cluster_buf = kmalloc(bytes_per_cluster);
-        if (!cluster_buf)
+        if (!cluster_buf && !(cluster_buf = kmalloc(bytes_per_cluster)))
             break;
-        defer(cleanup_kfree, &cluster_buf);
-
         if (fat32_read_cluster(fs, current_cluster, cluster_buf) != 0)
         {
             break;
@@ -611,41 +1073,16 @@ static uint64_t fat32_vfs_write(vfs_inode_t* node, uint64_t offset, uint64_t siz
         }
 
         bytes_written += chunk_size;
-        cluster_offset = 0;
-
-        if (bytes_written < size)
-        {
-            // Need next cluster
-            uint32_t next_cluster;
-            if (fat32_read_fat_entry(fs, current_cluster, &next_cluster) != 0)
-                break;
-
-            if (next_cluster >= FAT32_EOC)
-            {
-                // Allocate new
-                uint32_t new_cluster = fat32_find_free_cluster(fs);
-                if (new_cluster == 0)
-                    break;
-
-                fat32_write_fat_entry(fs, current_cluster, new_cluster);
-                fat32_write_fat_entry(fs, new_cluster, FAT32_EOC_MARK);
-
-                // Clear new cluster
-                uint8_t* zero_buf = kmalloc(bytes_per_cluster);
-                if (zero_buf)
-                {
-                    memset(zero_buf, 0, bytes_per_cluster);
-                    fat32_write_cluster(fs, new_cluster, zero_buf);
-                    kfree(zero_buf);
-                }
+    }
 
-                current_cluster = new_cluster;
-            }
-            else
-            {
-                current_cluster = next_cluster;
-            }
-        }
+    // New clusters the write stopped short of were left unzeroed for it, and would show
+    // stale disk contents once the file grows over them
+    const uint32_t reached = (uint32_t)((offset + bytes_written) / bytes_per_cluster);
+    for (uint32_t i = max(max(fresh_from, full_from), reached); i < full_to; i++)
+    {
+        uint32_t cluster = fat32_map_cluster(node, i, nullptr);
+        if (cluster == 0 || fat32_write_cluster(fs, cluster, nullptr) != 0)
+            break;
     }
 
     // Update file size if we extended it
@@ -673,6 +1110,7 @@ static uint64_t fat32_vfs_write(vfs_inode_t* node, uint64_t offset, uint64_t siz
             }
         }
     }
+    fat32_flush_fat(fs);
 
     return bytes_written;
 }
@@ -685,6 +1123,7 @@ static void fat32_vfs_close(vfs_inode_t* node)
 {
     if (node->device)
     {
+        kfree(((fat32_inode_data_t*)node->device)->extents);
         kfree(node->device);
         node->device = nullptr;
     }
@@ -744,6 +1183,35 @@ end:
     return dirent;
 }
 
+// Builds a node for the directory entry found at offset dir_offset of cluster dir_cluster
+static vfs_inode_t* fat32_vfs_node(fat32_fs_t* fs, const fat32_directory_entry_t* entry, uint32_t dir_cluster,
+                                   uint32_t dir_offset)
+{
+    vfs_inode_t* new_node = kmalloc(sizeof(vfs_inode_t));
+    memset(new_node, 0, sizeof(vfs_inode_t));
+
+    new_node->inode = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
+    if (new_node->inode == 0)
+        new_node->inode = fs->root_cluster;
+
+    new_node->size = entry->file_size;
+    new_node->flags = (entry->attr & ATTR_DIRECTORY) ? VFS_DIRECTORY : VFS_FILE;
+
+    fat32_inode_data_t* new_data = kzalloc(sizeof(fat32_inode_data_t));
+    sleeplock_init(&new_data->extent_lock, "fat32 extents");
+    new_data->fs = fs;
+    new_data->dir_cluster = dir_cluster;
+    new_data->dir_offset = dir_offset;
+    new_data->crt_time = fat32_datetime_to_unix(entry->crt_date, entry->crt_time);
+    new_data->mod_time = fat32_datetime_to_unix(entry->wrt_date, entry->wrt_time);
+    new_data->acc_time = fat32_datetime_to_unix(entry->lst_acc_date, 0);
+    new_node->device = new_data;
+
+    new_node->iops = &fat32_iops;
+
+    return new_node;
+}
+
 static vfs_inode_t* fat32_vfs_finddir(const vfs_inode_t* node, const char* name)
 {
     fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
@@ -756,28 +1224,33 @@ static vfs_inode_t* fat32_vfs_finddir(const vfs_inode_t* node, const char* name)
     if (fat32_find_entry(fs, dir_cluster, name, &entry, &found_cluster, &found_offset) != 0)
         return nullptr;
 
-    vfs_inode_t* new_node = kmalloc(sizeof(vfs_inode_t));
-    memset(new_node, 0, sizeof(vfs_inode_t));
-
-    new_node->inode = (entry.fst_clus_hi << 16) | entry.fst_clus_lo;
-    if (new_node->inode == 0)
-        new_node->inode = fs->root_cluster;
+    return fat32_vfs_node(fs, &entry, found_cluster, found_offset);
+}
 
-    new_node->size = entry.file_size;
-    new_node->flags = (entry.attr & ATTR_DIRECTORY) ? VFS_DIRECTORY : VFS_FILE;
+// The dentry cache key is the location of the directory entry, so a cached lookup
+// reads that entry back instead of scanning the directory.
+static vfs_inode_t* fat32_vfs_iget(const vfs_inode_t* node, const char* name, const vfs_cache_key_t* key)
+{
+    fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
+    fat32_fs_t* fs = data->fs;
+    uint32_t dir_cluster = (uint32_t)(key->id >> 32);
+    uint32_t dir_offset = (uint32_t)key->id;
+    if (dir_cluster < 2 || dir_offset >= fs->bytes_per_cluster)
+        return nullptr;
 
-    fat32_inode_data_t* new_data = kmalloc(sizeof(fat32_inode_data_t));
-    new_data->fs = fs;
-    new_data->dir_cluster = found_cluster;
-    new_data->dir_offset = found_offset;
-    new_data->crt_time = fat32_datetime_to_unix(entry.crt_date, entry.crt_time);
-    new_data->mod_time = fat32_datetime_to_unix(entry.wrt_date, entry.wrt_time);
-    new_data->acc_time = fat32_datetime_to_unix(entry.lst_acc_date, 0);
-    new_node->device = new_data;
+    uint8_t* cluster_buf = kmalloc(fs->bytes_per_cluster);
+    if (!cluster_buf)
+        return nullptr;
+    defer(cleanup_kfree, &cluster_buf);
+    if (fat32_read_cluster(fs, dir_cluster, cluster_buf) != 0)
+        return nullptr;
 
-    new_node->iops = &fat32_iops;
+    const fat32_directory_entry_t* entry = (fat32_directory_entry_t*)(cluster_buf + dir_offset);
+    if (entry->name[0] == FAT32_DIRENT_FREE || entry->name[0] == FAT32_DIRENT_DELETED ||
+        (entry->attr & ATTR_LONG_NAME) || fat_name_cmp(name, (const char*)entry->name) != 0)
+        return nullptr;
 
-    return new_node;
+    return fat32_vfs_node(fs, entry, dir_cluster, dir_offset);
 }
 
 static int fat32_vfs_mknod(const vfs_inode_t* node, const char* name, int mode, [[maybe_unused]] int dev)
@@ -798,10 +1271,9 @@ static int fat32_vfs_mknod(const vfs_inode_t* node, const char* name, int mode,
 
     if (mode == VFS_DIRECTORY)
     {
-        uint32_t cluster = fat32_find_free_cluster(fs);
+        uint32_t cluster = fat32_alloc_cluster(fs, 0);
         if (cluster == 0)
             return -1;
-        fat32_write_fat_entry(fs, cluster, FAT32_EOC_MARK); // EOC
 
         uint8_t* cluster_buf = kmalloc(fs->bytes_per_cluster);
         if (!cluster_buf)
@@ -828,14 +1300,17 @@ static int fat32_vfs_mknod(const vfs_inode_t* node, const char* name, int mode,
 
         fat32_write_cluster(fs, cluster, cluster_buf);
 
-        return fat32_add_entry(fs, node->inode, name, ATTR_DIRECTORY, cluster, 0);
+        int rc = fat32_add_entry(fs, node->inode, name, ATTR_DIRECTORY, cluster, 0);
+
+        fat32_flush_fat(fs);
+
+        return rc;
     }
 
     // Regular file
-    uint32_t cluster = fat32_find_free_cluster(fs);
+    uint32_t cluster = fat32_alloc_cluster(fs, 0);
     if (cluster == 0)
         return -1;
-    fat32_write_fat_entry(fs, cluster, FAT32_EOC_MARK); // EOC
 
     uint8_t* cluster_buf = kmalloc(fs->bytes_per_cluster);
     if (!cluster_buf)
@@ -843,7 +1318,11 @@ static int fat32_vfs_mknod(const vfs_inode_t* node, const char* name, int mode,
     memset(cluster_buf, 0, fs->bytes_per_cluster);
     fat32_write_cluster(fs, cluster, cluster_buf);
 
-    return fat32_add_entry(fs, node->inode, name, ATTR_ARCHIVE, cluster, 0);
+    int rc = fat32_add_entry(fs, node->inode, name, ATTR_ARCHIVE, cluster, 0);
+
+    fat32_flush_fat(fs);
+
+    return rc;
 }
 
 static vfs_inode_t* fat32_vfs_clone(const vfs_inode_t* node)
@@ -854,6 +1333,11 @@ static vfs_inode_t* fat32_vfs_clone(const vfs_inode_t* node)
     fat32_inode_data_t* old_data = (fat32_inode_data_t*)node->device;
     fat32_inode_data_t* new_data = kmalloc(sizeof(fat32_inode_data_t));
     memcpy(new_data, old_data, sizeof(fat32_inode_data_t));
+    // The clone builds its own extents
+    sleeplock_init(&new_data->extent_lock, "fat32 extents");
+    new_data->extents = nullptr;
+    new_data->extent_capacity = 0;
+    fat32_extents_reset(new_data, 0);
     new_node->device = new_data;
 
     return new_node;
@@ -884,10 +1368,15 @@ static int fat32_vfs_unlink(vfs_inode_t* parent, const char* name)
     if (fat32_unlink_entry(fs, parent->inode, name) != 0)
         return -1;
 
+    vfs_cache_key_t key;
+    fat32_cache_key(fs, dir_cluster_num, dir_offset, &key);
+    page_cache_invalidate(&key);
+
     // Free data clusters if any.
     uint32_t cluster = (entry.fst_clus_hi << 16) | entry.fst_clus_lo;
     if (cluster != 0)
         fat32_free_chain(fs, cluster);
+    fat32_flush_fat(fs);
 
     return 0;
 }
@@ -910,10 +1399,9 @@ static int fat32_vfs_truncate(vfs_inode_t* node)
     fat32_free_chain(fs, cluster);
 
     // Allocate a fresh cluster for the truncated file.
-    uint32_t new_cluster = fat32_find_free_cluster(fs);
+    uint32_t new_cluster = fat32_alloc_cluster(fs, 0);
     if (new_cluster == 0)
         return -1;
-    fat32_write_fat_entry(fs, new_cluster, FAT32_EOC_MARK);
 
     // Clear the new cluster.
     uint8_t* zero = kmalloc(fs->bytes_per_cluster);
@@ -926,6 +1414,9 @@ static int fat32_vfs_truncate(vfs_inode_t* node)
 
     node->inode = new_cluster;
     node->size = 0;
+    sleeplock_acquire(&data->extent_lock);
+    fat32_extents_reset(data, new_cluster);
+    sleeplock_release(&data->extent_lock);
 
     // Update directory entry with new cluster and size.
     if (data && data->dir_cluster != 0)
@@ -948,6 +1439,7 @@ static int fat32_vfs_truncate(vfs_inode_t* node)
             }
         }
     }
+    fat32_flush_fat(fs);
 
     return 0;
 }
@@ -978,18 +1470,34 @@ static int fat32_vfs_stat(const vfs_inode_t* node, struct stat* st)
     return 0;
 }
 
+static int fat32_vfs_cache_key(const vfs_inode_t* node, vfs_cache_key_t* key)
+{
+    const fat32_inode_data_t* data = (fat32_inode_data_t*)node->device;
+    if (!data)
+        return -1;
+    // Only the root directory has no entry of its own; it is named by id 0
+    if (data->dir_cluster == 0 && (!(node->flags & VFS_DIRECTORY) || node->inode != data->fs->root_cluster))
+        return -1;
+    fat32_cache_key(data->fs, data->dir_cluster, data->dir_offset, key);
+    return 0;
+}
+
 static struct inode_operations fat32_iops = {
     .read = fat32_vfs_read,
+    .readahead = fat32_vfs_readahead,
     .write = fat32_vfs_write,
     .truncate = fat32_vfs_truncate,
     .open = fat32_vfs_open,
     .close = fat32_vfs_close,
     .readdir = fat32_vfs_readdir,
     .finddir = fat32_vfs_finddir,
+    .iget = fat32_vfs_iget,
     .clone = fat32_vfs_clone,
     .mknod = fat32_vfs_mknod,
     .unlink = fat32_vfs_unlink,
     .stat = fat32_vfs_stat,
+    .mmap = vfs_generic_file_mmap,
+    .cache_key = fat32_vfs_cache_key,
 };
 
 vfs_inode_t* fat32_mount(uint8_t drive_index, uint32_t partition_lba)
@@ -1006,7 +1514,8 @@ vfs_inode_t* fat32_mount(uint8_t drive_index, uint32_t partition_lba)
     root->flags = VFS_DIRECTORY;
     root->inode = fs->root_cluster;
 
-    fat32_inode_data_t* data = kmalloc(sizeof(fat32_inode_data_t));
+    fat32_inode_data_t* data = kzalloc(sizeof(fat32_inode_data_t));
+    sleeplock_init(&data->extent_lock, "fat32 extents");
     data->fs = fs;
     data->dir_cluster = 0;
     data->dir_offset = 0;
@@ -1029,16 +1538,16 @@ int fat32_read_file(fat32_fs_t* fs, const char* filename, uint8_t* buffer, uint3
     vfs_inode_t temp_node;
     memset(&temp_node, 0, sizeof(vfs_inode_t));
 
-    fat32_inode_data_t data;
+    fat32_inode_data_t data = {0};
+    sleeplock_init(&data.extent_lock, "fat32 extents");
     data.fs = fs;
-    data.dir_cluster = 0;
-    data.dir_offset = 0;
     temp_node.device = &data;
 
     temp_node.inode = info.first_cluster;
     temp_node.size = info.size;
 
     uint64_t read = fat32_vfs_read(&temp_node, 0, buffer_size, buffer);
+    kfree(data.extents);
     if (read == 0 && info.size > 0 && buffer_size > 0)
         return 6;
 
@@ -1126,13 +1635,10 @@ static int fat32_add_entry(fat32_fs_t* fs, uint32_t dir_cluster, const char* nam
         if (next_cluster >= FAT32_EOC)
         {
             // End of chain, allocate new cluster for directory
-            uint32_t new_cluster = fat32_find_free_cluster(fs);
+            uint32_t new_cluster = fat32_alloc_cluster(fs, current_cluster);
             if (new_cluster == 0)
                 break;
 
-            fat32_write_fat_entry(fs, current_cluster, new_cluster);
-            fat32_write_fat_entry(fs, new_cluster, FAT32_EOC_MARK);
-
             // Clear new cluster
             memset(cluster_buf, 0, fs->bytes_per_cluster);
             fat32_write_cluster(fs, new_cluster, cluster_buf);
@@ -1162,10 +1668,9 @@ int fat32_create_file(fat32_fs_t* fs, const char* path)
         return 1; // Exists
 
     // Allocate first cluster for file
-    uint32_t cluster = fat32_find_free_cluster(fs);
+    uint32_t cluster = fat32_alloc_cluster(fs, 0);
     if (cluster == 0)
         return 1;
-    fat32_write_fat_entry(fs, cluster, FAT32_EOC_MARK); // EOC
 
     // Clear the new file cluster
     uint8_t* cluster_buf = kmalloc(fs->bytes_per_cluster);
@@ -1176,7 +1681,9 @@ int fat32_create_file(fat32_fs_t* fs, const char* path)
     fat32_write_cluster(fs, cluster, cluster_buf);
 
     // Add entry to parent
-    return fat32_add_entry(fs, parent_cluster, filename, ATTR_ARCHIVE, cluster, 0);
+    int rc = fat32_add_entry(fs, parent_cluster, filename, ATTR_ARCHIVE, cluster, 0);
+    fat32_flush_fat(fs);
+    return rc;
 }
 
 int fat32_create_dir(fat32_fs_t* fs, const char* path)
@@ -1192,10 +1699,9 @@ int fat32_create_dir(fat32_fs_t* fs, const char* path)
         return 1; // Exists
 
     // Allocate cluster for new dir
-    uint32_t cluster = fat32_find_free_cluster(fs);
+    uint32_t cluster = fat32_alloc_cluster(fs, 0);
     if (cluster == 0)
         return 1;
-    fat32_write_fat_entry(fs, cluster, FAT32_EOC_MARK); // EOC
 
     // Initialize new directory with . and ..
     uint8_t* cluster_buf = kmalloc(fs->bytes_per_cluster);
@@ -1228,7 +1734,9 @@ int fat32_create_dir(fat32_fs_t* fs, const char* path)
     fat32_write_cluster(fs, cluster, cluster_buf);
 
     // Add entry to parent
-    return fat32_add_entry(fs, parent_cluster, dirname, ATTR_DIRECTORY, cluster, 0);
+    int rc = fat32_add_entry(fs, parent_cluster, dirname, ATTR_DIRECTORY, cluster, 0);
+    fat32_flush_fat(fs);
+    return rc;
 }
 
 int fat32_write_file(fat32_fs_t* fs, const char* path, uint8_t* buffer, uint32_t size)
@@ -1274,12 +1782,9 @@ int fat32_write_file(fat32_fs_t* fs, const char* path, uint8_t* buffer, uint32_t
             if (next >= FAT32_EOC)
             {
                 // Allocate new
-                uint32_t new_cluster = fat32_find_free_cluster(fs);
+                uint32_t new_cluster = fat32_alloc_cluster(fs, current_cluster);
                 if (new_cluster == 0)
                     return 1;
-
-                fat32_write_fat_entry(fs, current_cluster, new_cluster);
-                fat32_write_fat_entry(fs, new_cluster, FAT32_EOC_MARK);
                 current_cluster = new_cluster;
             }
             else
@@ -1301,6 +1806,11 @@ int fat32_write_file(fat32_fs_t* fs, const char* path, uint8_t* buffer, uint32_t
 
     if (fat32_find_entry(fs, parent_cluster, filename, &entry, &dir_cluster_num, &dir_offset) == 0)
     {
+        // This path bypasses the VFS, so forget whatever the page cache holds
+        vfs_cache_key_t key;
+        fat32_cache_key(fs, dir_cluster_num, dir_offset, &key);
+        page_cache_invalidate(&key);
+
         // Found it, update size
         uint8_t* cluster_buf = kmalloc(fs->bytes_per_cluster);
         if (!cluster_buf)
@@ -1318,6 +1828,7 @@ int fat32_write_file(fat32_fs_t* fs, const char* path, uint8_t* buffer, uint32_t
             }
         }
     }
+    fat32_flush_fat(fs);
 
     return 0;
 }
@@ -1345,6 +1856,10 @@ int fat32_delete_file(fat32_fs_t* fs, const char* path)
         if (fat32_unlink_entry(fs, parent_cluster, filename) != 0)
             return 1;
 
+        vfs_cache_key_t key;
+        fat32_cache_key(fs, dir_cluster_num, dir_offset, &key);
+        page_cache_invalidate(&key);
+
         // Free chain
         while (cluster < FAT32_EOC && cluster != 0)
         {
@@ -1370,6 +1885,7 @@ int fat32_delete_file(fat32_fs_t* fs, const char* path)
         }
         if (freed == 0 && cluster == 0)
             printk("fat32_delete_file: freed 0 clusters for %s\n", filename);
+        fat32_flush_fat(fs);
         return 0;
     }
     return 1; // Not found
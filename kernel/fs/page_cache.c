@@ -0,0 +1,327 @@
+#include "page_cache.h"
+#include "heap.h"
+#include "list.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "string.h"
+#include "terminal.h"
+#include "util.h"
+#include "vmm.h"
+
+typedef struct page_cache_page
+{
+    list_head_t hash; // Bucket chain
+    list_head_t lru;  // Clock order, the hand starts at the head
+    vfs_cache_key_t key;
+    uint64_t index; // File offset / PAGE_SIZE
+    void *phys;
+    uint32_t valid;  // Bytes read from the file, the rest of the frame is zero
+    bool referenced; // Hit since the clock hand last passed
+} page_cache_page_t;
+
+static list_head_t *buckets;
+static size_t bucket_mask;
+static LIST_HEAD(clock_list);
+static spinlock_t cache_lock;
+static bool cache_ready = false;
+
+static size_t max_pages;
+static size_t min_free;
+static uint64_t generation; // Bumped by every update so fills that raced a write are not kept
+static page_cache_stats_t stats;
+
+void page_cache_init(void)
+{
+    spinlock_init(&cache_lock);
+
+    size_t free = pmm_free_page_count();
+    max_pages = max(free / PAGE_CACHE_FRACTION, (size_t)PAGE_CACHE_MIN_PAGES);
+    min_free = free / PAGE_CACHE_RESERVE;
+
+    size_t nbuckets = 64;
+    while (nbuckets < max_pages / 4)
+        nbuckets <<= 1;
+    buckets = kmalloc(nbuckets * sizeof(list_head_t));
+    if (!buckets)
+    {
+        boot_message(ERROR, "Page cache: failed to allocate %d buckets", nbuckets);
+        return;
+    }
+    for (size_t i = 0; i < nbuckets; i++)
+        INIT_LIST_HEAD(&buckets[i]);
+    bucket_mask = nbuckets - 1;
+
+    cache_ready = true;
+    boot_message(INFO, "Page cache initialized. Limit: %d pages, %d buckets", max_pages, nbuckets);
+}
+
+static inline uint8_t *page_data(void *phys)
+{
+    return (uint8_t *)((uint64_t)phys + g_hhdm_offset);
+}
+
+static size_t hash_key(const vfs_cache_key_t *key, uint64_t index)
+{
+    uint64_t h = key->volume ^ (key->id * 0x9E3779B97F4A7C15ull) ^ (index * 0xC2B2AE3D27D4EB4Full);
+    h ^= h >> 29;
+    return h & bucket_mask;
+}
+
+// Called with cache_lock held
+static page_cache_page_t *lookup(const vfs_cache_key_t *key, uint64_t index)
+{
+    page_cache_page_t *page;
+    list_for_each_entry(page, &buckets[hash_key(key, index)], hash)
+    {
+        if (page->index == index && page->key.id == key->id && page->key.volume == key->volume)
+            return page;
+    }
+    return nullptr;
+}
+
+// Called with cache_lock held. Frames still mapped or being copied only lose the cache's reference.
+static void remove_page(page_cache_page_t *page)
+{
+    list_del(&page->hash);
+    list_del(&page->lru);
+    stats.pages--;
+    pmm_free_page(page->phys);
+    kfree(page);
+}
+
+// Called with cache_lock held. Referenced and mapped pages get a second lap.
+static bool evict_one(void)
+{
+    for (size_t scanned = 0; scanned < 2 * stats.pages; scanned++)
+    {
+        page_cache_page_t *page = list_first_entry(&clock_list, page_cache_page_t, lru);
+        if (page->referenced || pmm_page_refcount(page->phys) > 1)
+        {
+            page->referenced = false;
+            list_del(&page->lru);
+            list_add_tail(&page->lru, &clock_list);
+            continue;
+        }
+        remove_page(page);
+        stats.evictions++;
+        return true;
+    }
+    return false;
+}
+
+// Called with cache_lock held
+static bool make_room(void)
+{
+    while (stats.pages >= max_pages || pmm_free_page_count() < min_free)
+    {
+        if (!evict_one())
+            return false;
+    }
+    return true;
+}
+
+// Returns the frame caching page index with a reference for the caller (released with
+// pmm_free_page), reading it from the file on a miss. *valid is set to the bytes of the
+// page that belong to the file. A cached page that ends short of what the caller needs is
+// re-read unless this handle agrees the file ends there.
+static void *page_cache_get(vfs_inode_t *node, const vfs_cache_key_t *key, uint64_t index, uint32_t need,
+                            uint32_t *valid)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(cache_lock, flags);
+    page_cache_page_t *page = lookup(key, index);
+    if (page && (page->valid >= need || index * PAGE_SIZE + page->valid >= node->size))
+    {
+        page->referenced = true;
+        stats.hits++;
+        pmm_page_get(page->phys);
+        *valid = page->valid;
+        void *phys = page->phys;
+        SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+        return phys;
+    }
+    stats.misses++;
+    uint64_t gen = generation;
+    SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+
+    void *phys = pmm_alloc_page();
+    if (!phys)
+        return nullptr;
+    uint8_t *data = page_data(phys);
+    uint64_t n = node->iops->read(node, index * PAGE_SIZE, PAGE_SIZE, data);
+    if (n > PAGE_SIZE)
+        n = 0;
+    memset(data + n, 0, PAGE_SIZE - n);
+    *valid = (uint32_t)n;
+
+    // Nothing to keep past the end of the file
+    if (n == 0)
+        return phys;
+
+    page_cache_page_t *entry = kmalloc(sizeof(page_cache_page_t));
+    if (!entry)
+        return phys;
+
+    SPIN_LOCK_IRQSAVE(cache_lock, flags);
+    page = lookup(key, index);
+    if (gen != generation || (page && page->valid >= n) || (!page && !make_room()))
+    {
+        SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+        kfree(entry);
+        return phys;
+    }
+    if (page)
+        remove_page(page);
+
+    entry->key = *key;
+    entry->index = index;
+    entry->phys = phys;
+    entry->valid = (uint32_t)n;
+    entry->referenced = false;
+    list_add(&entry->hash, &buckets[hash_key(key, index)]);
+    list_add_tail(&entry->lru, &clock_list);
+    stats.pages++;
+    pmm_page_get(phys);
+    SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+    return phys;
+}
+
+uint64_t page_cache_read(vfs_inode_t *node, const vfs_cache_key_t *key, uint64_t offset, uint64_t size,
+                         uint8_t *buffer)
+{
+    if (!cache_ready)
+        return node->iops->read(node, offset, size, buffer);
+
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint64_t pos = offset + done;
+        uint32_t in_page = pos % PAGE_SIZE;
+        uint32_t chunk = (uint32_t)min((uint64_t)(PAGE_SIZE - in_page), size - done);
+
+        uint32_t valid;
+        void *phys = page_cache_get(node, key, pos / PAGE_SIZE, in_page + chunk, &valid);
+        if (!phys)
+            return done + node->iops->read(node, pos, size - done, buffer + done);
+
+        // The destination may be a user page that faults in, so copy outside the lock
+        uint32_t n = valid > in_page ? min(chunk, valid - in_page) : 0;
+        memcpy(buffer + done, page_data(phys) + in_page, n);
+        pmm_free_page(phys);
+
+        done += n;
+        if (n < chunk)
+            break;
+    }
+    return done;
+}
+
+bool page_cache_contains(const vfs_cache_key_t *key, uint64_t index)
+{
+    if (!cache_ready)
+        return false;
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(cache_lock, flags);
+    bool found = lookup(key, index) != nullptr;
+    SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+    return found;
+}
+
+void page_cache_update(const vfs_cache_key_t *key, uint64_t offset, uint64_t size, const uint8_t *buffer)
+{
+    if (!cache_ready)
+        return;
+
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint64_t pos = offset + done;
+        uint64_t index = pos / PAGE_SIZE;
+        uint32_t in_page = pos % PAGE_SIZE;
+        uint32_t chunk = (uint32_t)min((uint64_t)(PAGE_SIZE - in_page), size - done);
+        done += chunk;
+
+        uint64_t flags;
+        SPIN_LOCK_IRQSAVE(cache_lock, flags);
+        generation++;
+        page_cache_page_t *page = lookup(key, index);
+        if (!page)
+        {
+            SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+            continue;
+        }
+        // A write past the cached bytes leaves a gap we know nothing about
+        if (in_page > page->valid)
+        {
+            remove_page(page);
+            SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+            continue;
+        }
+        void *phys = page->phys;
+        pmm_page_get(phys);
+        if (in_page + chunk > page->valid)
+            page->valid = in_page + chunk;
+        SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+
+        // Shared mappings write back straight from the cached frame
+        uint8_t *dst = page_data(phys) + in_page;
+        const uint8_t *src = buffer + (pos - offset);
+        if (dst != src)
+            memcpy(dst, src, chunk);
+        pmm_free_page(phys);
+    }
+}
+
+void page_cache_invalidate(const vfs_cache_key_t *key)
+{
+    if (!cache_ready)
+        return;
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(cache_lock, flags);
+    generation++;
+    page_cache_page_t *page;
+    page_cache_page_t *tmp;
+    list_for_each_entry_safe(page, tmp, &clock_list, lru)
+    {
+        if (page->key.id == key->id && page->key.volume == key->volume)
+            remove_page(page);
+    }
+    SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+}
+
+static void *page_cache_map_page(vfs_inode_t *node, uint64_t index, bool partial)
+{
+    vfs_cache_key_t key;
+    if (!cache_ready || !node->iops || !node->iops->cache_key || node->iops->cache_key(node, &key) != 0)
+        return nullptr;
+
+    uint32_t valid;
+    void *phys = page_cache_get(node, &key, index, PAGE_SIZE, &valid);
+    if (phys && (valid == 0 || (!partial && valid < PAGE_SIZE)))
+    {
+        pmm_free_page(phys);
+        return nullptr;
+    }
+    return phys;
+}
+
+void *page_cache_map(vfs_inode_t *node, uint64_t index)
+{
+    return page_cache_map_page(node, index, false);
+}
+
+void *page_cache_map_shared(vfs_inode_t *node, uint64_t index)
+{
+    return page_cache_map_page(node, index, true);
+}
+
+void page_cache_get_stats(page_cache_stats_t *out)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(cache_lock, flags);
+    *out = stats;
+    out->max_pages = max_pages;
+    SPIN_UNLOCK_IRQRESTORE(cache_lock, flags);
+}
@@ -10,12 +10,16 @@
 #include "heap.h"
 #include "string.h"
 #include "process.h"
+#include "ioctl.h"
+#include "pmm.h"
+#include "util.h"
 
 // Pipe inode operations
 static uint64_t pipe_inode_read(const vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer);
 // NOLINTNEXTLINE(readability-non-const-parameter) - Must match inode_operations signature
 static uint64_t pipe_inode_write(vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer);
 static void pipe_inode_close(vfs_inode_t *node);
+static int pipe_inode_ioctl(vfs_inode_t *node, int request, void *arg);
 
 static struct inode_operations pipe_read_ops = {
     .read = pipe_inode_read,
@@ -23,7 +27,7 @@ static struct inode_operations pipe_read_ops = {
     .truncate = nullptr,
     .open = nullptr,
     .close = pipe_inode_close,
-    .ioctl = nullptr,
+    .ioctl = pipe_inode_ioctl,
     .readdir = nullptr,
     .finddir = nullptr,
     .clone = nullptr,
@@ -38,7 +42,7 @@ static struct inode_operations pipe_write_ops = {
     .truncate = nullptr,
     .open = nullptr,
     .close = pipe_inode_close,
-    .ioctl = nullptr,
+    .ioctl = pipe_inode_ioctl,
     .readdir = nullptr,
     .finddir = nullptr,
     .clone = nullptr,
@@ -59,6 +63,13 @@ int pipe_alloc(vfs_inode_t **read_inode, vfs_inode_t **write_inode)
 
     memset(p, 0, sizeof(pipe_t));
     spinlock_init(&p->lock);
+    p->buffer = kmalloc(PIPE_BUF_SIZE);
+    if (!p->buffer)
+    {
+        kfree(p);
+        return -1;
+    }
+    p->capacity = PIPE_BUF_SIZE;
     p->read_pos = 0;
     p->write_pos = 0;
     p->count = 0;
@@ -69,6 +80,7 @@ int pipe_alloc(vfs_inode_t **read_inode, vfs_inode_t **write_inode)
     vfs_inode_t *ri = kmalloc(sizeof(vfs_inode_t));
     if (!ri)
     {
+        kfree(p->buffer);
         kfree(p);
         return -1;
     }
@@ -78,6 +90,7 @@ int pipe_alloc(vfs_inode_t **read_inode, vfs_inode_t **write_inode)
     if (!wi)
     {
         kfree(ri);
+        kfree(p->buffer);
         kfree(p);
         return -1;
     }
@@ -107,6 +120,59 @@ int pipe_alloc(vfs_inode_t **read_inode, vfs_inode_t **write_inode)
     return 0;
 }
 
+int pipe_set_capacity(pipe_t *p, uint32_t capacity)
+{
+    if (!p || capacity > PIPE_MAX_SIZE)
+        return -1;
+    capacity = capacity ? (capacity + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1) : PAGE_SIZE;
+
+    uint8_t *buffer = kmalloc(capacity);
+    if (!buffer)
+        return -1;
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(p->lock, flags);
+    if (p->count > capacity)
+    {
+        SPIN_UNLOCK_IRQRESTORE(p->lock, flags);
+        kfree(buffer);
+        return -1;
+    }
+
+    // Unwrap the data to the start of the new ring
+    const uint32_t first = min(p->count, p->capacity - p->read_pos);
+    memcpy(buffer, p->buffer + p->read_pos, first);
+    memcpy(buffer + first, p->buffer, p->count - first);
+    uint8_t *old = p->buffer;
+    p->buffer = buffer;
+    p->capacity = capacity;
+    p->read_pos = 0;
+    p->write_pos = p->count % capacity;
+    if (p->writers_waiting > 0)
+        thread_wakeup(&p->writers_waiting);
+    SPIN_UNLOCK_IRQRESTORE(p->lock, flags);
+
+    kfree(old);
+    return 0;
+}
+
+// Waits on the given queue of the pipe, called and returning with the lock held. Callers
+// that cannot sleep yield instead, and have to check again whatever they wait for.
+static void pipe_wait(pipe_t *p, int *queue, uint64_t *flags)
+{
+    if ((*flags & RFLAGS_IF) && get_current_thread() != nullptr)
+    {
+        (*queue)++;
+        thread_sleep(queue, &p->lock);
+        (*queue)--;
+        return;
+    }
+
+    SPIN_UNLOCK_IRQRESTORE(p->lock, *flags);
+    schedule();
+    SPIN_LOCK_IRQSAVE(p->lock, *flags);
+}
+
 static uint64_t pipe_inode_read(const vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
 {
     (void)offset; // Pipes ignore offset
@@ -120,25 +186,26 @@ static uint64_t pipe_inode_read(const vfs_inode_t *node, uint64_t offset, uint64
 
     uint64_t bytes_read = 0;
 
-    spinlock_acquire(&p->lock);
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(p->lock, flags);
 
     // Wait for data or closed write end
     while (p->count == 0 && p->write_open > 0)
-    {
-        spinlock_release(&p->lock);
-        schedule(); // Yield to let writer run
-        spinlock_acquire(&p->lock);
-    }
+        pipe_wait(p, &p->readers_waiting, &flags);
 
-    // Read available data
+    // Read available data, in at most two pieces when it wraps around the ring
     while (bytes_read < size && p->count > 0)
     {
-        buffer[bytes_read++] = p->buffer[p->read_pos];
-        p->read_pos = (p->read_pos + 1) % PIPE_BUF_SIZE;
-        p->count--;
+        const uint32_t chunk = (uint32_t)min(size - bytes_read, (uint64_t)min(p->count, p->capacity - p->read_pos));
+        memcpy(buffer + bytes_read, p->buffer + p->read_pos, chunk);
+        bytes_read += chunk;
+        p->read_pos = (p->read_pos + chunk) % p->capacity;
+        p->count -= chunk;
     }
 
-    spinlock_release(&p->lock);
+    if (bytes_read > 0 && p->writers_waiting > 0)
+        thread_wakeup(&p->writers_waiting);
+    SPIN_UNLOCK_IRQRESTORE(p->lock, flags);
     return bytes_read;
 }
 
@@ -156,12 +223,13 @@ static uint64_t pipe_inode_write(vfs_inode_t *node, uint64_t offset, uint64_t si
 
     uint64_t bytes_written = 0;
 
-    spinlock_acquire(&p->lock);
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(p->lock, flags);
 
     // Check if read end is closed
     if (p->read_open == 0)
     {
-        spinlock_release(&p->lock);
+        SPIN_UNLOCK_IRQRESTORE(p->lock, flags);
         return 0; // Broken pipe
     }
 
@@ -169,30 +237,51 @@ static uint64_t pipe_inode_write(vfs_inode_t *node, uint64_t offset, uint64_t si
     while (bytes_written < size)
     {
         // Wait for space in buffer
-        while (p->count >= PIPE_BUF_SIZE && p->read_open > 0)
-        {
-            spinlock_release(&p->lock);
-            schedule(); // Yield to let reader run
-            spinlock_acquire(&p->lock);
-        }
+        while (p->count >= p->capacity && p->read_open > 0)
+            pipe_wait(p, &p->writers_waiting, &flags);
 
         // Check again if read end closed while waiting
         if (p->read_open == 0)
             break;
 
-        // Write as much as possible
-        while (bytes_written < size && p->count < PIPE_BUF_SIZE)
+        // Write as much as fits, in at most two pieces when it wraps around the ring
+        while (bytes_written < size && p->count < p->capacity)
         {
-            p->buffer[p->write_pos] = buffer[bytes_written++];
-            p->write_pos = (p->write_pos + 1) % PIPE_BUF_SIZE;
-            p->count++;
+            const uint32_t chunk =
+                (uint32_t)min(size - bytes_written, (uint64_t)min(p->capacity - p->count, p->capacity - p->write_pos));
+            memcpy(p->buffer + p->write_pos, buffer + bytes_written, chunk);
+            bytes_written += chunk;
+            p->write_pos = (p->write_pos + chunk) % p->capacity;
+            p->count += chunk;
         }
+
+        // Readers take this part before the writer waits for room for the rest
+        if (p->readers_waiting > 0)
+            thread_wakeup(&p->readers_waiting);
     }
 
-    spinlock_release(&p->lock);
+    SPIN_UNLOCK_IRQRESTORE(p->lock, flags);
     return bytes_written;
 }
 
+static int pipe_inode_ioctl(vfs_inode_t *node, int request, void *arg)
+{
+    pipe_t *p = node ? (pipe_t *)node->device : nullptr;
+    if (!p || !arg)
+        return -1;
+
+    switch (request)
+    {
+    case PIPE_IOCTL_GET_SIZE:
+        *(uint32_t *)arg = p->capacity;
+        return 0;
+    case PIPE_IOCTL_SET_SIZE:
+        return pipe_set_capacity(p, *(uint32_t *)arg);
+    default:
+        return -1;
+    }
+}
+
 static void pipe_inode_close(vfs_inode_t *node)
 {
     if (!node)
@@ -202,7 +291,8 @@ static void pipe_inode_close(vfs_inode_t *node)
     if (!p)
         return;
 
-    spinlock_acquire(&p->lock);
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(p->lock, flags);
 
     // Determine if this is read or write end based on iops
     if (node->iops == &pipe_read_ops)
@@ -214,13 +304,20 @@ static void pipe_inode_close(vfs_inode_t *node)
         p->write_open--;
     }
 
+    // Whoever waits on the other end sees end of file or a broken pipe
+    if (p->readers_waiting > 0)
+        thread_wakeup(&p->readers_waiting);
+    if (p->writers_waiting > 0)
+        thread_wakeup(&p->writers_waiting);
+
     // If both ends closed, free the pipe
     bool should_free = (p->read_open <= 0 && p->write_open <= 0);
 
-    spinlock_release(&p->lock);
+    SPIN_UNLOCK_IRQRESTORE(p->lock, flags);
 
     if (should_free)
     {
+        kfree(p->buffer);
         kfree(p);
     }
 }
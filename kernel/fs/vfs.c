@@ -7,6 +7,11 @@
 #include "gpt.h"
 #include <stdbool.h>
 #include "heap.h"
+#include "page_cache.h"
+#include "dcache.h"
+#include "util.h"
+#include "pmm.h"
+#include "vmm.h"
 
 vfs_inode_t *vfs_root = nullptr;
 
@@ -210,25 +215,156 @@ void vfs_mount_root(void)
     boot_log_flush();
 }
 
+// Regular files on filesystems that name their contents go through the page cache
+static bool vfs_cache_key(const vfs_inode_t *node, vfs_cache_key_t *key)
+{
+    return (node->flags & 0x07) == VFS_FILE && node->iops && node->iops->cache_key &&
+           node->iops->cache_key(node, key) == 0;
+}
+
+// Hands [offset, end) to the filesystem's readahead, minus the pages already cached at its start
+static void vfs_prefetch(vfs_inode_t *node, const vfs_cache_key_t *key, uint64_t offset, uint64_t end)
+{
+    while (offset < end && page_cache_contains(key, offset / PAGE_SIZE))
+        offset = (offset / PAGE_SIZE + 1) * PAGE_SIZE;
+    if (offset < end)
+        node->iops->readahead(node, offset, end - offset);
+}
+
 uint64_t vfs_read(vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
 {
-    if (node->iops && node->iops->read)
-        return node->iops->read(node, offset, size, buffer);
-    return 0;
+    if (!node->iops || !node->iops->read)
+        return 0;
+
+    vfs_cache_key_t key;
+    if (vfs_cache_key(node, &key))
+    {
+        // Large reads (the ELF loader, whole-file loads) fetch their range in big requests
+        if (size > PAGE_SIZE && node->iops->readahead)
+            vfs_prefetch(node, &key, offset, min(offset + size, node->size));
+        return page_cache_read(node, &key, offset, size, buffer);
+    }
+    return node->iops->read(node, offset, size, buffer);
+}
+
+void vfs_readahead(vfs_inode_t *node, vfs_readahead_t *ra, uint64_t offset, uint64_t size)
+{
+    uint64_t end = offset + size;
+    bool sequential = offset == ra->next;
+    ra->next = end;
+
+    vfs_cache_key_t key;
+    if (!node->iops || !node->iops->readahead || !vfs_cache_key(node, &key))
+        return;
+
+    // A seek drops the window; it is rebuilt once reads are sequential again
+    if (!sequential)
+    {
+        ra->window = 0;
+        ra->end = 0;
+        return;
+    }
+
+    // Refill when the reader gets within half a window of what was read ahead
+    if (ra->window > 0 && end + ra->window / 2 <= ra->end)
+        return;
+    ra->window = ra->window ? min(ra->window * 2, (uint32_t)VFS_READAHEAD_MAX) : VFS_READAHEAD_MIN;
+
+    uint64_t start = max(ra->end, end);
+    uint64_t stop = min(end + ra->window, node->size);
+    if (start >= stop)
+        return;
+    ra->end = stop;
+    vfs_prefetch(node, &key, start, stop);
 }
 
 uint64_t vfs_write(vfs_inode_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
 {
-    if (node->iops && node->iops->write)
-        return node->iops->write(node, offset, size, buffer);
-    return 0;
+    if (!node->iops || !node->iops->write)
+        return 0;
+
+    uint64_t written = node->iops->write(node, offset, size, buffer);
+    vfs_cache_key_t key;
+    if (written > 0 && vfs_cache_key(node, &key))
+        page_cache_update(&key, offset, written, buffer);
+    return written;
+}
+
+// Whole pages of a cached input are written straight from the page cache, everything else
+// goes through a kernel buffer of up to VFS_SPLICE_CHUNK bytes. Stops at the end of the
+// input, after a short write, and after the first read from a pipe so that data already
+// queued is not held back waiting for more.
+int64_t vfs_splice(vfs_inode_t *in, uint64_t *in_offset, vfs_readahead_t *ra, vfs_inode_t *out,
+                   uint64_t *out_offset, uint64_t count)
+{
+    if (in == out || !in->iops || !in->iops->read || !out->iops || !out->iops->write)
+        return 0;
+
+    vfs_cache_key_t key;
+    const bool cached = vfs_cache_key(in, &key);
+    const bool from_pipe = (in->flags & 0x07) == VFS_PIPE;
+    uint8_t *bounce = nullptr;
+    defer(cleanup_kfree, &bounce);
+
+    uint64_t moved = 0;
+    uint64_t got = 0;
+    while (moved < count)
+    {
+        const uint64_t pos = *in_offset;
+        if (ra)
+            vfs_readahead(in, ra, pos, min(count - moved, (uint64_t)VFS_SPLICE_CHUNK));
+
+        uint64_t want;
+        uint64_t written;
+        void *page = cached ? page_cache_map(in, pos / PAGE_SIZE) : nullptr;
+        if (page)
+        {
+            // The whole page lies inside the file
+            want = min(count - moved, PAGE_SIZE - pos % PAGE_SIZE);
+            got = want;
+            written = vfs_write(out, *out_offset, got, (uint8_t *)page + g_hhdm_offset + pos % PAGE_SIZE);
+            pmm_free_page(page);
+        }
+        else
+        {
+            if (!bounce && !(bounce = kmalloc(VFS_SPLICE_CHUNK)))
+                break;
+            want = min(count - moved, (uint64_t)VFS_SPLICE_CHUNK);
+            got = vfs_read(in, pos, want, bounce);
+            written = got ? vfs_write(out, *out_offset, got, bounce) : 0;
+            // What was read from a pipe cannot be put back, so it all has to go out
+            while (from_pipe && written < got)
+            {
+                const uint64_t n = vfs_write(out, *out_offset + written, got - written, bounce + written);
+                if (n == 0)
+                    break;
+                written += n;
+            }
+        }
+
+        *in_offset += written;
+        *out_offset += written;
+        moved += written;
+        if (got < want || written < got || from_pipe)
+            break;
+    }
+    // Pipe bytes the output refused are gone; the caller learns how many got through
+    if (from_pipe && moved == 0 && got > 0)
+        return -1;
+    return (int64_t)moved;
 }
 
 int vfs_truncate(vfs_inode_t *node)
 {
-    if (node->iops && node->iops->truncate)
-        return node->iops->truncate(node);
-    return -1;
+    if (!node->iops || !node->iops->truncate)
+        return -1;
+
+    vfs_cache_key_t key;
+    bool cached = vfs_cache_key(node, &key);
+    int rc = node->iops->truncate(node);
+    if (cached)
+        page_cache_invalidate(&key);
+    return rc;
 }
 
 int vfs_ioctl(vfs_inode_t *node, int request, void *arg)
@@ -250,6 +386,23 @@ void vfs_close(vfs_inode_t *node)
         node->iops->close(node);
 }
 
+vfs_inode_t *vfs_clone(const vfs_inode_t *node)
+{
+    if (node->iops && node->iops->clone)
+        return node->iops->clone(node);
+    return nullptr;
+}
+
+// mmap hook for regular files: pages are read through iops->read when first touched.
+int vfs_generic_file_mmap(vfs_inode_t *node, [[maybe_unused]] uint64_t offset, [[maybe_unused]] uint64_t *length,
+                          uint64_t *phys)
+{
+    if ((node->flags & 0x07) != VFS_FILE || !node->iops->read || !node->iops->clone)
+        return -1;
+    *phys = 0;
+    return 0;
+}
+
 vfs_dirent_t *vfs_readdir(vfs_inode_t *node, uint32_t index)
 {
     if ((node->flags & 0x07) == VFS_DIRECTORY && node->iops && node->iops->readdir)
@@ -320,6 +473,22 @@ vfs_dirent_t *vfs_readdir(vfs_inode_t *node, uint32_t index)
     return nullptr;
 }
 
+// Directories whose filesystem can reopen entries by key have their lookups cached
+static bool vfs_dir_key(const vfs_inode_t *node, vfs_cache_key_t *key)
+{
+    return node->iops && node->iops->iget && node->iops->cache_key && node->iops->cache_key(node, key) == 0;
+}
+
+// Drops a node returned by vfs_finddir or vfs_resolve_path
+static void vfs_release(vfs_inode_t *node)
+{
+    if (node && node != vfs_root)
+    {
+        vfs_close(node);
+        kfree(node);
+    }
+}
+
 vfs_inode_t *vfs_finddir(vfs_inode_t *node, char *name)
 {
     if ((node->flags & 0x07) == VFS_DIRECTORY && node->iops && node->iops->finddir)
@@ -334,7 +503,27 @@ vfs_inode_t *vfs_finddir(vfs_inode_t *node, char *name)
             }
         }
 
+        vfs_cache_key_t dir;
+        if (!vfs_dir_key(node, &dir))
+            return node->iops->finddir(node, name);
+
+        vfs_cache_key_t key;
+        uint64_t gen;
+        int cached = dcache_lookup(&dir, name, &key, &gen);
+        if (cached == 0)
+            return nullptr;
+        if (cached > 0)
+        {
+            vfs_inode_t *child = node->iops->iget(node, name, &key);
+            if (child)
+                return child;
+        }
+
         vfs_inode_t *child = node->iops->finddir(node, name);
+        if (!child)
+            dcache_insert(&dir, name, nullptr, gen);
+        else if (child->iops && child->iops->cache_key && child->iops->cache_key(child, &key) == 0)
+            dcache_insert(&dir, name, &key, gen);
         return child;
     }
     return nullptr;
@@ -346,44 +535,27 @@ vfs_inode_t *vfs_resolve_path(const char *path)
         return nullptr;
 
     vfs_inode_t *current = vfs_root;
-
-    // Handle absolute paths (treat as relative to root for now)
-    while (*path == '/')
-        path++;
-
-    if (*path == 0)
-        return current; // Root
-
     char name[128]; // Max filename length
-    int name_idx = 0;
 
     while (*path)
     {
-        if (*path == '/')
-        {
-            name[name_idx] = 0;
-            if (name_idx > 0)
-            {
-                vfs_inode_t *next = vfs_finddir(current, name);
-                if (!next)
-                    return nullptr;
-                current = next;
-            }
-            name_idx = 0;
-        }
-        else
+        while (*path == '/')
+            path++;
+        if (*path == 0)
+            break;
+
+        int name_idx = 0;
+        while (*path && *path != '/')
         {
             if (name_idx < 127)
                 name[name_idx++] = *path;
+            path++;
         }
-        path++;
-    }
-
-    // Last component
-    if (name_idx > 0)
-    {
         name[name_idx] = 0;
+
+        // Intermediate directories are only needed until their child is found
         vfs_inode_t *next = vfs_finddir(current, name);
+        vfs_release(current);
         if (!next)
             return nullptr;
         current = next;
@@ -434,12 +606,15 @@ int vfs_mknod(char *path, int mode, int dev)
         return -1;
     }
 
+    int res = -1;
     if ((parent->flags & VFS_DIRECTORY) && parent->iops && parent->iops->mknod)
-    {
-        return parent->iops->mknod(parent, filename, mode, dev);
-    }
+        res = parent->iops->mknod(parent, filename, mode, dev);
 
-    return -1;
+    vfs_cache_key_t dir;
+    if (vfs_dir_key(parent, &dir))
+        dcache_invalidate_dir(&dir);
+    vfs_release(parent);
+    return res;
 }
 
 int vfs_link(const char *oldpath, const char *newpath)
@@ -511,6 +686,10 @@ int vfs_link(const char *oldpath, const char *newpath)
         res = parent->iops->link(parent, filename, target);
     }
 
+    vfs_cache_key_t dir;
+    if (vfs_dir_key(parent, &dir))
+        dcache_invalidate_dir(&dir);
+
     if (parent != vfs_root)
     {
         vfs_close(parent);
@@ -563,10 +742,26 @@ int vfs_unlink(const char *path)
     if (!parent)
         return -1;
 
+    // Names cached for the victim, or under it if it is a directory, go with it
+    vfs_cache_key_t victim;
+    bool known = false;
+    vfs_inode_t *node = vfs_finddir(parent, filename);
+    if (node)
+    {
+        known = node->iops && node->iops->cache_key && node->iops->cache_key(node, &victim) == 0;
+        vfs_release(node);
+    }
+
     int res = -1;
     if ((parent->flags & VFS_DIRECTORY) && parent->iops && parent->iops->unlink)
         res = parent->iops->unlink(parent, filename);
 
+    vfs_cache_key_t dir;
+    if (vfs_dir_key(parent, &dir))
+        dcache_invalidate_dir(&dir);
+    if (known)
+        dcache_invalidate(&victim);
+
     if (parent != vfs_root)
     {
         vfs_close(parent);
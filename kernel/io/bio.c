@@ -1,130 +1,401 @@
 #include "bio.h"
 #include "heap.h"
+#include "pmm.h"
 #include "storage.h"
 #include "string.h"
 #include "terminal.h"
 #include "spinlock.h"
+#include "util.h"
+#include "vmm.h"
+#include "process.h"
+#include "apic.h"
+#include "sort.h"
 
-#define BIO_CACHE_SIZE 128
+static size_t block_size = BIO_DEFAULT_BLOCK_SIZE;
+static uint32_t sectors_per_block = BIO_DEFAULT_BLOCK_SIZE / BIO_BLOCK_SIZE;
+static size_t nblocks = 0;
 
-static buffer_head_t cache[BIO_CACHE_SIZE];
+static list_head_t *buckets;
+static size_t bucket_mask;
 static LIST_HEAD(lru_list);
 static spinlock_t bio_lock;
-static bool bio_lock_initialized = false;
+
+// One flush pass at a time; the staging block holds the sectors being written
+static sleeplock_t flush_lock;
+static uint8_t *flush_staging;
+static bio_block_t *flush_batch[BIO_FLUSH_BATCH];
+
+// One read-ahead at a time; a run of blocks is read with one scatter-gather request
+static sleeplock_t readahead_lock;
+static uint32_t readahead_blocks;
 
 void bio_init(void)
 {
     boot_message(INFO, "BIO: Init starting...");
     spinlock_init(&bio_lock);
-    bio_lock_initialized = true;
-    memset(cache, 0, sizeof(cache));
-    for (int i = 0; i < BIO_CACHE_SIZE; i++)
+    sleeplock_init(&flush_lock, "bio_flush");
+    sleeplock_init(&readahead_lock, "bio_readahead");
+
+    size_t free_bytes = pmm_free_page_count() * PAGE_SIZE;
+    size_t want = free_bytes / BIO_CACHE_FRACTION / block_size;
+    want = min(max(want, (size_t)BIO_MIN_BLOCKS), (size_t)BIO_MAX_BLOCKS);
+
+    size_t nbuckets = 1;
+    while (nbuckets < want)
+        nbuckets <<= 1;
+    buckets = kmalloc(nbuckets * sizeof(list_head_t));
+    if (!buckets)
     {
-        cache[i].data = kmalloc(BIO_BLOCK_SIZE);
-        if (!cache[i].data)
+        boot_message(ERROR, "BIO: kmalloc failed for %d buckets", nbuckets);
+        return;
+    }
+    for (size_t i = 0; i < nbuckets; i++)
+        INIT_LIST_HEAD(&buckets[i]);
+    bucket_mask = nbuckets - 1;
+
+    flush_staging = kmalloc(block_size);
+    if (!flush_staging)
+    {
+        boot_message(ERROR, "BIO: kmalloc failed for the flush buffer");
+        return;
+    }
+
+    readahead_blocks = max(BIO_READAHEAD_MAX_SECTORS / sectors_per_block, 1u);
+
+    // Block data is carved out of whole pages
+    const size_t per_page = PAGE_SIZE / block_size;
+    uint8_t *page = nullptr;
+    for (size_t i = 0; i < want; i++)
+    {
+        if (i % per_page == 0)
+        {
+            void *phys = pmm_alloc_page();
+            if (!phys)
+                break;
+            page = (uint8_t *)((uint64_t)phys + g_hhdm_offset);
+        }
+
+        bio_block_t *blk = kzalloc(sizeof(bio_block_t) + sectors_per_block * sizeof(buffer_head_t));
+        if (!blk)
         {
-            boot_message(ERROR, "BIO: kmalloc failed at index %d", i);
-            return;
+            boot_message(ERROR, "BIO: kmalloc failed at block %d", i);
+            break;
+        }
+        blk->data = page + (i % per_page) * block_size;
+        INIT_LIST_HEAD(&blk->hash);
+        sleeplock_init(&blk->lock, "bio_block");
+        for (uint32_t s = 0; s < sectors_per_block; s++)
+        {
+            blk->sectors[s].data = blk->data + s * BIO_BLOCK_SIZE;
+            blk->sectors[s].owner = blk;
+            sleeplock_init(&blk->sectors[s].lock, "bio_buffer");
         }
-        // Initialize as free/empty
-        INIT_LIST_HEAD(&cache[i].list);
-        sleeplock_init(&cache[i].lock, "bio_buffer");
 
-        // Add to LRU list (initially all in list)
-        list_add_tail(&cache[i].list, &lru_list);
+        // Add to LRU list (initially all in list, none hashed)
+        list_add_tail(&blk->list, &lru_list);
+        nblocks++;
     }
-    boot_message(INFO, "Buffered I/O Initialized. Cache Size: %d blocks", BIO_CACHE_SIZE);
+    boot_message(INFO, "Buffered I/O Initialized. Cache Size: %d blocks of %d bytes", nblocks, block_size);
 }
 
-static void move_to_head(buffer_head_t *bh)
+size_t bio_block_size(void)
 {
-    list_del(&bh->list);
-    list_add(&bh->list, &lru_list);
+    return block_size;
 }
 
-// Look for a cached buffer or allocate one.
-// Called with bio_lock held, returns with bio_lock held.
-// Returns a buffer with ref_count incremented but NOT locked.
-static buffer_head_t *get_blk(uint8_t device, uint32_t block)
+size_t bio_cache_blocks(void)
+{
+    return nblocks;
+}
+
+static inline list_head_t *bucket_for(uint8_t device, uint32_t number)
+{
+    uint64_t h = ((uint64_t)device << 32 | number) * 0x9E3779B97F4A7C15ull;
+    return &buckets[(h >> 32) & bucket_mask];
+}
+
+static void move_to_head(bio_block_t *blk)
 {
-    // Search cache for existing buffer (regardless of validity)
-    for (int i = 0; i < BIO_CACHE_SIZE; i++)
+    list_del(&blk->list);
+    list_add(&blk->list, &lru_list);
+}
+
+static inline uint64_t ms_to_ticks(uint64_t ms)
+{
+    return (ms * TIMER_FREQUENCY_HZ + 999) / 1000;
+}
+
+// Writes the sectors of a block set in mask from data, one request per run of adjacent sectors
+static void write_runs(uint8_t device, uint32_t lba, const uint8_t *data, uint32_t mask)
+{
+    uint32_t i = 0;
+    while (i < sectors_per_block)
     {
-        if (cache[i].ref_count > 0 && cache[i].device == device && cache[i].block == block)
+        if (!(mask & (1u << i)))
         {
-            cache[i].ref_count++;
-            move_to_head(&cache[i]);
-            return &cache[i];
+            i++;
+            continue;
         }
+        uint32_t end = i;
+        while (end < sectors_per_block && (mask & (1u << end)))
+            end++;
+        if (storage_write(device, lba + i, end - i, data + i * BIO_BLOCK_SIZE) != 0)
+            printk("BIO: Failed to write blocks %d-%d\n", lba + i, lba + end - 1);
+        i = end;
     }
+}
 
-    // Not found, recycle the LRU unused buffer
-    buffer_head_t *bh;
-    list_for_each_entry_reverse(bh, &lru_list, list)
+static void flush_block(bio_block_t *blk, uint8_t *staging);
+
+// Look for a cached block or recycle one.
+// Called with bio_lock held, returns with bio_lock held.
+// Returns a block with ref_count incremented but NOT locked.
+static bio_block_t *get_blk(uint8_t device, uint32_t number)
+{
+    list_head_t *bucket = bucket_for(device, number);
+    bio_block_t *blk;
+    bio_block_t *victim = nullptr;
+    while (!victim)
     {
-        if (bh->ref_count == 0)
+        list_for_each_entry(blk, bucket, hash)
+        {
+            if (blk->device == device && blk->number == number)
+            {
+                blk->ref_count++;
+                move_to_head(blk);
+                return blk;
+            }
+        }
+
+        // Not found, recycle the least recently used clean block. Dirty ones are left to
+        // the flusher, unless every unused block is dirty.
+        bio_block_t *dirty = nullptr;
+        list_for_each_entry_reverse(blk, &lru_list, list)
         {
-            // Write back dirty buffer before recycling
-            if (bh->flags & BIO_FLAG_DIRTY)
+            if (blk->ref_count != 0)
+                continue;
+            if (!blk->dirty_since)
             {
-                storage_write(bh->device, bh->block, 1, bh->data);
-                bh->flags &= ~BIO_FLAG_DIRTY;
+                victim = blk;
+                break;
             }
-            bh->device = device;
-            bh->block = block;
-            bh->flags = 0; // Invalid - needs to be read
-            bh->ref_count = 1;
-            move_to_head(bh);
-            return bh;
+            if (!dirty)
+                dirty = blk;
+        }
+        if (victim)
+            break;
+        if (!dirty)
+        {
+            printk("BIO: No free buffers!\n");
+            return nullptr;
+        }
+
+        // The write may sleep, so it happens with the block pinned and bio_lock dropped,
+        // after which the lookup starts over
+        dirty->ref_count++;
+        spinlock_release(&bio_lock);
+        uint8_t *staging = kmalloc(block_size);
+        const bool written = staging != nullptr;
+        if (staging)
+        {
+            flush_block(dirty, staging);
+            kfree(staging);
+        }
+        spinlock_acquire(&bio_lock);
+        dirty->ref_count--;
+        if (!written)
+        {
+            printk("BIO: No memory to write back a buffer\n");
+            return nullptr;
         }
     }
 
-    printk("BIO: No free buffers!\n");
-    return nullptr;
+    blk = victim;
+    list_del(&blk->hash);
+    blk->device = device;
+    blk->number = number;
+    for (uint32_t i = 0; i < sectors_per_block; i++)
+    {
+        blk->sectors[i].device = device;
+        blk->sectors[i].block = number * sectors_per_block + i;
+        blk->sectors[i].flags = 0; // Invalid - needs to be read
+    }
+    list_add(&blk->hash, bucket);
+    blk->ref_count = 1;
+    move_to_head(blk);
+    return blk;
 }
 
-// Return a locked buffer with the contents of the indicated block.
-buffer_head_t *bread(uint8_t device, uint32_t block)
+static void put_blk(bio_block_t *blk)
 {
-    if (bio_lock_initialized)
-        spinlock_acquire(&bio_lock);
+    spinlock_acquire(&bio_lock);
+    if (blk->ref_count > 0)
+        blk->ref_count--;
+    spinlock_release(&bio_lock);
+}
 
-    buffer_head_t *bh = get_blk(device, block);
-    if (!bh)
+// Make sector index of blk valid. A block with nothing valid yet is read in one
+// request; otherwise (or if that fails, e.g. at the end of the disk) just the sector.
+static int fill_sector(bio_block_t *blk, uint32_t index)
+{
+    int rc = 0;
+    sleeplock_acquire(&blk->lock);
+    if (!(blk->sectors[index].flags & BIO_FLAG_VALID))
     {
-        if (bio_lock_initialized)
-            spinlock_release(&bio_lock);
-        return nullptr;
+        bool untouched = true;
+        for (uint32_t i = 0; i < sectors_per_block; i++)
+        {
+            if (blk->sectors[i].flags & BIO_FLAG_VALID)
+                untouched = false;
+        }
+
+        uint32_t lba = blk->number * sectors_per_block;
+        if (untouched && storage_read(blk->device, lba, sectors_per_block, blk->data) == 0)
+        {
+            for (uint32_t i = 0; i < sectors_per_block; i++)
+                blk->sectors[i].flags |= BIO_FLAG_VALID;
+        }
+        else
+        {
+            rc = storage_read(blk->device, lba + index, 1, blk->sectors[index].data);
+            if (rc == 0)
+                blk->sectors[index].flags |= BIO_FLAG_VALID;
+        }
     }
+    sleeplock_release(&blk->lock);
+    return rc;
+}
 
-    // Release spinlock before acquiring sleeplock (may sleep)
-    if (bio_lock_initialized)
-        spinlock_release(&bio_lock);
+// Called with blk->lock held
+static bool block_untouched(const bio_block_t *blk)
+{
+    for (uint32_t i = 0; i < sectors_per_block; i++)
+    {
+        if (blk->sectors[i].flags & BIO_FLAG_VALID)
+            return false;
+    }
+    return true;
+}
 
-    // Acquire exclusive access to this buffer
-    sleeplock_acquire(&bh->lock);
+// Fills a run of locked, untouched blocks with consecutive numbers in one request,
+// straight into each block's data. On failure the blocks stay invalid and bread()
+// retries them one at a time.
+static void read_run(bio_block_t **run, uint32_t count)
+{
+    storage_segment_t segments[BIO_READAHEAD_MAX_SECTORS] = {0};
+    for (uint32_t i = 0; i < count; i++)
+    {
+        segments[i].phys = (uint64_t)run[i]->data - g_hhdm_offset;
+        segments[i].length = (uint32_t)block_size;
+    }
 
-    // Check if we need to read from disk
-    if (!(bh->flags & BIO_FLAG_VALID))
+    uint32_t lba = run[0]->number * sectors_per_block;
+    bool ok = storage_read_segments(run[0]->device, lba, segments, count) == 0;
+    for (uint32_t i = 0; i < count; i++)
     {
-        int rc = storage_read(device, block, 1, bh->data);
-        if (rc != 0)
+        if (ok)
         {
-            // Read failed - release buffer
-            sleeplock_release(&bh->lock);
-            if (bio_lock_initialized)
-                spinlock_acquire(&bio_lock);
-            bh->ref_count--;
-            if (bio_lock_initialized)
-                spinlock_release(&bio_lock);
-            return nullptr;
+            for (uint32_t s = 0; s < sectors_per_block; s++)
+                run[i]->sectors[s].flags |= BIO_FLAG_VALID;
+        }
+        sleeplock_release(&run[i]->lock);
+        put_blk(run[i]);
+    }
+}
+
+// Bring sectors [block, block + count) into the cache without handing any out, reading
+// the blocks that are not cached yet in runs of up to BIO_READAHEAD_MAX_SECTORS.
+void breada(uint8_t device, uint32_t block, uint32_t count)
+{
+    if (nblocks == 0 || readahead_blocks == 0 || count == 0)
+        return;
+
+    bio_block_t *run[BIO_READAHEAD_MAX_SECTORS];
+    uint32_t queued = 0;
+    uint32_t last = (block + count - 1) / sectors_per_block;
+
+    sleeplock_acquire(&readahead_lock);
+    for (uint32_t number = block / sectors_per_block; number <= last; number++)
+    {
+        spinlock_acquire(&bio_lock);
+        bio_block_t *blk = get_blk(device, number);
+        spinlock_release(&bio_lock);
+        if (!blk)
+            break;
+
+        // Blocks are locked in ascending order and only one read-ahead runs at a time
+        sleeplock_acquire(&blk->lock);
+        if (!block_untouched(blk))
+        {
+            sleeplock_release(&blk->lock);
+            put_blk(blk);
+            if (queued > 0)
+                read_run(run, queued);
+            queued = 0;
+            continue;
         }
-        bh->flags |= BIO_FLAG_VALID;
+
+        run[queued++] = blk;
+        if (queued == readahead_blocks)
+        {
+            read_run(run, queued);
+            queued = 0;
+        }
+    }
+    if (queued > 0)
+        read_run(run, queued);
+    sleeplock_release(&readahead_lock);
+}
+
+// Return a locked buffer with the contents of the indicated sector.
+buffer_head_t *bread(uint8_t device, uint32_t block)
+{
+    if (nblocks == 0)
+        return nullptr;
+
+    spinlock_acquire(&bio_lock);
+    bio_block_t *blk = get_blk(device, block / sectors_per_block);
+    // Release spinlock before acquiring sleeplocks (may sleep)
+    spinlock_release(&bio_lock);
+    if (!blk)
+        return nullptr;
+
+    buffer_head_t *bh = &blk->sectors[block % sectors_per_block];
+    if (!(bh->flags & BIO_FLAG_VALID) && fill_sector(blk, block % sectors_per_block) != 0)
+    {
+        // Read failed - release block
+        put_blk(blk);
+        return nullptr;
     }
 
+    // Acquire exclusive access to this buffer
+    sleeplock_acquire(&bh->lock);
     return bh; // Return with sleeplock held
 }
 
+// Return a locked, zero-filled buffer for a sector whose old contents do not matter,
+// such as a newly allocated filesystem block, without reading it from disk.
+buffer_head_t *bzeroed(uint8_t device, uint32_t block)
+{
+    if (nblocks == 0)
+        return nullptr;
+
+    spinlock_acquire(&bio_lock);
+    bio_block_t *blk = get_blk(device, block / sectors_per_block);
+    spinlock_release(&bio_lock);
+    if (!blk)
+        return nullptr;
+
+    buffer_head_t *bh = &blk->sectors[block % sectors_per_block];
+    sleeplock_acquire(&bh->lock);
+    // Under the block lock, so a whole-block read in progress cannot land on top of the zeroes
+    sleeplock_acquire(&blk->lock);
+    memset(bh->data, 0, BIO_BLOCK_SIZE);
+    bh->flags |= BIO_FLAG_VALID;
+    sleeplock_release(&blk->lock);
+    return bh;
+}
+
 // Write buffer contents to disk.
 // Caller must hold the buffer lock.
 void bwrite(buffer_head_t *bh)
@@ -142,7 +413,139 @@ void bwrite(buffer_head_t *bh)
     bh->flags &= ~BIO_FLAG_DIRTY;
 }
 
-// Release a buffer - unlocks it and decrements ref_count.
+// Mark a buffer for delayed write-back.
+// Caller must hold the buffer lock.
+void bdirty(buffer_head_t *bh)
+{
+    if (!bh)
+        return;
+
+    bh->flags |= BIO_FLAG_DIRTY;
+    spinlock_acquire(&bio_lock);
+    if (!bh->owner->dirty_since)
+        bh->owner->dirty_since = scheduler_ticks + 1;
+    spinlock_release(&bio_lock);
+}
+
+static int compare_lba(const void *a, const void *b)
+{
+    const bio_block_t *x = *(bio_block_t *const *)a;
+    const bio_block_t *y = *(bio_block_t *const *)b;
+    if (x->device != y->device)
+        return x->device < y->device ? -1 : 1;
+    if (x->number != y->number)
+        return x->number < y->number ? -1 : 1;
+    return 0;
+}
+
+// Copies the dirty sectors of a pinned block aside one at a time (so the flusher never
+// holds two sector locks) and writes them out from staging. The flusher and eviction
+// take turns on a block, or an older copy of a sector could reach the disk last.
+static void flush_block(bio_block_t *blk, uint8_t *staging)
+{
+    // Cleared first, so a sector dirtied while we copy starts a new timestamp
+    spinlock_acquire(&bio_lock);
+    while (blk->writeback)
+        thread_sleep(&blk->writeback, &bio_lock);
+    blk->writeback = true;
+    blk->dirty_since = 0;
+    spinlock_release(&bio_lock);
+
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < sectors_per_block; i++)
+    {
+        buffer_head_t *bh = &blk->sectors[i];
+        sleeplock_acquire(&bh->lock);
+        if (bh->flags & BIO_FLAG_DIRTY)
+        {
+            memcpy(staging + i * BIO_BLOCK_SIZE, bh->data, BIO_BLOCK_SIZE);
+            bh->flags &= ~BIO_FLAG_DIRTY;
+            mask |= 1u << i;
+        }
+        sleeplock_release(&bh->lock);
+    }
+    if (mask)
+        write_runs(blk->device, blk->number * sectors_per_block, staging, mask);
+
+    spinlock_acquire(&bio_lock);
+    blk->writeback = false;
+    thread_wakeup(&blk->writeback);
+    spinlock_release(&bio_lock);
+}
+
+// Writes back up to BIO_FLUSH_BATCH blocks dirtied at or before the given tick, in
+// device and LBA order. Returns the number of blocks written.
+static size_t flush_pass(uint64_t dirty_before)
+{
+    if (nblocks == 0)
+        return 0;
+
+    sleeplock_acquire(&flush_lock);
+    size_t count = 0;
+    spinlock_acquire(&bio_lock);
+    bio_block_t *blk;
+    list_for_each_entry_reverse(blk, &lru_list, list)
+    {
+        if (count == BIO_FLUSH_BATCH)
+            break;
+        if (blk->dirty_since && blk->dirty_since <= dirty_before)
+        {
+            blk->ref_count++; // Pinned so it cannot be recycled under us
+            flush_batch[count++] = blk;
+        }
+    }
+    spinlock_release(&bio_lock);
+
+    qsort(flush_batch, count, sizeof(flush_batch[0]), compare_lba);
+    for (size_t i = 0; i < count; i++)
+    {
+        flush_block(flush_batch[i], flush_staging);
+        put_blk(flush_batch[i]);
+    }
+    sleeplock_release(&flush_lock);
+    return count;
+}
+
+// Write every dirty buffer to disk.
+void bio_sync(void)
+{
+    while (flush_pass(UINT64_MAX) > 0)
+        ;
+}
+
+static void bio_flusher(void)
+{
+    for (;;)
+    {
+        thread_sleep_until(scheduler_ticks + ms_to_ticks(BIO_FLUSH_INTERVAL_MS));
+        uint64_t expire = ms_to_ticks(BIO_DIRTY_EXPIRE_MS);
+        if (scheduler_ticks > expire)
+        {
+            while (flush_pass(scheduler_ticks - expire) == BIO_FLUSH_BATCH)
+                ;
+        }
+    }
+}
+
+void bio_start_flusher(void)
+{
+    if (!thread_create(kernel_process, bio_flusher, false))
+        boot_message(ERROR, "BIO: Failed to start the flusher thread");
+}
+
+// Every flush pass runs under flush_lock, so holding it waits out a running pass and
+// keeps new ones from starting. Eviction still writes the blocks it recycles.
+void bio_flusher_pause(void)
+{
+    sleeplock_acquire(&flush_lock);
+}
+
+void bio_flusher_resume(void)
+{
+    sleeplock_release(&flush_lock);
+}
+
+// Release a buffer - unlocks it and drops the block reference.
 void brelse(buffer_head_t *bh)
 {
     if (!bh)
@@ -152,12 +555,5 @@ void brelse(buffer_head_t *bh)
     sleeplock_release(&bh->lock);
 
     // Then update ref_count under spinlock
-    if (bio_lock_initialized)
-        spinlock_acquire(&bio_lock);
-
-    if (bh->ref_count > 0)
-        bh->ref_count--;
-
-    if (bio_lock_initialized)
-        spinlock_release(&bio_lock);
+    put_blk(bh->owner);
 }
@@ -1,8 +1,17 @@
 #include "storage.h"
 #include "ahci.h"
 #include "ide.h"
+#include "list.h"
+#include "pmm.h"
+#include "process.h"
+#include "spinlock.h"
+#include "string.h"
+#include "tsc.h"
+#include "vmm.h"
 #include <stddef.h>
 
+#define IDE_MAX_SECTORS_PER_CMD 255u
+
 enum storage_backend
 {
     STORAGE_BACKEND_NONE = 0,
@@ -10,14 +19,48 @@ enum storage_backend
     STORAGE_BACKEND_IDE,
 };
 
+typedef struct storage_request
+{
+    list_head_t list; // Queue entry, sorted by lba
+    uint32_t lba;
+    uint32_t sectors;
+    bool write;
+    const storage_segment_t *segments;
+    size_t count;
+    storage_segment_t linear; // Backs segments for single-buffer requests
+    uint64_t submitted;       // tsc_nanos() when queued
+    volatile bool done;
+    int status;
+} storage_request_t;
+
 struct storage_device
 {
     enum storage_backend backend;
     uint8_t port; // AHCI port index or IDE drive index depending on backend
+
+    spinlock_t lock;
+    list_head_t queue;     // Requests waiting for dispatch
+    uint32_t inflight;     // Backend commands issued and not yet completed
+    uint32_t max_inflight; // Backend queue depth
+    uint32_t head;         // LBA following the last dispatch, where the elevator resumes
+    storage_stats_t stats;
 };
 
 static struct storage_device g_devices[2];
 
+static void storage_init_queue(struct storage_device *dev)
+{
+    spinlock_init(&dev->lock);
+    INIT_LIST_HEAD(&dev->queue);
+    dev->inflight = 0;
+    dev->head = 0;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    // IDE channels take one command at a time
+    dev->max_inflight = dev->backend == STORAGE_BACKEND_AHCI ? ahci_queue_depth() : 1;
+    if (dev->max_inflight == 0)
+        dev->max_inflight = 1;
+}
+
 void storage_init(void)
 {
     // Default: try AHCI on device 0, fallback to IDE drive 0.
@@ -47,44 +90,340 @@ void storage_init(void)
             break;
         }
     }
+
+    for (size_t i = 0; i < sizeof(g_devices) / sizeof(g_devices[0]); i++)
+        storage_init_queue(&g_devices[i]);
 }
 
-static int storage_read_backend(const struct storage_device *dev, uint32_t lba, uint8_t count, uint8_t *buffer)
+// One IDE command (DMA, or PIO as a fallback) moves at most IDE_MAX_SECTORS_PER_CMD sectors
+static int ide_transfer(uint8_t port, uint32_t lba, uint32_t count, uint8_t *buffer, bool write)
+{
+    while (count > 0)
+    {
+        uint8_t n = (uint8_t)(count < IDE_MAX_SECTORS_PER_CMD ? count : IDE_MAX_SECTORS_PER_CMD);
+        int rc = write ? ide_write_sectors(port, lba, n, buffer) : ide_read_sectors(port, lba, n, buffer);
+        if (rc != 0)
+            return rc;
+        lba += n;
+        buffer += n * STORAGE_SECTOR_SIZE;
+        count -= n;
+    }
+    return 0;
+}
+
+static int storage_read_backend(const struct storage_device *dev, uint32_t lba, uint32_t count, uint8_t *buffer)
 {
     switch (dev->backend)
     {
     case STORAGE_BACKEND_AHCI:
         return ahci_read(lba, count, buffer);
     case STORAGE_BACKEND_IDE:
-        return ide_read_sectors(dev->port, lba, count, buffer);
+        return ide_transfer(dev->port, lba, count, buffer, false);
     default:
         return -1;
     }
 }
 
-static int storage_write_backend(const struct storage_device *dev, uint32_t lba, uint8_t count, const uint8_t *buffer)
+static int storage_write_backend(const struct storage_device *dev, uint32_t lba, uint32_t count, const uint8_t *buffer)
 {
     switch (dev->backend)
     {
     case STORAGE_BACKEND_AHCI:
         return ahci_write(lba, count, buffer);
     case STORAGE_BACKEND_IDE:
-        return ide_write_sectors(dev->port, lba, count, (uint8_t *)buffer);
+        return ide_transfer(dev->port, lba, count, (uint8_t *)buffer, true);
     default:
         return -1;
     }
 }
 
-int storage_read(uint8_t device, uint32_t lba, uint8_t count, uint8_t *buffer)
+static int storage_segments_backend(const struct storage_device *dev, uint32_t lba, const storage_segment_t *segments,
+                                    size_t count, bool write)
+{
+    switch (dev->backend)
+    {
+    case STORAGE_BACKEND_AHCI:
+        return write ? ahci_write_segments(lba, segments, count) : ahci_read_segments(lba, segments, count);
+    case STORAGE_BACKEND_IDE:
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t sectors = segments[i].length / STORAGE_SECTOR_SIZE;
+            int rc = ide_transfer(dev->port, lba, sectors, (uint8_t *)(segments[i].phys + g_hhdm_offset), write);
+            if (rc != 0)
+                return rc;
+            lba += sectors;
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static bool segments_valid(const storage_segment_t *segments, size_t count)
+{
+    if (!segments || count == 0)
+        return false;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (segments[i].length == 0 || segments[i].length % STORAGE_SECTOR_SIZE != 0)
+            return false;
+    }
+    return true;
+}
+
+// Called with dev->lock held. Serves the oldest request once it has waited past the
+// deadline, otherwise the first one at or after the elevator head (C-LOOK).
+static storage_request_t *storage_pick(struct storage_device *dev)
+{
+    storage_request_t *oldest = nullptr;
+    storage_request_t *next = nullptr;
+    storage_request_t *req;
+    list_for_each_entry(req, &dev->queue, list)
+    {
+        if (!oldest || req->submitted < oldest->submitted)
+            oldest = req;
+        if (!next && req->lba >= dev->head)
+            next = req;
+    }
+
+    if (tsc_nanos() - oldest->submitted >= STORAGE_DEADLINE_MS * 1000000ull)
+    {
+        dev->stats.deadline++;
+        return oldest;
+    }
+    return next ? next : list_first_entry(&dev->queue, storage_request_t, list);
+}
+
+static inline storage_request_t *storage_prev(struct storage_device *dev, storage_request_t *req)
+{
+    return req->list.prev == &dev->queue ? nullptr : list_entry(req->list.prev, storage_request_t, list);
+}
+
+static inline storage_request_t *storage_next(struct storage_device *dev, storage_request_t *req)
+{
+    return req->list.next == &dev->queue ? nullptr : list_entry(req->list.next, storage_request_t, list);
+}
+
+static void storage_account(struct storage_device *dev, const storage_request_t *req)
+{
+    uint64_t us = (tsc_nanos() - req->submitted) / 1000;
+    size_t bucket = 0;
+    while (bucket < STORAGE_LATENCY_BUCKETS - 1 && us >= (16ull << bucket))
+        bucket++;
+    dev->stats.latency[bucket]++;
+    dev->stats.depth--;
+}
+
+// Called with dev->lock held and a free backend slot. Takes a request and the queued
+// requests adjacent to it in the same direction, issues them as one command and
+// completes them. The lock is dropped around the transfer.
+static void storage_dispatch(struct storage_device *dev, uint64_t *flags)
+{
+    storage_request_t *first = storage_pick(dev);
+    storage_request_t *last = first;
+    size_t count = first->count;
+
+    storage_request_t *req;
+    while ((req = storage_prev(dev, first)) && req->write == first->write && req->lba + req->sectors == first->lba &&
+           count + req->count <= STORAGE_MERGE_SEGMENTS)
+    {
+        count += req->count;
+        first = req;
+    }
+    while ((req = storage_next(dev, last)) && req->write == last->write && last->lba + last->sectors == req->lba &&
+           count + req->count <= STORAGE_MERGE_SEGMENTS)
+    {
+        count += req->count;
+        last = req;
+    }
+
+    // Unlink the run [first, last] onto a private list
+    LIST_HEAD(batch);
+    batch.next = &first->list;
+    batch.prev = &last->list;
+    first->list.prev->next = last->list.next;
+    last->list.next->prev = first->list.prev;
+    first->list.prev = &batch;
+    last->list.next = &batch;
+
+    uint32_t lba = first->lba;
+    bool write = first->write;
+    dev->head = last->lba + last->sectors;
+    dev->inflight++;
+    dev->stats.dispatches++;
+    SPIN_UNLOCK_IRQRESTORE(dev->lock, *flags);
+
+    int rc;
+    if (first == last)
+        rc = storage_segments_backend(dev, lba, first->segments, first->count, write);
+    else
+    {
+        // Physically contiguous neighbours collapse into one segment
+        storage_segment_t segments[STORAGE_MERGE_SEGMENTS];
+        size_t n = 0;
+        list_for_each_entry(req, &batch, list)
+        {
+            for (size_t i = 0; i < req->count; i++)
+            {
+                if (n > 0 && segments[n - 1].phys + segments[n - 1].length == req->segments[i].phys)
+                    segments[n - 1].length += req->segments[i].length;
+                else
+                    segments[n++] = req->segments[i];
+            }
+        }
+        rc = storage_segments_backend(dev, lba, segments, n, write);
+    }
+
+    SPIN_LOCK_IRQSAVE(dev->lock, *flags);
+    dev->inflight--;
+    storage_request_t *tmp;
+    list_for_each_entry_safe(req, tmp, &batch, list)
+    {
+        if (req != first)
+            dev->stats.merged++;
+        storage_account(dev, req);
+        req->status = rc;
+        req->done = true;
+        thread_wakeup(req);
+    }
+    // The slot just freed goes to whoever waits at the front of the queue
+    if (!list_empty(&dev->queue))
+        thread_wakeup(list_first_entry(&dev->queue, storage_request_t, list));
+}
+
+// Queues the request and waits for it, dispatching on behalf of the queue whenever the
+// backend has a free slot. Callers that cannot sleep go straight to the backend.
+static int storage_submit(struct storage_device *dev, storage_request_t *req)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(dev->lock, flags);
+    dev->stats.requests++;
+    bool can_sleep = (flags & RFLAGS_IF) && get_current_thread() != nullptr;
+    if (!can_sleep)
+    {
+        dev->stats.bypassed++;
+        SPIN_UNLOCK_IRQRESTORE(dev->lock, flags);
+        return storage_segments_backend(dev, req->lba, req->segments, req->count, req->write);
+    }
+
+    req->submitted = tsc_nanos();
+    req->done = false;
+    req->status = 0;
+    storage_request_t *pos;
+    list_head_t *at = &dev->queue;
+    list_for_each_entry_reverse(pos, &dev->queue, list)
+    {
+        if (pos->lba <= req->lba)
+        {
+            at = &pos->list;
+            break;
+        }
+    }
+    list_add(&req->list, at);
+    if (++dev->stats.depth > dev->stats.max_depth)
+        dev->stats.max_depth = dev->stats.depth;
+
+    while (!req->done)
+    {
+        if (dev->inflight < dev->max_inflight && !list_empty(&dev->queue))
+            storage_dispatch(dev, &flags);
+        else
+            thread_sleep(req, &dev->lock);
+    }
+
+    // Someone else may have served this request after waking us for a free slot
+    if (dev->inflight < dev->max_inflight && !list_empty(&dev->queue))
+        thread_wakeup(list_first_entry(&dev->queue, storage_request_t, list));
+    int status = req->status;
+    SPIN_UNLOCK_IRQRESTORE(dev->lock, flags);
+    return status;
+}
+
+// Kernel buffers in the HHDM are physically contiguous and can be queued as a single
+// segment. Anything else keeps the backend's own buffer handling.
+static int storage_linear(struct storage_device *dev, uint32_t lba, uint32_t count, uint8_t *buffer, bool write)
+{
+    uint64_t addr = (uint64_t)buffer;
+    uint64_t bytes = (uint64_t)count * STORAGE_SECTOR_SIZE;
+    if (addr < g_hhdm_offset || addr - g_hhdm_offset + bytes > pmm_get_highest_addr())
+    {
+        uint64_t flags;
+        SPIN_LOCK_IRQSAVE(dev->lock, flags);
+        dev->stats.requests++;
+        dev->stats.bypassed++;
+        SPIN_UNLOCK_IRQRESTORE(dev->lock, flags);
+        return write ? storage_write_backend(dev, lba, count, buffer) : storage_read_backend(dev, lba, count, buffer);
+    }
+
+    storage_request_t req = {0};
+    req.lba = lba;
+    req.sectors = count;
+    req.write = write;
+    req.linear.phys = addr - g_hhdm_offset;
+    req.linear.length = (uint32_t)bytes;
+    req.segments = &req.linear;
+    req.count = 1;
+    return storage_submit(dev, &req);
+}
+
+static int storage_segmented(struct storage_device *dev, uint32_t lba, const storage_segment_t *segments,
+                             size_t count, bool write)
+{
+    storage_request_t req = {0};
+    req.lba = lba;
+    req.write = write;
+    req.segments = segments;
+    req.count = count;
+    for (size_t i = 0; i < count; i++)
+        req.sectors += segments[i].length / STORAGE_SECTOR_SIZE;
+    return storage_submit(dev, &req);
+}
+
+int storage_read(uint8_t device, uint32_t lba, uint32_t count, uint8_t *buffer)
 {
     if (device >= (sizeof(g_devices) / sizeof(g_devices[0])) || count == 0 || buffer == nullptr)
         return -1;
-    return storage_read_backend(&g_devices[device], lba, count, buffer);
+    if (g_devices[device].backend == STORAGE_BACKEND_NONE)
+        return -1;
+    return storage_linear(&g_devices[device], lba, count, buffer, false);
 }
 
-int storage_write(uint8_t device, uint32_t lba, uint8_t count, const uint8_t *buffer)
+int storage_write(uint8_t device, uint32_t lba, uint32_t count, const uint8_t *buffer)
 {
     if (device >= (sizeof(g_devices) / sizeof(g_devices[0])) || count == 0 || buffer == nullptr)
         return -1;
-    return storage_write_backend(&g_devices[device], lba, count, buffer);
+    if (g_devices[device].backend == STORAGE_BACKEND_NONE)
+        return -1;
+    return storage_linear(&g_devices[device], lba, count, (uint8_t *)buffer, true);
+}
+
+int storage_read_segments(uint8_t device, uint32_t lba, const storage_segment_t *segments, size_t count)
+{
+    if (device >= (sizeof(g_devices) / sizeof(g_devices[0])) || !segments_valid(segments, count))
+        return -1;
+    if (g_devices[device].backend == STORAGE_BACKEND_NONE)
+        return -1;
+    return storage_segmented(&g_devices[device], lba, segments, count, false);
+}
+
+int storage_write_segments(uint8_t device, uint32_t lba, const storage_segment_t *segments, size_t count)
+{
+    if (device >= (sizeof(g_devices) / sizeof(g_devices[0])) || !segments_valid(segments, count))
+        return -1;
+    if (g_devices[device].backend == STORAGE_BACKEND_NONE)
+        return -1;
+    return storage_segmented(&g_devices[device], lba, segments, count, true);
+}
+
+int storage_get_stats(uint8_t device, storage_stats_t *stats)
+{
+    if (device >= (sizeof(g_devices) / sizeof(g_devices[0])) || !stats)
+        return -1;
+
+    struct storage_device *dev = &g_devices[device];
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(dev->lock, flags);
+    *stats = dev->stats;
+    SPIN_UNLOCK_IRQRESTORE(dev->lock, flags);
+    return 0;
 }
@@ -12,6 +12,8 @@
 #include "vmm.h"
 #include "heap.h"
 #include "bio.h"
+#include "page_cache.h"
+#include "dcache.h"
 #include "ide.h"
 #include "keyboard.h"
 #include "vfs.h"
@@ -36,6 +38,9 @@
 
 void shutdown()
 {
+    // Delayed writes would be lost with the machine
+    bio_sync();
+
     // Exit QEMU
     // Try 0x501 which is common default
     outb(ISA_DEBUG_EXIT_PORT, ISA_DEBUG_EXIT_CMD);
@@ -140,6 +145,9 @@ void _start(void) // NOLINT(*-reserved-identifier)
     pci_scan();
     storage_init();
     bio_init();
+    bio_start_flusher();
+    page_cache_init();
+    dcache_init();
     vfs_init();
     devfs_init();
     console_init();
@@ -6,6 +6,7 @@
 #include "string.h"
 #include "terminal.h"
 #include "uart.h"
+#include "process.h"
 
 static bool elf_validate_header(Elf64_Ehdr *header)
 {
@@ -36,19 +37,12 @@ static Elf64_Phdr *elf_read_program_headers(vfs_inode_t *node, Elf64_Ehdr *heade
     return phdrs;
 }
 
-static bool elf_load_segment(vfs_inode_t *node, Elf64_Phdr *ph, pml4_t pml4, uint64_t *max_vaddr)
+// Fallback for segments that cannot be demand-paged (misaligned file offset or a
+// page shared with the previous segment): copy everything in up front.
+static bool elf_load_segment_eager(vfs_inode_t *node, Elf64_Phdr *ph, pml4_t pml4, process_t *proc)
 {
-    // Align start and end to page boundaries
-    uint64_t start_addr = ph->p_vaddr;
-    uint64_t end_addr = ph->p_vaddr + ph->p_memsz;
-
-    uint64_t page_start = start_addr & ~(PAGE_SIZE - 1);
-    uint64_t page_end = (end_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-
-    if (max_vaddr && page_end > *max_vaddr)
-    {
-        *max_vaddr = page_end;
-    }
+    uint64_t page_start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    uint64_t page_end = (ph->p_vaddr + ph->p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
     // Read segment data into a temporary buffer first
     uint8_t *temp_buf = nullptr;
@@ -71,8 +65,55 @@ static bool elf_load_segment(vfs_inode_t *node, Elf64_Phdr *ph, pml4_t pml4, uin
 
     for (uint64_t addr = page_start; addr < page_end; addr += PAGE_SIZE)
     {
-        // Check if already mapped?
-        // For now, just allocate new page.
+        // A page shared with the previous segment is filled in place
+        vm_area_t *area = proc ? vm_area_find(proc, addr) : nullptr;
+        if (area && !vmm_virt_to_phys(pml4, addr) && !vm_area_populate(area, pml4, addr))
+        {
+            if (temp_buf)
+                kfree(temp_buf);
+            return false;
+        }
+        uint64_t existing = vmm_virt_to_phys(pml4, addr);
+        if (existing && area)
+        {
+            // The area mapped the page with its own permissions; the page gets those of
+            // both segments, so a read-only text page does not make the data read-only
+            uint64_t flags = PTE_PRESENT | PTE_USER;
+            if ((ph->p_flags & PF_W) || (area->flags & VMA_WRITE))
+                flags |= PTE_WRITABLE;
+            uint64_t frame = existing;
+            if (pmm_page_refcount((void *)existing) > 1)
+            {
+                // Still the page cache's frame; take a private copy before filling it
+                void *copy = pmm_alloc_page();
+                if (!copy)
+                {
+                    if (temp_buf)
+                        kfree(temp_buf);
+                    return false;
+                }
+                memcpy((void *)((uint64_t)copy + g_hhdm_offset), (void *)(existing + g_hhdm_offset), PAGE_SIZE);
+                frame = (uint64_t)copy;
+            }
+            vmm_map_page(pml4, addr, frame, flags);
+            if (frame != existing)
+                pmm_free_page((void *)existing);
+            existing = frame;
+        }
+        if (existing)
+        {
+            if (temp_buf)
+            {
+                uint64_t copy_start = (addr > ph->p_vaddr) ? addr : ph->p_vaddr;
+                uint64_t file_end = ph->p_vaddr + ph->p_filesz;
+                uint64_t copy_end = (addr + PAGE_SIZE < file_end) ? (addr + PAGE_SIZE) : file_end;
+                if (copy_start < copy_end)
+                    memcpy((uint8_t *)(existing + g_hhdm_offset) + (copy_start - addr),
+                           temp_buf + (copy_start - ph->p_vaddr), copy_end - copy_start);
+            }
+            continue;
+        }
+
         void *phys = pmm_alloc_page();
         if (!phys)
         {
@@ -112,7 +153,49 @@ static bool elf_load_segment(vfs_inode_t *node, Elf64_Phdr *ph, pml4_t pml4, uin
     return true;
 }
 
-bool elf_load(const char *path, uint64_t *entry_point, uint64_t *max_vaddr, pml4_t pml4)
+static bool elf_load_segment(vfs_inode_t *node, Elf64_Phdr *ph, pml4_t pml4, process_t *proc, uint64_t *max_vaddr)
+{
+    // Align start and end to page boundaries
+    uint64_t page_start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+    uint64_t page_end = (ph->p_vaddr + ph->p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint64_t lead = ph->p_vaddr - page_start;
+
+    if (max_vaddr && page_end > *max_vaddr)
+    {
+        *max_vaddr = page_end;
+    }
+
+    uint32_t flags = VMA_USER | VMA_READ;
+    if (ph->p_flags & PF_W)
+        flags |= VMA_WRITE;
+    if (ph->p_flags & PF_X)
+        flags |= VMA_EXEC;
+
+    // The file offset has to line up with the page so each page maps to one file range
+    if (proc && ph->p_offset >= lead && (ph->p_offset & (PAGE_SIZE - 1)) == lead)
+    {
+        vfs_inode_t *file = nullptr;
+        if (ph->p_filesz > 0)
+        {
+            file = vfs_clone(node);
+            if (!file)
+                return elf_load_segment_eager(node, ph, pml4, proc);
+        }
+
+        if (vm_area_add_file(proc, page_start, page_end, flags, file, ph->p_offset - lead, ph->p_filesz + lead))
+            return true;
+
+        if (file)
+        {
+            vfs_close(file);
+            kfree(file);
+        }
+    }
+
+    return elf_load_segment_eager(node, ph, pml4, proc);
+}
+
+bool elf_load(const char *path, uint64_t *entry_point, uint64_t *max_vaddr, pml4_t pml4, process_t *proc)
 {
     vfs_inode_t *node = vfs_resolve_path(path);
     if (!node)
@@ -162,7 +245,7 @@ bool elf_load(const char *path, uint64_t *entry_point, uint64_t *max_vaddr, pml4
         Elf64_Phdr *ph = &phdrs[i];
         if (ph->p_type == PT_LOAD)
         {
-            if (!elf_load_segment(node, ph, pml4, max_vaddr))
+            if (!elf_load_segment(node, ph, pml4, proc, max_vaddr))
             {
                 kfree(phdrs);
                 if (node != vfs_root)
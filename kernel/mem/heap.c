@@ -4,6 +4,7 @@
 #include "terminal.h"
 #include "list.h"
 #include "kasan.h"
+#include "spinlock.h"
 
 #define HEAP_MAGIC 0xC0FFEE1234567890
 #define SLAB_MIN_SIZE 32
@@ -31,6 +32,7 @@ typedef struct slab_header
 #define CACHE_COUNT 7
 
 static list_head_t slab_caches[CACHE_COUNT];
+static spinlock_t heap_lock; // Guards slab_caches and slab free lists across CPUs
 
 #ifdef KASAN
 #define KASAN_HEAP_ALIGNMENT 64
@@ -278,18 +280,12 @@ void *kmalloc(size_t size)
 #endif
 
     int index = get_cache_index(padded);
-    if (index >= 0)
-    {
-        void *ptr = alloc_slab(index);
-        kasan_adjust_allocation(ptr, size);
-        return ptr;
-    }
-    else
-    {
-        void *ptr = alloc_big(size);
-        kasan_adjust_allocation(ptr, size);
-        return ptr;
-    }
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(heap_lock, flags);
+    void *ptr = index >= 0 ? alloc_slab(index) : alloc_big(size);
+    kasan_adjust_allocation(ptr, size);
+    SPIN_UNLOCK_IRQRESTORE(heap_lock, flags);
+    return ptr;
 }
 
 void *kzalloc(size_t size)
@@ -318,6 +314,8 @@ void kfree(void *ptr)
         return;
     }
 
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(heap_lock, flags);
     if (header->is_slab)
     {
         uint8_t *slot_base = SLOT_BASE_FROM_USER(ptr);
@@ -340,7 +338,6 @@ void kfree(void *ptr)
                 // Free the page
                 void *phys = (void *)(page_start - g_hhdm_offset);
                 pmm_free_pages(phys, 1);
-                return;
             }
         }
     }
@@ -361,6 +358,7 @@ void kfree(void *ptr)
         void *phys = (void *)(page_start - g_hhdm_offset);
         pmm_free_pages(phys, header->page_count);
     }
+    SPIN_UNLOCK_IRQRESTORE(heap_lock, flags);
 }
 
 void *krealloc(void *ptr, size_t new_size)
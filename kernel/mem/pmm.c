@@ -1,33 +1,211 @@
+/**
+ * Physical memory manager
+ *
+ * Binary buddy allocator over every usable page reported by Limine. Free
+ * blocks of 2^order pages sit on per-order lists; allocation splits the
+ * smallest fitting block and freeing merges a block with its buddy while the
+ * buddy is free and of the same order. Page metadata lives in a flat array
+ * indexed by page frame number, carved out of usable memory at boot.
+ *
+ * Order-0 traffic (page tables, slab pages, user pages) goes through small
+ * per-CPU magazines so the common path touches no shared state; the magazine
+ * is refilled from and drained to the buddy lists in batches under pmm_lock.
+ *
+ * Allocated pages carry a reference count so copy-on-write mappings can share
+ * a frame; pmm_free_page() only returns the frame once the last user drops it.
+ */
+
 #include "pmm.h"
 #include "limine.h"
 #include "string.h"
 #include "terminal.h"
 #include "kasan.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "list.h"
 #include <stdint.h>
 
 __attribute__((used, section(".requests"))) static volatile struct limine_memmap_request memmap_request = {
     .id = LIMINE_MEMMAP_REQUEST,
     .revision = 0};
 
-static uint8_t *bitmap = nullptr;
-static size_t bitmap_size = 0;
+#define PAGE_MANAGED (1u << 0) // Backed by usable RAM; everything else is ignored
+#define PAGE_BUDDY (1u << 1)   // Head of a free block on free_area[order]
+
+typedef struct page
+{
+    list_head_t list;
+    uint8_t order;
+    uint8_t flags;
+    uint32_t refcount; // Mappings holding an allocated page; 0 while free
+} page_t;
+
+static page_t *pages = nullptr;
+static list_head_t free_area[PMM_MAX_ORDER + 1];
+static size_t free_pages = 0; // Pages on the buddy lists (magazines not included)
 static size_t highest_page = 0;
 static uint64_t highest_addr = 0;
 static uint64_t pmm_hhdm_offset = 0;
+static spinlock_t pmm_lock;
 
-static void bitmap_set(size_t bit)
+static inline size_t page_to_pfn(const page_t *page)
 {
-    bitmap[bit / 8] |= (1 << (bit % 8));
+    return (size_t)(page - pages);
 }
 
-static void bitmap_unset(size_t bit)
+static inline bool pfn_managed(size_t pfn)
 {
-    bitmap[bit / 8] &= ~(1 << (bit % 8));
+    return pfn < highest_page && (pages[pfn].flags & PAGE_MANAGED);
+}
+
+// Called with pmm_lock held.
+static void buddy_free(size_t pfn, uint32_t order)
+{
+    while (order < PMM_MAX_ORDER)
+    {
+        size_t buddy = pfn ^ (1ull << order);
+        if (!pfn_managed(buddy) || !(pages[buddy].flags & PAGE_BUDDY) || pages[buddy].order != order)
+            break;
+
+        list_del(&pages[buddy].list);
+        pages[buddy].flags &= (uint8_t)~PAGE_BUDDY;
+        free_pages -= 1ull << order;
+        pfn &= ~(1ull << order);
+        order++;
+    }
+
+    pages[pfn].order = (uint8_t)order;
+    pages[pfn].flags |= PAGE_BUDDY;
+    list_add(&pages[pfn].list, &free_area[order]);
+    free_pages += 1ull << order;
+}
+
+// Called with pmm_lock held. Returns the first pfn of the block or 0 (page 0 is never free).
+static size_t buddy_alloc(uint32_t order)
+{
+    for (uint32_t current = order; current <= PMM_MAX_ORDER; current++)
+    {
+        if (list_empty(&free_area[current]))
+            continue;
+
+        page_t *page = list_first_entry(&free_area[current], page_t, list);
+        list_del(&page->list);
+        page->flags &= (uint8_t)~PAGE_BUDDY;
+        free_pages -= 1ull << current;
+
+        size_t pfn = page_to_pfn(page);
+        while (current > order)
+        {
+            current--;
+            size_t split = pfn + (1ull << current);
+            pages[split].order = (uint8_t)current;
+            pages[split].flags |= PAGE_BUDDY;
+            list_add(&pages[split].list, &free_area[current]);
+            free_pages += 1ull << current;
+        }
+        page->order = (uint8_t)order;
+        return pfn;
+    }
+    return 0;
 }
 
-static int bitmap_test(size_t bit)
+// Called with pmm_lock held. Splits [pfn, pfn + count) into aligned power-of-two blocks.
+static void buddy_free_range(size_t pfn, size_t count)
 {
-    return bitmap[bit / 8] & (1 << (bit % 8));
+    while (count > 0)
+    {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER &&
+               (pfn & ((1ull << (order + 1)) - 1)) == 0 &&
+               (1ull << (order + 1)) <= count)
+        {
+            order++;
+        }
+
+        if (pfn_managed(pfn) && !(pages[pfn].flags & PAGE_BUDDY))
+            buddy_free(pfn, order);
+        pfn += 1ull << order;
+        count -= 1ull << order;
+    }
+}
+
+// Called with pmm_lock held. Runs longer than the largest buddy block are made of free
+// top-order blocks that follow each other. Returns the first pfn of the run or 0.
+static size_t buddy_alloc_large(size_t count)
+{
+    const size_t block = 1ull << PMM_MAX_ORDER;
+    const size_t blocks = (count + block - 1) / block;
+    page_t *page;
+    list_for_each_entry(page, &free_area[PMM_MAX_ORDER], list)
+    {
+        const size_t pfn = page_to_pfn(page);
+        size_t found = 1;
+        while (found < blocks)
+        {
+            const size_t next = pfn + found * block;
+            if (!pfn_managed(next) || !(pages[next].flags & PAGE_BUDDY) || pages[next].order != PMM_MAX_ORDER)
+                break;
+            found++;
+        }
+        if (found < blocks)
+            continue;
+
+        for (size_t i = 0; i < blocks; i++)
+        {
+            page_t *head = &pages[pfn + i * block];
+            list_del(&head->list);
+            head->flags &= (uint8_t)~PAGE_BUDDY;
+            free_pages -= block;
+        }
+        if (blocks * block > count)
+            buddy_free_range(pfn + count, blocks * block - count);
+        return pfn;
+    }
+    return 0;
+}
+
+// Drops one reference to the page and returns true if it was the last. A page that is
+// already free keeps a count of 0, also when two frees of it race.
+static bool page_put(size_t pfn)
+{
+    uint32_t ref = __atomic_load_n(&pages[pfn].refcount, __ATOMIC_ACQUIRE);
+    while (ref != 0)
+    {
+        if (__atomic_compare_exchange_n(&pages[pfn].refcount, &ref, ref - 1, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+            return ref == 1;
+    }
+    return false;
+}
+
+static uint32_t order_for(size_t count)
+{
+    uint32_t order = 0;
+    while ((1ull << order) < count)
+        order++;
+    return order;
+}
+
+static void kasan_mark_alloc(size_t pfn, size_t count)
+{
+#ifdef KASAN
+    if (kasan_is_ready())
+        kasan_unpoison_range((void *)(pfn * PAGE_SIZE + pmm_hhdm_offset), count * PAGE_SIZE);
+#else
+    (void)pfn;
+    (void)count;
+#endif
+}
+
+static void kasan_mark_free(size_t pfn, size_t count)
+{
+#ifdef KASAN
+    if (kasan_is_ready())
+        kasan_poison_range((void *)(pfn * PAGE_SIZE + pmm_hhdm_offset), count * PAGE_SIZE, KASAN_POISON_FREE);
+#else
+    (void)pfn;
+    (void)count;
+#endif
 }
 
 void pmm_init(uint64_t hhdm_offset)
@@ -55,59 +233,70 @@ void pmm_init(uint64_t hhdm_offset)
     }
 
     highest_page = highest_addr / PAGE_SIZE;
-    bitmap_size = highest_page / 8 + 1;
+    size_t pages_size = highest_page * sizeof(page_t);
+    size_t pages_pages = (pages_size + PAGE_SIZE - 1) / PAGE_SIZE;
     pmm_hhdm_offset = hhdm_offset;
 
-    // Find a place to put the bitmap
+    // Find a place to put the page array
+    uint64_t pages_phys = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++)
     {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE)
+        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= pages_pages * PAGE_SIZE)
         {
-            if (entry->length >= bitmap_size)
-            {
-                bitmap = (uint8_t *)(entry->base + hhdm_offset);
-                // Initialize bitmap to all 1s (used)
-                memset(bitmap, 0xFF, bitmap_size);
-                break;
-            }
+            pages_phys = entry->base;
+            pages = (page_t *)(entry->base + hhdm_offset);
+            memset(pages, 0, pages_size);
+            break;
         }
     }
 
-    if (bitmap == nullptr)
+    if (pages == nullptr)
     {
-        boot_message(ERROR, "Error: Could not find memory for PMM bitmap");
+        boot_message(ERROR, "Error: Could not find memory for PMM page array");
         for (;;)
             __asm__("hlt");
     }
 
-    // Mark usable regions as free (0) in the bitmap
+    for (int order = 0; order <= PMM_MAX_ORDER; order++)
+        INIT_LIST_HEAD(&free_area[order]);
+
+    // Mark usable pages as managed, except page 0 and the page array itself
+    uint64_t pages_start = pages_phys / PAGE_SIZE;
     for (uint64_t i = 0; i < memmap->entry_count; i++)
     {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE)
+        if (entry->type != LIMINE_MEMMAP_USABLE)
+            continue;
+
+        for (uint64_t j = 0; j < entry->length; j += PAGE_SIZE)
         {
-            for (uint64_t j = 0; j < entry->length; j += PAGE_SIZE)
-            {
-                bitmap_unset((entry->base + j) / PAGE_SIZE);
-            }
+            size_t pfn = (entry->base + j) / PAGE_SIZE;
+            if (pfn == 0 || (pfn >= pages_start && pfn < pages_start + pages_pages))
+                continue;
+            pages[pfn].flags = PAGE_MANAGED;
         }
     }
 
-    // Mark the bitmap itself as used
-    // Note: bitmap pointer is virtual (HHDM), we need physical address for page calculation
-    uint64_t bitmap_phys = (uint64_t)bitmap - hhdm_offset;
-    uint64_t bitmap_start_page = bitmap_phys / PAGE_SIZE;
-    uint64_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t i = 0; i < bitmap_pages; i++)
+    // Hand every managed run to the buddy lists
+    size_t run_start = 0;
+    size_t run_length = 0;
+    for (size_t pfn = 0; pfn <= highest_page; pfn++)
     {
-        bitmap_set(bitmap_start_page + i);
+        if (pfn < highest_page && (pages[pfn].flags & PAGE_MANAGED))
+        {
+            if (run_length == 0)
+                run_start = pfn;
+            run_length++;
+            continue;
+        }
+        if (run_length > 0)
+            buddy_free_range(run_start, run_length);
+        run_length = 0;
     }
 
-    // Mark the first page (0x0) as used to avoid null pointer confusion
-    bitmap_set(0);
-
-    boot_message(INFO, "PMM Initialized. Highest Address: 0x%lx, Bitmap Size: %lu bytes", highest_addr, bitmap_size);
+    boot_message(INFO, "PMM Initialized. Highest Address: 0x%lx, Free: %lu pages, Page array: %lu bytes",
+                 highest_addr, free_pages, pages_size);
 }
 
 uint64_t pmm_get_highest_addr(void)
@@ -115,87 +304,180 @@ uint64_t pmm_get_highest_addr(void)
     return highest_addr;
 }
 
+bool pmm_range_is_free(void *ptr, size_t count)
+{
+    const size_t first = (uint64_t)ptr / PAGE_SIZE;
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(pmm_lock, flags);
+    bool free = true;
+    for (size_t pfn = first; pfn < first + count && free; pfn++)
+    {
+        // Look for the head of a free block that covers pfn, from the smallest up
+        free = false;
+        for (uint32_t order = 0; order <= PMM_MAX_ORDER && !free; order++)
+        {
+            const size_t head = pfn & ~((1ull << order) - 1);
+            free = pfn_managed(head) && (pages[head].flags & PAGE_BUDDY) && pages[head].order >= order &&
+                   pfn < head + (1ull << pages[head].order);
+        }
+    }
+    SPIN_UNLOCK_IRQRESTORE(pmm_lock, flags);
+    return free;
+}
+
+size_t pmm_free_page_count(void)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(pmm_lock, flags);
+    size_t count = free_pages;
+    SPIN_UNLOCK_IRQRESTORE(pmm_lock, flags);
+    return count;
+}
+
 void *pmm_alloc_page(void)
 {
-    for (size_t i = 0; i < highest_page; i++)
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags)::"memory");
+
+    cpu_t *cpu = get_cpu();
+    if (cpu->page_cache.count == 0)
     {
-            if (!bitmap_test(i))
-            {
-                bitmap_set(i);
-                uintptr_t phys = i * PAGE_SIZE;
-                void *addr = (void *)phys;
-#ifdef KASAN
-                if (kasan_is_ready())
-                    kasan_unpoison_range((void *)(phys + pmm_hhdm_offset), PAGE_SIZE);
-#endif
-                return addr;
-            }
+        spinlock_acquire(&pmm_lock);
+        while (cpu->page_cache.count < PMM_CPU_CACHE_BATCH)
+        {
+            size_t pfn = buddy_alloc(0);
+            if (!pfn)
+                break;
+            cpu->page_cache.pfns[cpu->page_cache.count++] = pfn;
         }
-    return nullptr; // Out of memory
+        spinlock_release(&pmm_lock);
+    }
+
+    size_t pfn = 0;
+    if (cpu->page_cache.count > 0)
+        pfn = cpu->page_cache.pfns[--cpu->page_cache.count];
+
+    if (rflags & RFLAGS_IF)
+        __asm__ volatile("sti" ::: "memory");
+
+    if (!pfn)
+        return nullptr; // Out of memory
+
+    __atomic_store_n(&pages[pfn].refcount, 1, __ATOMIC_RELAXED);
+    kasan_mark_alloc(pfn, 1);
+    return (void *)(pfn * PAGE_SIZE);
 }
 
 void pmm_free_page(void *ptr)
 {
-    uint64_t addr = (uint64_t)ptr;
-    size_t page = addr / PAGE_SIZE;
-    bitmap_unset(page);
-#ifdef KASAN
-    if (kasan_is_ready())
-        kasan_poison_range((void *)(addr + pmm_hhdm_offset), PAGE_SIZE, KASAN_POISON_FREE);
-#endif
+    size_t pfn = (uint64_t)ptr / PAGE_SIZE;
+    if (!pfn_managed(pfn))
+        return;
+
+    // Ignore double frees and only release the frame with its last reference
+    if (!page_put(pfn))
+        return;
+
+    kasan_mark_free(pfn, 1);
+
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags)::"memory");
+
+    cpu_t *cpu = get_cpu();
+    if (cpu->page_cache.count == PMM_CPU_CACHE_SIZE)
+    {
+        // Drain the oldest half back to the buddy lists
+        spinlock_acquire(&pmm_lock);
+        for (uint32_t i = 0; i < PMM_CPU_CACHE_BATCH; i++)
+            buddy_free(cpu->page_cache.pfns[i], 0);
+        spinlock_release(&pmm_lock);
+
+        memmove(cpu->page_cache.pfns, cpu->page_cache.pfns + PMM_CPU_CACHE_BATCH,
+                (PMM_CPU_CACHE_SIZE - PMM_CPU_CACHE_BATCH) * sizeof(cpu->page_cache.pfns[0]));
+        cpu->page_cache.count -= PMM_CPU_CACHE_BATCH;
+    }
+    cpu->page_cache.pfns[cpu->page_cache.count++] = pfn;
+
+    if (rflags & RFLAGS_IF)
+        __asm__ volatile("sti" ::: "memory");
 }
 
 void *pmm_alloc_pages(size_t count)
 {
-    // Simple first-fit search for contiguous pages
-    for (size_t i = 0; i < highest_page; i++)
-    {
-        if (!bitmap_test(i))
-        {
-            size_t free_count = 0;
-            for (size_t j = 0; j < count; j++)
-            {
-                if (i + j < highest_page && !bitmap_test(i + j))
-                {
-                    free_count++;
-                }
-                else
-                {
-                    break;
-                }
-            }
+    if (count == 0)
+        return nullptr;
+    if (count == 1)
+        return pmm_alloc_page();
 
-            if (free_count == count)
-            {
-                for (size_t j = 0; j < count; j++)
-                {
-                    bitmap_set(i + j);
-                }
-#ifdef KASAN
-                if (kasan_is_ready())
-                    kasan_unpoison_range((void *)((i * PAGE_SIZE) + pmm_hhdm_offset), count * PAGE_SIZE);
-#endif
-                return (void *)(i * PAGE_SIZE);
-            }
-            else
-            {
-                i += free_count; // Skip checked pages
-            }
-        }
+    uint32_t order = order_for(count);
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(pmm_lock, flags);
+    size_t pfn;
+    if (order > PMM_MAX_ORDER)
+        pfn = buddy_alloc_large(count);
+    else
+    {
+        pfn = buddy_alloc(order);
+        // Give back the tail of the power-of-two block we did not ask for
+        if (pfn && (1ull << order) > count)
+            buddy_free_range(pfn + count, (1ull << order) - count);
     }
-    return nullptr;
+    SPIN_UNLOCK_IRQRESTORE(pmm_lock, flags);
+
+    if (!pfn)
+        return nullptr;
+
+    // Each page can be released on its own later (e.g. when unmapped one by one)
+    for (size_t i = 0; i < count; i++)
+        __atomic_store_n(&pages[pfn + i].refcount, 1, __ATOMIC_RELAXED);
+    kasan_mark_alloc(pfn, count);
+    return (void *)(pfn * PAGE_SIZE);
 }
 
 void pmm_free_pages(void *ptr, size_t count)
 {
-    uint64_t addr = (uint64_t)ptr;
-    size_t page = addr / PAGE_SIZE;
-    for (size_t i = 0; i < count; i++)
+    if (count == 1)
     {
-        bitmap_unset(page + i);
+        pmm_free_page(ptr);
+        return;
     }
-#ifdef KASAN
-    if (kasan_is_ready())
-        kasan_poison_range((void *)(addr + pmm_hhdm_offset), count * PAGE_SIZE, KASAN_POISON_FREE);
-#endif
+
+    size_t pfn = (uint64_t)ptr / PAGE_SIZE;
+    if (!pfn_managed(pfn))
+        return;
+
+    // Same rule as pmm_free_page() for every page: pages still shared (page cache,
+    // copy-on-write) or already freed on their own stay where they are, and the runs
+    // that lost their last reference go back to the buddy lists
+    size_t start = 0;
+    for (size_t i = 0; i <= count; i++)
+    {
+        if (i < count && pfn + i < highest_page && page_put(pfn + i))
+            continue;
+        if (i > start)
+        {
+            kasan_mark_free(pfn + start, i - start);
+            uint64_t flags;
+            SPIN_LOCK_IRQSAVE(pmm_lock, flags);
+            buddy_free_range(pfn + start, i - start);
+            SPIN_UNLOCK_IRQRESTORE(pmm_lock, flags);
+        }
+        start = i + 1;
+    }
+}
+
+void pmm_page_get(void *ptr)
+{
+    size_t pfn = (uint64_t)ptr / PAGE_SIZE;
+    if (pfn_managed(pfn))
+        __atomic_add_fetch(&pages[pfn].refcount, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t pmm_page_refcount(void *ptr)
+{
+    size_t pfn = (uint64_t)ptr / PAGE_SIZE;
+    if (!pfn_managed(pfn))
+        return 0;
+    return __atomic_load_n(&pages[pfn].refcount, __ATOMIC_ACQUIRE);
 }
@@ -121,7 +121,7 @@ pml4_t vmm_new_pml4(void)
     return (pml4_t)phys;
 }
 
-static void copy_page_table_level(uint64_t *dest_table, const uint64_t *src_table, int level)
+static void copy_page_table_level(uint64_t *dest_table, uint64_t *src_table, int level, bool cow)
 {
     for (int i = 0; i < 512; i++)
     {
@@ -133,7 +133,21 @@ static void copy_page_table_level(uint64_t *dest_table, const uint64_t *src_tabl
                 continue;
             }
 
-            if (level == 1) // PT level
+            if (level == 1 && cow) // PT level, share the frame
+            {
+                // Writable pages become read-only in both spaces until one side writes.
+                // Frames outside managed RAM (framebuffer mappings) stay shared as-is.
+                void *phys = (void *)(src_table[i] & 0x000FFFFFFFFFF000);
+                if (pmm_page_refcount(phys) != 0)
+                {
+                    if ((src_table[i] & PTE_WRITABLE) && !(src_table[i] & PTE_SHARED))
+                        src_table[i] = (src_table[i] & ~PTE_WRITABLE) | PTE_COW;
+                    pmm_page_get(phys);
+                }
+                // The writes so far were the parent's; the child writes back only what it dirties
+                dest_table[i] = src_table[i] & ~PTE_DIRTY;
+            }
+            else if (level == 1) // PT level
             {
                 void *new_phys = pmm_alloc_page();
                 if (!new_phys)
@@ -163,13 +177,13 @@ static void copy_page_table_level(uint64_t *dest_table, const uint64_t *src_tabl
                 uint64_t src_next_phys = src_table[i] & 0x000FFFFFFFFFF000;
                 uint64_t *src_next_virt = (uint64_t *)(src_next_phys + g_hhdm_offset);
 
-                copy_page_table_level(new_table_virt, src_next_virt, level - 1);
+                copy_page_table_level(new_table_virt, src_next_virt, level - 1, cow);
             }
         }
     }
 }
 
-pml4_t vmm_copy_pml4(pml4_t src_pml4)
+static pml4_t copy_pml4(pml4_t src_pml4, bool cow)
 {
     pml4_t new_pml4 = vmm_new_pml4();
     if (!new_pml4)
@@ -195,13 +209,85 @@ pml4_t vmm_copy_pml4(pml4_t src_pml4)
             uint64_t src_pdpt_phys = src_virt[i] & 0x000FFFFFFFFFF000;
             uint64_t *src_pdpt_virt = (uint64_t *)(src_pdpt_phys + g_hhdm_offset);
 
-            copy_page_table_level(new_pdpt_virt, src_pdpt_virt, 3);
+            copy_page_table_level(new_pdpt_virt, src_pdpt_virt, 3, cow);
         }
     }
 
+    // Source entries lost their write bit; drop stale TLB entries if it is live
+    uint64_t current_cr3;
+    __asm__ volatile("mov %0, cr3" : "=r"(current_cr3));
+    if (cow && (current_cr3 & 0x000FFFFFFFFFF000) == (uint64_t)src_pml4)
+        __asm__ volatile("mov cr3, %0" : : "r"(current_cr3) : "memory");
+
     return new_pml4;
 }
 
+pml4_t vmm_copy_pml4(pml4_t src_pml4)
+{
+    return copy_pml4(src_pml4, true);
+}
+
+pml4_t vmm_copy_pml4_eager(pml4_t src_pml4)
+{
+    return copy_pml4(src_pml4, false);
+}
+
+static uint64_t *get_pte(pml4_t pml4, uint64_t virt)
+{
+    uint64_t *pml4_virt = (uint64_t *)((uint64_t)pml4 + g_hhdm_offset);
+
+    uint64_t *pdpt_virt = get_next_level(pml4_virt, (virt >> 39) & 0x1FF, false);
+    if (!pdpt_virt)
+        return nullptr;
+
+    uint64_t *pd_virt = get_next_level(pdpt_virt, (virt >> 30) & 0x1FF, false);
+    if (!pd_virt || (pd_virt[(virt >> 21) & 0x1FF] & PTE_HUGE))
+        return nullptr;
+
+    uint64_t *pt_virt = get_next_level(pd_virt, (virt >> 21) & 0x1FF, false);
+    if (!pt_virt)
+        return nullptr;
+
+    return &pt_virt[(virt >> 12) & 0x1FF];
+}
+
+bool vmm_handle_cow_fault(pml4_t pml4, uint64_t virt)
+{
+    uint64_t *pte = get_pte(pml4, virt);
+    if (!pte || (*pte & (PTE_PRESENT | PTE_COW)) != (PTE_PRESENT | PTE_COW))
+        return false;
+
+    void *old_phys = (void *)(*pte & 0x000FFFFFFFFFF000);
+    uint64_t flags = (*pte & ~0x000FFFFFFFFFF000 & ~PTE_COW) | PTE_WRITABLE;
+
+    // Last sharer keeps the frame; everyone else takes a private copy
+    if (pmm_page_refcount(old_phys) > 1)
+    {
+        void *new_phys = pmm_alloc_page();
+        if (!new_phys)
+            return false;
+
+        memcpy((void *)((uint64_t)new_phys + g_hhdm_offset),
+               (void *)((uint64_t)old_phys + g_hhdm_offset),
+               PAGE_SIZE);
+        *pte = (uint64_t)new_phys | flags;
+        pmm_free_page(old_phys);
+    }
+    else
+    {
+        *pte = (uint64_t)old_phys | flags;
+    }
+
+    __asm__ volatile("invlpg [%0]" : : "r"(virt & ~0xFFFull) : "memory");
+    return true;
+}
+
+bool vmm_page_dirty(pml4_t pml4, uint64_t virt)
+{
+    const uint64_t *pte = get_pte(pml4, virt);
+    return pte && (*pte & (PTE_PRESENT | PTE_DIRTY)) == (PTE_PRESENT | PTE_DIRTY);
+}
+
 void vmm_switch_pml4(const uint64_t *pml4)
 {
     __asm__ volatile("mov cr3, %0" : : "r"(pml4) : "memory");
@@ -3,52 +3,82 @@
 #include "net/network.h"
 #include "heap.h"
 #include "process.h"
+#include "spinlock.h"
 #include "string.h"
+#include "timer.h"
 #include <arpa/inet.h>
 
 uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 struct arp_cache_entry *arp_cache;
+static ktimer_t *arp_expiry; // One expiry timer per cache slot
+static spinlock_t arp_lock;  // Taken with IRQs saved, the expiry callbacks run in the BSP timer IRQ
 
-void arp_init(void)
+static void arp_cache_expire(void *arg)
 {
-    arp_cache = kzalloc(sizeof(struct arp_cache_entry) * ARP_CACHE_SIZE);
+    struct arp_cache_entry *entry = arg;
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(arp_lock, flags);
+    memset(entry->ip, 0, 4);
+    memset(entry->mac, 0, 6);
+    entry->timestamp = 0;
+    SPIN_UNLOCK_IRQRESTORE(arp_lock, flags);
 }
 
-void arp_cache_remove_expired_entries(void)
+void arp_init(void)
 {
-    const uint32_t current_time = scheduler_ticks;
+    spinlock_init(&arp_lock);
+    arp_cache = kzalloc(sizeof(struct arp_cache_entry) * ARP_CACHE_SIZE);
+    arp_expiry = kzalloc(sizeof(ktimer_t) * ARP_CACHE_SIZE);
+    if (!arp_cache || !arp_expiry) {
+        // Without both there is no cache; lookups miss and additions are dropped
+        kfree(arp_cache);
+        kfree(arp_expiry);
+        arp_cache = nullptr;
+        arp_expiry = nullptr;
+        return;
+    }
+
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].ip[0] != 0 && current_time - arp_cache[i].timestamp > ARP_CACHE_TIMEOUT) {
-            memset(arp_cache[i].ip, 0, 4);
-            memset(arp_cache[i].mac, 0, 6);
-            arp_cache[i].timestamp = 0;
-        }
+        timer_init(&arp_expiry[i], arp_cache_expire, &arp_cache[i]);
     }
 }
 
 struct arp_cache_entry arp_cache_find(const uint8_t ip[static 4])
 {
-    arp_cache_remove_expired_entries();
+    struct arp_cache_entry found = {0};
+    if (!arp_cache)
+        return found;
 
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(arp_lock, flags);
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
         if (network_compare_ip_addresses(arp_cache[i].ip, ip)) {
-            return arp_cache[i];
+            found = arp_cache[i];
+            break;
         }
     }
-    return (struct arp_cache_entry){0};
+    SPIN_UNLOCK_IRQRESTORE(arp_lock, flags);
+    return found;
 }
 
 void arp_cache_add(uint8_t ip[static 4], uint8_t mac[static 6])
 {
+    if (!arp_cache)
+        return;
+
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(arp_lock, flags);
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
         if (arp_cache[i].ip[0] == 0) {
             memcpy(arp_cache[i].ip, ip, 4);
             memcpy(arp_cache[i].mac, mac, 6);
             arp_cache[i].timestamp = scheduler_ticks;
-            return;
+            timer_add(&arp_expiry[i], scheduler_ticks + ARP_CACHE_TIMEOUT);
+            break;
         }
     }
+    SPIN_UNLOCK_IRQRESTORE(arp_lock, flags);
 }
 
 void arp_receive_reply(uint8_t *packet)
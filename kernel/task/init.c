@@ -12,7 +12,7 @@ void init_process_entry(void)
     uint64_t max_vaddr = 0;
     uint64_t cr3;
     __asm__ volatile("mov %0, cr3" : "=r"(cr3));
-    if (!elf_load("/bin/init", &entry_point, &max_vaddr, (pml4_t)cr3))
+    if (!elf_load("/bin/init", &entry_point, &max_vaddr, (pml4_t)cr3, current_process))
     {
         boot_message(ERROR, "Failed to load /bin/init");
         while (1)
@@ -48,19 +48,9 @@ void init_process_entry(void)
         boot_message(WARNING, "Failed to open /dev/console for init process");
     }
 
-    // Allocate user stack
-    uint64_t stack_top = 0x7FFFFFFFF000;
-    uint64_t stack_size = 4 * 4096;
-    uint64_t stack_base = stack_top - stack_size;
-
-    // Map stack
-    pml4_t pml4 = (pml4_t)cr3;
-
-    for (uint64_t addr = stack_base; addr < stack_top; addr += 4096)
-    {
-        void *phys = pmm_alloc_page();
-        vmm_map_page(pml4, addr, (uint64_t)phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-    }
+    // Reserve the user stack; pages are faulted in on first touch
+    uint64_t stack_top = USER_STACK_TOP;
+    vm_area_add(current_process, stack_top - USER_STACK_SIZE, stack_top, VMA_READ | VMA_WRITE | VMA_USER | VMA_STACK);
 
     // Set up an empty argc/argv for _start.
     uint64_t user_rsp = stack_top - 16;
@@ -7,18 +7,27 @@
 #include "syscall.h"
 #include "spinlock.h"
 #include "apic.h"
+#include "smp.h"
+#include "timer.h"
+#include "util.h"
+#include "page_cache.h"
 
 #define TIME_SLICE_TICKS ((TIME_SLICE_MS * TIMER_FREQUENCY_HZ) / 1000)
 
 list_head_t process_list __attribute__((aligned(16))) = LIST_HEAD_INIT(process_list);
 process_t *kernel_process = nullptr;
-thread_t *idle_thread = nullptr;
 static int next_pid = 1;
 static int next_tid = 1;
 volatile uint64_t scheduler_ticks = 0;
 
 spinlock_t scheduler_lock;
-static bool scheduler_ready = false; // Ignore timer ticks until process_init completes
+static volatile bool scheduler_ready = false; // Ignore timer ticks until process_init completes
+
+// Threads blocked in thread_sleep() hang off a bucket chosen by hashing their
+// channel, so thread_wakeup() only visits threads that could match.
+#define WAIT_HASH_BITS 6
+#define WAIT_HASH_SIZE (1u << WAIT_HASH_BITS)
+static list_head_t wait_table[WAIT_HASH_SIZE];
 
 extern void fork_return(void);
 
@@ -31,6 +40,13 @@ void vm_area_init(process_t *proc)
 }
 
 vm_area_t *vm_area_add(process_t *proc, uint64_t start, uint64_t end, uint32_t flags)
+{
+    return vm_area_add_file(proc, start, end, flags, nullptr, 0, 0);
+}
+
+// The area takes ownership of file (a handle from vfs_clone) on success.
+vm_area_t *vm_area_add_file(process_t *proc, uint64_t start, uint64_t end, uint32_t flags,
+                            vfs_inode_t *file, uint64_t file_offset, uint64_t file_size)
 {
     if (!proc || start >= end)
         return nullptr;
@@ -60,6 +76,9 @@ vm_area_t *vm_area_add(process_t *proc, uint64_t start, uint64_t end, uint32_t f
     area->start = start;
     area->end = end;
     area->flags = flags;
+    area->file = file;
+    area->file_offset = file_offset;
+    area->file_size = file_size;
     list_add_tail(&area->list, &proc->vm_areas);
     proc->vm_area_count++;
     return area;
@@ -76,25 +95,308 @@ void vm_area_clone(process_t *dest, const process_t *src)
     vm_area_t *area;
     list_for_each_entry(area, &src->vm_areas, list)
     {
-        vm_area_add(dest, area->start, area->end, area->flags);
+        vfs_inode_t *file = area->file ? vfs_clone(area->file) : nullptr;
+        if (!vm_area_add_file(dest, area->start, area->end, area->flags, file, area->file_offset, area->file_size) &&
+            file)
+        {
+            vfs_close(file);
+            kfree(file);
+        }
     }
 }
 
-void vm_area_clear(process_t *proc)
+// Size of the file behind an area now. Other handles may have truncated or grown it since
+// the mapping was made, so the filesystem is asked before the area's own handle.
+static uint64_t vm_area_file_size(vfs_inode_t *file)
 {
-    if (!proc)
+    struct stat st;
+    if (file->iops && file->iops->stat && file->iops->stat(file, &st) == 0)
+        return st.size;
+    return file->size;
+}
+
+// Writes the pages of a shared, writable file mapping that were written through this
+// address space back to the file, without taking it past its current end.
+static void vm_area_writeback(const vm_area_t *area, pml4_t pml4)
+{
+    if (!area->file || (area->flags & (VMA_SHARED | VMA_WRITE)) != (VMA_SHARED | VMA_WRITE))
         return;
 
+    const uint64_t size = vm_area_file_size(area->file);
+    const uint64_t limit = size > area->file_offset ? min(area->file_size, size - area->file_offset) : 0;
+    for (uint64_t rel = 0; rel < limit; rel += PAGE_SIZE)
+    {
+        if (!vmm_page_dirty(pml4, area->start + rel))
+            continue;
+        uint64_t phys = vmm_virt_to_phys(pml4, area->start + rel);
+        uint64_t len = min(limit - rel, (uint64_t)PAGE_SIZE);
+        vfs_write(area->file, area->file_offset + rel, len, (uint8_t *)(phys + g_hhdm_offset));
+    }
+}
+
+// Frees a list of areas. pml4 is the address space they were mapped in, used to
+// write shared file mappings back; pass nullptr when nothing was ever touched.
+void vm_area_release(list_head_t *areas, pml4_t pml4)
+{
     vm_area_t *area, *tmp;
-    list_for_each_entry_safe(area, tmp, &proc->vm_areas, list)
+    list_for_each_entry_safe(area, tmp, areas, list)
     {
+        if (pml4)
+            vm_area_writeback(area, pml4);
         list_del(&area->list);
+        if (area->file)
+        {
+            vfs_close(area->file);
+            kfree(area->file);
+        }
         kfree(area);
     }
-    INIT_LIST_HEAD(&proc->vm_areas);
+    INIT_LIST_HEAD(areas);
+}
+
+void vm_area_clear(process_t *proc)
+{
+    if (!proc)
+        return;
+
+    vm_area_release(&proc->vm_areas, proc->pml4);
     proc->vm_area_count = 0;
 }
 
+// Exchanges the process's areas with a detached list, e.g. to keep the old
+// image around while exec builds the new one.
+void vm_area_swap(process_t *proc, list_head_t *areas)
+{
+    list_head_t tmp;
+    INIT_LIST_HEAD(&tmp);
+    while (!list_empty(&proc->vm_areas))
+    {
+        list_head_t *pos = proc->vm_areas.next;
+        list_del(pos);
+        list_add_tail(pos, &tmp);
+    }
+
+    proc->vm_area_count = 0;
+    while (!list_empty(areas))
+    {
+        list_head_t *pos = areas->next;
+        list_del(pos);
+        list_add_tail(pos, &proc->vm_areas);
+        proc->vm_area_count++;
+    }
+
+    while (!list_empty(&tmp))
+    {
+        list_head_t *pos = tmp.next;
+        list_del(pos);
+        list_add_tail(pos, areas);
+    }
+}
+
+vm_area_t *vm_area_find(process_t *proc, uint64_t addr)
+{
+    if (!proc)
+        return nullptr;
+
+    vm_area_t *area;
+    list_for_each_entry(area, &proc->vm_areas, list)
+    {
+        if (addr >= area->start && addr < area->end)
+            return area;
+    }
+    return nullptr;
+}
+
+// Maps the page of area containing addr into pml4: file-backed areas read
+// their bytes from the file, everything past file_size (BSS) is zero-filled.
+bool vm_area_populate(vm_area_t *area, pml4_t pml4, uint64_t addr)
+{
+    uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t rel = page - area->start;
+
+    uint64_t flags = PTE_PRESENT | PTE_USER;
+    if (area->flags & VMA_WRITE)
+        flags |= PTE_WRITABLE;
+    if (area->flags & VMA_SHARED)
+        flags |= PTE_SHARED;
+
+    // Whole file pages map the page cache frame itself: shared mappings write
+    // straight into it, private writable ones copy it on the first write. Shared
+    // mappings take the partial last page from the cache too, so all mappers see it.
+    const bool shared = flags & PTE_SHARED;
+    if (area->file && (shared ? rel < area->file_size : rel + PAGE_SIZE <= area->file_size) &&
+        (area->file_offset + rel) % PAGE_SIZE == 0)
+    {
+        const uint64_t index = (area->file_offset + rel) / PAGE_SIZE;
+        void *cached = shared ? page_cache_map_shared(area->file, index) : page_cache_map(area->file, index);
+        if (cached)
+        {
+            if ((flags & PTE_WRITABLE) && !(flags & PTE_SHARED))
+                flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+            vmm_map_page(pml4, page, (uint64_t)cached, flags);
+            return true;
+        }
+    }
+
+    void *phys = pmm_alloc_page();
+    if (!phys)
+        return false;
+
+    uint8_t *dest = (uint8_t *)((uint64_t)phys + g_hhdm_offset);
+    memset(dest, 0, PAGE_SIZE);
+
+    if (area->file && rel < area->file_size)
+    {
+        uint64_t len = area->file_size - rel;
+        if (len > PAGE_SIZE)
+            len = PAGE_SIZE;
+        if (vfs_read(area->file, area->file_offset + rel, len, dest) != len)
+        {
+            pmm_free_page(phys);
+            return false;
+        }
+    }
+
+    vmm_map_page(pml4, page, (uint64_t)phys, flags);
+    return true;
+}
+
+// True if [start, end) overlaps no area other than skip. A stack also claims
+// the guard gap below it, so nothing can be placed right underneath.
+static bool vm_area_range_free(process_t *proc, uint64_t start, uint64_t end, const vm_area_t *skip)
+{
+    vm_area_t *area;
+    list_for_each_entry(area, &proc->vm_areas, list)
+    {
+        if (area == skip)
+            continue;
+        uint64_t low = area->start;
+        if ((area->flags & VMA_STACK) && low >= USER_STACK_GUARD_GAP)
+            low -= USER_STACK_GUARD_GAP;
+        if (start < area->end && end > low)
+            return false;
+    }
+    return true;
+}
+
+// Unmaps [start, end) and drops the frames (shared copy-on-write frames only lose a reference)
+static void vm_area_unmap(process_t *proc, uint64_t start, uint64_t end)
+{
+    for (uint64_t va = start; va < end; va += PAGE_SIZE)
+    {
+        uint64_t phys = vmm_virt_to_phys(proc->pml4, va);
+        if (!phys)
+            continue;
+        vmm_unmap_page(proc->pml4, va);
+        pmm_free_page((void *)phys);
+    }
+}
+
+// Extends a stack area down to cover addr, leaving the guard gap to the area below.
+static vm_area_t *vm_area_grow_stack(process_t *proc, uint64_t addr)
+{
+    vm_area_t *area;
+    list_for_each_entry(area, &proc->vm_areas, list)
+    {
+        if (!(area->flags & VMA_STACK) || addr >= area->start || area->end - addr > USER_STACK_MAX)
+            continue;
+
+        uint64_t new_start = addr & ~(uint64_t)(PAGE_SIZE - 1);
+        if (new_start < USER_STACK_GUARD_GAP ||
+            !vm_area_range_free(proc, new_start - USER_STACK_GUARD_GAP, area->start, area))
+            return nullptr;
+        area->start = new_start;
+        return area;
+    }
+    return nullptr;
+}
+
+// Demand paging: called from the page-fault handler for not-present user pages.
+bool vm_area_handle_fault(process_t *proc, uint64_t addr, bool write)
+{
+    vm_area_t *area = vm_area_find(proc, addr);
+    if (!area)
+        area = vm_area_grow_stack(proc, addr);
+    if (!area || (write && !(area->flags & VMA_WRITE)))
+        return false;
+
+    return vm_area_populate(area, proc->pml4, addr);
+}
+
+// Moves the end of the heap area. Growing only reserves address space; pages
+// are zero-filled on first touch. Shrinking releases the pages past the new end.
+int vm_area_brk(process_t *proc, uint64_t old_brk, uint64_t new_brk)
+{
+    uint64_t new_end = align_up(new_brk, PAGE_SIZE);
+
+    vm_area_t *heap = nullptr;
+    vm_area_t *area;
+    list_for_each_entry(area, &proc->vm_areas, list)
+    {
+        if (area->flags & VMA_HEAP)
+        {
+            heap = area;
+            break;
+        }
+    }
+
+    if (!heap)
+    {
+        uint64_t start = align_up(old_brk, PAGE_SIZE);
+        if (new_end <= start)
+            return 0;
+        if (!vm_area_range_free(proc, start, new_end, nullptr))
+            return -1;
+        return vm_area_add(proc, start, new_end, VMA_READ | VMA_WRITE | VMA_USER | VMA_HEAP) ? 0 : -1;
+    }
+
+    if (new_end > heap->end)
+    {
+        if (!vm_area_range_free(proc, heap->end, new_end, heap))
+            return -1;
+        heap->end = new_end;
+        return 0;
+    }
+
+    if (new_end <= heap->start)
+    {
+        vm_area_unmap(proc, heap->start, heap->end);
+        list_del(&heap->list);
+        kfree(heap);
+        proc->vm_area_count--;
+        return 0;
+    }
+
+    vm_area_unmap(proc, new_end, heap->end);
+    heap->end = new_end;
+    return 0;
+}
+
+// munmap: removes the mmap area covering exactly [start, end), writing shared
+// file pages back first.
+int vm_area_unmap_area(process_t *proc, uint64_t start, uint64_t end)
+{
+    vm_area_t *area;
+    list_for_each_entry(area, &proc->vm_areas, list)
+    {
+        if (area->start != start || area->end != end || !(area->flags & VMA_MMAP))
+            continue;
+
+        vm_area_writeback(area, proc->pml4);
+        vm_area_unmap(proc, start, end);
+        list_del(&area->list);
+        if (area->file)
+        {
+            vfs_close(area->file);
+            kfree(area->file);
+        }
+        kfree(area);
+        proc->vm_area_count--;
+        return 0;
+    }
+    return -1;
+}
+
 [[noreturn]] static void idle_task(void)
 {
     while (1)
@@ -103,6 +405,112 @@ void vm_area_clear(process_t *proc)
     }
 }
 
+// Run queue helpers. All of them expect scheduler_lock to be held.
+// A thread is queued iff run_list.next is non-null (list_del clears it).
+static void runqueue_add(thread_t *thread)
+{
+    thread->state = THREAD_READY;
+    if (thread->run_list.next)
+        return;
+
+    cpu_t *cpu = smp_get_cpu(thread->cpu);
+    list_add_tail(&thread->run_list, &cpu->run_queue);
+    cpu->nr_ready++;
+}
+
+static void runqueue_remove(thread_t *thread)
+{
+    if (!thread->run_list.next)
+        return;
+
+    cpu_t *cpu = smp_get_cpu(thread->cpu);
+    list_del(&thread->run_list);
+    cpu->nr_ready--;
+}
+
+static thread_t *runqueue_pop(cpu_t *cpu)
+{
+    while (!list_empty(&cpu->run_queue))
+    {
+        thread_t *t = list_first_entry(&cpu->run_queue, thread_t, run_list);
+        list_del(&t->run_list);
+        cpu->nr_ready--;
+
+        // Threads killed while queued are dropped here; process_destroy frees them.
+        if (t->state == THREAD_READY)
+            return t;
+    }
+    return nullptr;
+}
+
+static list_head_t *wait_bucket(const void *chan)
+{
+    uint64_t key = (uint64_t)chan >> 4;
+    return &wait_table[(key * 0x9E3779B97F4A7C15ull) >> (64 - WAIT_HASH_BITS)];
+}
+
+static void waitq_add(thread_t *thread)
+{
+    list_add_tail(&thread->wait_list, wait_bucket(thread->chan));
+}
+
+static void waitq_remove(thread_t *thread)
+{
+    if (thread->wait_list.next)
+        list_del(&thread->wait_list);
+}
+
+static uint32_t cpu_load(const cpu_t *cpu)
+{
+    const thread_t *active = cpu->active_thread;
+    return cpu->nr_ready + ((active && !active->is_idle) ? 1 : 0);
+}
+
+// Least-loaded CPU that is already scheduling; falls back to the BSP during boot.
+static cpu_t *pick_cpu(void)
+{
+    cpu_t *best = smp_bsp();
+    uint32_t best_load = cpu_load(best);
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
+    {
+        cpu_t *cpu = smp_get_cpu(i);
+        if (!cpu || !cpu->sched_online)
+            continue;
+
+        uint32_t load = cpu_load(cpu);
+        if (load < best_load)
+        {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static bool thread_on_cpu(const thread_t *thread)
+{
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
+    {
+        const cpu_t *cpu = smp_get_cpu(i);
+        if (cpu && cpu->active_thread == thread)
+            return true;
+    }
+    return false;
+}
+
+static void sleep_timer_expired(void *arg)
+{
+    thread_t *thread = arg;
+    uint64_t rflags;
+    SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
+    if (thread->state == THREAD_BLOCKED && thread->sleep_until)
+    {
+        thread->sleep_until = 0;
+        runqueue_add(thread);
+    }
+    SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
+}
+
 #ifdef TEST_MODE
 // #define SCHED_LOG(fmt, ...) printf(fmt "\n", ##__VA_ARGS__)
 #define SCHED_LOG(fmt, ...) ((void)0)
@@ -115,35 +523,32 @@ bool scheduler_tick(void)
     if (!scheduler_ready)
         return false;
 
-    scheduler_ticks++;
+    cpu_t *cpu = get_cpu();
+    if (!cpu->sched_online)
+        return false;
+
     bool need_resched = false;
 
-    spinlock_acquire(&scheduler_lock);
-    process_t *p;
-    list_for_each_entry(p, &process_list, list)
+    // Every CPU takes LAPIC ticks; only the BSP advances the clock and fires
+    // timers. Timer callbacks take scheduler_lock themselves.
+    if (cpu == smp_bsp())
     {
-        if (list_empty(&p->threads))
-        {
-            continue;
-        }
-
-        thread_t *t;
-        list_for_each_entry(t, &p->threads, list)
-        {
-            if (t->state == THREAD_BLOCKED && t->sleep_until && t->sleep_until <= scheduler_ticks)
-            {
-                t->state = THREAD_READY;
-                t->sleep_until = 0;
-                need_resched = true;
-            }
-        }
+        scheduler_ticks++;
+        timer_run(scheduler_ticks);
     }
 
-    thread_t *curr = get_current_thread();
+    spinlock_acquire(&scheduler_lock);
+
+    thread_t *curr = cpu->active_thread;
     if (curr)
     {
         if (curr->is_idle)
         {
+            need_resched = cpu->nr_ready > 0;
+        }
+        else if (curr->state == THREAD_TERMINATED)
+        {
+            // Killed from another CPU while running here.
             need_resched = true;
         }
         else if (curr->state == THREAD_RUNNING)
@@ -163,6 +568,8 @@ bool scheduler_tick(void)
 void process_init(void)
 {
     spinlock_init(&scheduler_lock);
+    for (uint32_t i = 0; i < WAIT_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&wait_table[i]);
 
     // Initialize the first kernel process (idle task / initial kernel task)
     kernel_process = kmalloc(sizeof(process_t));
@@ -190,6 +597,7 @@ void process_init(void)
         return;
     }
     memset(kernel_thread, 0, sizeof(thread_t));
+    timer_init(&kernel_thread->sleep_timer, sleep_timer_expired, kernel_thread);
 
     kernel_thread->tid = next_tid++;
     kernel_thread->process = kernel_process;
@@ -199,6 +607,7 @@ void process_init(void)
     // For the initial kernel thread, we assume we are running on a valid stack.
     cpu_t *cpu = get_cpu();
     kernel_thread->kstack_top = cpu->kernel_rsp;
+    kernel_thread->cpu = cpu->id;
 
     kernel_thread->is_idle = false;
 
@@ -210,19 +619,52 @@ void process_init(void)
     // Set current thread for this CPU
     cpu->active_thread = kernel_thread;
 
-    // Create the actual idle thread
-    idle_thread = thread_create(kernel_process, idle_task, false);
-    if (idle_thread)
+    // Each CPU gets its own idle thread. Idle threads never sit on a run queue;
+    // sched() falls back to them when the local queue is empty.
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
     {
-        idle_thread->is_idle = true;
-    }
-    else
-    {
-        boot_message(ERROR, "Process: Failed to create idle thread");
+        cpu_t *c = smp_get_cpu(i);
+        if (!c)
+            continue;
+
+        thread_t *idle = thread_alloc(kernel_process, idle_task);
+        if (!idle)
+        {
+            boot_message(ERROR, "Process: Failed to create idle thread for CPU %u", i);
+            continue;
+        }
+        idle->is_idle = true;
+        idle->cpu = c->id;
+        c->idle_thread = idle;
     }
 
     boot_message(INFO, "Process: Initialized kernel process PID %d", kernel_process->pid);
-    scheduler_ready = true;
+    cpu->sched_online = true;
+    __atomic_store_n(&scheduler_ready, true, __ATOMIC_RELEASE);
+}
+
+[[noreturn]] void scheduler_enter_ap(void)
+{
+    cpu_t *cpu = get_cpu();
+
+    while (!__atomic_load_n(&scheduler_ready, __ATOMIC_ACQUIRE))
+        __asm__ volatile("pause");
+
+    thread_t *idle = cpu->idle_thread;
+    if (!idle)
+        hcf();
+
+    // The Limine boot stack is abandoned here: switch_to saves into a throwaway
+    // thread and this CPU continues on its idle thread, which releases the lock.
+    thread_t boot;
+    spinlock_acquire(&scheduler_lock);
+    idle->state = THREAD_RUNNING;
+    cpu->active_thread = idle;
+    cpu->sched_online = true;
+    syscall_set_stack(idle->kstack_top);
+    restore_fpu_state(&idle->fpu_state);
+    switch_to(&boot, idle);
+    __builtin_unreachable();
 }
 
 process_t *process_create(const char *name)
@@ -272,6 +714,7 @@ void process_copy_fds(process_t *dest, const process_t *src)
             {
                 new_desc->flags = old_desc->flags;
                 new_desc->offset = old_desc->offset;
+                new_desc->ra = old_desc->ra;
                 new_desc->ref = 1; // Initialize ref count for new descriptor
 
                 if (old_desc->inode)
@@ -320,10 +763,27 @@ void process_destroy(process_t *proc)
     if (!proc)
         return;
 
-    // Free threads
+    // Sleep timer callbacks take scheduler_lock, so disarm them before holding it.
     thread_t *t, *next_t;
+    list_for_each_entry(t, &proc->threads, list)
+    {
+        timer_cancel(&t->sleep_timer);
+    }
+
+    // Free threads. A dying thread may still be switching away on another CPU,
+    // so wait until no CPU has it active before freeing its stack.
+    uint64_t rflags;
+    SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
     list_for_each_entry_safe(t, next_t, &proc->threads, list)
     {
+        while (thread_on_cpu(t))
+        {
+            SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
+            __asm__ volatile("pause");
+            SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
+        }
+        runqueue_remove(t);
+        waitq_remove(t);
         list_del(&t->list);
 
         // Free kernel stack
@@ -333,6 +793,7 @@ void process_destroy(process_t *proc)
 
         kfree(t);
     }
+    SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
 
     // Free file descriptors (respecting reference counts)
     // Note: Multiple fd entries can point to the same descriptor due to dup()
@@ -393,7 +854,6 @@ void process_destroy(process_t *proc)
         vmm_destroy_pml4(proc->pml4);
     }
 
-    uint64_t rflags;
     SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
     list_del(&proc->list);
     SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
@@ -401,7 +861,9 @@ void process_destroy(process_t *proc)
     kfree(proc);
 }
 
-thread_t *thread_create(process_t *process, void (*entry)(void), [[maybe_unused]] bool is_user)
+// Allocates a thread with its kernel stack and initial context but does not make
+// it runnable; callers that still need to fill in fields finish with thread_start().
+thread_t *thread_alloc(process_t *process, void (*entry)(void))
 {
     thread_t *thread = kmalloc(sizeof(thread_t));
     if (!thread)
@@ -413,8 +875,9 @@ thread_t *thread_create(process_t *process, void (*entry)(void), [[maybe_unused]
     spinlock_release(&scheduler_lock);
 
     thread->process = process;
-    thread->state = THREAD_READY;
+    thread->state = THREAD_BLOCKED;
     thread->ticks_remaining = TIME_SLICE_TICKS;
+    timer_init(&thread->sleep_timer, sleep_timer_expired, thread);
 
     init_fpu_state(&thread->fpu_state);
 
@@ -448,6 +911,36 @@ thread_t *thread_create(process_t *process, void (*entry)(void), [[maybe_unused]
     return thread;
 }
 
+// Places the thread on the least-loaded CPU's run queue.
+void thread_start(thread_t *thread)
+{
+    uint64_t rflags;
+    SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
+    thread->cpu = pick_cpu()->id;
+    runqueue_add(thread);
+    SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
+}
+
+// Places the thread on the given CPU's run queue. Threads never migrate, so it stays there.
+void thread_start_on(thread_t *thread, uint32_t cpu)
+{
+    uint64_t rflags;
+    SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
+    thread->cpu = cpu;
+    runqueue_add(thread);
+    SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
+}
+
+thread_t *thread_create(process_t *process, void (*entry)(void), [[maybe_unused]] bool is_user)
+{
+    thread_t *thread = thread_alloc(process, entry);
+    if (!thread)
+        return nullptr;
+
+    thread_start(thread);
+    return thread;
+}
+
 thread_t *get_current_thread(void)
 {
     cpu_t *cpu = get_cpu();
@@ -480,78 +973,17 @@ static void sched(void)
     }
 #endif
 
-    thread_t *next_thread = nullptr;
     if (!curr)
         return;
 
-    process_t *p = curr->process;
-
-    // Search remaining threads in current process
-    list_head_t *t_node = curr->list.next;
-    while (t_node != &p->threads)
-    {
-        thread_t *t = list_entry(t_node, thread_t, list);
-        if (t->state == THREAD_READY && !t->is_idle)
-        {
-            next_thread = t;
-            goto found;
-        }
-        t_node = t_node->next;
-    }
-
-    // Search subsequent processes
-    list_head_t *p_node = p->list.next;
-    while (p_node != &process_list)
-    {
-        process_t *next_p = list_entry(p_node, process_t, list);
-        thread_t *t;
-        list_for_each_entry(t, &next_p->threads, list)
-        {
-            if (t->state == THREAD_READY && !t->is_idle)
-            {
-                next_thread = t;
-                goto found;
-            }
-        }
-        p_node = p_node->next;
-    }
-
-    // Search from beginning of process list to current process
-    p_node = process_list.next;
-    while (p_node != &p->list)
-    {
-        process_t *prev_p = list_entry(p_node, process_t, list);
-        thread_t *t;
-        list_for_each_entry(t, &prev_p->threads, list)
-        {
-            if (t->state == THREAD_READY && !t->is_idle)
-            {
-                next_thread = t;
-                goto found;
-            }
-        }
-        p_node = p_node->next;
-    }
-
-    // Search current process from start to current thread
-    t_node = p->threads.next;
-    while (t_node != &curr->list)
-    {
-        thread_t *t = list_entry(t_node, thread_t, list);
-        if (t->state == THREAD_READY && !t->is_idle)
-        {
-            next_thread = t;
-            goto found;
-        }
-        t_node = t_node->next;
-    }
+    // A thread giving up the CPU while still runnable goes to the back of the queue.
+    if (curr->state == THREAD_RUNNING && !curr->is_idle)
+        runqueue_add(curr);
 
+    thread_t *next_thread = runqueue_pop(cpu);
     if (!next_thread)
-    {
-        next_thread = idle_thread;
-    }
+        next_thread = cpu->idle_thread;
 
-found:
     if (next_thread && next_thread != curr)
     {
         thread_t *prev = curr;
@@ -576,6 +1008,7 @@ found:
         restore_fpu_state(&next_thread->fpu_state);
 
         cpu->active_thread = next_thread;
+        cpu->nr_switches++;
         next_thread->state = THREAD_RUNNING;
         next_thread->ticks_remaining = TIME_SLICE_TICKS;
         if (prev->state == THREAD_RUNNING)
@@ -596,6 +1029,11 @@ found:
     }
     else
     {
+        if (curr->state == THREAD_READY)
+        {
+            curr->state = THREAD_RUNNING;
+            curr->ticks_remaining = TIME_SLICE_TICKS;
+        }
         SCHED_LOG("no switch, staying on PID %d TID %d (state=%d)",
                   curr->process ? curr->process->pid : -1, curr->tid, curr->state);
         // spinlock_release(&scheduler_lock); // Handled by caller
@@ -645,9 +1083,11 @@ void thread_sleep(void *chan, spinlock_t *lock)
 
     curr->chan = chan;
     curr->state = THREAD_BLOCKED;
+    waitq_add(curr);
 
     sched();
 
+    waitq_remove(curr);
     curr->chan = nullptr;
 
     if (lock != &scheduler_lock)
@@ -662,26 +1102,65 @@ void thread_sleep(void *chan, spinlock_t *lock)
         __asm__ volatile("sti");
 }
 
+// Blocks the current thread until scheduler_ticks reaches `tick`.
+void thread_sleep_until(uint64_t tick)
+{
+    thread_t *curr = get_current_thread();
+    if (!curr)
+        return;
+
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags));
+    spinlock_acquire(&scheduler_lock);
+
+    if (tick > scheduler_ticks)
+    {
+        curr->sleep_until = tick;
+        curr->state = THREAD_BLOCKED;
+        timer_add(&curr->sleep_timer, tick);
+        sched();
+        curr->sleep_until = 0;
+    }
+
+    spinlock_release(&scheduler_lock);
+    if (rflags & RFLAGS_IF)
+        __asm__ volatile("sti");
+}
+
 void thread_wakeup(void *chan)
 {
     uint64_t rflags;
     SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
-    process_t *p;
-    list_for_each_entry(p, &process_list, list)
+    thread_t *t, *tmp;
+    list_for_each_entry_safe(t, tmp, wait_bucket(chan), wait_list)
     {
-        thread_t *t;
-        list_for_each_entry(t, &p->threads, list)
+        if (t->chan == chan && t->state == THREAD_BLOCKED)
         {
-            if (t->state == THREAD_BLOCKED && t->chan == chan)
-            {
-                t->state = THREAD_READY;
-                t->chan = nullptr;
-            }
+            waitq_remove(t);
+            t->chan = nullptr;
+            runqueue_add(t);
         }
     }
     SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
 }
 
+// Wakes a specific thread blocked without a channel (e.g. the keyboard reader).
+void thread_wake(thread_t *thread)
+{
+    if (!thread)
+        return;
+
+    uint64_t rflags;
+    SPIN_LOCK_IRQSAVE(scheduler_lock, rflags);
+    if (thread->state == THREAD_BLOCKED)
+    {
+        waitq_remove(thread);
+        thread->chan = nullptr;
+        runqueue_add(thread);
+    }
+    SPIN_UNLOCK_IRQRESTORE(scheduler_lock, rflags);
+}
+
 void yield(void)
 {
     schedule();
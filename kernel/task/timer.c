@@ -0,0 +1,182 @@
+/**
+ * Hierarchical timer wheel
+ *
+ * Three levels: 256 one-tick slots, then 64 slots of 256 ticks and 64 slots
+ * of 16384 ticks. A timer is filed by how far away it is; when the first
+ * level wraps, the next slot of the outer level is cascaded down. Adding and
+ * cancelling are O(1) and each tick only touches the timers that expire.
+ */
+
+#include "timer.h"
+#include "spinlock.h"
+#include "apic.h"
+
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TIMER_MAX_DELTA ((1ull << (TVR_BITS + 2 * TVN_BITS)) - 1)
+
+static list_head_t tv1[TVR_SIZE];
+static list_head_t tv2[TVN_SIZE];
+static list_head_t tv3[TVN_SIZE];
+static uint64_t timer_clock = 0; // Next tick the wheel will process
+static bool wheel_ready = false;
+static spinlock_t timer_lock;
+static ktimer_t *volatile running_timer = nullptr;
+
+static void wheel_init(void)
+{
+    for (int i = 0; i < TVR_SIZE; i++)
+        INIT_LIST_HEAD(&tv1[i]);
+    for (int i = 0; i < TVN_SIZE; i++)
+    {
+        INIT_LIST_HEAD(&tv2[i]);
+        INIT_LIST_HEAD(&tv3[i]);
+    }
+    wheel_ready = true;
+}
+
+// Called with timer_lock held.
+static void wheel_insert(ktimer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    list_head_t *slot;
+
+    if (expires < timer_clock)
+    {
+        // Already due: run on the next processed tick.
+        slot = &tv1[timer_clock & TVR_MASK];
+    }
+    else
+    {
+        uint64_t delta = expires - timer_clock;
+        if (delta < TVR_SIZE)
+        {
+            slot = &tv1[expires & TVR_MASK];
+        }
+        else if (delta < (1ull << (TVR_BITS + TVN_BITS)))
+        {
+            slot = &tv2[(expires >> TVR_BITS) & TVN_MASK];
+        }
+        else
+        {
+            // Beyond the wheel's range: park in the farthest slot and re-file on cascade.
+            if (delta > TIMER_MAX_DELTA)
+                expires = timer_clock + TIMER_MAX_DELTA;
+            slot = &tv3[(expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK];
+        }
+    }
+
+    list_add_tail(&timer->list, slot);
+    timer->pending = true;
+}
+
+static void wheel_cascade(list_head_t *level, uint64_t index)
+{
+    ktimer_t *timer, *tmp;
+    list_for_each_entry_safe(timer, tmp, &level[index], list)
+    {
+        list_del(&timer->list);
+        wheel_insert(timer);
+    }
+}
+
+void timer_init(ktimer_t *timer, timer_callback_t callback, void *arg)
+{
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->list.next = nullptr;
+    timer->list.prev = nullptr;
+    timer->pending = false;
+}
+
+void timer_add(ktimer_t *timer, uint64_t expires)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(timer_lock, flags);
+    if (!wheel_ready)
+        wheel_init();
+    if (timer->pending)
+        list_del(&timer->list);
+    timer->expires = expires;
+    wheel_insert(timer);
+    SPIN_UNLOCK_IRQRESTORE(timer_lock, flags);
+}
+
+bool timer_cancel(ktimer_t *timer)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(timer_lock, flags);
+    bool was_pending = timer->pending;
+    if (was_pending)
+    {
+        list_del(&timer->list);
+        timer->pending = false;
+    }
+    SPIN_UNLOCK_IRQRESTORE(timer_lock, flags);
+
+    // The callback may be executing on the BSP right now; callers usually free
+    // the timer (or its owner) next, so wait for it to finish.
+    while (running_timer == timer)
+        __asm__ volatile("pause");
+
+    return was_pending;
+}
+
+bool timer_pending(const ktimer_t *timer)
+{
+    return timer->pending;
+}
+
+uint64_t timer_ms_to_ticks(uint64_t ms)
+{
+    uint64_t ticks = (ms * TIMER_FREQUENCY_HZ + 999) / 1000;
+    return ticks ? ticks : 1;
+}
+
+void timer_run(uint64_t now)
+{
+    uint64_t flags;
+    SPIN_LOCK_IRQSAVE(timer_lock, flags);
+    if (!wheel_ready)
+    {
+        timer_clock = now + 1;
+        SPIN_UNLOCK_IRQRESTORE(timer_lock, flags);
+        return;
+    }
+
+    while (timer_clock <= now)
+    {
+        uint64_t index = timer_clock & TVR_MASK;
+        if (index == 0)
+        {
+            uint64_t index2 = (timer_clock >> TVR_BITS) & TVN_MASK;
+            if (index2 == 0)
+                wheel_cascade(tv3, (timer_clock >> (TVR_BITS + TVN_BITS)) & TVN_MASK);
+            wheel_cascade(tv2, index2);
+        }
+
+        list_head_t *slot = &tv1[index];
+        while (!list_empty(slot))
+        {
+            ktimer_t *timer = list_first_entry(slot, ktimer_t, list);
+            list_del(&timer->list);
+            timer->pending = false;
+            running_timer = timer;
+
+            timer_callback_t callback = timer->callback;
+            void *arg = timer->arg;
+            SPIN_UNLOCK_IRQRESTORE(timer_lock, flags);
+            if (callback)
+                callback(arg);
+            SPIN_LOCK_IRQSAVE(timer_lock, flags);
+            running_timer = nullptr;
+        }
+        timer_clock++;
+    }
+    SPIN_UNLOCK_IRQRESTORE(timer_lock, flags);
+}
@@ -2,6 +2,8 @@
 #include "terminal.h"
 #include "string.h"
 #include "test.h"
+#include "tsc.h"
+#include "storage.h"
 
 TEST(bio_test)
 {
@@ -102,3 +104,101 @@ TEST(bio_test)
     printk("BIO Stress: Completed successfully.\n");
     return true;
 }
+
+TEST(bio_block_shares_sectors)
+{
+    // Neighbouring sectors of one cache block come from a single read
+    uint32_t spb = bio_block_size() / BIO_BLOCK_SIZE;
+    uint32_t base = 4096;
+    buffer_head_t *first = bread(0, base);
+    TEST_ASSERT(first != nullptr);
+    brelse(first);
+
+    buffer_head_t *last = bread(0, base + spb - 1);
+    TEST_ASSERT(last != nullptr);
+    bool ok = last->owner == first->owner && last->data == first->data + (spb - 1) * BIO_BLOCK_SIZE;
+    ok = ok && (last->flags & BIO_FLAG_VALID);
+    brelse(last);
+    return ok;
+}
+
+TEST(bio_cache_benchmark)
+{
+    const uint32_t spb = bio_block_size() / BIO_BLOCK_SIZE;
+    const size_t cache = bio_cache_blocks();
+    const uint32_t base = 4096;
+    const size_t sets[] = {16, 64, 256, cache / 2, cache, cache * 2};
+
+    for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+    {
+        size_t working = sets[s] > 4096 ? 4096 : sets[s];
+        if (working == 0)
+            continue;
+
+        // Warm up, then cycle over the working set
+        for (size_t i = 0; i < working; i++)
+        {
+            buffer_head_t *bh = bread(0, base + i * spb);
+            TEST_ASSERT(bh != nullptr);
+            brelse(bh);
+        }
+
+        const size_t accesses = 4096;
+        uint64_t start = tsc_nanos();
+        for (size_t i = 0; i < accesses; i++)
+        {
+            buffer_head_t *bh = bread(0, base + (i % working) * spb);
+            TEST_ASSERT(bh != nullptr);
+            brelse(bh);
+        }
+        uint64_t elapsed = tsc_nanos() - start;
+        if (elapsed == 0)
+            elapsed = 1;
+
+        uint64_t mib_s = (uint64_t)accesses * bio_block_size() * 1000000000ull / elapsed / (1024 * 1024);
+        printk("bio: %lu/%lu blocks: %lu ns per bread, %lu MiB/s\n", working, cache, elapsed / accesses, mib_s);
+    }
+    return true;
+}
+
+TEST(bio_dirty_buffer_written_on_sync)
+{
+    const uint32_t sector = 2300;
+    uint8_t disk[BIO_BLOCK_SIZE];
+
+    buffer_head_t *bh = bread(0, sector);
+    TEST_ASSERT(bh != nullptr);
+    uint32_t old = *(uint32_t *)bh->data;
+    uint32_t value = old ^ 0x5A5A5A5A;
+    *(uint32_t *)bh->data = value;
+    bdirty(bh);
+    brelse(bh);
+
+    // Still only in memory until the flusher or a sync gets to it
+    TEST_ASSERT(storage_read(0, sector, 1, disk) == 0);
+    bool deferred = *(uint32_t *)disk == old;
+
+    bio_sync();
+    TEST_ASSERT(storage_read(0, sector, 1, disk) == 0);
+    TEST_ASSERT(*(uint32_t *)disk == value);
+    return deferred;
+}
+
+TEST(bio_readahead_fills_range)
+{
+    const uint32_t start = 8195;
+    const uint32_t count = 300;
+    uint8_t disk[BIO_BLOCK_SIZE];
+
+    breada(0, start, count);
+    for (uint32_t i = 0; i < count; i += 37)
+    {
+        buffer_head_t *bh = bread(0, start + i);
+        TEST_ASSERT(bh != nullptr);
+        bool valid = bh->flags & BIO_FLAG_VALID;
+        bool same = storage_read(0, start + i, 1, disk) == 0 && memcmp(disk, bh->data, BIO_BLOCK_SIZE) == 0;
+        brelse(bh);
+        TEST_ASSERT(valid && same);
+    }
+    return true;
+}
@@ -21,6 +21,7 @@
 #include "vfs.h"
 #include "string.h"
 #include "heap.h"
+#include "ext2.h"
 
 // Helper to generate unique file paths
 static void make_test_path(char *buf, size_t size, const char *base, int index)
@@ -426,3 +427,59 @@ TEST(test_ext2_directory_isolation)
 
     return true;
 }
+
+/**
+ * Test: Goal-based block allocation
+ *
+ * A file written in one go should get its direct blocks back to back with the
+ * single-indirect block right after them, and the allocator's free counts should
+ * drop by exactly what the file took and come back when it is deleted.
+ */
+TEST(test_ext2_contiguous_allocation)
+{
+    if (!vfs_root)
+        return false;
+
+    const char *path = "/disk1/contiguous_alloc_test.bin";
+    const uint32_t size = 64 * EXT2_BSIZE;
+
+    vfs_unlink((char *)path);
+    TEST_ASSERT(vfs_mknod((char *)path, VFS_FILE, 0) == 0);
+    vfs_inode_t *file = vfs_resolve_path(path);
+    TEST_ASSERT(file != nullptr);
+    const struct ext2_inode *ip = file->device;
+    const uint32_t dev = ip->dev;
+
+    uint32_t blocks_before, inodes_before;
+    TEST_ASSERT(ext2_free_counts(dev, &blocks_before, &inodes_before) == 0);
+
+    uint8_t *data = kmalloc(size);
+    uint8_t *check = kmalloc(size);
+    TEST_ASSERT(data != nullptr && check != nullptr);
+    for (uint32_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 13 + i / EXT2_BSIZE);
+
+    bool ok = vfs_write(file, 0, size, data) == size;
+    ok = ok && vfs_read(file, 0, size, check) == size && memcmp(data, check, size) == 0;
+
+    // 64 data blocks and the single-indirect block
+    uint32_t blocks_after, inodes_after;
+    ok = ok && ext2_free_counts(dev, &blocks_after, &inodes_after) == 0;
+    ok = ok && blocks_before - blocks_after == size / EXT2_BSIZE + 1;
+
+    const struct ext2fs_addrs *ad = ip->addrs;
+    for (uint32_t i = 1; i < EXT2_NDIR_BLOCKS; i++)
+        ok = ok && ad->addrs[i] == ad->addrs[0] + i;
+    ok = ok && ad->addrs[EXT2_IND_BLOCK] == ad->addrs[0] + EXT2_NDIR_BLOCKS;
+
+    kfree(data);
+    kfree(check);
+    vfs_close(file);
+    kfree(file);
+
+    // Deleting gives back the blocks and the inode
+    ok = ok && vfs_unlink((char *)path) == 0;
+    ok = ok && ext2_free_counts(dev, &blocks_after, &inodes_after) == 0;
+    ok = ok && blocks_after == blocks_before && inodes_after == inodes_before + 1;
+    return ok;
+}
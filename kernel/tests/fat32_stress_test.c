@@ -3,6 +3,8 @@
 #include "string.h"
 #include "terminal.h"
 #include "heap.h"
+#include "bio.h"
+#include "tsc.h"
 
 extern fat32_fs_t test_fs;
 extern bool fs_initialized;
@@ -127,3 +129,58 @@ TEST(test_fat32_stress)
     kfree(read_buf);
     return true;
 }
+
+#define BENCH_FILE_SIZE (4 * 1024 * 1024)
+#define BENCH_CHUNK_SIZE (64 * 1024)
+
+// Writes a 4 MiB file on /mnt in 64 KiB chunks, first growing it and then overwriting it,
+// and reports the throughput including the flush to disk
+TEST(test_fat32_large_file_write_benchmark)
+{
+    if (!fs_initialized)
+        return false;
+
+    const char *path = "/mnt/BENCH.BIN";
+    vfs_unlink(path);
+    TEST_ASSERT(vfs_mknod((char *)path, VFS_FILE, 0) == 0);
+    vfs_inode_t *node = vfs_resolve_path(path);
+    TEST_ASSERT(node != nullptr);
+    vfs_open(node);
+
+    uint8_t *buf = kmalloc(BENCH_CHUNK_SIZE);
+    TEST_ASSERT(buf != nullptr);
+
+    bool ok = true;
+    const char *phases[] = {"append", "overwrite"};
+    for (int phase = 0; phase < 2 && ok; phase++)
+    {
+        uint64_t start = tsc_nanos();
+        for (uint32_t off = 0; off < BENCH_FILE_SIZE && ok; off += BENCH_CHUNK_SIZE)
+        {
+            memset(buf, (int)((off / BENCH_CHUNK_SIZE + phase) & 0xFF), BENCH_CHUNK_SIZE);
+            ok = vfs_write(node, off, BENCH_CHUNK_SIZE, buf) == BENCH_CHUNK_SIZE;
+        }
+        bio_sync();
+        uint64_t elapsed = tsc_nanos() - start;
+        if (elapsed == 0)
+            elapsed = 1;
+        uint64_t kib_s = (uint64_t)BENCH_FILE_SIZE * 1000000000ull / elapsed / 1024;
+        printk("fat32: %s of a %d KiB file: %lu KiB/s\n", phases[phase], BENCH_FILE_SIZE / 1024, kib_s);
+    }
+    ok = ok && node->size == BENCH_FILE_SIZE;
+
+    // Every chunk holds what the overwrite put there
+    for (uint32_t off = 0; off < BENCH_FILE_SIZE && ok; off += BENCH_CHUNK_SIZE)
+    {
+        ok = vfs_read(node, off, BENCH_CHUNK_SIZE, buf) == BENCH_CHUNK_SIZE;
+        const uint8_t expected = (uint8_t)(off / BENCH_CHUNK_SIZE + 1);
+        for (uint32_t i = 0; i < BENCH_CHUNK_SIZE && ok; i++)
+            ok = buf[i] == expected;
+    }
+
+    kfree(buf);
+    vfs_close(node);
+    kfree(node);
+    ok = vfs_unlink(path) == 0 && ok;
+    return ok;
+}
@@ -3,6 +3,8 @@
 #include "ide.h"
 #include "string.h"
 #include "terminal.h"
+#include "heap.h"
+#include "bio.h"
 
 fat32_fs_t test_fs;
 bool fs_initialized = false;
@@ -102,3 +104,54 @@ TEST(test_fat32_write_delete)
 
     return true;
 }
+
+// Allocation is tracked in the in-memory FAT, which every fat32_fs_t on the volume
+// shares, and written back to both FAT copies.
+TEST(test_fat32_fat_cache_mirrored)
+{
+    if (!fs_initialized)
+        return false;
+
+    fat32_fs_t other;
+    TEST_ASSERT(fat32_init(&other, test_fs.drive_index, test_fs.partition_lba) == 0);
+    TEST_ASSERT(other.fat == test_fs.fat);
+
+    const char *filename = "FATCACHE.BIN";
+    const uint32_t clusters = 8;
+    const uint32_t size = clusters * test_fs.bytes_per_cluster;
+    fat32_delete_file(&test_fs, filename);
+    uint8_t *data = kzalloc(size);
+    TEST_ASSERT(data != nullptr);
+
+    const uint32_t free_before = fat32_free_clusters(&test_fs);
+    bool ok = fat32_write_file(&test_fs, filename, data, size) == 0;
+    kfree(data);
+    ok = ok && free_before - fat32_free_clusters(&other) == clusters;
+
+    // The sector holding the start of the chain is the same in both copies
+    fat32_file_info_t info;
+    ok = ok && fat32_stat(&test_fs, filename, &info) == 0;
+    buffer_head_t *boot = bread(test_fs.drive_index, test_fs.partition_lba);
+    TEST_ASSERT(boot != nullptr);
+    const fat32_bpb_t *bpb = (const fat32_bpb_t *)boot->data;
+    const uint32_t fat_size = bpb->fat_size_32;
+    const bool mirrored = bpb->num_fats > 1 && !(bpb->ext_flags & FAT32_EXT_FLAGS_NO_MIRROR);
+    brelse(boot);
+    if (ok && mirrored)
+    {
+        const uint32_t sector = test_fs.fat_start_lba + info.first_cluster * 4 / 512;
+        buffer_head_t *first = bread(test_fs.drive_index, sector);
+        TEST_ASSERT(first != nullptr);
+        uint8_t copy[512];
+        memcpy(copy, first->data, sizeof(copy));
+        brelse(first);
+        buffer_head_t *second = bread(test_fs.drive_index, sector + fat_size);
+        TEST_ASSERT(second != nullptr);
+        ok = memcmp(copy, second->data, sizeof(copy)) == 0;
+        brelse(second);
+    }
+
+    ok = ok && fat32_delete_file(&test_fs, filename) == 0;
+    ok = ok && fat32_free_clusters(&test_fs) == free_before;
+    return ok;
+}
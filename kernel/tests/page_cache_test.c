@@ -0,0 +1,157 @@
+#include "test.h"
+#include "test_helpers.h"
+#include "page_cache.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "tsc.h"
+#include "util.h"
+
+static bool page_cache_key_of(vfs_inode_t *node, vfs_cache_key_t *key)
+{
+    return node->iops && node->iops->cache_key && node->iops->cache_key(node, key) == 0;
+}
+
+TEST(test_page_cache_serves_repeat_reads)
+{
+    vfs_inode_t *node = vfs_resolve_path("/bin/init");
+    TEST_ASSERT(node != nullptr);
+    vfs_cache_key_t key;
+    TEST_ASSERT(page_cache_key_of(node, &key));
+    page_cache_invalidate(&key);
+
+    uint64_t size = node->size;
+    uint8_t *first = kmalloc(size);
+    uint8_t *second = kmalloc(size);
+    TEST_ASSERT(first && second);
+
+    page_cache_stats_t before, cold, warm;
+    page_cache_get_stats(&before);
+    uint64_t t0 = tsc_nanos();
+    bool ok = vfs_read(node, 0, size, first) == size;
+    uint64_t t1 = tsc_nanos();
+    page_cache_get_stats(&cold);
+    ok = ok && vfs_read(node, 0, size, second) == size;
+    uint64_t t2 = tsc_nanos();
+    page_cache_get_stats(&warm);
+
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    ok = ok && memcmp(first, second, size) == 0;
+    ok = ok && cold.misses - before.misses >= pages && warm.hits - cold.hits >= pages;
+    printk("page cache: %lu bytes cold %lu ns, warm %lu ns\n", size, t1 - t0, t2 - t1);
+
+    kfree(first);
+    kfree(second);
+    vfs_close(node);
+    kfree(node);
+    return ok;
+}
+
+TEST(test_page_cache_follows_writes_and_truncate)
+{
+    const char *path = "/page_cache_test.txt";
+    uint8_t data[PAGE_SIZE + 100];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)i;
+    TEST_ASSERT(test_vfs_write_file(path, 0, data, sizeof(data)));
+
+    vfs_inode_t *reader = vfs_resolve_path(path);
+    vfs_inode_t *writer = vfs_resolve_path(path);
+    TEST_ASSERT(reader && writer);
+
+    // Pull both pages in, then change them through another handle
+    uint8_t buf[sizeof(data)];
+    bool ok = vfs_read(reader, 0, sizeof(buf), buf) == sizeof(buf) && memcmp(buf, data, sizeof(buf)) == 0;
+    const char *patch = "patched";
+    ok = ok && vfs_write(writer, PAGE_SIZE - 3, 7, (uint8_t *)patch) == 7;
+    ok = ok && vfs_read(reader, PAGE_SIZE - 3, 7, buf) == 7 && memcmp(buf, patch, 7) == 0;
+
+    // Truncation drops the cached contents
+    ok = ok && vfs_truncate(writer) == 0;
+    vfs_close(reader);
+    kfree(reader);
+    reader = vfs_resolve_path(path);
+    ok = ok && reader && vfs_read(reader, 0, sizeof(buf), buf) == 0;
+
+    if (reader)
+    {
+        vfs_close(reader);
+        kfree(reader);
+    }
+    vfs_close(writer);
+    kfree(writer);
+    vfs_unlink(path);
+    return ok;
+}
+
+TEST(test_page_cache_maps_whole_pages_only)
+{
+    const char *path = "/page_cache_map.txt";
+    uint8_t data[PAGE_SIZE + 10];
+    memset(data, 0x5A, sizeof(data));
+    TEST_ASSERT(test_vfs_write_file(path, 0, data, sizeof(data)));
+
+    vfs_inode_t *node = vfs_resolve_path(path);
+    TEST_ASSERT(node != nullptr);
+
+    void *full = page_cache_map(node, 0);
+    void *again = page_cache_map(node, 0);
+    void *partial = page_cache_map(node, 1);
+    bool ok = full && full == again && partial == nullptr;
+    ok = ok && ((uint8_t *)full + g_hhdm_offset)[PAGE_SIZE - 1] == 0x5A;
+    // The cache keeps its own reference next to the two handed out here
+    ok = ok && pmm_page_refcount(full) == 3;
+
+    if (full)
+        pmm_free_page(full);
+    if (again)
+        pmm_free_page(again);
+    vfs_close(node);
+    kfree(node);
+    vfs_unlink(path);
+    return ok;
+}
+
+TEST(test_vfs_readahead_window_adapts)
+{
+    const char *path = "/readahead_test.bin";
+    const size_t size = 4 * VFS_READAHEAD_MAX;
+    uint8_t *data = kmalloc(size);
+    TEST_ASSERT(data != nullptr);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 7);
+    bool ok = test_vfs_write_file(path, 0, data, size);
+    vfs_inode_t *node = ok ? vfs_resolve_path(path) : nullptr;
+    if (!node)
+    {
+        kfree(data);
+        return false;
+    }
+
+    // Sequential reads start a window and double it at every refill
+    vfs_readahead_t ra = {0};
+    uint8_t buf[512];
+    uint64_t offset = 0;
+    uint32_t last_window = 0;
+    bool grew = true;
+    while (offset < size && ok)
+    {
+        vfs_readahead(node, &ra, offset, sizeof(buf));
+        ok = vfs_read(node, offset, sizeof(buf), buf) == sizeof(buf) && memcmp(buf, data + offset, sizeof(buf)) == 0;
+        grew = grew && (ra.window == last_window || ra.window == min(last_window * 2, (uint32_t)VFS_READAHEAD_MAX) ||
+                        (last_window == 0 && ra.window == (uint32_t)VFS_READAHEAD_MIN));
+        last_window = ra.window;
+        offset += sizeof(buf);
+        ok = ok && ra.end >= min(offset, size) && ra.end <= size;
+    }
+    ok = ok && grew && ra.window == (uint32_t)VFS_READAHEAD_MAX;
+
+    // A seek resets it
+    vfs_readahead(node, &ra, 1000, sizeof(buf));
+    ok = ok && ra.window == 0 && ra.next == 1000 + sizeof(buf);
+
+    vfs_close(node);
+    kfree(node);
+    vfs_unlink(path);
+    kfree(data);
+    return ok;
+}
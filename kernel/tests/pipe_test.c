@@ -0,0 +1,195 @@
+#include "test.h"
+#include "pipe.h"
+#include "ioctl.h"
+#include "heap.h"
+#include "string.h"
+#include "process.h"
+#include "tsc.h"
+
+// Data is a running byte counter, so a misplaced piece of the ring shows up anywhere
+static inline uint8_t pipe_test_byte(uint64_t pos)
+{
+    return (uint8_t)(pos * 7 + (pos >> 12));
+}
+
+TEST(test_pipe_resize_keeps_wrapped_data)
+{
+    vfs_inode_t *r = nullptr;
+    vfs_inode_t *w = nullptr;
+    TEST_ASSERT(pipe_alloc(&r, &w) == 0);
+    pipe_t *p = (pipe_t *)r->device;
+
+    // Leave the data wrapped around the end of the ring
+    uint8_t *buf = kmalloc(PIPE_BUF_SIZE);
+    TEST_ASSERT(buf != nullptr);
+    for (uint32_t i = 0; i < PIPE_BUF_SIZE; i++)
+        buf[i] = pipe_test_byte(i);
+    bool ok = w->iops->write(w, 0, 3000, buf) == 3000;
+    ok = ok && r->iops->read(r, 0, 2000, buf) == 2000;
+    for (uint32_t i = 0; i < PIPE_BUF_SIZE && ok; i++)
+        buf[i] = pipe_test_byte(3000 + i);
+    ok = ok && w->iops->write(w, 0, 2000, buf) == 2000 && p->count == 3000 && p->write_pos < p->read_pos;
+
+    // Too small for what is queued, then above the limit, then grown
+    uint32_t size = 2048;
+    ok = ok && vfs_ioctl(w, PIPE_IOCTL_SET_SIZE, &size) != 0;
+    size = PIPE_MAX_SIZE + 1;
+    ok = ok && vfs_ioctl(w, PIPE_IOCTL_SET_SIZE, &size) != 0;
+    size = 3 * PIPE_BUF_SIZE - 100;
+    ok = ok && vfs_ioctl(w, PIPE_IOCTL_SET_SIZE, &size) == 0;
+    ok = ok && vfs_ioctl(r, PIPE_IOCTL_GET_SIZE, &size) == 0 && size == 3 * PIPE_BUF_SIZE;
+
+    // The queued bytes come out in order, followed by what fits in the larger ring
+    for (uint32_t i = 0; i < PIPE_BUF_SIZE && ok; i++)
+        buf[i] = pipe_test_byte(5000 + i);
+    ok = ok && w->iops->write(w, 0, PIPE_BUF_SIZE, buf) == PIPE_BUF_SIZE;
+    ok = ok && r->iops->read(r, 0, PIPE_BUF_SIZE, buf) == PIPE_BUF_SIZE;
+    for (uint32_t i = 0; i < PIPE_BUF_SIZE && ok; i++)
+        ok = buf[i] == pipe_test_byte(2000 + i);
+    ok = ok && r->iops->read(r, 0, PIPE_BUF_SIZE, buf) == 3000;
+    for (uint32_t i = 0; i < 3000 && ok; i++)
+        ok = buf[i] == pipe_test_byte(2000 + PIPE_BUF_SIZE + i);
+
+    kfree(buf);
+    vfs_close(w);
+    vfs_close(r);
+    kfree(w);
+    kfree(r);
+    return ok;
+}
+
+#define PIPE_BENCH_BYTES (8 * 1024 * 1024)
+#define PIPE_BENCH_CHUNK (16 * 1024)
+
+static vfs_inode_t *pipe_bench_writer;
+static volatile bool pipe_bench_failed;
+
+static void pipe_bench_entry(void)
+{
+    uint8_t *buf = kmalloc(PIPE_BENCH_CHUNK);
+    for (uint64_t pos = 0; buf && pos < PIPE_BENCH_BYTES; pos += PIPE_BENCH_CHUNK)
+    {
+        for (uint32_t i = 0; i < PIPE_BENCH_CHUNK; i++)
+            buf[i] = pipe_test_byte(pos + i);
+        if (pipe_bench_writer->iops->write(pipe_bench_writer, 0, PIPE_BENCH_CHUNK, buf) != PIPE_BENCH_CHUNK)
+            break;
+    }
+    if (!buf)
+        pipe_bench_failed = true;
+    kfree(buf);
+    // The reader sees end of file
+    vfs_close(pipe_bench_writer);
+}
+
+// A writer thread streams 8 MiB through a pipe to the test thread, with the default and a
+// larger capacity. Reading blocks until the writer has filled the ring, and the reverse.
+TEST(test_pipe_throughput_benchmark)
+{
+    static const uint32_t capacities[] = {PIPE_BUF_SIZE, 16 * PIPE_BUF_SIZE};
+    uint8_t *buf = kmalloc(PIPE_BENCH_CHUNK);
+    TEST_ASSERT(buf != nullptr);
+
+    bool ok = true;
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]) && ok; c++)
+    {
+        vfs_inode_t *r = nullptr;
+        ok = pipe_alloc(&r, &pipe_bench_writer) == 0 && pipe_set_capacity((pipe_t *)r->device, capacities[c]) == 0;
+        if (!ok)
+            break;
+        pipe_bench_failed = false;
+
+        uint64_t start = tsc_nanos();
+        process_t *proc = process_create("pipe_bench");
+        const bool started = proc && thread_create(proc, pipe_bench_entry, false);
+        if (!started)
+            vfs_close(pipe_bench_writer);
+        ok = started;
+        uint64_t total = 0;
+        while (ok)
+        {
+            uint64_t n = r->iops->read(r, 0, PIPE_BENCH_CHUNK, buf);
+            if (n == 0)
+                break;
+            for (uint64_t i = 0; i < n && ok; i++)
+                ok = buf[i] == pipe_test_byte(total + i);
+            total += n;
+        }
+        uint64_t elapsed = tsc_nanos() - start;
+        if (elapsed == 0)
+            elapsed = 1;
+
+        // A writer stopped short by a failed check gets a broken pipe instead of waiting
+        vfs_close(r);
+        while (started && !proc->terminated)
+            yield();
+        if (proc)
+            process_destroy(proc);
+        kfree(r);
+        kfree(pipe_bench_writer);
+
+        ok = ok && !pipe_bench_failed && total == PIPE_BENCH_BYTES;
+        printk("pipe: %u byte ring, %lu MB/s\n", capacities[c], total * 1000ull / elapsed);
+    }
+
+    kfree(buf);
+    return ok;
+}
+
+static vfs_inode_t *splice_sink_reader;
+
+// Closes the read end of the sink once a writer has filled it, so that writer is cut short
+static void splice_sink_close_entry(void)
+{
+    const pipe_t *p = (pipe_t *)splice_sink_reader->device;
+    while (__atomic_load_n(&p->count, __ATOMIC_ACQUIRE) < p->capacity)
+        yield();
+    vfs_close(splice_sink_reader);
+}
+
+// A splice out of a pipe whose output gives up halfway reports the bytes that made it and
+// advances both offsets by that much
+TEST(test_pipe_splice_reports_partial_delivery)
+{
+    vfs_inode_t *src_r = nullptr;
+    vfs_inode_t *src_w = nullptr;
+    vfs_inode_t *sink_w = nullptr;
+    TEST_ASSERT(pipe_alloc(&src_r, &src_w) == 0);
+    TEST_ASSERT(pipe_set_capacity((pipe_t *)src_r->device, 2 * PIPE_BUF_SIZE) == 0);
+    TEST_ASSERT(pipe_alloc(&splice_sink_reader, &sink_w) == 0);
+
+    const uint64_t queued = PIPE_BUF_SIZE + 1000;
+    uint8_t *buf = kmalloc(queued);
+    TEST_ASSERT(buf != nullptr);
+    for (uint64_t i = 0; i < queued; i++)
+        buf[i] = pipe_test_byte(i);
+    bool ok = src_w->iops->write(src_w, 0, queued, buf) == queued;
+
+    process_t *proc = process_create("splice_sink");
+    const bool started = proc && thread_create(proc, splice_sink_close_entry, false);
+    uint64_t in_offset = 0;
+    uint64_t out_offset = 0;
+    if (started)
+        ok = ok && vfs_splice(src_r, &in_offset, nullptr, sink_w, &out_offset, queued) == PIPE_BUF_SIZE &&
+             in_offset == PIPE_BUF_SIZE && out_offset == PIPE_BUF_SIZE;
+    else
+        vfs_close(splice_sink_reader);
+    ok = ok && started;
+    while (started && !proc->terminated)
+        yield();
+    if (proc)
+        process_destroy(proc);
+
+    // With nobody reading the sink at all, nothing gets through
+    ok = ok && src_w->iops->write(src_w, 0, 100, buf) == 100;
+    ok = ok && vfs_splice(src_r, &in_offset, nullptr, sink_w, &out_offset, 100) == -1;
+
+    kfree(buf);
+    vfs_close(sink_w);
+    vfs_close(src_w);
+    vfs_close(src_r);
+    kfree(splice_sink_reader);
+    kfree(sink_w);
+    kfree(src_w);
+    kfree(src_r);
+    return ok;
+}
@@ -2,6 +2,9 @@
 #include "cpu.h" 
 #include "limine.h"
 #include "pmm.h"
+#include "vmm.h"
+#include "tsc.h"
+#include "terminal.h"
 
 TEST(test_pmm_alloc_free)
 {
@@ -60,3 +63,121 @@ TEST(test_pmm_large_contiguous_alignment)
     pmm_free_pages(block, pages);
     return true;
 }
+
+TEST(test_pmm_buddy_merges_back)
+{
+    // An order-3 block must be naturally aligned, and freeing it must put it back on the
+    // buddy lists. Other CPUs allocate and free meanwhile, so the blocks themselves are
+    // checked rather than the free count.
+    void *block = pmm_alloc_pages(8);
+    TEST_ASSERT(block != nullptr);
+    TEST_ASSERT(((uintptr_t)block & (8 * PAGE_SIZE - 1)) == 0);
+    TEST_ASSERT(!pmm_range_is_free(block, 8));
+
+    // An odd-sized request gives the unused tail back straight away
+    void *odd = pmm_alloc_pages(5);
+    TEST_ASSERT(odd != nullptr);
+    TEST_ASSERT(pmm_range_is_free((void *)((uintptr_t)odd + 5 * PAGE_SIZE), 3));
+
+    pmm_free_pages(odd, 5);
+    pmm_free_pages(block, 8);
+    TEST_ASSERT(pmm_range_is_free(odd, 8) && pmm_range_is_free(block, 8));
+    return true;
+}
+
+// Freeing a run drops one reference per page: a page someone else still holds stays
+// allocated, and one already freed on its own is not freed a second time
+TEST(test_pmm_free_pages_respects_refcounts)
+{
+    uint8_t *run = pmm_alloc_pages(4);
+    TEST_ASSERT(run != nullptr);
+    void *shared = run + PAGE_SIZE;
+    void *single = run + 2 * PAGE_SIZE;
+    pmm_page_get(shared);
+    pmm_free_page(single);
+
+    pmm_free_pages(run, 4);
+    bool ok = pmm_page_refcount(shared) == 1 && pmm_page_refcount(single) == 0;
+    ok = ok && pmm_range_is_free(run, 1) && pmm_range_is_free(run + 3 * PAGE_SIZE, 1) && !pmm_range_is_free(shared, 1);
+
+    pmm_free_page(shared);
+    return ok && pmm_page_refcount(shared) == 0;
+}
+
+// Runs longer than the top buddy order (here 6 MiB) are built from adjacent top-order blocks
+TEST(test_pmm_alloc_beyond_max_order)
+{
+    const size_t count = (1ull << PMM_MAX_ORDER) + (1ull << (PMM_MAX_ORDER - 1));
+    void *run = pmm_alloc_pages(count);
+    TEST_ASSERT(run != nullptr);
+    TEST_ASSERT(!pmm_range_is_free(run, count));
+
+    // Every page of the run is usable
+    for (size_t i = 0; i < count; i++)
+        *(uint64_t *)((uint64_t)run + i * PAGE_SIZE + g_hhdm_offset) = i;
+    bool ok = true;
+    for (size_t i = 0; i < count && ok; i++)
+        ok = *(uint64_t *)((uint64_t)run + i * PAGE_SIZE + g_hhdm_offset) == i;
+
+    pmm_free_pages(run, count);
+    return ok && pmm_range_is_free(run, count);
+}
+
+// Hold roughly `percent` of the free pages, chaining them through their first word.
+static uint64_t pmm_hold_pages(size_t percent)
+{
+    size_t target = pmm_free_page_count() * percent / 100;
+    uint64_t head = 0;
+    for (size_t i = 0; i < target; i++)
+    {
+        void *page = pmm_alloc_page();
+        if (!page)
+            break;
+        *(uint64_t *)((uint64_t)page + g_hhdm_offset) = head;
+        head = (uint64_t)page;
+    }
+    return head;
+}
+
+static void pmm_release_pages(uint64_t head)
+{
+    while (head)
+    {
+        uint64_t next = *(uint64_t *)(head + g_hhdm_offset);
+        pmm_free_page((void *)head);
+        head = next;
+    }
+}
+
+static uint64_t pmm_time_pairs(size_t count, size_t iterations)
+{
+    uint64_t start = tsc_nanos();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        void *page = pmm_alloc_pages(count);
+        if (!page)
+            return 0;
+        pmm_free_pages(page, count);
+    }
+    return tsc_nanos() - start;
+}
+
+TEST(test_pmm_alloc_throughput_under_pressure)
+{
+    const size_t iterations = 20000;
+    const size_t fill[] = {0, 50, 90};
+
+    for (size_t i = 0; i < sizeof(fill) / sizeof(fill[0]); i++)
+    {
+        uint64_t held = pmm_hold_pages(fill[i]);
+        uint64_t ns0 = pmm_time_pairs(1, iterations);
+        uint64_t ns3 = pmm_time_pairs(8, iterations);
+        // Given back before anything is checked, so a failure does not keep the memory
+        pmm_release_pages(held);
+
+        TEST_ASSERT(ns0 != 0 && ns3 != 0);
+        printk("pmm: %lu%% used: order-0 %lu allocs/s, order-3 %lu allocs/s\n", fill[i],
+               iterations * 1000000000ull / ns0, iterations * 1000000000ull / ns3);
+    }
+    return true;
+}
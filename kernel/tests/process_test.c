@@ -2,6 +2,11 @@
 #include "process.h"
 #include "string.h"
 #include "terminal.h"
+#include "smp.h"
+#include "tsc.h"
+#include "heap.h"
+#include "elf.h"
+#include "vmm.h"
 
 static void test_thread_entry(void)
 {
@@ -99,3 +104,248 @@ TEST(test_scheduler)
         return false;
     }
 }
+
+static void placement_thread_entry(void)
+{
+}
+
+TEST(test_thread_placed_on_online_cpu)
+{
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
+    {
+        cpu_t *cpu = smp_get_cpu(i);
+        if (!cpu || !cpu->sched_online)
+            continue;
+        TEST_ASSERT(cpu->idle_thread != nullptr);
+        TEST_ASSERT(cpu->idle_thread->is_idle);
+        TEST_ASSERT(cpu->idle_thread->cpu == cpu->id);
+    }
+
+    process_t *proc = process_create("placement_test");
+    TEST_ASSERT(proc != nullptr);
+
+    thread_t *t = thread_create(proc, placement_thread_entry, false);
+    TEST_ASSERT(t != nullptr);
+
+    cpu_t *owner = smp_get_cpu(t->cpu);
+    while (!proc->terminated)
+        yield();
+    process_destroy(proc);
+
+    TEST_ASSERT(owner != nullptr);
+    TEST_ASSERT(owner->sched_online);
+    return true;
+}
+
+static volatile bool switch_bench_stop = false;
+
+static void switch_bench_entry(void)
+{
+    while (!switch_bench_stop)
+        yield();
+}
+
+// Context-switch latency as the number of runnable processes grows. Picking
+// the next thread is a run-queue pop, so the per-switch cost should stay flat.
+// The bench threads share this CPU, so its switch counter sees every switch.
+TEST(test_context_switch_latency)
+{
+    static const int counts[] = {1, 8, 32, 128};
+    const int yields = 2000;
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        int n = counts[c];
+        process_t **procs = kzalloc(sizeof(process_t *) * (size_t)n);
+        TEST_ASSERT(procs != nullptr);
+
+        switch_bench_stop = false;
+        cpu_t *cpu = get_cpu();
+        for (int i = 0; i < n; i++)
+        {
+            procs[i] = process_create("switch_bench");
+            TEST_ASSERT(procs[i] != nullptr);
+            thread_t *t = thread_alloc(procs[i], switch_bench_entry);
+            TEST_ASSERT(t != nullptr);
+            thread_start_on(t, cpu->id);
+        }
+
+        uint64_t switches_before = cpu->nr_switches;
+        uint64_t start = tsc_nanos();
+        for (int i = 0; i < yields; i++)
+            yield();
+        uint64_t elapsed = tsc_nanos() - start;
+        uint64_t switches = cpu->nr_switches - switches_before;
+
+        printk("sched bench: %d procs, %lu switches on cpu %u, %lu ns/switch\n",
+               n, switches, cpu->id, switches ? elapsed / switches : elapsed / (uint64_t)yields);
+
+        switch_bench_stop = true;
+        for (int i = 0; i < n; i++)
+        {
+            while (!procs[i]->terminated)
+                yield();
+            process_destroy(procs[i]);
+        }
+        kfree(procs);
+    }
+    return true;
+}
+
+static spinlock_t wait_test_lock;
+static volatile int wait_chan_a;
+static volatile int wait_chan_b;
+static volatile bool woke_a = false;
+static volatile bool woke_b = false;
+
+static void wait_on_a(void)
+{
+    spinlock_acquire(&wait_test_lock);
+    thread_sleep((void *)&wait_chan_a, &wait_test_lock);
+    spinlock_release(&wait_test_lock);
+    woke_a = true;
+}
+
+static void wait_on_b(void)
+{
+    spinlock_acquire(&wait_test_lock);
+    thread_sleep((void *)&wait_chan_b, &wait_test_lock);
+    spinlock_release(&wait_test_lock);
+    woke_b = true;
+}
+
+TEST(test_wakeup_only_touches_channel_waiters)
+{
+    spinlock_init(&wait_test_lock);
+    woke_a = false;
+    woke_b = false;
+
+    process_t *pa = process_create("wait_a");
+    process_t *pb = process_create("wait_b");
+    TEST_ASSERT(pa && pb);
+    thread_t *ta = thread_create(pa, wait_on_a, false);
+    thread_t *tb = thread_create(pb, wait_on_b, false);
+    TEST_ASSERT(ta && tb);
+
+    while (ta->chan != &wait_chan_a || tb->chan != &wait_chan_b)
+        yield();
+
+    thread_wakeup((void *)&wait_chan_a);
+    while (!woke_a)
+        yield();
+    TEST_ASSERT(!woke_b);
+    TEST_ASSERT(tb->state == THREAD_BLOCKED);
+
+    thread_wakeup((void *)&wait_chan_b);
+    while (!woke_b)
+        yield();
+
+    while (!pa->terminated || !pb->terminated)
+        yield();
+    process_destroy(pa);
+    process_destroy(pb);
+    return true;
+}
+
+TEST(test_elf_load_is_demand_paged)
+{
+    process_t *proc = process_create("elf_lazy");
+    TEST_ASSERT(proc != nullptr);
+    proc->pml4 = vmm_new_pml4();
+    TEST_ASSERT(proc->pml4 != nullptr);
+
+    uint64_t entry = 0;
+    uint64_t max_vaddr = 0;
+    bool loaded = elf_load("/bin/init", &entry, &max_vaddr, proc->pml4, proc);
+    vm_area_t *text = loaded ? vm_area_find(proc, entry) : nullptr;
+    bool text_mapped_early = loaded && vmm_virt_to_phys(proc->pml4, entry) != 0;
+
+    // Nothing is mapped until the first touch, which reads the page from the file
+    bool text_ok = text && text->file && (text->flags & VMA_EXEC) && !text_mapped_early &&
+                   vm_area_populate(text, proc->pml4, entry);
+    if (text_ok)
+    {
+        uint64_t page = entry & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t rel = page - text->start;
+        uint64_t len = text->file_size - rel < PAGE_SIZE ? text->file_size - rel : PAGE_SIZE;
+        uint8_t *expected = kmalloc(PAGE_SIZE);
+        text_ok = expected && vfs_read(text->file, text->file_offset + rel, len, expected) == len &&
+                  memcmp(expected, (void *)(vmm_virt_to_phys(proc->pml4, page) + g_hhdm_offset), len) == 0;
+        kfree(expected);
+    }
+
+    // Pages past the file-backed part (BSS) come back zeroed
+    bool bss_ok = true;
+    vm_area_t *area;
+    list_for_each_entry(area, &proc->vm_areas, list)
+    {
+        uint64_t last = area->end - PAGE_SIZE;
+        if (last - area->start < area->file_size)
+            continue;
+        bss_ok = vm_area_populate(area, proc->pml4, last);
+        const uint8_t *bytes = (const uint8_t *)(vmm_virt_to_phys(proc->pml4, last) + g_hhdm_offset);
+        for (int i = 0; bss_ok && i < PAGE_SIZE; i++)
+            bss_ok = bytes[i] == 0;
+        break;
+    }
+
+    process_destroy(proc);
+    TEST_ASSERT(loaded);
+    TEST_ASSERT(text_ok);
+    TEST_ASSERT(bss_ok);
+    return true;
+}
+
+TEST(test_brk_reserves_heap_lazily)
+{
+    process_t *proc = process_create("brk_lazy");
+    TEST_ASSERT(proc != nullptr);
+    proc->pml4 = vmm_new_pml4();
+
+    const uint64_t base = 0x10000000;
+    bool grown = vm_area_brk(proc, base, base + 16 * PAGE_SIZE) == 0;
+    bool unmapped = vmm_virt_to_phys(proc->pml4, base + 5 * PAGE_SIZE) == 0;
+
+    // First touch maps a zeroed page
+    bool faulted = vm_area_handle_fault(proc, base + 5 * PAGE_SIZE + 8, true);
+    uint64_t phys = vmm_virt_to_phys(proc->pml4, base + 5 * PAGE_SIZE);
+    bool zeroed = phys && *(uint64_t *)(phys + g_hhdm_offset) == 0;
+
+    // Shrinking below the page releases it
+    bool shrunk = vm_area_brk(proc, base + 16 * PAGE_SIZE, base + 2 * PAGE_SIZE) == 0;
+    bool released = vmm_virt_to_phys(proc->pml4, base + 5 * PAGE_SIZE) == 0;
+    bool outside = !vm_area_handle_fault(proc, base + 5 * PAGE_SIZE, true);
+
+    process_destroy(proc);
+    TEST_ASSERT(grown && unmapped);
+    TEST_ASSERT(faulted && zeroed);
+    TEST_ASSERT(shrunk && released && outside);
+    return true;
+}
+
+TEST(test_stack_grows_down_to_guard_gap)
+{
+    process_t *proc = process_create("stack_grow");
+    TEST_ASSERT(proc != nullptr);
+    proc->pml4 = vmm_new_pml4();
+
+    const uint64_t top = USER_STACK_TOP;
+    vm_area_t *stack = vm_area_add(proc, top - USER_STACK_SIZE, top, VMA_READ | VMA_WRITE | VMA_USER | VMA_STACK);
+
+    // A touch 64 KiB down extends the area instead of faulting
+    bool grew = stack && vm_area_handle_fault(proc, top - 64 * 1024, true) && stack->start == top - 64 * 1024;
+
+    // Growth stops at USER_STACK_MAX
+    bool capped = !vm_area_handle_fault(proc, top - USER_STACK_MAX - PAGE_SIZE, true);
+
+    // An area just below the stack blocks growth into the guard gap
+    uint64_t low_end = top - 2 * 1024 * 1024;
+    vm_area_add(proc, low_end - PAGE_SIZE, low_end, VMA_READ | VMA_USER);
+    bool guarded = !vm_area_handle_fault(proc, low_end + PAGE_SIZE, true);
+
+    process_destroy(proc);
+    TEST_ASSERT(grew);
+    TEST_ASSERT(capped);
+    TEST_ASSERT(guarded);
+    return true;
+}
@@ -1,6 +1,13 @@
 #include "test.h"
 #include "storage.h"
 #include "string.h"
+#include "heap.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "ahci.h"
+#include "process.h"
+#include "tsc.h"
+#include "bio.h"
 #include <stdint.h>
 
 // GPT header signature.
@@ -38,3 +45,193 @@ TEST(test_storage_disk1_ext2_superblock)
     TEST_ASSERT(log_block_size == 0);
     return true;
 }
+
+TEST(test_storage_segments_match_linear_read)
+{
+    // Two separate pages, the second one filled first, against one 300-sector read
+    const uint32_t lba = 1;
+    const uint32_t count = 300;
+    uint8_t *linear = kmalloc(count * STORAGE_SECTOR_SIZE);
+    void *a = pmm_alloc_page();
+    void *b = pmm_alloc_page();
+    bool ok = linear && a && b && storage_read(0, lba, count, linear) == 0;
+
+    storage_segment_t segments[] = {
+        {.phys = (uint64_t)b, .length = PAGE_SIZE},
+        {.phys = (uint64_t)a + STORAGE_SECTOR_SIZE, .length = 2 * STORAGE_SECTOR_SIZE},
+    };
+    ok = ok && storage_read_segments(0, lba, segments, 2) == 0;
+    ok = ok && memcmp((uint8_t *)b + g_hhdm_offset, linear, PAGE_SIZE) == 0;
+    ok = ok && memcmp((uint8_t *)a + g_hhdm_offset + STORAGE_SECTOR_SIZE, linear + PAGE_SIZE,
+                      2 * STORAGE_SECTOR_SIZE) == 0;
+
+    // Lengths must be whole sectors
+    storage_segment_t odd = {.phys = (uint64_t)a, .length = 100};
+    ok = ok && storage_read_segments(0, lba, &odd, 1) != 0;
+
+    if (a)
+        pmm_free_page(a);
+    if (b)
+        pmm_free_page(b);
+    kfree(linear);
+    return ok;
+}
+
+static volatile uint32_t queue_bench_next;
+static volatile uint32_t queue_bench_failures;
+static const uint32_t queue_bench_reads = 64;
+
+static void queue_bench_entry(void)
+{
+    uint32_t worker = __atomic_fetch_add(&queue_bench_next, 1, __ATOMIC_RELAXED);
+    void *page = pmm_alloc_page();
+    if (!page)
+    {
+        __atomic_fetch_add(&queue_bench_failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint8_t *buf = (uint8_t *)page + g_hhdm_offset;
+    for (uint32_t i = 0; i < queue_bench_reads; i++)
+    {
+        // Scatter the reads so neighbouring requests do not hit the same track
+        uint32_t lba = 4096 + ((worker * 7919 + i * 104729) % 4096) * 8;
+        if (storage_read(0, lba, 8, buf) != 0)
+            __atomic_fetch_add(&queue_bench_failures, 1, __ATOMIC_RELAXED);
+    }
+    pmm_free_page(page);
+}
+
+// Random 4 KiB reads from 1 to 32 concurrent submitters. With NCQ the throughput
+// should rise with the number of submitters until the queue depth is reached.
+TEST(test_storage_queue_depth_benchmark)
+{
+    static const uint32_t depths[] = {1, 2, 4, 8, 16, 32};
+    printk("storage bench: AHCI queue depth %u\n", ahci_queue_depth());
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+    {
+        uint32_t n = depths[d];
+        process_t **procs = kzalloc(sizeof(process_t *) * n);
+        TEST_ASSERT(procs != nullptr);
+
+        queue_bench_next = 0;
+        queue_bench_failures = 0;
+        uint64_t start = tsc_nanos();
+        for (uint32_t i = 0; i < n; i++)
+        {
+            procs[i] = process_create("storage_bench");
+            TEST_ASSERT(procs[i] != nullptr);
+            TEST_ASSERT(thread_create(procs[i], queue_bench_entry, false) != nullptr);
+        }
+        for (uint32_t i = 0; i < n; i++)
+        {
+            while (!procs[i]->terminated)
+                yield();
+        }
+        uint64_t elapsed = tsc_nanos() - start;
+        if (elapsed == 0)
+            elapsed = 1;
+
+        for (uint32_t i = 0; i < n; i++)
+            process_destroy(procs[i]);
+        kfree(procs);
+
+        uint64_t reads = (uint64_t)n * queue_bench_reads;
+        printk("storage bench: %u submitters, %lu reads, %lu IOPS, %lu KiB/s\n", n, reads,
+               reads * 1000000000ull / elapsed, reads * 4 * 1000000000ull / elapsed);
+        TEST_ASSERT(queue_bench_failures == 0);
+    }
+    return true;
+}
+
+static constexpr uint32_t merge_workers = 8;
+static const uint32_t merge_rounds = 32;
+static const uint32_t merge_base = 8192;
+static volatile uint32_t merge_next;
+static volatile uint32_t merge_failures;
+static const uint8_t *merge_expected;
+
+static void merge_entry(void)
+{
+    uint32_t worker = __atomic_fetch_add(&merge_next, 1, __ATOMIC_RELAXED);
+    uint8_t *sector = kmalloc(STORAGE_SECTOR_SIZE);
+    for (uint32_t i = 0; sector && i < merge_rounds; i++)
+    {
+        // Workers interleave sector by sector, so their queued requests are adjacent
+        uint32_t index = i * merge_workers + worker;
+        if (storage_read(0, merge_base + index, 1, sector) != 0 ||
+            memcmp(sector, merge_expected + index * STORAGE_SECTOR_SIZE, STORAGE_SECTOR_SIZE) != 0)
+            __atomic_fetch_add(&merge_failures, 1, __ATOMIC_RELAXED);
+    }
+    if (!sector)
+        __atomic_fetch_add(&merge_failures, 1, __ATOMIC_RELAXED);
+    kfree(sector);
+}
+
+// Concurrent single-sector reads of neighbouring LBAs return the right data whether or
+// not the scheduler merged them, and the counters add up. The flusher is paused so its
+// writes to device 0 do not land in the counters.
+TEST(test_storage_queue_merges_adjacent_requests)
+{
+    const uint32_t total = merge_workers * merge_rounds;
+    uint8_t *expected = kmalloc(total * STORAGE_SECTOR_SIZE);
+    TEST_ASSERT(expected != nullptr);
+    bool ok = storage_read(0, merge_base, total, expected) == 0;
+    merge_expected = expected;
+    merge_next = 0;
+    merge_failures = 0;
+
+    storage_stats_t before, after;
+    bio_flusher_pause();
+    ok = ok && storage_get_stats(0, &before) == 0;
+    process_t *procs[merge_workers];
+    bool started[merge_workers];
+    for (uint32_t i = 0; i < merge_workers; i++)
+    {
+        // Every worker is started even after a failure, or the rest of the sectors are never claimed
+        procs[i] = process_create("storage_merge");
+        started[i] = procs[i] && thread_create(procs[i], merge_entry, false);
+        ok = ok && started[i];
+    }
+    for (uint32_t i = 0; i < merge_workers; i++)
+    {
+        while (started[i] && !procs[i]->terminated)
+            yield();
+        if (procs[i])
+            process_destroy(procs[i]);
+    }
+    ok = ok && storage_get_stats(0, &after) == 0;
+    bio_flusher_resume();
+
+    uint64_t requests = after.requests - before.requests;
+    uint64_t queued = requests - (after.bypassed - before.bypassed);
+    uint64_t dispatches = after.dispatches - before.dispatches;
+    uint64_t merged = after.merged - before.merged;
+    uint64_t completed = 0;
+    for (size_t i = 0; i < STORAGE_LATENCY_BUCKETS; i++)
+        completed += after.latency[i] - before.latency[i];
+
+    ok = ok && merge_failures == 0 && requests >= total && after.depth == 0;
+    ok = ok && completed == queued && dispatches + merged == queued;
+    printk("storage queue: %lu requests, %lu dispatches, %lu merged, max depth %u\n", requests, dispatches, merged,
+           after.max_depth);
+
+    kfree(expected);
+    return ok;
+}
+
+TEST(test_storage_ide_dma_matches_pio)
+{
+    // An odd buffer address cannot be used by the bus master, so that read goes through PIO
+    const uint32_t count = 200;
+    uint8_t *dma = kmalloc(count * STORAGE_SECTOR_SIZE);
+    uint8_t *raw = kmalloc(count * STORAGE_SECTOR_SIZE + 1);
+    bool ok = dma && raw;
+    ok = ok && storage_read(1, 2048, count, dma) == 0;
+    ok = ok && storage_read(1, 2048, count, raw + 1) == 0;
+    ok = ok && memcmp(dma, raw + 1, count * STORAGE_SECTOR_SIZE) == 0;
+    kfree(dma);
+    kfree(raw);
+    return ok;
+}
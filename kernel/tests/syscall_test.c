@@ -10,6 +10,7 @@
 #include "uart.h"
 #include "vfs.h"
 #include "mman.h"
+#include "heap.h"
 
 // Direct syscall implementations from kernel/arch/x86_64/syscall.c
 int sys_open(const char *path, int flags);
@@ -29,6 +30,8 @@ int sys_usleep(uint64_t usec);
 int sys_kill(int pid, int sig);
 void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, size_t offset);
 int sys_munmap(void *addr, size_t length);
+int sys_sync(void);
+int sys_fsync(int fd);
 
 // Buffer for setjmp/longjmp
 static void *test_env[64];
@@ -1134,6 +1137,73 @@ TEST(test_syscall_pipe_null_arg)
     return true;
 }
 
+int sys_splice(int fd_in, int fd_out, size_t count);
+
+// Copies a file to another file and through a pipe without a user buffer. The file spans
+// a few whole cached pages and a partial one, so both ways of reading it are used.
+TEST(test_syscall_splice_file_and_pipe)
+{
+    const char *src = "/splice_src.bin";
+    const char *dst = "/splice_dst.bin";
+    const size_t size = 3 * PAGE_SIZE + 123;
+    uint8_t *data = kmalloc(size);
+    uint8_t *check = kmalloc(size);
+    TEST_ASSERT(data != nullptr && check != nullptr);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 13 + (i >> 8));
+
+    int fd = sys_open(src, O_CREATE | O_WRONLY | O_TRUNC);
+    TEST_ASSERT(fd >= 0);
+    bool ok = sys_write(fd, (const char *)data, size) == (int)size;
+    TEST_ASSERT(sys_close(fd) == 0);
+
+    // File to file, in pieces that do not line up with pages
+    int in = sys_open(src, O_RDONLY);
+    int out = sys_open(dst, O_CREATE | O_WRONLY | O_TRUNC);
+    TEST_ASSERT(in >= 0 && out >= 0);
+    size_t total = 0;
+    int n;
+    while (ok && (n = sys_splice(in, out, 5000)) > 0)
+        total += (size_t)n;
+    ok = ok && total == size && sys_splice(out, in, 1) == -1;
+    TEST_ASSERT(sys_close(out) == 0);
+
+    out = sys_open(dst, O_RDONLY);
+    TEST_ASSERT(out >= 0);
+    ok = ok && sys_read(out, (char *)check, size) == (int)size && memcmp(data, check, size) == 0;
+    TEST_ASSERT(sys_close(out) == 0);
+    TEST_ASSERT(sys_close(in) == 0);
+
+    // File to pipe and pipe to file. A splice from a pipe returns what was queued.
+    int pipefd[2] = {-1, -1};
+    TEST_ASSERT(sys_pipe(pipefd) == 0);
+    in = sys_open(src, O_RDONLY);
+    out = sys_open(dst, O_WRONLY | O_TRUNC);
+    TEST_ASSERT(in >= 0 && out >= 0);
+    ok = ok && sys_splice(in, pipefd[1], 1000) == 1000 && sys_splice(pipefd[0], out, PAGE_SIZE) == 1000;
+    TEST_ASSERT(sys_close(out) == 0);
+    out = sys_open(dst, O_RDONLY);
+    TEST_ASSERT(out >= 0);
+    ok = ok && sys_read(out, (char *)check, size) == 1000 && memcmp(data, check, 1000) == 0;
+
+    // Bytes taken from a pipe that the output refuses are reported, not dropped quietly
+    int broken[2] = {-1, -1};
+    TEST_ASSERT(sys_pipe(broken) == 0);
+    TEST_ASSERT(sys_close(broken[0]) == 0);
+    ok = ok && sys_splice(in, pipefd[1], 1000) == 1000 && sys_splice(pipefd[0], broken[1], PAGE_SIZE) == -1;
+    TEST_ASSERT(sys_close(broken[1]) == 0);
+
+    TEST_ASSERT(sys_close(out) == 0);
+    TEST_ASSERT(sys_close(in) == 0);
+    TEST_ASSERT(sys_close(pipefd[0]) == 0);
+    TEST_ASSERT(sys_close(pipefd[1]) == 0);
+    sys_unlink(src);
+    sys_unlink(dst);
+    kfree(data);
+    kfree(check);
+    return ok;
+}
+
 // lseek and dup syscall declarations
 long sys_lseek(int fd, long offset, int whence);
 int sys_dup(int oldfd);
@@ -1509,20 +1579,13 @@ TEST(test_syscall_usleep_zero)
 
 TEST(test_syscall_mmap_anonymous)
 {
-    // Note: Current mmap implementation only supports shared framebuffer mappings.
-    // Anonymous mappings are not yet implemented.
-    // Map anonymous memory
+    // Map anonymous memory; pages are zero-filled on first touch
     void *addr = sys_mmap(NULL, 4096, PROT_READ | PROT_WRITE,
                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    // Anonymous mmap is not supported - expect failure
-    if (addr == MAP_FAILED)
-    {
-        // Expected behavior for current implementation
-        return true;
-    }
+    TEST_ASSERT(addr != MAP_FAILED);
 
-    // If it somehow succeeds in the future, verify it works
     char *p = (char *)addr;
+    TEST_ASSERT(p[100] == 0);
     p[0] = 'A';
     p[4095] = 'Z';
     TEST_ASSERT(p[0] == 'A');
@@ -1533,6 +1596,136 @@ TEST(test_syscall_mmap_anonymous)
     return true;
 }
 
+TEST(test_syscall_mmap_rejects_ranges_outside_user_space)
+{
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    const size_t len = 2 * PAGE_SIZE;
+
+    // A fixed range that crosses the top of user space, or wraps around, is refused
+    TEST_ASSERT(sys_mmap((void *)(USER_SPACE_END - PAGE_SIZE), len, PROT_READ, flags | MAP_FIXED, -1, 0) ==
+                MAP_FAILED);
+    TEST_ASSERT(sys_mmap((void *)(0ull - PAGE_SIZE), len, PROT_READ, flags | MAP_FIXED, -1, 0) == MAP_FAILED);
+
+    // The same hint without MAP_FIXED is ignored and the mapping goes elsewhere
+    void *addr = sys_mmap((void *)(0ull - PAGE_SIZE), len, PROT_READ, flags, -1, 0);
+    TEST_ASSERT(addr != MAP_FAILED);
+    bool ok = (uint64_t)addr + len <= USER_SPACE_END;
+    TEST_ASSERT(sys_munmap(addr, len) == 0);
+    return ok;
+}
+
+TEST(test_syscall_mmap_file_private)
+{
+    const char *path = "/mmap_private.txt";
+    int fd = sys_open(path, O_CREATE | O_RDWR | O_TRUNC);
+    TEST_ASSERT(fd >= 3);
+
+    // Two pages plus a tail so the last page is partly past EOF
+    static char data[2 * 4096 + 100];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char)('a' + i % 26);
+    TEST_ASSERT(sys_write(fd, data, sizeof(data)) == (int)sizeof(data));
+
+    char *map = sys_mmap(NULL, sizeof(data), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    TEST_ASSERT(map != MAP_FAILED);
+    TEST_ASSERT(memcmp(map, data, sizeof(data)) == 0);
+    TEST_ASSERT(map[sizeof(data)] == 0); // Rest of the last page is zero
+
+    // Private writes never reach the file
+    map[0] = 'Z';
+    TEST_ASSERT(sys_munmap(map, sizeof(data)) == 0);
+
+    char first = 0;
+    TEST_ASSERT(sys_lseek(fd, 0, SEEK_SET) == 0);
+    TEST_ASSERT(sys_read(fd, &first, 1) == 1);
+    TEST_ASSERT(first == 'a');
+
+    sys_close(fd);
+    sys_unlink(path);
+    return true;
+}
+
+TEST(test_syscall_mmap_file_shared_writes_back)
+{
+    const char *path = "/mmap_shared.txt";
+    int fd = sys_open(path, O_CREATE | O_RDWR | O_TRUNC);
+    TEST_ASSERT(fd >= 3);
+    TEST_ASSERT(sys_write(fd, "hello mmap", 10) == 10);
+
+    char *map = sys_mmap(NULL, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    TEST_ASSERT(map != MAP_FAILED);
+    TEST_ASSERT(strncmp(map, "hello mmap", 10) == 0);
+    map[0] = 'j';
+    TEST_ASSERT(sys_munmap(map, 10) == 0);
+
+    char buf[10] = {0};
+    TEST_ASSERT(sys_lseek(fd, 0, SEEK_SET) == 0);
+    TEST_ASSERT(sys_read(fd, buf, 10) == 10);
+    TEST_ASSERT(strncmp(buf, "jello mmap", 10) == 0);
+
+    sys_close(fd);
+    sys_unlink(path);
+    return true;
+}
+
+TEST(test_syscall_mmap_shared_anonymous_is_populated)
+{
+    // Nothing may be left to fault in privately, or a fork would not share it
+    const size_t len = 3 * PAGE_SIZE;
+    uint8_t *map = sys_mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    TEST_ASSERT(map != MAP_FAILED);
+    bool ok = true;
+    for (size_t off = 0; off < len && ok; off += PAGE_SIZE)
+        ok = vmm_virt_to_phys(current_process->pml4, (uint64_t)map + off) != 0 && map[off] == 0;
+    TEST_ASSERT(sys_munmap(map, len) == 0);
+    return ok;
+}
+
+TEST(test_syscall_mmap_shared_tail_page_is_common)
+{
+    const char *path = "/mmap_tail.txt";
+    int fd = sys_open(path, O_CREATE | O_RDWR | O_TRUNC);
+    TEST_ASSERT(fd >= 3);
+    TEST_ASSERT(sys_write(fd, "hello mmap", 10) == 10);
+
+    // The file ends inside its only page; both mappings and read() still see one copy
+    char *a = sys_mmap(NULL, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    char *b = sys_mmap(NULL, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    TEST_ASSERT(a != MAP_FAILED && b != MAP_FAILED);
+    a[0] = 'j';
+    char buf[10] = {0};
+    bool ok = b[0] == 'j' && sys_lseek(fd, 0, SEEK_SET) == 0 && sys_read(fd, buf, 10) == 10 && buf[0] == 'j';
+
+    TEST_ASSERT(sys_munmap(a, 10) == 0);
+    TEST_ASSERT(sys_munmap(b, 10) == 0);
+    sys_close(fd);
+    sys_unlink(path);
+    return ok;
+}
+
+TEST(test_syscall_mmap_shared_writeback_keeps_truncation)
+{
+    const char *path = "/mmap_trunc.txt";
+    int fd = sys_open(path, O_CREATE | O_RDWR | O_TRUNC);
+    TEST_ASSERT(fd >= 3);
+    TEST_ASSERT(sys_write(fd, "hello mmap", 10) == 10);
+
+    // A page dirtied before the file was cut must not grow it back on unmap
+    char *map = sys_mmap(NULL, 10, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    TEST_ASSERT(map != MAP_FAILED);
+    map[0] = 'j';
+    int trunc = sys_open(path, O_RDWR | O_TRUNC);
+    TEST_ASSERT(trunc >= 3);
+    TEST_ASSERT(sys_munmap(map, 10) == 0);
+
+    struct stat st;
+    bool ok = sys_stat(path, &st) == 0 && st.size == 0;
+    sys_close(trunc);
+    sys_close(fd);
+    sys_unlink(path);
+    return ok;
+}
+
 TEST(test_syscall_mmap_invalid_length)
 {
     void *addr = sys_mmap(NULL, 0, PROT_READ | PROT_WRITE,
@@ -1567,6 +1760,24 @@ TEST(test_syscall_kill_protected_pids)
     return true;
 }
 
+// ============================================================================
+// Tests for sync/fsync syscalls
+// ============================================================================
+
+TEST(test_syscall_fsync_writes_file_data)
+{
+    const char *path = "/fsync_test.txt";
+    int fd = sys_open(path, O_CREATE | O_RDWR);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT(sys_write(fd, "durable", 7) == 7);
+    TEST_ASSERT(sys_fsync(fd) == 0);
+    TEST_ASSERT(sys_fsync(-1) == -1);
+    sys_close(fd);
+    TEST_ASSERT(sys_sync() == 0);
+    sys_unlink(path);
+    return true;
+}
+
 // ============================================================================
 // Tests for mknod syscall
 // ============================================================================
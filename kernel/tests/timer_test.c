@@ -0,0 +1,88 @@
+#include "test.h"
+#include "timer.h"
+#include "process.h"
+
+static volatile int fire_count = 0;
+static volatile int fire_order[3];
+
+static void count_fire(void *arg)
+{
+    (void)arg;
+    fire_count++;
+}
+
+static void record_fire(void *arg)
+{
+    if (fire_count < 3)
+        fire_order[fire_count] = (int)(uint64_t)arg;
+    fire_count++;
+}
+
+static void wait_ticks(uint64_t ticks)
+{
+    uint64_t deadline = scheduler_ticks + ticks;
+    while (scheduler_ticks < deadline)
+        yield();
+}
+
+TEST(test_timer_fires)
+{
+    ktimer_t timer;
+    fire_count = 0;
+    timer_init(&timer, count_fire, nullptr);
+    timer_add(&timer, scheduler_ticks + 2);
+    TEST_ASSERT(timer_pending(&timer));
+
+    wait_ticks(4);
+    // Never leave a stack timer armed if the assertion below fails.
+    TEST_ASSERT(!timer_cancel(&timer));
+    TEST_ASSERT(fire_count == 1);
+    return true;
+}
+
+TEST(test_timer_cancel)
+{
+    ktimer_t timer;
+    fire_count = 0;
+    timer_init(&timer, count_fire, nullptr);
+    timer_add(&timer, scheduler_ticks + 3);
+    TEST_ASSERT(timer_cancel(&timer));
+    TEST_ASSERT(!timer_cancel(&timer));
+
+    wait_ticks(5);
+    TEST_ASSERT(fire_count == 0);
+    return true;
+}
+
+TEST(test_timer_order)
+{
+    ktimer_t timers[3];
+    fire_count = 0;
+    uint64_t now = scheduler_ticks;
+    for (int i = 0; i < 3; i++)
+        timer_init(&timers[i], record_fire, (void *)(uint64_t)i);
+
+    timer_add(&timers[0], now + 4);
+    timer_add(&timers[1], now + 2);
+    timer_add(&timers[2], now + 3);
+
+    wait_ticks(6);
+    bool any_pending = false;
+    for (int i = 0; i < 3; i++)
+        any_pending |= timer_cancel(&timers[i]);
+    TEST_ASSERT(!any_pending);
+    TEST_ASSERT(fire_count == 3);
+    TEST_ASSERT(fire_order[0] == 1);
+    TEST_ASSERT(fire_order[1] == 2);
+    TEST_ASSERT(fire_order[2] == 0);
+    return true;
+}
+
+TEST(test_thread_sleep_until)
+{
+    uint64_t start = scheduler_ticks;
+    thread_sleep_until(start + 2);
+    TEST_ASSERT(scheduler_ticks >= start + 2);
+    TEST_ASSERT(current_thread->sleep_until == 0);
+    return true;
+}
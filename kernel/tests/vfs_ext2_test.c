@@ -2,6 +2,7 @@
 #include "vfs.h"
 #include "string.h"
 #include "heap.h"
+#include "ext2.h"
 
 // Tests for EXT2 Root Filesystem
 
@@ -209,3 +210,130 @@ TEST_PRIO(test_ext2_link_and_unlink, 40)
     kfree(src);
     return true;
 }
+
+TEST(test_ext2_large_directory_lookup_and_listing)
+{
+    if (!vfs_root)
+        return false;
+
+    const char *dirname = "/disk1/ext2_bigdir";
+    const int entries = 150;
+    char path[96];
+    vfs_mknod((char *)dirname, VFS_DIRECTORY, 0);
+    for (int i = 0; i < entries; i++)
+    {
+        snprintk(path, sizeof(path), "%s/entry_%03d", dirname, i);
+        vfs_mknod(path, VFS_FILE, 0); // May exist from an earlier run
+    }
+
+    vfs_inode_t *dir = vfs_resolve_path(dirname);
+    TEST_ASSERT(dir != nullptr);
+    TEST_ASSERT(dir->size >= 2 * 1024); // Big enough for the in-memory index
+
+    // Look every name up in the filesystem itself, past the dentry cache
+    bool ok = true;
+    char name[32];
+    for (int i = 0; i < entries && ok; i++)
+    {
+        snprintk(name, sizeof(name), "entry_%03d", i);
+        vfs_inode_t *child = dir->iops->finddir(dir, name);
+        ok = child != nullptr;
+        if (child)
+        {
+            vfs_close(child);
+            kfree(child);
+        }
+    }
+    ok = ok && dir->iops->finddir(dir, "entry_missing") == nullptr;
+
+    // A full listing sees every entry once
+    uint8_t seen[150] = {0};
+    uint32_t index = 0;
+    vfs_dirent_t *dent;
+    while ((dent = vfs_readdir(dir, index++)) != nullptr)
+    {
+        int n = -1;
+        if (strncmp(dent->name, "entry_", 6) == 0)
+            n = (dent->name[6] - '0') * 100 + (dent->name[7] - '0') * 10 + (dent->name[8] - '0');
+        if (n >= 0 && n < entries)
+            seen[n]++;
+        kfree(dent);
+    }
+    uint32_t total = index - 1;
+    for (int i = 0; i < entries; i++)
+        ok = ok && seen[i] == 1;
+
+    // Going back to an earlier index still works, and removing a name is seen by both
+    vfs_dirent_t *first = vfs_readdir(dir, 0);
+    vfs_dirent_t *again = vfs_readdir(dir, 0);
+    ok = ok && first && again && strcmp(first->name, again->name) == 0;
+    kfree(first);
+    kfree(again);
+
+    snprintk(path, sizeof(path), "%s/entry_007", dirname);
+    ok = ok && vfs_unlink(path) == 0 && dir->iops->finddir(dir, "entry_007") == nullptr;
+    uint32_t listed = 0;
+    for (index = 0; (dent = vfs_readdir(dir, index)) != nullptr; index++)
+    {
+        ok = ok && strcmp(dent->name, "entry_007") != 0;
+        kfree(dent);
+        listed++;
+    }
+    ok = ok && vfs_mknod(path, VFS_FILE, 0) == 0;
+    vfs_inode_t *child = dir->iops->finddir(dir, "entry_007");
+    ok = ok && child != nullptr && listed == total - 1;
+    if (child)
+    {
+        vfs_close(child);
+        kfree(child);
+    }
+
+    vfs_close(dir);
+    kfree(dir);
+    return ok;
+}
+
+// /disk1/htree is indexed by e2fsck -D when the image is built, so lookups go through
+// the HTree. "." and ".." live outside its leaves and must still resolve.
+TEST(test_ext2_htree_directory_lookup)
+{
+    if (!vfs_root)
+        return false;
+
+    vfs_inode_t *dir = vfs_resolve_path("/disk1/htree");
+    TEST_ASSERT(dir != nullptr);
+    const struct ext2_inode *ip = dir->device;
+    bool ok = ip && (ip->i_flags & EXT2_INDEX_FL);
+
+    char name[32];
+    for (int i = 0; i < 300 && ok; i++)
+    {
+        snprintk(name, sizeof(name), "name_%03d.txt", i);
+        vfs_inode_t *child = dir->iops->finddir(dir, name);
+        ok = child != nullptr && child->size == 16; // "htree entry NNN\n"
+        if (child)
+        {
+            vfs_close(child);
+            kfree(child);
+        }
+    }
+    ok = ok && dir->iops->finddir(dir, "name_300.txt") == nullptr;
+
+    vfs_inode_t *self = dir->iops->finddir(dir, ".");
+    vfs_inode_t *parent = dir->iops->finddir(dir, "..");
+    vfs_inode_t *disk1 = vfs_resolve_path("/disk1");
+    vfs_inode_t *resolved = vfs_resolve_path("/disk1/htree/../hello.txt");
+    ok = ok && self && self->inode == dir->inode;
+    ok = ok && parent && disk1 && parent->inode == disk1->inode && resolved != nullptr;
+
+    vfs_inode_t *nodes[] = {self, parent, disk1, resolved, dir};
+    for (size_t i = 0; i < sizeof(nodes) / sizeof(nodes[0]); i++)
+    {
+        if (nodes[i])
+        {
+            vfs_close(nodes[i]);
+            kfree(nodes[i]);
+        }
+    }
+    return ok;
+}
@@ -279,6 +279,68 @@ TEST_PRIO(test_vfs_fat32_long_chain_rw, 50)
     return true;
 }
 
+// Two files appended to in turn get interleaved clusters, so their chains are many short
+// runs. Reading them back to front, and across cluster boundaries, checks the extent lookups.
+TEST_PRIO(test_vfs_fat32_interleaved_extents, 55)
+{
+    vfs_inode_t *mnt = vfs_resolve_path("/mnt");
+    if (!mnt)
+        return false;
+    fat32_inode_data_t *mnt_data = (fat32_inode_data_t *)mnt->device;
+    TEST_ASSERT(mnt_data != nullptr);
+    fat32_fs_t *fs = mnt_data->fs;
+    TEST_ASSERT(fs != nullptr);
+
+    const char *names[2] = {"EXTA.BIN", "EXTB.BIN"};
+    const uint32_t chunk = fs->bytes_per_cluster;
+    const uint32_t chunks = 32;
+    vfs_inode_t *files[2];
+    for (int f = 0; f < 2; f++)
+    {
+        fat32_delete_file(fs, names[f]);
+        TEST_ASSERT(fat32_create_file(fs, names[f]) == 0);
+        files[f] = vfs_finddir(mnt, (char *)names[f]);
+        TEST_ASSERT(files[f] != nullptr);
+    }
+
+    uint8_t *buf = kmalloc(chunk);
+    TEST_ASSERT(buf != nullptr);
+    bool ok = true;
+    for (uint32_t c = 0; c < chunks && ok; c++)
+    {
+        for (int f = 0; f < 2; f++)
+        {
+            memset(buf, (int)(c * 2 + f + 1), chunk);
+            ok = ok && files[f]->iops->write(files[f], (uint64_t)c * chunk, chunk, buf) == chunk;
+        }
+    }
+
+    for (int f = 0; f < 2 && ok; f++)
+    {
+        for (uint32_t c = chunks; c-- > 0 && ok;)
+        {
+            ok = files[f]->iops->read(files[f], (uint64_t)c * chunk, chunk, buf) == chunk;
+            for (uint32_t i = 0; i < chunk && ok; i++)
+                ok = buf[i] == (uint8_t)(c * 2 + f + 1);
+            if (ok && c > 0)
+            {
+                ok = files[f]->iops->read(files[f], (uint64_t)c * chunk - 1, 2, buf) == 2;
+                ok = ok && buf[0] == (uint8_t)((c - 1) * 2 + f + 1) && buf[1] == (uint8_t)(c * 2 + f + 1);
+            }
+        }
+    }
+
+    kfree(buf);
+    for (int f = 0; f < 2; f++)
+    {
+        vfs_close(files[f]);
+        kfree(files[f]);
+        fat32_delete_file(fs, names[f]);
+    }
+    kfree(mnt);
+    return ok;
+}
+
 TEST_PRIO(test_vfs_fat32_write, 40)
 {
     vfs_inode_t *mnt = vfs_resolve_path("/mnt");
@@ -3,6 +3,8 @@
 #include "limine.h"
 #include "string.h"
 #include "pmm.h"
+#include "tsc.h"
+#include "terminal.h"
 
 TEST(test_vmm_map)
 {
@@ -31,7 +33,7 @@ TEST(test_vmm_copy_preserves_user_mapping)
 
     vmm_map_page(original, virt, (uint64_t)phys, PTE_PRESENT | PTE_WRITABLE);
 
-    pml4_t clone = vmm_copy_pml4(original);
+    pml4_t clone = vmm_copy_pml4_eager(original);
     TEST_ASSERT(clone != nullptr);
 
     uint64_t resolved_clone = vmm_virt_to_phys(clone, virt);
@@ -98,3 +100,86 @@ TEST(test_vmm_remap_overwrites_translation)
     vmm_destroy_pml4(pml4);
     return true;
 }
+
+TEST(test_vmm_copy_on_write_breaks_sharing)
+{
+    pml4_t original = vmm_new_pml4();
+    TEST_ASSERT(original != nullptr);
+
+    uint64_t virt = 0x600000000; // 24GB
+    void *phys = pmm_alloc_page();
+    TEST_ASSERT(phys != nullptr);
+    memset((void *)((uint64_t)phys + g_hhdm_offset), 0x5A, PAGE_SIZE);
+    vmm_map_page(original, virt, (uint64_t)phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
+
+    pml4_t clone = vmm_copy_pml4(original);
+    TEST_ASSERT(clone != nullptr);
+
+    // Both spaces share the frame until one of them writes
+    TEST_ASSERT(vmm_virt_to_phys(clone, virt) == (uint64_t)phys);
+    TEST_ASSERT(pmm_page_refcount(phys) == 2);
+
+    // The clone writes first and gets a private copy
+    TEST_ASSERT(vmm_handle_cow_fault(clone, virt));
+    uint64_t copy = vmm_virt_to_phys(clone, virt);
+    TEST_ASSERT(copy != 0 && copy != (uint64_t)phys);
+    TEST_ASSERT(*(uint8_t *)(copy + g_hhdm_offset) == 0x5A);
+    TEST_ASSERT(pmm_page_refcount(phys) == 1);
+
+    // The original is now the only owner and keeps its frame
+    TEST_ASSERT(vmm_handle_cow_fault(original, virt));
+    TEST_ASSERT(vmm_virt_to_phys(original, virt) == (uint64_t)phys);
+    TEST_ASSERT(!vmm_handle_cow_fault(original, virt)); // Already writable
+
+    vmm_destroy_pml4(clone);
+    vmm_destroy_pml4(original);
+    return true;
+}
+
+// fork() immediately followed by exec(): copy the image, touch a few stack pages, then throw it away.
+static uint64_t fork_exec_cycle(pml4_t parent, uint64_t base, size_t image_pages, bool cow)
+{
+    uint64_t start = tsc_nanos();
+    pml4_t child = cow ? vmm_copy_pml4(parent) : vmm_copy_pml4_eager(parent);
+    if (!child)
+        return 0;
+    for (size_t i = 0; i < 4 && cow; i++)
+        vmm_handle_cow_fault(child, base + (image_pages - 1 - i) * PAGE_SIZE);
+    vmm_destroy_pml4(child);
+    return tsc_nanos() - start;
+}
+
+TEST(test_vmm_fork_exec_latency)
+{
+    static const size_t sizes[] = {64, 512, 2048}; // 256 KiB, 2 MiB, 8 MiB images
+    const uint64_t base = 0x700000000;
+    const int rounds = 8;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        pml4_t parent = vmm_new_pml4();
+        TEST_ASSERT(parent != nullptr);
+        for (size_t i = 0; i < sizes[s]; i++)
+        {
+            void *phys = pmm_alloc_page();
+            TEST_ASSERT(phys != nullptr);
+            vmm_map_page(parent, base + i * PAGE_SIZE, (uint64_t)phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
+        }
+
+        uint64_t eager = 0;
+        uint64_t cow = 0;
+        for (int r = 0; r < rounds; r++)
+        {
+            uint64_t e = fork_exec_cycle(parent, base, sizes[s], false);
+            uint64_t c = fork_exec_cycle(parent, base, sizes[s], true);
+            TEST_ASSERT(e != 0 && c != 0);
+            eager += e;
+            cow += c;
+        }
+
+        printk("fork+exec bench: %lu KiB image, eager %lu us, cow %lu us\n",
+               sizes[s] * PAGE_SIZE / 1024, eager / rounds / 1000, cow / rounds / 1000);
+        vmm_destroy_pml4(parent);
+    }
+    return true;
+}
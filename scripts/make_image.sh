@@ -139,9 +139,18 @@ parted -s "$SECOND_DISK" mkpart EXT2 ext2 "${SECOND_EXT2_PART_START_MB}MiB" "$((
 rm -rf build/rootfs_ext2_disk2
 mkdir -p build/rootfs_ext2_disk2
 echo "Hello from IDE disk ext2" > build/rootfs_ext2_disk2/hello.txt
+# A directory big enough for e2fsck -D to give it an HTree index
+mkdir -p build/rootfs_ext2_disk2/htree
+for i in $(seq -w 0 299); do
+    echo "htree entry $i" > "build/rootfs_ext2_disk2/htree/name_$i.txt"
+done
 
 dd if=/dev/zero of=second_root.img bs=1M count=$SECOND_EXT2_PART_SIZE_MB
-mkfs.ext2 -b 1024 -d build/rootfs_ext2_disk2 -r 1 -N 0 -m 0 -L "IDEEXT2" second_root.img
+mkfs.ext2 -b 1024 -O dir_index -d build/rootfs_ext2_disk2 -r 1 -N 0 -m 0 -L "IDEEXT2" second_root.img
+# Exit status 1 only means directories were rewritten
+e2fsck_rc=0
+e2fsck -fyD second_root.img || e2fsck_rc=$?
+[ "$e2fsck_rc" -le 1 ]
 dd if=second_root.img of="$SECOND_DISK" bs=1M seek=$SECOND_EXT2_PART_START_MB conv=notrunc
 
 # Quick sanity checks to catch a bad image early instead of flaking in QEMU.
@@ -33,6 +33,9 @@
 #define SYS_SHUTDOWN 30
 #define SYS_REBOOT 31
 #define SYS_KILL 32
+#define SYS_SYNC 33
+#define SYS_FSYNC 34
+#define SYS_SPLICE 35
 
 static inline long syscall0(long n)
 {
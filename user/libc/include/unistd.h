@@ -40,5 +40,9 @@ int isatty(int fd);
 int pipe(int pipefd[2]);
 int dup(int oldfd);
 int kill(int pid, int sig);
+int sync(void);
+int fsync(int fd);
+// Copies up to count bytes between two descriptors inside the kernel
+ssize_t splice(int fd_in, int fd_out, size_t count);
 void shutdown(void);
 void reboot(void);
@@ -243,6 +243,21 @@ int kill(int pid, int sig)
     return clamp_signed_to_int(syscall2(SYS_KILL, pid, sig));
 }
 
+int sync(void)
+{
+    return clamp_signed_to_int(syscall0(SYS_SYNC));
+}
+
+int fsync(int fd)
+{
+    return clamp_signed_to_int(syscall1(SYS_FSYNC, fd));
+}
+
+ssize_t splice(int fd_in, int fd_out, size_t count)
+{
+    return syscall3(SYS_SPLICE, fd_in, fd_out, (long)count);
+}
+
 void shutdown(void)
 {
     syscall0(SYS_SHUTDOWN);